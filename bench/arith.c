@@ -0,0 +1,64 @@
+// What the overflow checks on add, subtract and multiply cost: the
+// arithmetic scripts in bench/ under jack and under jack-unchecked, built
+// with JACK_UNCHECKED_ARITH so tagged results wrap instead of going to big
+// integers.  They take turns so both see the same machine, best CPU time
+// of each.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define ROUNDS 21
+
+static const char* scripts[] = {
+  "bench/arith.jack", "bench/loop.jack", "bench/fib.jack",
+};
+
+static double children(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_CHILDREN, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+// CPU seconds binary takes to run script, output thrown away.
+static double run(const char* binary, const char* script) {
+  double before = children();
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (!pid) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execl(binary, binary, script, (char*)NULL);
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && !WEXITSTATUS(status));
+  return children() - before;
+}
+
+int main() {
+  // jack runs twice a round, how far apart those two end up is the noise.
+  printf("script                 jack   again unchecked   (s, best of %d)\n", ROUNDS);
+  for (size_t i = 0; i < sizeof(scripts) / sizeof(*scripts); i++) {
+    double checked = 1e9, again = 1e9, unchecked = 1e9;
+    for (int round = 0; round < ROUNDS; round++) {
+      double t = run("./jack", scripts[i]);
+      if (t < checked) checked = t;
+      t = run("./jack-unchecked", scripts[i]);
+      if (t < unchecked) unchecked = t;
+      t = run("./jack", scripts[i]);
+      if (t < again) again = t;
+    }
+    printf("%-20s %6.3f  %+5.1f%%    %+5.1f%%\n", scripts[i], checked,
+           (again / checked - 1) * 100, (unchecked / checked - 1) * 100);
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+// The byte primitives in old/mem.c at each level the CPU supports, over
+// input sizes from a short symbol up to a large buffer.  Figures are GB/s
+// of input, best of three runs.  Every search is a miss until the very end
+// of the input.  jack_mem_repeat is left out, it is memcpy at every level.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../old/mem.h"
+
+#define WORK (64 << 20) // Bytes per run
+#define MAX (1 << 16)
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char a[MAX], b[MAX], same[MAX];
+static volatile uintptr_t sink;
+
+enum { EQUAL, CASECMP, CHR, FIND, HASH, OPS };
+static const char *names[] = {"equal", "casecmp", "chr", "find", "hash"};
+
+static uintptr_t run(int op, size_t size) {
+  switch (op) {
+    case EQUAL: return jack_mem_equal(a, same, size);
+    case CASECMP: return jack_mem_casecmp(a, b, size);
+    case CHR: return (uintptr_t)jack_mem_chr(a, size, '!');
+    case FIND: return (uintptr_t)jack_mem_find(a, size, a + size - 8, 8);
+    default: return jack_mem_hash(a, size);
+  }
+}
+
+static double rate(int op, size_t size) {
+  size_t times = WORK / size;
+  double best = 0;
+  for (int round = 0; round < 3; ++round) {
+    uintptr_t sum = 0;
+    double start = now();
+    for (size_t i = 0; i < times; ++i) sum += run(op, size);
+    double elapsed = now() - start;
+    sink += sum;
+    double gbs = (double)times * size / elapsed / 1e9;
+    if (gbs > best) best = gbs;
+  }
+  return best;
+}
+
+int main() {
+  static const size_t sizes[] = {16, 64, 256, 1024, 4096, MAX};
+  static const char *levels[] = {"scalar", "sse2", "avx2"};
+  // b only differs from a in case, so casecmp has to read all of it, and
+  // the searches are for bytes only found at the end.
+  for (int i = 0; i < MAX; ++i) {
+    a[i] = "abcdefghABCDEFGH"[(i * 7 + i / 5) % 16];
+    b[i] = a[i] ^ 32;
+  }
+  int best = jack_mem_use(JACK_MEM_AVX2);
+  printf("op       size    ");
+  for (int level = 0; level <= best; ++level) printf("%8s", levels[level]);
+  printf("  (GB/s)\n");
+  for (int op = 0; op < OPS; ++op) {
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(*sizes)); ++i) {
+      size_t size = sizes[i];
+      char saved[8];
+      memcpy(saved, a + size - 8, 8);
+      memset(a + size - 8, '!', 8);
+      memcpy(same, a, size);
+      printf("%-8s %-7zu ", names[op], size);
+      for (int level = 0; level <= best; ++level) {
+        jack_mem_use(level);
+        printf("%8.2f", rate(op, size));
+      }
+      printf("\n");
+      memcpy(a + size - 8, saved, 8);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,262 @@
+// Producer/consumer throughput between two root states on their own
+// threads, passing messages (a map holding a symbol, an integer, a buffer
+// and a list of symbols) through a locked mailbox state.
+//   xmove   the message is handed over with jack_xmove, nothing is copied
+//   copy    the producer flattens it into a C struct and the consumer builds
+//           it again, what sending took before jack_xmove could cross heaps
+//   frozen  the message is frozen and shared by two consumers at once
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "../old/api.h"
+
+#define MESSAGES 200000
+#define BODY 256
+#define LIMIT 256 // Messages in a mailbox before the producer waits
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char *tags[] = {"urgent", "billing", "retry"};
+
+static void message(jack_state_t *state, intptr_t id, const char *body) {
+  jack_new_map(state, 4);
+  jack_new_symbol(state, "order");
+  jack_map_set_symbol(state, -2, "name");
+  jack_new_integer(state, id);
+  jack_map_set_symbol(state, -2, "id");
+  jack_new_buffer(state, BODY, body);
+  jack_map_set_symbol(state, -2, "body");
+  jack_new_list(state);
+  for (int i = 0; i < 3; ++i) {
+    jack_new_symbol(state, tags[i]);
+    jack_list_push(state, -2);
+  }
+  jack_map_set_symbol(state, -2, "tags");
+}
+
+// Read every field of the message on top, and drop it.
+static intptr_t consume(jack_state_t *state) {
+  int size;
+  jack_map_get_symbol(state, -1, "id");
+  intptr_t sum = jack_get_integer(state, -1);
+  jack_map_get_symbol(state, -2, "body");
+  sum += jack_get_buffer(state, -1, &size)[size - 1];
+  jack_map_get_symbol(state, -3, "tags");
+  sum += jack_list_length(state, -1);
+  jack_map_get_symbol(state, -4, "name");
+  jack_get_symbol(state, -1, &size);
+  jack_popn(state, 5);
+  return sum + size;
+}
+
+// What the copy mode sends instead.
+struct flat {
+  char name[16];
+  intptr_t id;
+  char body[BODY];
+  char tags[3][16];
+};
+
+static struct flat* flatten(jack_state_t *state) {
+  struct flat *flat = malloc(sizeof(*flat));
+  int size;
+  jack_map_get_symbol(state, -1, "name");
+  const char *name = jack_get_symbol(state, -1, &size);
+  memcpy(flat->name, name, size);
+  flat->name[size] = 0;
+  jack_map_get_symbol(state, -2, "id");
+  flat->id = jack_get_integer(state, -1);
+  jack_map_get_symbol(state, -3, "body");
+  memcpy(flat->body, jack_get_buffer(state, -1, &size), BODY);
+  jack_map_get_symbol(state, -4, "tags");
+  for (int i = 0; i < 3; ++i) {
+    jack_list_get(state, -1, i);
+    const char *tag = jack_get_symbol(state, -1, &size);
+    memcpy(flat->tags[i], tag, size);
+    flat->tags[i][size] = 0;
+    jack_pop(state);
+  }
+  jack_popn(state, 5);
+  return flat;
+}
+
+static void unflatten(jack_state_t *state, struct flat *flat) {
+  jack_new_map(state, 4);
+  jack_new_symbol(state, flat->name);
+  jack_map_set_symbol(state, -2, "name");
+  jack_new_integer(state, flat->id);
+  jack_map_set_symbol(state, -2, "id");
+  jack_new_buffer(state, BODY, flat->body);
+  jack_map_set_symbol(state, -2, "body");
+  jack_new_list(state);
+  for (int i = 0; i < 3; ++i) {
+    jack_new_symbol(state, flat->tags[i]);
+    jack_list_push(state, -2);
+  }
+  jack_map_set_symbol(state, -2, "tags");
+  free(flat);
+}
+
+// A mailbox is a state of its own with a list of messages in slot 0, only
+// touched with the lock held.  Copies go through a plain array instead.
+struct mailbox {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  jack_state_t *box;
+  struct flat *flats[LIMIT];
+  int head;
+  int length;
+  bool closed;
+};
+
+static void open_mailbox(struct mailbox *mailbox) {
+  memset(mailbox, 0, sizeof(*mailbox));
+  pthread_mutex_init(&mailbox->lock, NULL);
+  pthread_cond_init(&mailbox->changed, NULL);
+  mailbox->box = jack_new_state(10);
+  jack_new_list(mailbox->box);
+}
+
+static void close_mailbox(struct mailbox *mailbox) {
+  jack_free_state(mailbox->box);
+  pthread_cond_destroy(&mailbox->changed);
+  pthread_mutex_destroy(&mailbox->lock);
+}
+
+// Take the message on top of state, or the flat one if given.
+static void post(struct mailbox *mailbox, jack_state_t *state, struct flat *flat) {
+  pthread_mutex_lock(&mailbox->lock);
+  while (mailbox->length == LIMIT) pthread_cond_wait(&mailbox->changed, &mailbox->lock);
+  if (flat) {
+    mailbox->flats[(mailbox->head + mailbox->length) % LIMIT] = flat;
+  }
+  else {
+    bool moved = jack_xmove(state, mailbox->box, 1);
+    assert(moved);
+    (void)moved;
+    jack_list_push(mailbox->box, 0);
+  }
+  mailbox->length++;
+  pthread_cond_broadcast(&mailbox->changed);
+  pthread_mutex_unlock(&mailbox->lock);
+}
+
+// Push the next message on state, or return the flat one.  Returns NULL
+// without pushing anything once the mailbox is closed and empty.
+static void* take(struct mailbox *mailbox, jack_state_t *state, bool flat) {
+  void *result = state;
+  pthread_mutex_lock(&mailbox->lock);
+  while (!mailbox->length && !mailbox->closed) {
+    pthread_cond_wait(&mailbox->changed, &mailbox->lock);
+  }
+  if (!mailbox->length) {
+    result = NULL;
+  }
+  else {
+    if (flat) {
+      result = mailbox->flats[mailbox->head];
+      mailbox->head = (mailbox->head + 1) % LIMIT;
+    }
+    else {
+      jack_list_shift(mailbox->box, 0);
+      bool moved = jack_xmove(mailbox->box, state, 1);
+      assert(moved);
+      (void)moved;
+    }
+    mailbox->length--;
+    pthread_cond_broadcast(&mailbox->changed);
+  }
+  pthread_mutex_unlock(&mailbox->lock);
+  return result;
+}
+
+enum { XMOVE, COPY, FROZEN };
+
+struct consumer {
+  pthread_t thread;
+  struct mailbox mailbox;
+  int mode;
+  intptr_t sum;
+};
+
+static void* consumer(void *data) {
+  struct consumer *self = data;
+  jack_state_t *state = jack_new_state(20);
+  void *received;
+  while ((received = take(&self->mailbox, state, self->mode == COPY))) {
+    if (self->mode == COPY) unflatten(state, received);
+    self->sum += consume(state);
+  }
+  jack_free_state(state);
+  return NULL;
+}
+
+static double run(int mode, intptr_t *sum) {
+  static char body[BODY];
+  memset(body, '.', BODY);
+  int consumers = mode == FROZEN ? 2 : 1;
+  struct consumer readers[2];
+  for (int i = 0; i < consumers; ++i) {
+    readers[i].mode = mode;
+    readers[i].sum = 0;
+    open_mailbox(&readers[i].mailbox);
+    pthread_create(&readers[i].thread, NULL, consumer, &readers[i]);
+  }
+  jack_state_t *state = jack_new_state(20);
+  double start = now();
+  for (intptr_t id = 0; id < MESSAGES; ++id) {
+    message(state, id, body);
+    if (mode == COPY) {
+      post(&readers[0].mailbox, NULL, flatten(state));
+    }
+    else if (mode == FROZEN) {
+      jack_freeze(state, -1);
+      jack_dup(state, -1);
+      post(&readers[0].mailbox, state, NULL);
+      post(&readers[1].mailbox, state, NULL);
+    }
+    else {
+      post(&readers[0].mailbox, state, NULL);
+    }
+  }
+  for (int i = 0; i < consumers; ++i) {
+    pthread_mutex_lock(&readers[i].mailbox.lock);
+    readers[i].mailbox.closed = true;
+    pthread_cond_broadcast(&readers[i].mailbox.changed);
+    pthread_mutex_unlock(&readers[i].mailbox.lock);
+  }
+  *sum = 0;
+  for (int i = 0; i < consumers; ++i) {
+    pthread_join(readers[i].thread, NULL);
+    *sum += readers[i].sum;
+  }
+  double elapsed = now() - start;
+  // Consumers are gone, so the mailboxes are the last to hold the producer.
+  jack_free_state(state);
+  for (int i = 0; i < consumers; ++i) close_mailbox(&readers[i].mailbox);
+  return elapsed;
+}
+
+int main() {
+  static const char *names[] = {"xmove", "copy", "frozen"};
+  intptr_t expected = 0;
+  for (intptr_t id = 0; id < MESSAGES; ++id) expected += id + '.' + 3 + 5;
+  printf("%d messages with a %d byte body\n", MESSAGES, BODY);
+  printf("mode     seconds  messages/s\n");
+  for (int mode = XMOVE; mode <= FROZEN; ++mode) {
+    intptr_t sum;
+    double elapsed = run(mode, &sum);
+    assert(sum == expected * (mode == FROZEN ? 2 : 1));
+    printf("%-7s  %7.3f  %10.0f\n", names[mode], elapsed, MESSAGES / elapsed);
+  }
+  return 0;
+}
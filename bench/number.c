@@ -0,0 +1,95 @@
+// Throughput of the rational ops in number.c against the textbook way of
+// doing them: cross multiply, then reduce with Euclid's algorithm every
+// time, as old/rational.c did.  Operands are random ratios of a few sizes.
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "../number.h"
+
+#define COUNT 4096
+#define ROUNDS 500
+
+static uint64_t state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next(void) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dull;
+}
+
+static double now(void) {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static int64_t euclid(int64_t a, int64_t b) {
+  if (a < 0) a = -a;
+  while (b) {
+    int64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static bool naive(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r, int op) {
+  int64_t n, d;
+  switch (op) {
+    case 0:
+      if (__builtin_mul_overflow(a.num, b.den, &n) ||
+          __builtin_mul_overflow(b.num, a.den, &d) ||
+          __builtin_add_overflow(n, d, &n) ||
+          __builtin_mul_overflow(a.den, b.den, &d)) {
+        return false;
+      }
+      break;
+    default:
+      if (__builtin_mul_overflow(a.num, b.num, &n) ||
+          __builtin_mul_overflow(a.den, b.den, &d)) {
+        return false;
+      }
+      break;
+  }
+  int64_t g = euclid(n, d);
+  *r = (jack_ratio_t){ n / g, d / g };
+  return true;
+}
+
+static bool add(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r, int op) {
+  return op ? jack_ratio_mul(a, b, r) : jack_ratio_add(a, b, r);
+}
+
+typedef bool (*op_t)(jack_ratio_t, jack_ratio_t, jack_ratio_t*, int);
+
+static double run(op_t fn, const jack_ratio_t* a, int op, int64_t* checksum) {
+  jack_ratio_t r;
+  double start = now();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i + 1 < COUNT; i++) {
+      if (fn(a[i], a[i + 1], &r, op)) *checksum += r.num ^ r.den;
+    }
+  }
+  return (now() - start) * 1e9 / ((double)ROUNDS * (COUNT - 1));
+}
+
+int main() {
+  static jack_ratio_t ratios[COUNT];
+  static const int sizes[] = { 1, 8, 16, 31 };
+  int64_t checksum = 0;
+  printf("bits  op   number.c  naive     (ns per op)\n");
+  for (int s = 0; s < (int)(sizeof(sizes) / sizeof(*sizes)); s++) {
+    int bits = sizes[s];
+    for (int i = 0; i < COUNT; i++) {
+      int64_t n = next() >> (64 - bits), d = (next() >> (64 - bits)) | 1;
+      int64_t g = euclid(n, d);
+      ratios[i] = (jack_ratio_t){ (next() & 1 ? -n : n) / g, d / g };
+    }
+    for (int op = 0; op < 2; op++) {
+      double fast = run(add, ratios, op, &checksum);
+      double slow = run(naive, ratios, op, &checksum);
+      printf("%4d  %s    %6.1f    %6.1f\n", bits, op ? "*" : "+", fast, slow);
+    }
+  }
+  printf("checksum %lld\n", (long long)checksum);
+  return 0;
+}
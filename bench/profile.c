@@ -0,0 +1,70 @@
+// What building with JACK_PROFILE costs: the scripts in bench/ run under
+// jack, and under jack-profile with sampling off (JACK_PROFILE_HZ=0) and
+// at its default rate, taking turns so all see the same machine, best CPU
+// time of each.  The request was under 2% sampling, nothing while off.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define ROUNDS 21
+
+static const char* scripts[] = {
+  "bench/fib.jack", "bench/loop.jack", "bench/arith.jack", "bench/fields.jack",
+  "bench/maps.jack", "bench/records.jack", "bench/threads.jack",
+};
+
+static double children(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_CHILDREN, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+// CPU seconds binary takes to run script, output thrown away.
+static double run(const char* binary, const char* script) {
+  double before = children();
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (!pid) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execl(binary, binary, script, (char*)NULL);
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && !WEXITSTATUS(status));
+  return children() - before;
+}
+
+int main() {
+  // jack runs twice a round, how far apart those two end up is the noise.
+  printf("script                 jack   again     off sampling   (s, best of %d)\n",
+         ROUNDS);
+  for (size_t i = 0; i < sizeof(scripts) / sizeof(*scripts); i++) {
+    double plain = 1e9, again = 1e9, off = 1e9, sampling = 1e9;
+    for (int round = 0; round < ROUNDS; round++) {
+      double t = run("./jack", scripts[i]);
+      if (t < plain) plain = t;
+      setenv("JACK_PROFILE_HZ", "0", 1);
+      t = run("./jack-profile", scripts[i]);
+      if (t < off) off = t;
+      unsetenv("JACK_PROFILE_HZ");
+      t = run("./jack-profile", scripts[i]);
+      if (t < sampling) sampling = t;
+      t = run("./jack", scripts[i]);
+      if (t < again) again = t;
+    }
+    printf("%-20s %6.3f  %+5.1f%%  %+5.1f%%   %+5.1f%%\n", scripts[i], plain,
+           (again / plain - 1) * 100, (off / plain - 1) * 100,
+           (sampling / plain - 1) * 100);
+  }
+  return 0;
+}
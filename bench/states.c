@@ -0,0 +1,136 @@
+// The old/main.c fib workload spread over many root states, run on 1, 2, 4
+// ... worker threads by old/sched.c.  Every state gets its own fib with a
+// cache map, as in old/math.c, and a task that does one generation of
+// fib(0..91) per step before yielding.  The total work stays the same for
+// every worker count, so the times show how it scales.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include "../old/api.h"
+#include "../old/sched.h"
+
+#define STATES 64
+#define GENERATIONS 1000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int add(jack_state_t *state) {
+  jack_new_integer(state, jack_get_integer(state, 0) + jack_get_integer(state, 1));
+  return 1;
+}
+
+// Same as fib in old/math.c: 0 - cache map, 1 - index.
+static int fib(jack_state_t *state) {
+  intptr_t i = jack_get_integer(state, 1);
+  if (i < 2) {
+    jack_new_integer(state, 1);
+    return 1;
+  }
+  jack_dup(state, 1);
+  jack_map_get(state, 0);
+  if (jack_get_type(state, -1) != Nil) return 1;
+  jack_dup(state, 0);
+  jack_new_integer(state, i - 1);
+  jack_call(state, fib, 2);
+  jack_dup(state, 0);
+  jack_new_integer(state, i - 2);
+  jack_call(state, fib, 2);
+  jack_call(state, add, 2);
+  jack_dup(state, 1);
+  jack_dup(state, -2);
+  jack_map_set(state, 0);
+  return 1;
+}
+
+// Leaves the fib function at slot 0, the way old/main.c sets it up.
+static jack_state_t* new_state(void) {
+  jack_state_t *state = jack_new_state(20);
+  jack_new_map(state, 10);
+  jack_new_function(state, fib, 1);
+  return state;
+}
+
+struct job {
+  int generations;
+  uintptr_t checksum;
+};
+
+static void generation(jack_state_t *state, struct job *job) {
+  for (intptr_t i = 0; i <= 91; ++i) {
+    jack_new_integer(state, i);
+    jack_function_call(state, 0, 1);
+    job->checksum += jack_get_integer(state, -1);
+    jack_pop(state);
+  }
+  job->generations++;
+}
+
+static bool step(jack_state_t *state, void *userdata) {
+  struct job *job = userdata;
+  generation(state, job);
+  return job->generations < GENERATIONS;
+}
+
+static uintptr_t expected(void) {
+  jack_state_t *state = new_state();
+  struct job job = {0, 0};
+  generation(state, &job);
+  jack_free_state(state);
+  return job.checksum * GENERATIONS;
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int most = argc > 1 ? atoi(argv[1]) : cpus > 4 ? cpus : 4;
+  uintptr_t sum = expected();
+  static jack_state_t *states[STATES];
+  static struct job jobs[STATES];
+
+  // The same work on the calling thread, without the scheduler.
+  for (int s = 0; s < STATES; ++s) states[s] = new_state();
+  double start = now();
+  for (int s = 0; s < STATES; ++s) {
+    jobs[s] = (struct job){0, 0};
+    while (step(states[s], &jobs[s]));
+  }
+  double serial = now() - start;
+  for (int s = 0; s < STATES; ++s) {
+    assert(jobs[s].checksum == sum);
+    jack_free_state(states[s]);
+  }
+  printf("%d states x %d generations, %ld cpus\n", STATES, GENERATIONS, cpus);
+  printf("serial   %7.3fs\n", serial);
+  printf("workers  seconds  speedup  steals  sleeps\n");
+
+  for (int workers = 1; workers <= most; workers *= 2) {
+    jack_sched_t *sched = jack_sched_new(workers);
+    for (int s = 0; s < STATES; ++s) {
+      states[s] = new_state();
+      jobs[s] = (struct job){0, 0};
+    }
+    start = now();
+    for (int s = 0; s < STATES; ++s) {
+      jack_sched_spawn(sched, states[s], step, &jobs[s]);
+    }
+    jack_sched_wait(sched);
+    double elapsed = now() - start;
+    jack_sched_stats_t stats;
+    jack_sched_stats(sched, &stats);
+    jack_sched_free(sched);
+    for (int s = 0; s < STATES; ++s) {
+      assert(jobs[s].checksum == sum);
+      jack_free_state(states[s]);
+    }
+    printf("%7d  %7.3f  %7.2f  %6zu  %6zu\n", workers, elapsed, serial / elapsed,
+      stats.steals, stats.sleeps);
+  }
+  return 0;
+}
@@ -0,0 +1,1554 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <assert.h>
+
+#include "compiler.h"
+#include "symbol.h"
+
+// Single pass compiler.  The lexer hands out tokens that point into the
+// source, the parser keeps one token of lookahead (two when telling
+// functions from maps) and code is emitted while parsing, so compiling is
+// linear in the size of the source.  The only allocations are the growable
+// arrays of each function being compiled and the prototypes themselves.
+
+// Single character tokens are their own character.
+enum {
+  TOK_EOF = 256, TOK_NAME, TOK_INT, TOK_STRING,
+  TOK_VARS, TOK_IF, TOK_ELSE, TOK_WHILE, TOK_RETURN,
+  TOK_AND, TOK_OR, TOK_NOT, TOK_IN, TOK_THREAD, TOK_RESUME, TOK_YIELD,
+  TOK_TRUE, TOK_FALSE, TOK_NIL,
+  TOK_EQ, TOK_NE, TOK_LE, TOK_GE,
+};
+
+typedef struct {
+  int type;
+  const char* start;
+  int length;
+  int line;
+  intptr_t integer;
+} token_t;
+
+// Slot numbers have to fit the 8 bit A, B and C operands.
+#define MAX_SLOTS 250
+
+typedef struct {
+  const char* name;
+  int length;
+  bool captured;
+  bool hidden; // Declared, but its initializer isn't done yet
+} local_t;
+
+// Where an expression's value is.  Constants and variables are only loaded
+// into a slot once the code using them knows which slot it wants, which is
+// what makes the VN/NV and constant compare forms and folding possible.
+typedef enum {
+  EVoid,    // No value
+  ENil,
+  ETrue,
+  EFalse,
+  EInt,     // Integer constant
+  ESym,     // Symbol constant
+  ELocal,   // Declared variable in slot `reg`
+  EReg,     // Temporary in slot `reg`
+  ECall,    // Result of the CALL, RESUME or YIELD at `pc`, in slot `reg`
+  EUpval,   // Upvalue `index`
+  EGlobal,  // `symbol` in the globals map
+  EIndex,   // obj[key] where op is MGETV, MGETS or MGETB
+  ECompare, // Comparison op that jumps when true, not evaluated yet
+} exp_kind_t;
+
+typedef struct {
+  exp_kind_t kind;
+  int reg;
+  int pc;
+  int index;
+  intptr_t integer;
+  const jack_symbol_t* symbol;
+  int op;  // EIndex and ECompare
+  int obj; // EIndex object slot, ECompare A operand
+  int key; // EIndex key operand, ECompare D operand
+  bool fresh; // EReg written by the last instruction and nothing else
+} exp_t;
+
+typedef struct func {
+  struct func* parent;
+  struct compiler* compiler;
+  const char* name;
+  int params;
+  uint32_t* code;
+  int ncode, code_size;
+  uint32_t* lines; // Line of the token each instruction was emitted at
+  int lines_size;
+  const jack_symbol_t** symbols;
+  int nsymbols, symbols_size;
+  intptr_t* numbers;
+  int nnumbers, numbers_size;
+  jack_proto_t** protos;
+  int nprotos, protos_size;
+  jack_map_t** templates; // Map literals, copied by MDUP
+  int ntemplates, templates_size;
+  jack_upvaldesc_t upvals[MAX_SLOTS];
+  const char* upnames[MAX_SLOTS];
+  int uplengths[MAX_SLOTS];
+  int nupvals;
+  int first_local; // This function's locals start here in compiler->locals
+  int nactive;     // Slots 0..nactive-1 hold declared variables
+  int freereg;     // First free slot, temporaries are stacked above nactive
+  int maxslots;
+  int depth;       // Block nesting inside this function
+  jack_map_t constants; // Symbol or integer -> index in its table
+} func_t;
+
+typedef struct compiler {
+  const char* name;
+  const char* p;
+  const char* end;
+  int line;
+  token_t t;
+  token_t ahead;
+  bool has_ahead;
+  func_t* fs;
+  local_t* locals;
+  int nlocals, locals_size;
+  char* scratch; // Unescaped string literals
+  int scratch_size;
+  const char* hint; // Name for the next function literal
+  int hint_length;
+  char* error;
+  size_t error_size;
+  jmp_buf jump;
+} compiler_t;
+
+static const char env_name[] = "(globals)";
+
+static void vfail(compiler_t* c, int line, const char* format, va_list args) {
+  int n = snprintf(c->error, c->error_size, "%s:%d: ", c->name, line);
+  if (n >= 0 && (size_t)n < c->error_size) {
+    vsnprintf(c->error + n, c->error_size - n, format, args);
+  }
+  longjmp(c->jump, 1);
+}
+
+// Report an error at the current token.
+static void fail(compiler_t* c, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfail(c, c->t.line, format, args);
+}
+
+static void fail_at(compiler_t* c, int line, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfail(c, line, format, args);
+}
+
+// Double `*array` until it holds `needed` items of `item` bytes.
+static void* grow(void* array, int* size, int needed, size_t item) {
+  if (needed <= *size) return array;
+  int new_size = *size ? *size * 2 : 16;
+  while (new_size < needed) new_size *= 2;
+  array = realloc(array, item * new_size);
+  assert(array);
+  *size = new_size;
+  return array;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   LEXER
+////////////////////////////////////////////////////////////////////////////////
+
+static bool is_name_start(char ch) {
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+}
+
+static bool is_digit(char ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+static int keyword(const char* start, int length) {
+  static const struct { const char* name; int type; } keywords[] = {
+    { "vars", TOK_VARS }, { "if", TOK_IF }, { "else", TOK_ELSE },
+    { "while", TOK_WHILE }, { "return", TOK_RETURN }, { "and", TOK_AND },
+    { "or", TOK_OR }, { "not", TOK_NOT }, { "in", TOK_IN },
+    { "thread", TOK_THREAD }, { "resume", TOK_RESUME }, { "yield", TOK_YIELD },
+    { "true", TOK_TRUE }, { "false", TOK_FALSE }, { "nil", TOK_NIL },
+  };
+  for (int i = 0; i < (int)(sizeof(keywords) / sizeof(*keywords)); i++) {
+    if ((int)strlen(keywords[i].name) == length &&
+        !memcmp(keywords[i].name, start, length)) {
+      return keywords[i].type;
+    }
+  }
+  return TOK_NAME;
+}
+
+static token_t lex(compiler_t* c) {
+  const char* p = c->p;
+  for (;;) {
+    while (p < c->end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+      if (*p == '\n') c->line++;
+      p++;
+    }
+    // Comments run from -- to the end of the line.
+    if (p + 1 < c->end && p[0] == '-' && p[1] == '-') {
+      while (p < c->end && *p != '\n') p++;
+      continue;
+    }
+    break;
+  }
+  token_t t = { .start = p, .line = c->line };
+  if (p >= c->end) {
+    t.type = TOK_EOF;
+  }
+  else if (is_name_start(*p)) {
+    while (p < c->end && (is_name_start(*p) || is_digit(*p))) p++;
+    t.type = keyword(t.start, p - t.start);
+  }
+  else if (is_digit(*p)) {
+    intptr_t value = 0;
+    for (; p < c->end && is_digit(*p); p++) {
+      if (value > ((INTPTR_MAX >> 1) - (*p - '0')) / 10) {
+        fail_at(c, c->line, "Number too large");
+      }
+      value = value * 10 + (*p - '0');
+    }
+    t.type = TOK_INT;
+    t.integer = value;
+  }
+  else if (*p == '"') {
+    for (p++; p < c->end && *p != '"'; p++) {
+      if (*p == '\\') p++;
+      if (p < c->end && *p == '\n') c->line++;
+    }
+    if (p >= c->end) fail_at(c, t.line, "Unfinished string");
+    p++;
+    t.type = TOK_STRING;
+  }
+  else {
+    char ch = *p++;
+    bool eq = p < c->end && *p == '=';
+    t.type = ch;
+    if (ch == '=' && eq) t.type = TOK_EQ;
+    else if (ch == '!' && eq) t.type = TOK_NE;
+    else if (ch == '<' && eq) t.type = TOK_LE;
+    else if (ch == '>' && eq) t.type = TOK_GE;
+    if (t.type >= 256) p++;
+  }
+  t.length = p - t.start;
+  c->p = p;
+  return t;
+}
+
+static void next(compiler_t* c) {
+  if (c->has_ahead) {
+    c->t = c->ahead;
+    c->has_ahead = false;
+  }
+  else {
+    c->t = lex(c);
+  }
+}
+
+static const token_t* peek(compiler_t* c) {
+  if (!c->has_ahead) {
+    c->ahead = lex(c);
+    c->has_ahead = true;
+  }
+  return &c->ahead;
+}
+
+static bool accept(compiler_t* c, int type) {
+  if (c->t.type != type) return false;
+  next(c);
+  return true;
+}
+
+static void expect(compiler_t* c, int type, const char* what) {
+  if (accept(c, type)) return;
+  if (c->t.type == TOK_EOF) fail(c, "Expected %s at end of file", what);
+  fail(c, "Expected %s near '%.*s'", what, c->t.length, c->t.start);
+}
+
+// Symbol for a string literal token, with escapes resolved.
+static const jack_symbol_t* string_symbol(compiler_t* c, const token_t* t) {
+  const char* p = t->start + 1;
+  const char* end = t->start + t->length - 1;
+  c->scratch = grow(c->scratch, &c->scratch_size, end - p, 1);
+  int n = 0;
+  for (; p < end; p++) {
+    char ch = *p;
+    if (ch == '\\') {
+      switch (*++p) {
+        case 'n': ch = '\n'; break;
+        case 't': ch = '\t'; break;
+        case 'r': ch = '\r'; break;
+        case '0': ch = '\0'; break;
+        default: ch = *p; break;
+      }
+    }
+    c->scratch[n++] = ch;
+  }
+  return jack_intern(c->scratch, n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   CODE GENERATION
+////////////////////////////////////////////////////////////////////////////////
+
+static int emit(func_t* fs, uint32_t ins) {
+  fs->code = grow(fs->code, &fs->code_size, fs->ncode + 1, sizeof(*fs->code));
+  fs->lines = grow(fs->lines, &fs->lines_size, fs->ncode + 1, sizeof(*fs->lines));
+  fs->code[fs->ncode] = ins;
+  fs->lines[fs->ncode] = fs->compiler->t.line;
+  return fs->ncode++;
+}
+
+static void patch_jump(func_t* fs, int pc, int target) {
+  int offset = target - (pc + 1);
+  if (offset < INT16_MIN || offset > INT16_MAX) fail(fs->compiler, "Jump too far");
+  fs->code[pc] = OPAD(OPGETOP(fs->code[pc]), OPGETA(fs->code[pc]), offset);
+}
+
+// Emit a JMP to be patched later.
+static int emit_jump(func_t* fs) {
+  return emit(fs, OPAD(JMP, 0, 0));
+}
+
+static void patch_here(func_t* fs, int pc) {
+  if (pc >= 0) patch_jump(fs, pc, fs->ncode);
+}
+
+static void reserve(func_t* fs, int n) {
+  fs->freereg += n;
+  if (fs->freereg > MAX_SLOTS) fail(fs->compiler, "Function needs too many slots");
+  if (fs->freereg > fs->maxslots) fs->maxslots = fs->freereg;
+}
+
+// Temporaries are freed in the reverse order they were reserved.
+static void free_reg(func_t* fs, int reg) {
+  if (reg >= fs->nactive) {
+    fs->freereg--;
+    assert(reg == fs->freereg);
+  }
+}
+
+static void free_regs(func_t* fs, int a, int b) {
+  if (a > b) {
+    free_reg(fs, a);
+    free_reg(fs, b);
+  }
+  else {
+    free_reg(fs, b);
+    free_reg(fs, a);
+  }
+}
+
+static void free_exp(func_t* fs, exp_t* e) {
+  switch (e->kind) {
+    case EReg:
+    case ECall:
+      free_reg(fs, e->reg);
+      break;
+    case EIndex:
+      if (e->op == MGETV) free_regs(fs, e->obj, e->key);
+      else free_reg(fs, e->obj);
+      break;
+    case ECompare:
+      if (e->op == ISLT || e->op == ISGE || e->op == ISEQV || e->op == ISNEV) {
+        free_regs(fs, e->obj, e->key);
+      }
+      else {
+        free_reg(fs, e->obj);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Index of a constant in the symbol or number table, adding it if needed.
+static int add_constant(func_t* fs, jack_value_t key) {
+  jack_value_t index = jack_map_get(&fs->constants, key);
+  if (index) return jack_tointeger(index);
+  int n;
+  if (jack_isinteger(key)) {
+    n = fs->nnumbers;
+    fs->numbers = grow(fs->numbers, &fs->numbers_size, n + 1, sizeof(*fs->numbers));
+    fs->numbers[fs->nnumbers++] = jack_tointeger(key);
+  }
+  else {
+    n = fs->nsymbols;
+    fs->symbols = grow(fs->symbols, &fs->symbols_size, n + 1, sizeof(*fs->symbols));
+    fs->symbols[fs->nsymbols++] = jack_tosymbol(key);
+  }
+  if (n > INT16_MAX) fail(fs->compiler, "Too many constants");
+  jack_map_set(&fs->constants, key, jack_integer(n));
+  return n;
+}
+
+static int number_constant(func_t* fs, intptr_t number) {
+  return add_constant(fs, jack_integer(number));
+}
+
+static int symbol_constant(func_t* fs, const jack_symbol_t* symbol) {
+  return add_constant(fs, jack_object(symbol));
+}
+
+static void exp_to_anyreg_as(func_t* fs, exp_t* e);
+
+// Resolve the globals map, which is the first slot of the main function.
+static void load_globals(func_t* fs, exp_t* e);
+
+static void load_int(func_t* fs, int reg, intptr_t integer) {
+  if (integer >= INT16_MIN && integer <= INT16_MAX) {
+    emit(fs, OPAD(KSHORT, reg, integer));
+  }
+  else {
+    emit(fs, OPAD(KNUM, reg, number_constant(fs, integer)));
+  }
+}
+
+// Emit the code that puts the value of e into reg.  Any temporaries of e
+// must already be freed, every instruction reads its operands before
+// writing, so reg may be one of them.
+static void exp_to_reg(func_t* fs, exp_t* e, int reg) {
+  int ncode = fs->ncode;
+  switch (e->kind) {
+    case EVoid:
+    case ENil:
+      emit(fs, OPAD(KPRI, reg, PriNil));
+      break;
+    case ETrue:
+      emit(fs, OPAD(KPRI, reg, PriTrue));
+      break;
+    case EFalse:
+      emit(fs, OPAD(KPRI, reg, PriFalse));
+      break;
+    case EInt:
+      load_int(fs, reg, e->integer);
+      break;
+    case ESym:
+      emit(fs, OPAD(KSYM, reg, symbol_constant(fs, e->symbol)));
+      break;
+    case ELocal:
+    case EReg:
+    case ECall:
+      if (e->reg != reg) emit(fs, OPAD(MOV, reg, e->reg));
+      break;
+    case EUpval:
+      emit(fs, OPAD(UGET, reg, e->index));
+      break;
+    case EIndex:
+      emit(fs, OPABC(e->op, reg, e->obj, e->key));
+      break;
+    case ECompare:
+      emit(fs, OPAD(e->op, e->obj, e->key));
+      emit(fs, OPAD(JMP, 0, 2));
+      emit(fs, OPAD(KPRI, reg, PriFalse));
+      emit(fs, OPAD(JMP, 0, 1));
+      emit(fs, OPAD(KPRI, reg, PriTrue));
+      break;
+    case EGlobal:
+      assert(0);
+      break;
+  }
+  e->fresh = e->kind != ECompare && ncode + 1 == fs->ncode;
+  e->kind = EReg;
+  e->reg = reg;
+}
+
+// Globals turn into a lookup in the globals map.
+static void discharge_global(func_t* fs, exp_t* e) {
+  if (e->kind != EGlobal) return;
+  const jack_symbol_t* symbol = e->symbol;
+  load_globals(fs, e);
+  exp_to_anyreg_as(fs, e);
+  int obj = e->reg;
+  int k = symbol_constant(fs, symbol);
+  e->kind = EIndex;
+  e->obj = obj;
+  if (k <= 0xff) {
+    e->op = MGETS;
+    e->key = k;
+  }
+  else {
+    exp_t key = { .kind = ESym, .symbol = symbol };
+    exp_to_anyreg_as(fs, &key);
+    e->op = MGETV;
+    e->key = key.reg;
+  }
+}
+
+// Put e in a fresh temporary on top of the others.
+static void exp_to_nextreg(func_t* fs, exp_t* e) {
+  discharge_global(fs, e);
+  if ((e->kind == EReg || e->kind == ECall) && e->reg == fs->freereg - 1 &&
+      e->reg >= fs->nactive) {
+    e->kind = EReg;
+    return;
+  }
+  free_exp(fs, e);
+  reserve(fs, 1);
+  exp_to_reg(fs, e, fs->freereg - 1);
+}
+
+// Put e in some slot, variables are used where they are.
+static void exp_to_anyreg_as(func_t* fs, exp_t* e) {
+  discharge_global(fs, e);
+  if (e->kind == ELocal) return;
+  if (e->kind == EReg || e->kind == ECall) {
+    e->kind = e->kind == ECall ? EReg : e->kind;
+    return;
+  }
+  exp_to_nextreg(fs, e);
+}
+
+static int exp_to_anyreg(func_t* fs, exp_t* e) {
+  exp_to_anyreg_as(fs, e);
+  return e->reg;
+}
+
+// The test with the opposite outcome, 0 for instructions that aren't tests.
+static const uint8_t negate[JACK_OPCODES] = {
+  [ISLT] = ISGE, [ISGE] = ISLT, [ISEQV] = ISNEV, [ISNEV] = ISEQV,
+  [ISEQS] = ISNES, [ISNES] = ISEQS, [ISEQN] = ISNEN, [ISNEN] = ISEQN,
+  [ISEQP] = ISNEP, [ISNEP] = ISEQP, [ISLTN] = ISGEN, [ISGEN] = ISLTN,
+  [ISLEN] = ISGTN, [ISGTN] = ISLEN, [IST] = ISF, [ISF] = IST,
+};
+
+// Emit a test and a JMP taken when e is false.  Returns the JMP to patch,
+// or -1 when e is known to be true.
+static int jump_if_false(func_t* fs, exp_t* e) {
+  switch (e->kind) {
+    case ETrue:
+    case EInt:
+    case ESym:
+      return -1;
+    case EVoid:
+    case ENil:
+    case EFalse:
+      return emit_jump(fs);
+    case ECompare:
+      free_exp(fs, e);
+      emit(fs, OPAD(negate[e->op], e->obj, e->key));
+      return emit_jump(fs);
+    default: {
+      int reg = exp_to_anyreg(fs, e);
+      free_exp(fs, e);
+      emit(fs, OPAD(ISF, 0, reg));
+      return emit_jump(fs);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   SCOPES
+////////////////////////////////////////////////////////////////////////////////
+
+static void open_func(compiler_t* c, func_t* fs, const char* name) {
+  memset(fs, 0, sizeof(*fs));
+  fs->parent = c->fs;
+  fs->compiler = c;
+  fs->name = name;
+  fs->first_local = c->nlocals;
+  jack_map_init(&fs->constants, 8);
+  c->fs = fs;
+}
+
+static void free_func(func_t* fs) {
+  free(fs->code);
+  free(fs->lines);
+  free(fs->symbols);
+  free(fs->numbers);
+  for (int i = 0; i < fs->nprotos; i++) jack_free_proto(fs->protos[i]);
+  free(fs->protos);
+  for (int i = 0; i < fs->ntemplates; i++) {
+    jack_map_clear(fs->templates[i]);
+    free(fs->templates[i]);
+  }
+  free(fs->templates);
+  free((char*)fs->name);
+  jack_map_clear(&fs->constants);
+}
+
+static void* copy_array(const void* data, int count, size_t item) {
+  if (!count) return NULL;
+  void* copy = malloc(item * count);
+  assert(copy);
+  memcpy(copy, data, item * count);
+  return copy;
+}
+
+// Turn ADDVN followed by a test into a superinstruction.  Both words stay,
+// so nothing moves and jumps to the test are unaffected.
+static void fuse(func_t* fs) {
+  static const uint8_t fused[JACK_OPCODES] = {
+    [ISLT] = ADDLT, [ISGE] = ADDGE, [ISLTN] = ADDLTN, [ISLEN] = ADDLEN,
+  };
+  for (int pc = 0; pc + 1 < fs->ncode; pc++) {
+    uint32_t* ins = &fs->code[pc];
+    int op = fused[OPGETOP(ins[1])];
+    if (OPGETOP(ins[0]) == ADDVN && op) ins[0] = (ins[0] & ~(uint32_t)0xff) | op;
+  }
+}
+
+// Finish the function being compiled and turn it into a prototype.
+static jack_proto_t* close_func(compiler_t* c) {
+  func_t* fs = c->fs;
+  emit(fs, OPAD(RET, 0, 0));
+  fuse(fs);
+  jack_proto_t* proto = malloc(sizeof(*proto));
+  assert(proto);
+  *proto = (jack_proto_t){
+    .object = { Code },
+    .name = fs->name,
+    .params = fs->params,
+    .slots = fs->maxslots,
+    .ncode = fs->ncode,
+    .code = copy_array(fs->code, fs->ncode, sizeof(*fs->code)),
+    .lines = copy_array(fs->lines, fs->ncode, sizeof(*fs->lines)),
+    .caches = jack_new_caches(fs->code, fs->ncode),
+    .nsymbols = fs->nsymbols,
+    .symbols = copy_array(fs->symbols, fs->nsymbols, sizeof(*fs->symbols)),
+    .nnumbers = fs->nnumbers,
+    .numbers = copy_array(fs->numbers, fs->nnumbers, sizeof(*fs->numbers)),
+    .nprotos = fs->nprotos,
+    .protos = copy_array(fs->protos, fs->nprotos, sizeof(*fs->protos)),
+    .nupvals = fs->nupvals,
+    .upvals = copy_array(fs->upvals, fs->nupvals, sizeof(*fs->upvals)),
+    .ntemplates = fs->ntemplates,
+    .templates = copy_array(fs->templates, fs->ntemplates, sizeof(*fs->templates)),
+  };
+  // The prototype owns the name, children and templates now.
+  fs->name = NULL;
+  fs->nprotos = 0;
+  fs->ntemplates = 0;
+  free_func(fs);
+  c->nlocals = fs->first_local;
+  c->fs = fs->parent;
+  return proto;
+}
+
+static int add_local(func_t* fs, const char* name, int length) {
+  compiler_t* c = fs->compiler;
+  assert(fs->freereg == fs->nactive);
+  c->locals = grow(c->locals, &c->locals_size, c->nlocals + 1, sizeof(*c->locals));
+  c->locals[c->nlocals++] = (local_t){ name, length, false, false };
+  int reg = fs->nactive++;
+  reserve(fs, 1);
+  return reg;
+}
+
+static int find_local(func_t* fs, const char* name, int length) {
+  compiler_t* c = fs->compiler;
+  for (int i = fs->nactive - 1; i >= 0; i--) {
+    local_t* local = &c->locals[fs->first_local + i];
+    if (!local->hidden && local->length == length &&
+        !memcmp(local->name, name, length)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int find_upval(func_t* fs, const char* name, int length) {
+  for (int i = 0; i < fs->nupvals; i++) {
+    if (fs->uplengths[i] == length && !memcmp(fs->upnames[i], name, length)) {
+      return i;
+    }
+  }
+  if (!fs->parent) return -1;
+  jack_upvaldesc_t desc;
+  int reg = find_local(fs->parent, name, length);
+  if (reg >= 0) {
+    fs->compiler->locals[fs->parent->first_local + reg].captured = true;
+    desc = (jack_upvaldesc_t){ .local = 1, .index = reg };
+  }
+  else {
+    int index = find_upval(fs->parent, name, length);
+    if (index < 0) return -1;
+    desc = (jack_upvaldesc_t){ .local = 0, .index = index };
+  }
+  if (fs->nupvals == MAX_SLOTS) fail(fs->compiler, "Too many upvalues");
+  fs->upvals[fs->nupvals] = desc;
+  fs->upnames[fs->nupvals] = name;
+  fs->uplengths[fs->nupvals] = length;
+  return fs->nupvals++;
+}
+
+static void resolve(func_t* fs, const char* name, int length, exp_t* e) {
+  int reg = find_local(fs, name, length);
+  if (reg >= 0) {
+    *e = (exp_t){ .kind = ELocal, .reg = reg };
+    return;
+  }
+  int index = find_upval(fs, name, length);
+  if (index >= 0) {
+    *e = (exp_t){ .kind = EUpval, .index = index };
+    return;
+  }
+  *e = (exp_t){ .kind = EGlobal, .symbol = jack_intern(name, length) };
+}
+
+static void load_globals(func_t* fs, exp_t* e) {
+  resolve(fs, env_name, sizeof(env_name) - 1, e);
+  assert(e->kind == ELocal || e->kind == EUpval);
+}
+
+typedef struct {
+  int nactive;
+} block_t;
+
+static void enter_block(func_t* fs, block_t* block) {
+  block->nactive = fs->nactive;
+  fs->depth++;
+}
+
+// Drop the block's variables.  If a closure captured one of them, its slot
+// is about to be reused, so the upvalue has to be closed first.
+static void leave_block(func_t* fs, block_t* block) {
+  compiler_t* c = fs->compiler;
+  bool captured = false;
+  for (int i = block->nactive; i < fs->nactive; i++) {
+    captured |= c->locals[fs->first_local + i].captured;
+  }
+  if (captured) emit(fs, OPAD(UCLO, block->nactive, 0));
+  c->nlocals = fs->first_local + block->nactive;
+  fs->nactive = fs->freereg = block->nactive;
+  fs->depth--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   PARSER
+////////////////////////////////////////////////////////////////////////////////
+
+static void expr(compiler_t* c, exp_t* e);
+static void block(compiler_t* c);
+static void call(compiler_t* c, exp_t* e, jack_opcode_t op);
+
+static char* copy_name(const char* name, int length) {
+  char* copy = malloc(length + 1);
+  assert(copy);
+  memcpy(copy, name, length);
+  copy[length] = 0;
+  return copy;
+}
+
+// {a, b| body}
+static void function(compiler_t* c, exp_t* e) {
+  func_t* parent = c->fs;
+  func_t fs;
+  open_func(c, &fs, c->hint ? copy_name(c->hint, c->hint_length)
+                             : copy_name("function", 8));
+  c->hint = NULL;
+  // The variable being declared is visible in function literals of its
+  // initializer, so a function can call itself.
+  if (parent->nactive) c->locals[parent->first_local + parent->nactive - 1].hidden = false;
+  if (c->t.type == TOK_NAME) {
+    do {
+      if (c->t.type != TOK_NAME) fail(c, "Expected parameter name");
+      add_local(&fs, c->t.start, c->t.length);
+      fs.params++;
+      next(c);
+    } while (accept(c, ','));
+  }
+  expect(c, '|', "'|'");
+  block(c);
+  expect(c, '}', "'}'");
+  jack_proto_t* proto = close_func(c);
+  parent->protos = grow(parent->protos, &parent->protos_size,
+                        parent->nprotos + 1, sizeof(*parent->protos));
+  parent->protos[parent->nprotos] = proto;
+  if (parent->nprotos > INT16_MAX) fail(c, "Too many functions");
+  reserve(parent, 1);
+  emit(parent, OPAD(FNEW, parent->freereg - 1, parent->nprotos++));
+  *e = (exp_t){ .kind = EReg, .fresh = true, .reg = parent->freereg - 1 };
+}
+
+// Store value in obj[symbol].
+static void store_field(func_t* fs, int obj, const jack_symbol_t* symbol, exp_t* value) {
+  int k = symbol_constant(fs, symbol);
+  int reg = exp_to_anyreg(fs, value);
+  if (k <= 0xff) {
+    emit(fs, OPABC(MSETS, reg, obj, k));
+  }
+  else {
+    exp_t key = { .kind = ESym, .symbol = symbol };
+    int key_reg = exp_to_anyreg(fs, &key);
+    emit(fs, OPABC(MSETV, reg, obj, key_reg));
+    free_exp(fs, &key);
+  }
+  free_exp(fs, value);
+}
+
+// Value of a constant that can be stored in a template, or nil.
+static jack_value_t template_value(const exp_t* e) {
+  switch (e->kind) {
+    case ETrue: return JACK_TRUE;
+    case EFalse: return JACK_FALSE;
+    case EInt: return jack_integer(e->integer);
+    case ESym: return jack_object(e->symbol);
+    default: return JACK_NIL;
+  }
+}
+
+// {} or {name: value, ...}
+//
+// A literal with keys becomes MDUP of a template map holding every key and
+// the constant values, only the other values are stored one by one.
+static void map(compiler_t* c, exp_t* e) {
+  func_t* fs = c->fs;
+  reserve(fs, 1);
+  int reg = fs->freereg - 1;
+  if (accept(c, '}')) {
+    emit(fs, OPAD(MNEW, reg, 0));
+    *e = (exp_t){ .kind = EReg, .reg = reg };
+    return;
+  }
+  jack_map_t* template = malloc(sizeof(*template));
+  assert(template);
+  jack_map_init(template, 0);
+  fs->templates = grow(fs->templates, &fs->templates_size,
+                       fs->ntemplates + 1, sizeof(*fs->templates));
+  fs->templates[fs->ntemplates] = template;
+  if (fs->ntemplates > INT16_MAX) fail(c, "Too many map literals");
+  emit(fs, OPAD(MDUP, reg, fs->ntemplates++));
+  do {
+    if (c->t.type != TOK_NAME) fail(c, "Expected key name");
+    const jack_symbol_t* key = jack_intern(c->t.start, c->t.length);
+    next(c);
+    expect(c, ':', "':'");
+    exp_t value;
+    expr(c, &value);
+    jack_value_t k = jack_object(key), v = template_value(&value);
+    // A repeated key is stored in order, after the values before it.
+    if (jack_map_has(template, k) || (!v && value.kind != ENil)) {
+      if (!jack_map_has(template, k)) jack_map_set(template, k, JACK_NIL);
+      store_field(fs, reg, key, &value);
+    }
+    else {
+      jack_map_set(template, k, v);
+    }
+  } while (accept(c, ',') && c->t.type != '}');
+  expect(c, '}', "'}'");
+  *e = (exp_t){ .kind = EReg, .reg = reg };
+}
+
+static void primary(compiler_t* c, exp_t* e) {
+  token_t t = c->t;
+  switch (t.type) {
+    case TOK_NAME:
+      next(c);
+      resolve(c->fs, t.start, t.length, e);
+      return;
+    case TOK_INT:
+      next(c);
+      *e = (exp_t){ .kind = EInt, .integer = t.integer };
+      return;
+    case TOK_STRING:
+      next(c);
+      *e = (exp_t){ .kind = ESym, .symbol = string_symbol(c, &t) };
+      return;
+    case ':':
+      next(c);
+      // Keywords are fine as symbol names.
+      if (c->t.type != TOK_NAME && !(c->t.type >= TOK_VARS && c->t.type <= TOK_NIL)) {
+        fail(c, "Expected symbol name");
+      }
+      *e = (exp_t){ .kind = ESym, .symbol = jack_intern(c->t.start, c->t.length) };
+      next(c);
+      return;
+    case TOK_TRUE:
+      next(c);
+      *e = (exp_t){ .kind = ETrue };
+      return;
+    case TOK_FALSE:
+      next(c);
+      *e = (exp_t){ .kind = EFalse };
+      return;
+    case TOK_NIL:
+      next(c);
+      *e = (exp_t){ .kind = ENil };
+      return;
+    case '(':
+      next(c);
+      expr(c, e);
+      expect(c, ')', "')'");
+      return;
+    // thread(f), resume(t, ...) and yield(...) look like calls.
+    case TOK_THREAD: {
+      func_t* fs = c->fs;
+      next(c);
+      expect(c, '(', "'('");
+      expr(c, e);
+      expect(c, ')', "')'");
+      int reg = exp_to_anyreg(fs, e);
+      free_exp(fs, e);
+      reserve(fs, 1);
+      emit(fs, OPAD(TNEW, fs->freereg - 1, reg));
+      *e = (exp_t){ .kind = EReg, .fresh = true, .reg = fs->freereg - 1 };
+      return;
+    }
+    case TOK_RESUME:
+      next(c);
+      expect(c, '(', "'('");
+      expr(c, e);
+      call(c, e, RESUME);
+      return;
+    case TOK_YIELD:
+      next(c);
+      expect(c, '(', "'('");
+      call(c, e, YIELD);
+      return;
+    case '{': {
+      next(c);
+      // {| or {name| or {name, starts a function, anything else is a map.
+      const token_t* ahead = peek(c);
+      if (c->t.type == '|' ||
+          (c->t.type == TOK_NAME && (ahead->type == '|' || ahead->type == ','))) {
+        function(c, e);
+      }
+      else {
+        c->hint = NULL;
+        map(c, e);
+      }
+      return;
+    }
+    default:
+      fail(c, "Unexpected '%.*s'", t.length, t.start);
+  }
+}
+
+static void index_exp(func_t* fs, exp_t* e, exp_t* key) {
+  int obj = exp_to_anyreg(fs, e);
+  if (key->kind == EInt && key->integer >= 0 && key->integer <= 0xff) {
+    *e = (exp_t){ .kind = EIndex, .op = MGETB, .obj = obj, .key = key->integer };
+    return;
+  }
+  if (key->kind == ESym) {
+    int k = symbol_constant(fs, key->symbol);
+    if (k <= 0xff) {
+      *e = (exp_t){ .kind = EIndex, .op = MGETS, .obj = obj, .key = k };
+      return;
+    }
+  }
+  int reg = exp_to_anyreg(fs, key);
+  *e = (exp_t){ .kind = EIndex, .op = MGETV, .obj = obj, .key = reg };
+}
+
+// The arguments up to ')' of a CALL, or of a RESUME after the thread.  The
+// function or thread is e, YIELD leaves that slot empty.
+static void call(compiler_t* c, exp_t* e, jack_opcode_t op) {
+  func_t* fs = c->fs;
+  if (op == YIELD) {
+    reserve(fs, 1);
+    *e = (exp_t){ .kind = EReg, .reg = fs->freereg - 1 };
+  }
+  else {
+    exp_to_nextreg(fs, e);
+  }
+  int base = e->reg;
+  int argc = 0;
+  if (op == RESUME && c->t.type != ')') expect(c, ',', "','");
+  if (c->t.type != ')') {
+    do {
+      exp_t arg;
+      expr(c, &arg);
+      exp_to_nextreg(fs, &arg);
+      argc++;
+    } while (accept(c, ','));
+  }
+  expect(c, ')', "')'");
+  if (argc > 0xff) fail(c, "Too many arguments");
+  fs->freereg = base + 1;
+  *e = (exp_t){ .kind = ECall, .reg = base, .pc = emit(fs, OPABC(op, base, 1, argc)) };
+}
+
+static void suffixed(compiler_t* c, exp_t* e) {
+  primary(c, e);
+  for (;;) {
+    switch (c->t.type) {
+      case '(':
+        next(c);
+        call(c, e, CALL);
+        break;
+      case '[': {
+        next(c);
+        exp_to_anyreg(c->fs, e);
+        exp_t key;
+        expr(c, &key);
+        expect(c, ']', "']'");
+        index_exp(c->fs, e, &key);
+        break;
+      }
+      case '.': {
+        next(c);
+        if (c->t.type != TOK_NAME) fail(c, "Expected field name");
+        exp_t key = { .kind = ESym, .symbol = jack_intern(c->t.start, c->t.length) };
+        next(c);
+        index_exp(c->fs, e, &key);
+        break;
+      }
+      default:
+        return;
+    }
+  }
+}
+
+// Fold arithmetic on two constants when the result is exact and fits.
+static bool fold(int op, intptr_t x, intptr_t y, intptr_t* result) {
+  const intptr_t limit = INTPTR_MAX >> 1;
+  switch (op) {
+    case '+': *result = x + y; break;
+    case '-': *result = x - y; break;
+    case '*':
+      if (x > INT32_MAX || x < -INT32_MAX || y > INT32_MAX || y < -INT32_MAX) {
+        return false;
+      }
+      *result = x * y;
+      break;
+    case '/':
+    case '%':
+      // Division that isn't exact gives a Rational, which isn't a constant.
+      if (!y || (op == '/' && x % y)) return false;
+      *result = op == '/' ? x / y : x % y;
+      break;
+    default:
+      return false;
+  }
+  return *result >= -limit - 1 && *result <= limit;
+}
+
+static bool is_constant(const exp_t* e) {
+  return e->kind == ENil || e->kind == ETrue || e->kind == EFalse ||
+         e->kind == EInt || e->kind == ESym;
+}
+
+static void unary(compiler_t* c, exp_t* e) {
+  func_t* fs = c->fs;
+  if (accept(c, '-')) {
+    unary(c, e);
+    // The lowest tagged integer has no tagged negation, UNM boxes it.
+    intptr_t folded;
+    if (e->kind == EInt && fold('-', 0, e->integer, &folded)) {
+      e->integer = folded;
+      return;
+    }
+    int reg = exp_to_anyreg(fs, e);
+    free_exp(fs, e);
+    reserve(fs, 1);
+    emit(fs, OPAD(UNM, fs->freereg - 1, reg));
+    *e = (exp_t){ .kind = EReg, .fresh = true, .reg = fs->freereg - 1 };
+  }
+  else if (accept(c, TOK_NOT) || accept(c, '!')) {
+    unary(c, e);
+    if (is_constant(e)) {
+      e->kind = e->kind == ENil || e->kind == EFalse ? ETrue : EFalse;
+      return;
+    }
+    int reg = exp_to_anyreg(fs, e);
+    free_exp(fs, e);
+    reserve(fs, 1);
+    emit(fs, OPAD(NOT, fs->freereg - 1, reg));
+    *e = (exp_t){ .kind = EReg, .fresh = true, .reg = fs->freereg - 1 };
+  }
+  else if (accept(c, '#')) {
+    unary(c, e);
+    int reg = exp_to_anyreg(fs, e);
+    free_exp(fs, e);
+    reserve(fs, 1);
+    emit(fs, OPAD(LEN, fs->freereg - 1, reg));
+    *e = (exp_t){ .kind = EReg, .fresh = true, .reg = fs->freereg - 1 };
+  }
+  else {
+    suffixed(c, e);
+  }
+}
+
+// Operator precedence, higher binds tighter.
+static int precedence(int type) {
+  switch (type) {
+    case TOK_OR: return 1;
+    case TOK_AND: return 2;
+    case '<': case '>': case TOK_LE: case TOK_GE:
+    case TOK_EQ: case TOK_NE: case TOK_IN: return 3;
+    case '+': case '-': return 4;
+    case '*': case '/': case '%': return 5;
+    default: return 0;
+  }
+}
+
+static void arith(func_t* fs, int op, exp_t* left, exp_t* right) {
+  static const int base_op[] = {
+    ['+'] = ADDVN, ['-'] = SUBVN, ['*'] = MULVN, ['/'] = DIVVN, ['%'] = MODVN,
+  };
+  intptr_t folded;
+  if (left->kind == EInt && right->kind == EInt &&
+      fold(op, left->integer, right->integer, &folded)) {
+    left->integer = folded;
+    return;
+  }
+  int code = base_op[op];
+  int b, k;
+  if (right->kind == EInt && (k = number_constant(fs, right->integer)) <= 0xff &&
+      left->kind != EInt) {
+    b = exp_to_anyreg(fs, left);
+    free_exp(fs, left);
+  }
+  else if (left->kind == EInt && (k = number_constant(fs, left->integer)) <= 0xff) {
+    b = exp_to_anyreg(fs, right);
+    free_exp(fs, right);
+    code += ADDNV - ADDVN;
+  }
+  else {
+    b = exp_to_anyreg(fs, left);
+    k = exp_to_anyreg(fs, right);
+    free_regs(fs, b, k);
+    code += ADDVV - ADDVN;
+  }
+  reserve(fs, 1);
+  emit(fs, OPABC(code, fs->freereg - 1, b, k));
+  *left = (exp_t){ .kind = EReg, .fresh = true, .reg = fs->freereg - 1 };
+}
+
+static bool constant_equal(const exp_t* a, const exp_t* b) {
+  if (a->kind != b->kind) return false;
+  if (a->kind == EInt) return a->integer == b->integer;
+  if (a->kind == ESym) return a->symbol == b->symbol;
+  return true;
+}
+
+// Equality against a constant uses the ISxxS/N/P forms.
+static void compare_constant(func_t* fs, bool equal, exp_t* var, exp_t* k, exp_t* e) {
+  int reg = exp_to_anyreg(fs, var);
+  int op, d;
+  switch (k->kind) {
+    case EInt:
+      op = ISEQN;
+      d = number_constant(fs, k->integer);
+      break;
+    case ESym:
+      op = ISEQS;
+      d = symbol_constant(fs, k->symbol);
+      break;
+    default:
+      op = ISEQP;
+      d = k->kind == ENil ? PriNil : k->kind == ETrue ? PriTrue : PriFalse;
+      break;
+  }
+  *e = (exp_t){ .kind = ECompare, .op = op + !equal, .obj = reg, .key = d };
+}
+
+static void compare(func_t* fs, int op, exp_t* left, exp_t* right) {
+  bool equality = op == TOK_EQ || op == TOK_NE;
+  if (is_constant(left) && is_constant(right) && equality) {
+    left->kind = constant_equal(left, right) == (op == TOK_EQ) ? ETrue : EFalse;
+    return;
+  }
+  if (left->kind == EInt && right->kind == EInt) {
+    intptr_t x = left->integer, y = right->integer;
+    bool result = op == '<' ? x < y : op == '>' ? x > y :
+                  op == TOK_LE ? x <= y : x >= y;
+    left->kind = result ? ETrue : EFalse;
+    return;
+  }
+  if (equality && is_constant(right)) {
+    compare_constant(fs, op == TOK_EQ, left, right, left);
+    return;
+  }
+  if (equality && is_constant(left)) {
+    compare_constant(fs, op == TOK_EQ, right, left, left);
+    return;
+  }
+  // Ordering against a number needs no slot for the number either.
+  if (right->kind == EInt || left->kind == EInt) {
+    bool swap = left->kind == EInt;
+    exp_t* var = swap ? right : left;
+    int d = number_constant(fs, swap ? left->integer : right->integer);
+    int a = exp_to_anyreg(fs, var);
+    int code;
+    switch (op) {
+      case '<': code = swap ? ISGTN : ISLTN; break;
+      case TOK_GE: code = swap ? ISLEN : ISGEN; break;
+      case '>': code = swap ? ISLTN : ISGTN; break;
+      default: code = swap ? ISGEN : ISLEN; break;
+    }
+    *left = (exp_t){ .kind = ECompare, .op = code, .obj = a, .key = d };
+    return;
+  }
+  int a = exp_to_anyreg(fs, left);
+  int d = exp_to_anyreg(fs, right);
+  int code;
+  switch (op) {
+    case '<': code = ISLT; break;
+    case TOK_GE: code = ISGE; break;
+    case '>': code = ISLT; { int t = a; a = d; d = t; } break;
+    case TOK_LE: code = ISGE; { int t = a; a = d; d = t; } break;
+    case TOK_EQ: code = ISEQV; break;
+    default: code = ISNEV; break;
+  }
+  *left = (exp_t){ .kind = ECompare, .op = code, .obj = a, .key = d };
+}
+
+static void binary(compiler_t* c, exp_t* e, int limit);
+
+// Parse the right operand of a binary operator at precedence prec.
+static void operand(compiler_t* c, exp_t* e, int prec) {
+  unary(c, e);
+  binary(c, e, prec);
+}
+
+static void binary(compiler_t* c, exp_t* e, int limit) {
+  func_t* fs = c->fs;
+  for (;;) {
+    int op = c->t.type;
+    int prec = precedence(op);
+    if (!prec || prec <= limit) return;
+    next(c);
+    if (op == TOK_AND || op == TOK_OR) {
+      // `and` and `or` keep the deciding value, so the left side goes into
+      // the result slot and the right side only runs when it has to.
+      exp_t right;
+      if (is_constant(e)) {
+        bool truthy = e->kind != ENil && e->kind != EFalse;
+        int ncode = fs->ncode;
+        operand(c, &right, prec);
+        if (truthy == (op == TOK_OR)) {
+          free_exp(fs, &right);
+          fs->ncode = ncode;
+        }
+        else {
+          *e = right;
+        }
+        continue;
+      }
+      int reg;
+      if (e->kind == ELocal) {
+        reserve(fs, 1);
+        reg = fs->freereg - 1;
+        emit(fs, OPAD(op == TOK_AND ? ISFC : ISTC, reg, e->reg));
+      }
+      else {
+        exp_to_nextreg(fs, e);
+        reg = e->reg;
+        emit(fs, OPAD(op == TOK_AND ? ISF : IST, 0, reg));
+      }
+      int jump = emit_jump(fs);
+      operand(c, &right, prec);
+      discharge_global(fs, &right);
+      free_exp(fs, &right);
+      exp_to_reg(fs, &right, reg);
+      patch_here(fs, jump);
+      *e = (exp_t){ .kind = EReg, .reg = reg };
+      continue;
+    }
+    // Variables and anything that needs code go into a slot before the
+    // right side is parsed, constants wait so they can be folded.
+    if (!is_constant(e)) exp_to_anyreg(fs, e);
+    exp_t right;
+    operand(c, &right, prec);
+    if (op == TOK_IN) {
+      int key = exp_to_anyreg(fs, e);
+      int map = exp_to_anyreg(fs, &right);
+      free_regs(fs, key, map);
+      reserve(fs, 1);
+      emit(fs, OPABC(MHAS, fs->freereg - 1, key, map));
+      *e = (exp_t){ .kind = EReg, .fresh = true, .reg = fs->freereg - 1 };
+    }
+    else if (prec == 3) {
+      compare(fs, op, e, &right);
+    }
+    else {
+      arith(fs, op, e, &right);
+    }
+  }
+}
+
+static void expr(compiler_t* c, exp_t* e) {
+  unary(c, e);
+  binary(c, e, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   STATEMENTS
+////////////////////////////////////////////////////////////////////////////////
+
+// The last statement of a function body gives its value.
+static bool at_tail(compiler_t* c) {
+  accept(c, ';');
+  return c->fs->depth == 0 && (c->t.type == '}' || c->t.type == TOK_EOF);
+}
+
+static void return_value(func_t* fs, exp_t* e) {
+  int reg = exp_to_anyreg(fs, e);
+  emit(fs, OPAD(RET, reg, 1));
+  free_exp(fs, e);
+}
+
+// Store e in the variable in slot reg.  A value that was just computed
+// into a temporary is computed into the variable instead.
+static void store_local(func_t* fs, exp_t* e, int reg) {
+  discharge_global(fs, e);
+  if (e->kind == EReg && e->fresh && e->reg == fs->freereg - 1 &&
+      e->reg >= fs->nactive && OPGETA(fs->code[fs->ncode - 1]) == e->reg) {
+    uint32_t* last = &fs->code[fs->ncode - 1];
+    *last = (*last & ~(uint32_t)0xff00) | (uint32_t)reg << 8;
+    free_reg(fs, e->reg);
+    *e = (exp_t){ .kind = ELocal, .reg = reg };
+    return;
+  }
+  free_exp(fs, e);
+  exp_to_reg(fs, e, reg);
+}
+
+// vars a, b = 1, c
+static void vars(compiler_t* c) {
+  func_t* fs = c->fs;
+  int nil_start = -1;
+  do {
+    if (c->t.type != TOK_NAME) fail(c, "Expected variable name");
+    token_t name = c->t;
+    next(c);
+    int reg = add_local(fs, name.start, name.length);
+    if (accept(c, '=')) {
+      if (nil_start >= 0) emit(fs, OPAD(KNIL, nil_start, reg - 1));
+      nil_start = -1;
+      c->hint = name.start;
+      c->hint_length = name.length;
+      // Until it has a value the name still means what it did before.
+      c->locals[fs->first_local + reg].hidden = true;
+      exp_t e;
+      expr(c, &e);
+      c->hint = NULL;
+      c->locals[fs->first_local + reg].hidden = false;
+      store_local(fs, &e, reg);
+    }
+    else if (nil_start < 0) {
+      nil_start = reg;
+    }
+  } while (accept(c, ','));
+  if (nil_start >= 0) emit(fs, OPAD(KNIL, nil_start, fs->nactive - 1));
+}
+
+static void body(compiler_t* c) {
+  func_t* fs = c->fs;
+  block_t bl;
+  expect(c, '{', "'{'");
+  enter_block(fs, &bl);
+  block(c);
+  leave_block(fs, &bl);
+  expect(c, '}', "'}'");
+}
+
+// if cond { ... } else if cond { ... } else { ... }
+static void if_statement(compiler_t* c) {
+  func_t* fs = c->fs;
+  exp_t cond;
+  expr(c, &cond);
+  int skip = jump_if_false(fs, &cond);
+  body(c);
+  if (accept(c, TOK_ELSE)) {
+    int done = emit_jump(fs);
+    patch_here(fs, skip);
+    if (accept(c, TOK_IF)) if_statement(c);
+    else body(c);
+    patch_here(fs, done);
+  }
+  else {
+    patch_here(fs, skip);
+  }
+}
+
+// while cond { ... }
+//
+// Short conditions are repeated after the body with the test reversed, so
+// each iteration ends in one branch back to the body instead of a JMP to
+// the condition followed by the branch out.
+static void while_statement(compiler_t* c) {
+  func_t* fs = c->fs;
+  int loop = fs->ncode;
+  exp_t cond;
+  expr(c, &cond);
+  int exit = jump_if_false(fs, &cond);
+  int start = fs->ncode;
+  body(c);
+  if (exit > loop && exit - loop <= 8 && negate[OPGETOP(fs->code[exit - 1])]) {
+    // Jumps inside the condition are relative and stay inside the copy.
+    for (int pc = loop; pc < exit - 1; pc++) {
+      int copy = emit(fs, fs->code[pc]);
+      fs->lines[copy] = fs->lines[pc];
+    }
+    uint32_t test = fs->code[exit - 1];
+    emit(fs, (test & ~(uint32_t)0xff) | negate[OPGETOP(test)]);
+    patch_jump(fs, emit_jump(fs), start);
+  }
+  else {
+    patch_jump(fs, emit_jump(fs), loop);
+  }
+  patch_here(fs, exit);
+}
+
+static void return_statement(compiler_t* c) {
+  func_t* fs = c->fs;
+  accept(c, ';');
+  if (c->t.type == '}' || c->t.type == TOK_EOF) {
+    emit(fs, OPAD(RET, 0, 0));
+    return;
+  }
+  exp_t e;
+  expr(c, &e);
+  return_value(fs, &e);
+}
+
+// Assignment or a bare expression.
+static void expression_statement(compiler_t* c) {
+  func_t* fs = c->fs;
+  int line = c->t.line;
+  exp_t e;
+  if (c->t.type == TOK_NAME && peek(c)->type == '=') {
+    c->hint = c->t.start;
+    c->hint_length = c->t.length;
+  }
+  expr(c, &e);
+  if (accept(c, '=')) {
+    exp_t value;
+    expr(c, &value);
+    c->hint = NULL;
+    switch (e.kind) {
+      case ELocal:
+        store_local(fs, &value, e.reg);
+        break;
+      case EUpval:
+        emit(fs, OPAD(USETV, e.index, exp_to_anyreg(fs, &value)));
+        break;
+      case EIndex: {
+        int reg = exp_to_anyreg(fs, &value);
+        emit(fs, OPABC(e.op + (MSETV - MGETV), reg, e.obj, e.key));
+        break;
+      }
+      case EGlobal:
+        fail_at(c, line, "Assignment to undeclared variable %.*s",
+                e.symbol->size, e.symbol->data);
+        break;
+      default:
+        fail_at(c, line, "Can't assign to expression");
+    }
+    if (at_tail(c)) {
+      return_value(fs, &value);
+    }
+    else {
+      free_exp(fs, &value);
+    }
+    // The target's slots sit below the value's, so they go last.
+    if (e.kind != ELocal) free_exp(fs, &e);
+    return;
+  }
+  c->hint = NULL;
+  if (at_tail(c)) {
+    return_value(fs, &e);
+    return;
+  }
+  if (e.kind == ECall) {
+    // Nobody wants the result.
+    uint32_t bc = fs->code[e.pc];
+    fs->code[e.pc] = OPABC(OPGETOP(bc), e.reg, 0, OPGETC(bc));
+  }
+  else if (e.kind != ELocal && e.kind != EReg && !is_constant(&e)) {
+    exp_to_anyreg(fs, &e);
+  }
+  free_exp(fs, &e);
+}
+
+static void statement(compiler_t* c) {
+  switch (c->t.type) {
+    case ';':
+      next(c);
+      break;
+    case TOK_VARS:
+      next(c);
+      vars(c);
+      break;
+    case TOK_IF:
+      next(c);
+      if_statement(c);
+      break;
+    case TOK_WHILE:
+      next(c);
+      while_statement(c);
+      break;
+    case TOK_RETURN:
+      next(c);
+      return_statement(c);
+      break;
+    default:
+      expression_statement(c);
+      break;
+  }
+  assert(c->fs->freereg == c->fs->nactive);
+}
+
+static void block(compiler_t* c) {
+  while (c->t.type != '}' && c->t.type != TOK_EOF) {
+    statement(c);
+  }
+}
+
+jack_proto_t* jack_compile(const char* source, size_t length, const char* name,
+                           char* error, size_t error_size) {
+  compiler_t c = {
+    .name = name,
+    .p = source,
+    .end = source + length,
+    .line = 1,
+    .error = error,
+    .error_size = error_size,
+  };
+  func_t fs;
+  jack_proto_t* volatile proto = NULL;
+  if (!setjmp(c.jump)) {
+    open_func(&c, &fs, copy_name("main", 4));
+    // The globals map is the one parameter of the main function.
+    add_local(&fs, env_name, sizeof(env_name) - 1);
+    fs.params = 1;
+    next(&c);
+    block(&c);
+    if (c.t.type != TOK_EOF) fail(&c, "Unexpected '}'");
+    proto = close_func(&c);
+  }
+  else {
+    // Unwind whatever functions were still open.
+    while (c.fs) {
+      func_t* open = c.fs;
+      c.fs = open->parent;
+      free_func(open);
+    }
+  }
+  free(c.locals);
+  free(c.scratch);
+  return proto;
+}
+
+void jack_free_proto(jack_proto_t* proto) {
+  for (int i = 0; i < proto->nprotos; i++) {
+    jack_free_proto((jack_proto_t*)proto->protos[i]);
+  }
+  free((void*)proto->code);
+  free((void*)proto->lines);
+  free(proto->caches);
+  free((void*)proto->symbols);
+  free((void*)proto->numbers);
+  free((void*)proto->protos);
+  free((void*)proto->upvals);
+  for (int i = 0; i < proto->ntemplates; i++) {
+    jack_map_clear((jack_map_t*)proto->templates[i]);
+    free((void*)proto->templates[i]);
+  }
+  free((void*)proto->templates);
+  free((void*)proto->name);
+  free(proto);
+}
@@ -0,0 +1,21 @@
+#ifndef JACK_COMPILER_H
+#define JACK_COMPILER_H
+
+#include <stddef.h>
+
+#include "vm.h"
+
+// Compile Jack source into a prototype in a single pass.  The result takes
+// one argument, the map that names not declared with `vars` are read from
+// (globals).  A function returns the value of its last statement when that
+// is an expression or an assignment, anywhere else `return` is needed.
+//
+// On a syntax error NULL is returned and a message with the line number is
+// written to `error`.
+jack_proto_t* jack_compile(const char* source, size_t length, const char* name,
+                           char* error, size_t error_size);
+
+// Free a prototype returned by jack_compile, with all nested prototypes.
+void jack_free_proto(jack_proto_t* proto);
+
+#endif
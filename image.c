@@ -0,0 +1,492 @@
+// mmap and fstat are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifndef JACK_NO_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "image.h"
+#include "symbol.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//   LOADER
+////////////////////////////////////////////////////////////////////////////////
+
+static bool little_endian(void) {
+  const uint16_t one = 1;
+  return *(const uint8_t*)&one;
+}
+
+static void* fail(char* error, size_t error_size, const char* path,
+                  const char* message) {
+  snprintf(error, error_size, "%s: %s", path, message);
+  return NULL;
+}
+
+// Read the whole file, mapped when the platform can.
+static bool read_image(jack_image_t* image, const char* path) {
+#ifndef JACK_NO_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  image->data = data;
+  image->size = st.st_size;
+  image->mapped = true;
+  return true;
+#else
+  FILE* file = fopen(path, "rb");
+  if (!file) return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  // malloc is aligned for any type, which covers the 8 byte sections.
+  uint8_t* data = size > 0 ? malloc(size) : NULL;
+  if (!data || fread(data, 1, size, file) != (size_t)size) {
+    free(data);
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+  image->data = data;
+  image->size = size;
+  image->mapped = false;
+  return true;
+#endif
+}
+
+// Does [offset, offset + count * item) lie in the image, suitably aligned?
+static bool in_image(const jack_image_t* image, uint32_t offset,
+                     uint32_t count, size_t item, size_t align) {
+  return offset % align == 0 &&
+         (uint64_t)offset + (uint64_t)count * item <= image->size;
+}
+
+static bool check_ids(const uint32_t* ids, uint32_t count, uint32_t limit) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (ids[i] >= limit) return false;
+  }
+  return true;
+}
+
+static const char* symbol_data(const jack_image_t* image, uint32_t id, uint32_t* size) {
+  const uint8_t* entry = image->data + image->symbol_offsets[id];
+  memcpy(size, entry, sizeof(*size));
+  return (const char*)entry + sizeof(*size);
+}
+
+// Check the offsets table and records of a prototype's templates.
+static bool check_templates(const jack_image_t* image, const jack_image_proto_t* in) {
+  if (!in_image(image, in->templates, in->ntemplates, sizeof(uint32_t), 4)) {
+    return false;
+  }
+  const uint32_t* offsets = (const uint32_t*)(image->data + in->templates);
+  for (uint32_t i = 0; i < in->ntemplates; i++) {
+    uint32_t count;
+    if (!in_image(image, offsets[i], 2, sizeof(uint32_t), 8)) return false;
+    memcpy(&count, image->data + offsets[i], sizeof(count));
+    if (count > INT32_MAX / 2 ||
+        !in_image(image, offsets[i] + 8, count, sizeof(jack_image_entry_t), 8)) {
+      return false;
+    }
+    const jack_image_entry_t* entries =
+      (const jack_image_entry_t*)(image->data + offsets[i] + 8);
+    for (uint32_t j = 0; j < count; j++) {
+      const jack_image_entry_t* entry = &entries[j];
+      if (entry->key >= (uint32_t)image->nsymbols ||
+          entry->type > JACK_IMAGE_SYMBOL ||
+          (entry->type == JACK_IMAGE_SYMBOL &&
+           (uint64_t)entry->value >= (uint64_t)image->nsymbols) ||
+          (entry->type == JACK_IMAGE_INTEGER &&
+           (entry->value < INTPTR_MIN / 2 || entry->value > INTPTR_MAX / 2))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool load_proto(jack_image_t* image, const jack_image_proto_t* in,
+                       uint32_t nprotos, jack_proto_t* proto) {
+  const uint8_t* data = image->data;
+  if (in->name >= (uint32_t)image->nsymbols ||
+      in->params > in->slots || in->slots > 0xff || !in->ncode ||
+      !in_image(image, in->code, in->ncode, sizeof(uint32_t), 4) ||
+      (in->lines && !in_image(image, in->lines, in->ncode, sizeof(uint32_t), 4)) ||
+      !in_image(image, in->symbols, in->nsymbols, sizeof(uint32_t), 4) ||
+      !in_image(image, in->numbers, in->nnumbers, sizeof(intptr_t), sizeof(intptr_t)) ||
+      !in_image(image, in->protos, in->nprotos, sizeof(uint32_t), 4) ||
+      !in_image(image, in->upvals, in->nupvals, sizeof(jack_upvaldesc_t), 1) ||
+      in->ntemplates > INT16_MAX + 1u || !check_templates(image, in)) {
+    return false;
+  }
+  const uint32_t* symbol_ids = (const uint32_t*)(data + in->symbols);
+  const uint32_t* proto_ids = (const uint32_t*)(data + in->protos);
+  if (!check_ids(symbol_ids, in->nsymbols, image->nsymbols) ||
+      !check_ids(proto_ids, in->nprotos, nprotos)) {
+    return false;
+  }
+  uint32_t size;
+  const jack_proto_t** protos = malloc(sizeof(*protos) * (in->nprotos + 1));
+  assert(protos);
+  for (uint32_t i = 0; i < in->nprotos; i++) {
+    protos[i] = &image->protos[proto_ids[i]];
+  }
+  *proto = (jack_proto_t){
+    .object = { Code },
+    .name = symbol_data(image, in->name, &size),
+    .params = in->params,
+    .slots = in->slots,
+    .ncode = in->ncode,
+    .code = (const uint32_t*)(data + in->code),
+    .nsymbols = in->nsymbols,
+    .symbols = calloc(in->nsymbols + 1, sizeof(jack_symbol_t*)),
+    .nnumbers = in->nnumbers,
+    .numbers = (const intptr_t*)(data + in->numbers),
+    .nprotos = in->nprotos,
+    .protos = protos,
+    .nupvals = in->nupvals,
+    .upvals = (const jack_upvaldesc_t*)(data + in->upvals),
+    .ntemplates = in->ntemplates,
+    .templates = calloc(in->ntemplates + 1, sizeof(jack_map_t*)),
+    .lines = in->lines ? (const uint32_t*)(data + in->lines) : NULL,
+    .caches = jack_new_caches((const uint32_t*)(data + in->code), in->ncode),
+    .image = image,
+    .symbol_ids = symbol_ids,
+  };
+  assert(proto->symbols && proto->templates);
+  return true;
+}
+
+static bool load(jack_image_t* image) {
+  const jack_image_header_t* header = (const jack_image_header_t*)image->data;
+  if (image->size < sizeof(*header) ||
+      memcmp(header->magic, JACK_IMAGE_MAGIC, 4) ||
+      header->version != JACK_IMAGE_VERSION ||
+      header->word != sizeof(intptr_t) ||
+      header->endian != little_endian() ||
+      header->size != image->size || !header->nprotos ||
+      !in_image(image, header->protos, header->nprotos, sizeof(jack_image_proto_t), 4) ||
+      !in_image(image, header->symbols, header->nsymbols, sizeof(uint32_t), 4)) {
+    return false;
+  }
+  image->nsymbols = header->nsymbols;
+  image->symbol_offsets = (const uint32_t*)(image->data + header->symbols);
+  for (int i = 0; i < image->nsymbols; i++) {
+    uint32_t offset = image->symbol_offsets[i], size;
+    if (!in_image(image, offset, 1, sizeof(uint32_t), 4)) return false;
+    memcpy(&size, image->data + offset, sizeof(size));
+    if (size > INT32_MAX ||
+        !in_image(image, offset + sizeof(uint32_t), size + 1, 1, 1) ||
+        image->data[offset + sizeof(uint32_t) + size]) {
+      return false;
+    }
+  }
+  image->interned = calloc(image->nsymbols + 1, sizeof(*image->interned));
+  image->protos = calloc(header->nprotos, sizeof(*image->protos));
+  assert(image->interned && image->protos);
+  image->records = (const jack_image_proto_t*)(image->data + header->protos);
+  for (uint32_t i = 0; i < header->nprotos; i++) {
+    if (!load_proto(image, &image->records[i], header->nprotos, &image->protos[i])) {
+      return false;
+    }
+    image->nprotos++;
+  }
+  return true;
+}
+
+jack_image_t* jack_image_open(const char* path, char* error, size_t error_size) {
+  jack_image_t* image = calloc(1, sizeof(*image));
+  assert(image);
+  if (!read_image(image, path)) {
+    free(image);
+    return fail(error, error_size, path, "Can't read image");
+  }
+  if (!load(image)) {
+    jack_image_close(image);
+    return fail(error, error_size, path, "Not a valid image for this machine");
+  }
+  return image;
+}
+
+const jack_proto_t* jack_image_main(const jack_image_t* image) {
+  return &image->protos[0];
+}
+
+void jack_image_close(jack_image_t* image) {
+  for (int i = 0; i < image->nprotos; i++) {
+    free((void*)image->protos[i].symbols);
+    free((void*)image->protos[i].protos);
+    free(image->protos[i].caches);
+    for (int j = 0; j < image->protos[i].ntemplates; j++) {
+      jack_map_t* template = (jack_map_t*)image->protos[i].templates[j];
+      if (!template) continue;
+      jack_map_clear(template);
+      free(template);
+    }
+    free((void*)image->protos[i].templates);
+  }
+  free(image->protos);
+  free(image->interned);
+#ifndef JACK_NO_MMAP
+  if (image->mapped) munmap((void*)image->data, image->size);
+#endif
+  if (!image->mapped) free((void*)image->data);
+  free(image);
+}
+
+static const jack_symbol_t* intern(jack_image_t* image, uint32_t id) {
+  if (!image->interned[id]) {
+    uint32_t size;
+    const char* data = symbol_data(image, id, &size);
+    image->interned[id] = jack_intern(data, size);
+  }
+  return image->interned[id];
+}
+
+const jack_symbol_t* jack_image_symbol(const jack_proto_t* proto, int index) {
+  const jack_symbol_t* symbol =
+    intern((jack_image_t*)proto->image, proto->symbol_ids[index]);
+  // The loader allocated the table, it's only const for the VM.
+  ((const jack_symbol_t**)proto->symbols)[index] = symbol;
+  return symbol;
+}
+
+const jack_map_t* jack_image_template(const jack_proto_t* proto, int index) {
+  jack_image_t* image = (jack_image_t*)proto->image;
+  const jack_image_proto_t* in = &image->records[proto - image->protos];
+  uint32_t offset = ((const uint32_t*)(image->data + in->templates))[index], count;
+  memcpy(&count, image->data + offset, sizeof(count));
+  const jack_image_entry_t* entries =
+    (const jack_image_entry_t*)(image->data + offset + 8);
+  jack_map_t* template = malloc(sizeof(*template));
+  assert(template);
+  jack_map_init(template, count);
+  for (uint32_t i = 0; i < count; i++) {
+    jack_value_t value = JACK_NIL;
+    switch (entries[i].type) {
+      case JACK_IMAGE_FALSE: value = JACK_FALSE; break;
+      case JACK_IMAGE_TRUE: value = JACK_TRUE; break;
+      case JACK_IMAGE_INTEGER: value = jack_integer(entries[i].value); break;
+      case JACK_IMAGE_SYMBOL: value = jack_object(intern(image, entries[i].value)); break;
+    }
+    jack_map_set(template, jack_object(intern(image, entries[i].key)), value);
+  }
+  ((const jack_map_t**)proto->templates)[index] = template;
+  return template;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   WRITER
+////////////////////////////////////////////////////////////////////////////////
+
+// The image is laid out twice, first without a file to find every offset,
+// then for real.  Both passes run the same code so they can't disagree.
+typedef struct {
+  FILE* file;
+  uint32_t offset;
+  bool failed;
+  const jack_proto_t** protos;
+  int nprotos, protos_size;
+  jack_map_t proto_ids;
+  const jack_symbol_t** symbols;
+  int nsymbols, symbols_size;
+  jack_map_t symbol_ids;
+  jack_image_proto_t* headers;
+  uint32_t* symbol_offsets;
+  uint32_t size;
+} writer_t;
+
+static void* grow(void* array, int* size, int needed, size_t item) {
+  if (needed <= *size) return array;
+  int new_size = *size ? *size * 2 : 16;
+  while (new_size < needed) new_size *= 2;
+  array = realloc(array, item * new_size);
+  assert(array);
+  *size = new_size;
+  return array;
+}
+
+static void put(writer_t* w, const void* data, size_t size) {
+  if (w->file && size && fwrite(data, 1, size, w->file) != size) w->failed = true;
+  w->offset += size;
+}
+
+static void pad(writer_t* w) {
+  static const uint8_t zeros[8];
+  put(w, zeros, -w->offset & 7);
+}
+
+static uint32_t symbol_id(writer_t* w, const jack_symbol_t* symbol) {
+  jack_value_t id = jack_map_get(&w->symbol_ids, jack_object(symbol));
+  if (id) return jack_tointeger(id);
+  w->symbols = grow(w->symbols, &w->symbols_size, w->nsymbols + 1, sizeof(*w->symbols));
+  w->symbols[w->nsymbols] = symbol;
+  jack_map_set(&w->symbol_ids, jack_object(symbol), jack_integer(w->nsymbols));
+  return w->nsymbols++;
+}
+
+// Number every prototype reachable from proto, which may include itself.
+static uint32_t proto_id(writer_t* w, const jack_proto_t* proto) {
+  jack_value_t id = jack_map_get(&w->proto_ids, jack_object(proto));
+  if (id) return jack_tointeger(id);
+  uint32_t n = w->nprotos;
+  w->protos = grow(w->protos, &w->protos_size, n + 1, sizeof(*w->protos));
+  w->protos[w->nprotos++] = proto;
+  jack_map_set(&w->proto_ids, jack_object(proto), jack_integer(n));
+  for (int i = 0; i < proto->nprotos; i++) proto_id(w, proto->protos[i]);
+  return n;
+}
+
+static const jack_symbol_t* proto_symbol(const jack_proto_t* proto, int i) {
+  return proto->symbols[i] ? proto->symbols[i] : jack_image_symbol(proto, i);
+}
+
+static const jack_map_t* proto_template(const jack_proto_t* proto, int i) {
+  return proto->templates[i] ? proto->templates[i] : jack_image_template(proto, i);
+}
+
+static jack_image_entry_t template_entry(writer_t* w, jack_value_t key,
+                                         jack_value_t value) {
+  jack_image_entry_t entry = { symbol_id(w, jack_tosymbol(key)), JACK_IMAGE_NIL, 0 };
+  if (value == JACK_FALSE) entry.type = JACK_IMAGE_FALSE;
+  else if (value == JACK_TRUE) entry.type = JACK_IMAGE_TRUE;
+  else if (jack_isinteger(value)) {
+    entry.type = JACK_IMAGE_INTEGER;
+    entry.value = jack_tointeger(value);
+  }
+  else if (value) {
+    entry.type = JACK_IMAGE_SYMBOL;
+    entry.value = symbol_id(w, jack_tosymbol(value));
+  }
+  return entry;
+}
+
+// The offsets table, then the records right after it.
+static void put_templates(writer_t* w, jack_image_proto_t* out,
+                          const jack_proto_t* proto) {
+  out->ntemplates = proto->ntemplates;
+  out->templates = w->offset;
+  uint32_t offset = (w->offset + sizeof(uint32_t) * proto->ntemplates + 7) & ~7u;
+  for (int i = 0; i < proto->ntemplates; i++) {
+    put(w, &offset, sizeof(offset));
+    offset += 8 + sizeof(jack_image_entry_t) * proto_template(proto, i)->length;
+  }
+  pad(w);
+  for (int i = 0; i < proto->ntemplates; i++) {
+    const jack_map_t* template = proto_template(proto, i);
+    uint32_t count[2] = { template->length, 0 };
+    put(w, count, sizeof(count));
+    for (int j = 0; j < template->capacity; j++) {
+      if (!template->keys[j]) continue;
+      jack_image_entry_t entry = template_entry(w, template->keys[j], template->values[j]);
+      put(w, &entry, sizeof(entry));
+    }
+  }
+}
+
+static void put_ids(writer_t* w, uint32_t* offset, int count, bool symbols,
+                    const jack_proto_t* proto) {
+  *offset = w->offset;
+  for (int i = 0; i < count; i++) {
+    uint32_t id = symbols ? symbol_id(w, proto_symbol(proto, i))
+                          : proto_id(w, proto->protos[i]);
+    put(w, &id, sizeof(id));
+  }
+}
+
+static void put_body(writer_t* w) {
+  jack_image_header_t header = {
+    .version = JACK_IMAGE_VERSION,
+    .word = sizeof(intptr_t),
+    .endian = little_endian(),
+    .size = w->size,
+    .nprotos = w->nprotos,
+    .protos = sizeof(header),
+    .nsymbols = w->nsymbols,
+    .symbols = sizeof(header) + sizeof(*w->headers) * w->nprotos,
+  };
+  memcpy(header.magic, JACK_IMAGE_MAGIC, 4);
+  w->offset = 0;
+  put(w, &header, sizeof(header));
+  put(w, w->headers, sizeof(*w->headers) * w->nprotos);
+  put(w, w->symbol_offsets, sizeof(*w->symbol_offsets) * w->nsymbols);
+  pad(w);
+  for (int i = 0; i < w->nsymbols; i++) {
+    uint32_t size = w->symbols[i]->size;
+    // The sizing pass runs before the table exists.
+    if (w->symbol_offsets) w->symbol_offsets[i] = w->offset;
+    put(w, &size, sizeof(size));
+    put(w, w->symbols[i]->data, size + 1);
+    pad(w);
+  }
+  for (int i = 0; i < w->nprotos; i++) {
+    const jack_proto_t* proto = w->protos[i];
+    jack_image_proto_t* out = &w->headers[i];
+    out->name = symbol_id(w, jack_intern(proto->name, strlen(proto->name)));
+    out->params = proto->params;
+    out->slots = proto->slots;
+    out->ncode = proto->ncode;
+    out->code = w->offset;
+    put(w, proto->code, sizeof(*proto->code) * proto->ncode);
+    out->lines = proto->lines ? w->offset : 0;
+    if (proto->lines) put(w, proto->lines, sizeof(*proto->lines) * proto->ncode);
+    out->nsymbols = proto->nsymbols;
+    put_ids(w, &out->symbols, proto->nsymbols, true, proto);
+    pad(w);
+    out->nnumbers = proto->nnumbers;
+    out->numbers = w->offset;
+    put(w, proto->numbers, sizeof(*proto->numbers) * proto->nnumbers);
+    out->nprotos = proto->nprotos;
+    put_ids(w, &out->protos, proto->nprotos, false, proto);
+    out->nupvals = proto->nupvals;
+    out->upvals = w->offset;
+    put(w, proto->upvals, sizeof(*proto->upvals) * proto->nupvals);
+    pad(w);
+    put_templates(w, out, proto);
+  }
+}
+
+int jack_image_write(const jack_proto_t* main, FILE* file) {
+  writer_t w = { 0 };
+  jack_map_init(&w.proto_ids, 8);
+  jack_map_init(&w.symbol_ids, 8);
+  proto_id(&w, main);
+  w.headers = calloc(w.nprotos, sizeof(*w.headers));
+  assert(w.headers);
+  // Symbols are numbered during the first pass, after which the tables
+  // have their final sizes.  Until then there are no symbol offsets to
+  // fill in.
+  put_body(&w);
+  w.symbol_offsets = calloc(w.nsymbols + 1, sizeof(*w.symbol_offsets));
+  assert(w.symbol_offsets);
+  put_body(&w);
+  w.size = w.offset;
+  w.file = file;
+  put_body(&w);
+  assert(w.offset == w.size);
+  if (fflush(file)) w.failed = true;
+  free(w.protos);
+  free(w.symbols);
+  free(w.headers);
+  free(w.symbol_offsets);
+  jack_map_clear(&w.proto_ids);
+  jack_map_clear(&w.symbol_ids);
+  return w.failed ? -1 : 0;
+}
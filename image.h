@@ -0,0 +1,116 @@
+#ifndef JACK_IMAGE_H
+#define JACK_IMAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+// Precompiled bytecode image.  The file is mapped read only and executed in
+// place: instructions, number constants, upvalue descriptors and line info
+// are used straight out of the mapping, only the prototype headers and the
+// pointer tables between them are built at load time.  Symbols are interned
+// and template maps built the first time an instruction uses them.
+//
+// Layout, every section 8 byte aligned and every offset relative to the
+// start of the file:
+//
+//   jack_image_header_t
+//   jack_image_proto_t[nprotos]  prototype 0 is the main function
+//   uint32_t[nsymbols]           offsets of the symbol entries
+//   symbol entries               uint32_t size, bytes, terminating 0
+//   per prototype                code, lines, symbol ids, numbers,
+//                                prototype ids, upvalue descriptors,
+//                                uint32_t[ntemplates] template offsets,
+//                                templates
+//   template                     uint32_t count, uint32_t reserved,
+//                                jack_image_entry_t[count]
+//
+// Values are stored in the byte order and word size of the machine that
+// wrote the image, a loader on a different kind of machine refuses it.
+#define JACK_IMAGE_MAGIC "\x1bJCK"
+#define JACK_IMAGE_VERSION 4
+
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint8_t word;    // sizeof(intptr_t)
+  uint8_t endian;  // 1 when little endian
+  uint32_t size;   // Size of the whole image
+  uint32_t nprotos;
+  uint32_t protos;
+  uint32_t nsymbols;
+  uint32_t symbols;
+  uint32_t reserved;
+} jack_image_header_t;
+
+typedef struct {
+  uint32_t name;   // Symbol id
+  uint16_t params;
+  uint16_t slots;
+  uint32_t ncode;
+  uint32_t code;
+  uint32_t lines;  // One uint32_t per instruction, 0 if there's no line info
+  uint32_t nsymbols;
+  uint32_t symbols;
+  uint32_t nnumbers;
+  uint32_t numbers;
+  uint32_t nprotos;
+  uint32_t protos;
+  uint32_t nupvals;
+  uint32_t upvals;
+  uint32_t ntemplates;
+  uint32_t templates;
+} jack_image_proto_t;
+
+// Types of template values
+enum {
+  JACK_IMAGE_NIL,
+  JACK_IMAGE_FALSE,
+  JACK_IMAGE_TRUE,
+  JACK_IMAGE_INTEGER,
+  JACK_IMAGE_SYMBOL, // value is a symbol id
+};
+
+typedef struct {
+  uint32_t key;    // Symbol id
+  uint32_t type;
+  int64_t value;
+} jack_image_entry_t;
+
+typedef struct jack_image {
+  const uint8_t* data;
+  size_t size;
+  bool mapped;
+  int nprotos;
+  jack_proto_t* protos;
+  const jack_image_proto_t* records;
+  const uint32_t* symbol_offsets;
+  int nsymbols;
+  const jack_symbol_t** interned; // Shared by all prototypes, NULL until used
+} jack_image_t;
+
+// Map an image file.  Returns NULL and writes a message to `error` if the
+// file can't be read or isn't a valid image for this machine.  Bytecode is
+// trusted just like the output of jack_compile, only the structure of the
+// file is checked.
+jack_image_t* jack_image_open(const char* path, char* error, size_t error_size);
+
+// The main function.  It and everything it creates refer into the image,
+// so the image must stay open while the VM runs any of them, and the file
+// must not be rewritten in place while it is mapped.
+const jack_proto_t* jack_image_main(const jack_image_t* image);
+
+void jack_image_close(jack_image_t* image);
+
+// Symbol constant `index` of a loaded prototype, interned on first use.
+const jack_symbol_t* jack_image_symbol(const jack_proto_t* proto, int index);
+
+// Template map `index` of a loaded prototype, built on first use.
+const jack_map_t* jack_image_template(const jack_proto_t* proto, int index);
+
+// Write a compiled main function and everything nested in it as an image.
+// Returns 0 on success or -1 if writing failed.
+int jack_image_write(const jack_proto_t* main, FILE* file);
+
+#endif
@@ -1,220 +1,214 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
-
-typedef enum {
-  Error,    // Contagious type that causes all operations to return Error
-  Boolean,  // True or False
-  Integer,  // Signed integer
-  Function, // C API Function
-  Symbol,   // Immutable interned data
-  List,     // Linked-list of Values
-  Map,      // Hash-map of values (weak key for boxed types)
-  Code,     // Bytecode
-} jack_type_t;
-
-
-struct jack_value {
-  union {
-    bool boolean;
-    int integer;
-    const char* error;
-    // TODO, add more types
-  };
-  jack_type_t type : 3;
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "symbol.h"
+#include "compiler.h"
+#include "image.h"
+#ifdef JACK_PROFILE
+#include "profile.h"
+#endif
+
+#define COUNT(ARRAY) ((int)(sizeof(ARRAY) / sizeof(*(ARRAY))))
+
+// fib(n) = n < 2 ? 1 : fib(n - 1) + fib(n - 2)
+static const jack_proto_t fib_proto;
+static const jack_proto_t* const fib_protos[] = { &fib_proto };
+static const intptr_t fib_numbers[] = { 1, 2 };
+static const uint32_t fib_code[] = {
+  OPAD(KSHORT, 1, 2),    // 1 = 2
+  OPAD(ISGE, 0, 1),      // if n >= 2
+  OPAD(JMP, 0, 2),       //   goto recurse
+  OPAD(KSHORT, 1, 1),
+  OPAD(RET, 1, 1),       // return 1
+  OPAD(FNEW, 1, 0),      // recurse: 1 = fib
+  OPABC(SUBVN, 2, 0, 0), // 2 = n - 1
+  OPABC(CALL, 1, 1, 1),  // 1 = fib(2)
+  OPAD(FNEW, 2, 0),      // 2 = fib
+  OPABC(SUBVN, 3, 0, 1), // 3 = n - 2
+  OPABC(CALL, 2, 1, 1),  // 2 = fib(3)
+  OPABC(ADDVV, 1, 1, 2),
+  OPAD(RET, 1, 1),       // return 1 + 2
+};
+static const jack_proto_t fib_proto = {
+  .object = { Code },
+  .name = "fib",
+  .params = 1,
+  .slots = 4,
+  .ncode = COUNT(fib_code),
+  .code = fib_code,
+  .nnumbers = COUNT(fib_numbers),
+  .numbers = fib_numbers,
+  .nprotos = COUNT(fib_protos),
+  .protos = fib_protos,
 };
 
-typedef struct jack_value jack_value_t;
-
-typedef enum {
-
-  END, // Stop execution
-
-  // Comparison ops
-  // --------------
-  // These skip the next instruction if false
-  // The next instruction is generally a jump
-  //
-  // OP   | A   | D   | Description
-  //------+-----+-----+--------------
-  ISLT,  // var | var | Jump if A < D
-  ISGE,  // var | var | Jump if A ≥ D
-  ISEQV, // var | var | Jump if A = D
-  ISNEV, // var | var | Jump if A ≠ D
-  ISEQS, // var | str | Jump if A = D
-  ISNES, // var | str | Jump if A ≠ D
-  ISEQN, // var | num | Jump if A = D
-  ISNEN, // var | num | Jump if A ≠ D
-  ISEQP, // var | pri | Jump if A = D
-  ISNEP, // var | pri | Jump if A ≠ D
-
-  // Unary Test and Copy ops
-  // -----------------------
-  // These skip the next instruction if false
-  // The next instruction is generally a jump
-  //
-  // OP  | A   | D   | Description
-  //-----+-----+-----+------------------------------------
-  ISTC, // dst | var | Copy D to A and jump, if D is true
-  ISFC, // dst | var | Copy D to A and jump, if D is false
-  IST,  //     | var | Jump if D is true
-  ISF,  //     | var | Jump if D is false
-
-  // Unary ops
-  // ---------
-  // OP  | A   | D   | Description
-  //-----+-----+-----+----------------------------
-  MOV,  // dst | var | Copy D to A
-  NOT,  // dst | var | Set A to boolean not of D
-  UNM,  // dst | var | Set A to -D (unary minus)
-  LEN,  // dst | var | Set A to length of D
-  ITER, // dst | var | Set A to iterator or D
-
-  // Binary ops
-  // ------------------+-------------
-  // Symbol + Symbol   | Concatenate
-  // Symbol * Integer  | Repeat
-  // Integer + Integer | Add
-  // Integer - Integer | Subtract
-  // Integer / Integer | Divide
-  // Integer % Integer | Modulus
-  //
-  // OP   | A   | B     | C     | Description
-  //------+-----+-------+-------+--------------
-  ADDVN, // dst | var   | num   | A = B + C
-  SUBVN, // dst | var   | num   | A = B - C
-  MULVN, // dst | var   | num   | A = B * C
-  DIVVN, // dst | var   | num   | A = B / C
-  MODVN, // dst | var   | num   | A = B % C
-  ADDNV, // dst | var   | num   | A = C + B
-  SUBNV, // dst | var   | num   | A = C - B
-  MULNV, // dst | var   | num   | A = C * B
-  DIVNV, // dst | var   | num   | A = C / B
-  MODNV, // dst | var   | num   | A = C % B
-  ADDVV, // dst | var   | var   | A = B + C
-  SUBVV, // dst | var   | var   | A = B - C
-  MULVV, // dst | var   | var   | A = B * C
-  DIVVV, // dst | var   | var   | A = B / C
-  MODVV, // dst | var   | var   | A = B % C
-
-  // Constant ops
-  // ------------
-  // OP     | A     | D     | Description
-  //--------+-------+-------+----------------------------------
-  KERR,    // dst   | sym   | Set A to error constant D
-  KSYM,    // dst   | sym   | Set A to symbol constant D
-  KSHORT,  // dst   | lits  | Set A to 16 bit signed integer D
-  KNUM,    // dst   | num   | Set A to number constant D
-  KPRI,    // dst   | pri   | Set A to primitive D
-
-  JMP,     //       | DELTA | Jump DELTA instructions
-
-} jack_opcode_t;
-
-// A single bytecode instruction is 32 bit wide and has an 8 bit opcode field
-// and several operand fields of 8 or 16 bit. Instructions come in one of two
-// formats:
-// ┏━━━┳━━━┳━━━┳━━━━┓
-// ┃ B ┃ C ┃ A ┃ OP ┃
-// ┣━━━┻━━━╋━━━╋━━━━┫
-// ┃   D   ┃ A ┃ OP ┃
-// ┗━━━━━━━┻━━━┻━━━━┛
-
-typedef struct {
-  char b : 8;
-  char c : 8;
-  char a : 8;
-  jack_opcode_t op : 8;
-} jack_opabc_t;
-
-typedef struct {
-  short d : 16;
-  char a : 8;
-  jack_opcode_t op : 8;
-} jack_opd_t;
-
-// #define OPABC(OP, A, B, C) (uint32_t)(jack_opabc_t){ \
-//   .op = OP, \
-//   .a = A, \
-//   .b = B, \
-//   .c = C \
-// }
-#define OPABC(OP, A, B, C) (OP | (int8_t)(A) << 8 | (int8_t)(B) << 24 | (int8_t)(C) << 16)
-//(((A) & 0xff) << 8) | (((B) & 0xff) << 24) | (((C) & 0xff) << 16))
-#define OPAD(OP, A, D)     (OP | (int8_t)(A) << 8 | (int16_t)(D) << 16)
-//(((A) & 0xff) << 8) | (((D) & 0xffff) << 16))
-
-#define OPGETOP(BC) (BC) & 0xff
-#define OPGETA(BC) (int8_t)(((BC) >> 8) & 0xff)
-#define OPGETB(BC) (int8_t)(((BC) >> 24) & 0xff)
-#define OPGETC(BC) (int8_t)(((BC) >> 16) & 0xff)
-#define OPGETD(BC) (int16_t)(((BC) >> 16) & 0xffff)
-
-static uint32_t program[] = {
-  OPAD(KSHORT, 0, 42),
-  OPAD(KSHORT, 1, -100),
-  OPABC(ADDVV, 2, 0, 1),
-  0,
+// Sum the integers below 10, then check the total against a constant.
+// Finally call fib(25) to exercise the call path.
+static const jack_symbol_t sum_symbol = JACK_SYMBOL("sum");
+static const jack_symbol_t wrong_total_symbol = JACK_SYMBOL("Wrong total");
+static const jack_symbol_t* const main_symbols[] = {
+  &sum_symbol,
+  &wrong_total_symbol,
+};
+static const intptr_t main_numbers[] = {
+  1,
+  45,
+};
+static const uint32_t main_code[] = {
+  OPAD(KSYM, 0, 0),      // 0 = :sum
+  OPAD(KSHORT, 1, 0),    // 1 = 0 (total)
+  OPAD(KSHORT, 2, 0),    // 2 = 0 (i)
+  OPAD(KSHORT, 3, 10),   // 3 = 10 (limit)
+  OPAD(ISGE, 2, 3),      // loop: if i >= limit
+  OPAD(JMP, 0, 3),       //   goto done
+  OPABC(ADDVV, 1, 1, 2), // total = total + i
+  OPABC(ADDVN, 2, 2, 0), // i = i + 1
+  OPAD(JMP, 0, -5),      // goto loop
+  OPAD(ISEQN, 1, 1),     // done: if total == 45
+  OPAD(JMP, 0, 1),       //   skip the error
+  OPAD(KERR, 4, 1),      // 4 = Error
+  OPAD(KPRI, 5, PriTrue),// 5 = true
+  OPAD(FNEW, 6, 0),      // 6 = fib
+  OPAD(KSHORT, 7, 25),
+  OPABC(CALL, 6, 1, 1),  // 6 = fib(25)
+  OPAD(RET, 0, 7),       // return 0 .. 6
+};
+static const jack_proto_t* const main_protos[] = { &fib_proto };
+static const jack_proto_t main_proto = {
+  .object = { Code },
+  .name = "main",
+  .params = 0,
+  .slots = 8,
+  .ncode = COUNT(main_code),
+  .code = main_code,
+  .nsymbols = COUNT(main_symbols),
+  .symbols = main_symbols,
+  .nnumbers = COUNT(main_numbers),
+  .numbers = main_numbers,
+  .nprotos = COUNT(main_protos),
+  .protos = main_protos,
 };
-static int pc = 0;
-static jack_value_t slots[10];
 
-#define break_if_error(DEST, SOURCE) \
-  if (SOURCE->type == Error) { \
-    DEST->type = Error; \
-    DEST->error = SOURCE->error; \
-    break; \
+static jack_value_t print(jack_vm_t* vm, const jack_value_t* args, int argc) {
+  (void)vm;
+  for (int i = 0; i < argc; i++) {
+    if (i) printf(" ");
+    jack_dump_value(args[i]);
   }
+  printf("\n");
+  return JACK_NIL;
+}
 
-#define break_if_not(DEST, COND, MESSAGE) \
-  if (!(COND)) { \
-    DEST->type = Error; \
-    DEST->error = MESSAGE; \
-    break; \
-  }
+static const jack_native_t print_native = JACK_NATIVE("print", print);
+
+static char* read_file(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* data = malloc(length + 1);
+  *size = fread(data, 1, length, file);
+  data[*size] = 0;
+  fclose(file);
+  return data;
+}
 
-int main() {
-  uint32_t bc;
-  while ((bc = program[pc++])) {
-    switch(OPGETOP(bc)) {
-     case KSHORT:
-      printf("KSHORT slot=%d value=%d\n", OPGETA(bc), OPGETD(bc));
-      jack_value_t* value = &slots[OPGETA(bc)];
-      value->type = Integer;
-      value->integer = OPGETD(bc);
-      break;
-     case ADDVV:
-      printf("ADDVV %x %x %x\n", OPGETA(bc), OPGETB(bc), OPGETC(bc));
-      // A = B + C
-      jack_value_t* A = &slots[OPGETA(bc)];
-      jack_value_t* B = &slots[OPGETB(bc)];
-      jack_value_t* C = &slots[OPGETC(bc)];
-      break_if_error(A, B)
-      break_if_error(A, C)
-      break_if_not(A, B->type == Integer && C->type == Integer, "Not a Number")
+static bool is_image(const char* path) {
+  char magic[4];
+  FILE* file = fopen(path, "rb");
+  if (!file) return false;
+  bool image = fread(magic, 1, 4, file) == 4 && !memcmp(magic, JACK_IMAGE_MAGIC, 4);
+  fclose(file);
+  return image;
+}
 
-      A->type = Integer;
-      A->integer = B->integer + C->integer;
-      break;
-     default:
-      printf("%d %08x\n", pc, bc);
-      printf("%d OP=%d A=%d B=%d C=%d D=%d\n", pc, OPGETOP(bc), OPGETA(bc), OPGETB(bc), OPGETC(bc), OPGETD(bc));
-      break;
+// With a script argument, compile and run it with a global map holding the
+// builtins.  Images written by jackc are mapped and run without compiling.
+// Without an argument, run the hand assembled demo.
+int main(int argc, char* argv[]) {
+  jack_vm_t vm;
+  jack_proto_t* script = NULL;
+  jack_image_t* image = NULL;
+  const jack_proto_t* proto = &main_proto;
+  jack_vm_init(&vm);
+
+  if (argc > 1 && is_image(argv[1])) {
+    char error[256];
+    image = jack_image_open(argv[1], error, sizeof(error));
+    if (!image) {
+      fprintf(stderr, "%s\n", error);
+      jack_vm_free(&vm);
+      return 1;
     }
+    proto = jack_image_main(image);
   }
-
-  for (int i = 0; i < 3; i++) {
-    jack_value_t* slot = &slots[i];
-    switch (slot->type) {
-     case Integer:
-      printf("%d = %d\n", i, slot->integer);
-      break;
-     case Error:
-      printf("%d = Error: %s\n", i, slot->error);
-      break;
-     default:
-      printf("%d = Unknown\n", i);
+  else if (argc > 1) {
+    size_t size;
+    char* source = read_file(argv[1], &size);
+    if (!source) {
+      fprintf(stderr, "Can't read %s\n", argv[1]);
+      jack_vm_free(&vm);
+      return 1;
+    }
+    char error[256];
+    script = jack_compile(source, size, argv[1], error, sizeof(error));
+    free(source);
+    if (!script) {
+      fprintf(stderr, "%s\n", error);
+      jack_vm_free(&vm);
+      jack_intern_free();
+      return 1;
     }
+    proto = script;
+  }
+  if (argc > 1) {
+    jack_map_t* globals = jack_new_map(&vm, 8);
+    jack_map_set(globals, jack_object(jack_intern("print", 5)),
+                 jack_object(&print_native));
+    vm.stack[0] = jack_object(globals);
+  }
+
+#ifdef JACK_PROFILE
+  // JACK_PROFILE_HZ=0 leaves sampling off, which measures what publishing
+  // the running frame costs the interpreter by itself.
+  const char* hz = getenv("JACK_PROFILE_HZ");
+  int rate = hz ? atoi(hz) : JACK_PROFILE_HZ;
+  if (rate && !jack_profile_start(rate)) fprintf(stderr, "Can't start the profiler\n");
+#endif
+  int retc = jack_run(&vm, proto);
+#ifdef JACK_PROFILE
+  if (rate) jack_profile_stop();
+#endif
+
+  for (int i = 0; i < retc; i++) {
+    printf("%d = ", i);
+    jack_dump_value(vm.stack[i]);
+    printf("\n");
+  }
+#ifdef JACK_PROFILE
+  // Collapsed stacks, ready for flamegraph.pl, which skips the note since
+  // it doesn't end in a count.
+  jack_profile_dump(stderr, false);
+  jack_profile_stats_t stats;
+  jack_profile_stats(&stats);
+  if (stats.dropped) {
+    fprintf(stderr, "# %llu samples dropped, the ring was full\n",
+            (unsigned long long)stats.dropped);
   }
+#endif
+#ifdef JACK_PROFILE_PAIRS
+  jack_dump_pairs(stderr, 20);
+  fprintf(stderr, "inline caches: %llu hits, %llu misses\n",
+          (unsigned long long)vm.cache_hits, (unsigned long long)vm.cache_misses);
+#endif
+  if (script) jack_free_proto(script);
+  if (image) jack_image_close(image);
+  jack_vm_free(&vm);
+  jack_intern_free();
   return 0;
 }
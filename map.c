@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "map.h"
+#include "number.h"
+
+// Boxed numbers are keys by value, as ISEQV compares them, so a Rational or
+// big Integer finds the entry made with any other box of the same number.
+// Every other key is the word itself.
+static inline bool is_number(jack_value_t key) {
+  return jack_isobject(key, Integer) || jack_isobject(key, Rational);
+}
+
+static inline uint64_t number_hash(jack_value_t key) {
+  if (jack_toobject(key)->type == Integer) {
+    const jack_integer_t* integer = (const jack_integer_t*)key;
+    uint64_t hash = (uint64_t)integer->value;
+    for (int i = 0; i < integer->length; i++) hash = hash * 31 + integer->digits[i];
+    return hash;
+  }
+  jack_ratio_t ratio = ((jack_rational_t*)key)->ratio;
+  return (uint64_t)ratio.num * 31 + (uint64_t)ratio.den;
+}
+
+static inline bool number_equal(jack_value_t a, jack_value_t b) {
+  if (a == b) return true;
+  if (!is_number(a) || jack_toobject(a)->type != jack_toobject(b)->type) {
+    return false;
+  }
+  if (jack_toobject(a)->type == Integer) {
+    const jack_integer_t *x = (const jack_integer_t*)a, *y = (const jack_integer_t*)b;
+    return x->length == y->length && x->value == y->value &&
+           !memcmp(x->digits, y->digits, sizeof(*x->digits) * x->length);
+  }
+  jack_ratio_t x = ((jack_rational_t*)a)->ratio, y = ((jack_rational_t*)b)->ratio;
+  return x.num == y.num && x.den == y.den;
+}
+
+// Fibonacci hashing, the top bits of the product are well mixed even for
+// pointers that only differ in their low bits.
+static inline uint32_t map_slot(const jack_map_t* map, uint64_t hash) {
+  hash *= 0x9e3779b97f4a7c15ull;
+  return (uint32_t)(hash >> 32) & (map->capacity - 1);
+}
+
+// Returns the slot holding key, or the empty slot where it would go.
+static uint32_t map_find(const jack_map_t* map, jack_value_t key) {
+  if (is_number(key)) {
+    uint32_t i = map_slot(map, number_hash(key));
+    while (map->keys[i] && !number_equal(map->keys[i], key)) {
+      i = (i + 1) & (map->capacity - 1);
+    }
+    return i;
+  }
+  uint32_t i = map_slot(map, key);
+  while (map->keys[i] && map->keys[i] != key) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  return i;
+}
+
+void jack_map_init(jack_map_t* map, int capacity) {
+  int size = 4;
+  while (size * 3 < capacity * 4) size *= 2;
+  map->object.type = Map;
+  map->length = 0;
+  map->capacity = size;
+  map->keys = calloc(size, sizeof(*map->keys));
+  map->values = calloc(size, sizeof(*map->values));
+  assert(map->keys && map->values);
+  map->shared_keys = map->inline_values = false;
+}
+
+void jack_map_clear(jack_map_t* map) {
+  if (!map->shared_keys) free(map->keys);
+  if (!map->inline_values) free(map->values);
+  map->keys = map->values = NULL;
+  map->length = map->capacity = 0;
+  map->shared_keys = map->inline_values = false;
+}
+
+void jack_map_copy_template(jack_map_t* map, const jack_map_t* template,
+                            jack_value_t* values) {
+  map->object.type = Map;
+  map->length = template->length;
+  map->capacity = template->capacity;
+  map->keys = template->keys;
+  map->values = values;
+  memcpy(values, template->values, sizeof(*values) * template->capacity);
+  map->shared_keys = true;
+  map->inline_values = true;
+}
+
+jack_value_t jack_map_get(const jack_map_t* map, jack_value_t key) {
+  return map->values[map_find(map, key)];
+}
+
+bool jack_map_has(const jack_map_t* map, jack_value_t key) {
+  return key && map->keys[map_find(map, key)];
+}
+
+int jack_map_index(const jack_map_t* map, jack_value_t key) {
+  if (!map->capacity) return -1;
+  uint32_t i = map_find(map, key);
+  return map->keys[i] ? (int)i : -1;
+}
+
+// Move everything into key and value arrays owned by the map.  This is
+// also how a copy of a template gets its own keys.
+static void map_resize(jack_map_t* map, int capacity) {
+  jack_value_t* keys = map->keys;
+  jack_value_t* values = map->values;
+  int old_capacity = map->capacity;
+  bool shared_keys = map->shared_keys, inline_values = map->inline_values;
+  map->capacity = capacity;
+  map->keys = calloc(capacity, sizeof(*map->keys));
+  map->values = calloc(capacity, sizeof(*map->values));
+  assert(map->keys && map->values);
+  map->shared_keys = map->inline_values = false;
+  for (int i = 0; i < old_capacity; i++) {
+    if (!keys[i]) continue;
+    uint32_t j = map_find(map, keys[i]);
+    map->keys[j] = keys[i];
+    map->values[j] = values[i];
+  }
+  if (!shared_keys) free(keys);
+  if (!inline_values) free(values);
+}
+
+int jack_map_set(jack_map_t* map, jack_value_t key, jack_value_t value) {
+  assert(key);
+  uint32_t i = map_find(map, key);
+  if (!map->keys[i]) {
+    bool full = (map->length + 1) * 4 > map->capacity * 3;
+    if (full || map->shared_keys) {
+      map_resize(map, full ? map->capacity * 2 : map->capacity);
+      i = map_find(map, key);
+    }
+    map->keys[i] = key;
+    map->length++;
+  }
+  map->values[i] = value;
+  return i;
+}
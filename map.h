@@ -0,0 +1,45 @@
+#ifndef JACK_MAP_H
+#define JACK_MAP_H
+
+#include "types.h"
+
+// Open addressing hash table keyed by the value word itself.  Symbols are
+// interned, so hashing and comparing the word is enough for every type but
+// boxed numbers, which are hashed and compared by value.  A
+// nil key marks an empty slot, so nil can't be used as a key.  Capacity is
+// a power of two and the table doubles when three quarters full.
+//
+// Keys and values are parallel arrays indexed by slot.  Maps copied from a
+// template share the template's key array and only own their values, until
+// a key is added and they get a key array of their own.
+typedef struct {
+  jack_object_t object;
+  int length;
+  int capacity;
+  jack_value_t* keys;
+  jack_value_t* values;
+  bool shared_keys;   // keys belong to a template
+  bool inline_values; // values were allocated with the map itself
+} jack_map_t;
+
+void jack_map_init(jack_map_t* map, int capacity);
+// Releases the keys and values, not the map itself.
+void jack_map_clear(jack_map_t* map);
+
+// Make map a copy of template that shares its keys.  `values` has room for
+// template->capacity values and lives as long as the map, typically in the
+// same allocation.  The template must outlive the map.
+void jack_map_copy_template(jack_map_t* map, const jack_map_t* template,
+                            jack_value_t* values);
+
+// Returns nil if the key isn't there.
+jack_value_t jack_map_get(const jack_map_t* map, jack_value_t key);
+bool jack_map_has(const jack_map_t* map, jack_value_t key);
+// Returns the slot of the key.
+int jack_map_set(jack_map_t* map, jack_value_t key, jack_value_t value);
+
+// Slot of the key, or -1 if the key isn't there.  Keys are never removed,
+// so a slot stays right until the map grows.
+int jack_map_index(const jack_map_t* map, jack_value_t key);
+
+#endif
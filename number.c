@@ -0,0 +1,327 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "number.h"
+
+// Products of two 64 bit values, and sums of two such products, are done
+// in 128 bits where the compiler has them and can't overflow there because
+// no numerator is INT64_MIN.  Elsewhere they are 64 bit and checked.
+#ifdef __SIZEOF_INT128__
+typedef __int128 wide_t;
+typedef unsigned __int128 uwide_t;
+
+static inline bool wide_mul(wide_t x, wide_t y, wide_t* r) {
+  *r = x * y;
+  return false;
+}
+
+static inline bool wide_add(wide_t x, wide_t y, wide_t* r) {
+  *r = x + y;
+  return false;
+}
+#else
+typedef int64_t wide_t;
+typedef uint64_t uwide_t;
+
+static bool wide_mul(wide_t x, wide_t y, wide_t* r) {
+  if (x > 0 ? (y > 0 ? x > INT64_MAX / y : y < INT64_MIN / x)
+            : (y > 0 ? x < INT64_MIN / y : x && y < INT64_MAX / x)) {
+    return true;
+  }
+  *r = x * y;
+  return false;
+}
+
+static bool wide_add(wide_t x, wide_t y, wide_t* r) {
+  if (y > 0 ? x > INT64_MAX - y : x < INT64_MIN - y) return true;
+  *r = x + y;
+  return false;
+}
+#endif
+
+static inline uint64_t abs64(int64_t x) {
+  return x < 0 ? -(uint64_t)x : (uint64_t)x;
+}
+
+static inline uwide_t abs_wide(wide_t x) {
+  return x < 0 ? -(uwide_t)x : (uwide_t)x;
+}
+
+static inline int ctz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  for (; !(x & 1); x >>= 1) n++;
+  return n;
+#endif
+}
+
+// The trailing zeros of the difference are counted before taking its
+// absolute value, which has the same ones, to shorten the dependency chain
+// through each step.  Or-ing in the top bit keeps ctz64 defined at zero.
+uint64_t jack_gcd(uint64_t a, uint64_t b) {
+  if (!a || !b) return a | b;
+  int az = ctz64(a), bz = ctz64(b), shift = az < bz ? az : bz;
+  b >>= bz;
+  while (a) {
+    a >>= az;
+    uint64_t min = a < b ? a : b, diff = a < b ? b - a : a - b;
+    az = ctz64((b - a) | (uint64_t)1 << 63);
+    b = min;
+    a = diff;
+  }
+  return b << shift;
+}
+
+#ifdef __SIZEOF_INT128__
+static inline int ctz_wide(uwide_t x) {
+  uint64_t low = (uint64_t)x;
+  return low ? ctz64(low) : 64 + ctz64((uint64_t)(x >> 64));
+}
+
+// Only mod needs a gcd wider than 64 bits.
+static uwide_t gcd_wide(uwide_t a, uwide_t b) {
+  if ((a | b) <= UINT64_MAX) return jack_gcd((uint64_t)a, (uint64_t)b);
+  if (!a || !b) return a | b;
+  int shift = ctz_wide(a | b);
+  a >>= ctz_wide(a);
+  do {
+    b >>= ctz_wide(b);
+    if (a > b) {
+      uwide_t t = a;
+      a = b;
+      b = t;
+    }
+    b -= a;
+  } while (b);
+  return a << shift;
+}
+#else
+#define gcd_wide jack_gcd
+#endif
+
+// Store n/d if it's a valid ratio.  The caller has normalized it.
+static inline bool fits(wide_t n, wide_t d, jack_ratio_t* r) {
+  if (n <= INT64_MIN || n > INT64_MAX || d > INT64_MAX) return false;
+  *r = (jack_ratio_t){ (int64_t)n, (int64_t)d };
+  return true;
+}
+
+// a + b or a - b.  When the denominators share no factor the sum is
+// already normalized, otherwise only their common factor can cancel
+// (Knuth, TAOCP 4.5.1).
+static bool add(jack_ratio_t a, jack_ratio_t b, bool subtract, jack_ratio_t* r) {
+  int64_t bn = subtract ? -b.num : b.num;
+  wide_t n, d, x, y;
+  if (a.den == b.den) {
+    if (wide_add(a.num, bn, &n)) return false;
+    if (a.den == 1) return fits(n, 1, r);
+    uint64_t g = gcd_wide(abs_wide(n), a.den);
+    return fits(n / (wide_t)g, a.den / (int64_t)g, r);
+  }
+  uint64_t g = a.den == 1 || b.den == 1 ? 1 : jack_gcd(a.den, b.den);
+  if (wide_mul(a.num, b.den / g, &x) || wide_mul(bn, a.den / g, &y) ||
+      wide_add(x, y, &n)) {
+    return false;
+  }
+  if (g == 1) return !wide_mul(a.den, b.den, &d) && fits(n, d, r);
+  uint64_t g2 = gcd_wide(abs_wide(n), g);
+  return !wide_mul(a.den / g, b.den / g2, &d) && fits(n / (wide_t)g2, d, r);
+}
+
+bool jack_ratio_add(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r) {
+  return add(a, b, false, r);
+}
+
+bool jack_ratio_sub(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r) {
+  return add(a, b, true, r);
+}
+
+// Cancelling across before multiplying leaves nothing to normalize after.
+bool jack_ratio_mul(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r) {
+  wide_t n, d;
+  if (a.den == 1 && b.den == 1) return !wide_mul(a.num, b.num, &n) && fits(n, 1, r);
+  if (!a.num || !b.num) {
+    *r = (jack_ratio_t){ 0, 1 };
+    return true;
+  }
+  int64_t g1 = b.den == 1 ? 1 : jack_gcd(abs64(a.num), b.den);
+  int64_t g2 = a.den == 1 ? 1 : jack_gcd(abs64(b.num), a.den);
+  return !wide_mul(a.num / g1, b.num / g2, &n) &&
+         !wide_mul(a.den / g2, b.den / g1, &d) && fits(n, d, r);
+}
+
+bool jack_ratio_div(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r) {
+  jack_ratio_t inverse = b.num < 0 ? (jack_ratio_t){ -b.den, -b.num }
+                                   : (jack_ratio_t){ b.den, b.num };
+  return jack_ratio_mul(a, inverse, r);
+}
+
+// a - b * trunc(a / b), over the common denominator a.den * b.den.
+bool jack_ratio_mod(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r) {
+  wide_t x, y, d;
+  if (wide_mul(a.num, b.den, &x) || wide_mul(b.num, a.den, &y) ||
+      wide_mul(a.den, b.den, &d)) {
+    return false;
+  }
+  wide_t n = y == -1 ? 0 : x % y;
+  uwide_t g = gcd_wide(abs_wide(n), d);
+  return fits(n / (wide_t)g, d / (wide_t)g, r);
+}
+
+int jack_ratio_compare(jack_ratio_t a, jack_ratio_t b) {
+#ifdef __SIZEOF_INT128__
+  wide_t x = (wide_t)a.num * b.den, y = (wide_t)b.num * a.den;
+  return (x > y) - (x < y);
+#else
+  // Compare the continued fractions term by term, nothing can overflow.
+  int64_t an = a.num, ad = a.den, bn = b.num, bd = b.den;
+  for (int sign = 1;; sign = -sign) {
+    int64_t aq = an / ad, ar = an % ad, bq = bn / bd, br = bn % bd;
+    if (ar < 0) aq--, ar += ad;
+    if (br < 0) bq--, br += bd;
+    if (aq != bq) return aq < bq ? -sign : sign;
+    if (!ar || !br) return sign * ((ar > 0) - (br > 0));
+    an = ad, ad = ar, bn = bd, bd = br;
+  }
+#endif
+}
+
+static inline int trim(const uint32_t* a, int n) {
+  while (n && !a[n - 1]) n--;
+  return n;
+}
+
+int jack_digits_compare(const uint32_t* a, int na, const uint32_t* b, int nb) {
+  if (na != nb) return na > nb ? 1 : -1;
+  while (na--) {
+    if (a[na] != b[na]) return a[na] > b[na] ? 1 : -1;
+  }
+  return 0;
+}
+
+int jack_digits_add(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* r) {
+  if (na < nb) return jack_digits_add(b, nb, a, na, r);
+  uint64_t carry = 0;
+  for (int i = 0; i < na; i++) {
+    carry += (uint64_t)a[i] + (i < nb ? b[i] : 0);
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  r[na] = (uint32_t)carry;
+  return trim(r, na + 1);
+}
+
+int jack_digits_sub(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* r) {
+  int64_t borrow = 0;
+  for (int i = 0; i < na; i++) {
+    borrow += (int64_t)a[i] - (i < nb ? b[i] : 0);
+    r[i] = (uint32_t)borrow;
+    borrow = borrow < 0 ? -1 : 0;
+  }
+  return trim(r, na);
+}
+
+// Schoolbook, the numbers a script builds are rarely long enough for
+// anything cleverer to pay off.
+int jack_digits_mul(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* r) {
+  for (int i = 0; i < na + nb; i++) r[i] = 0;
+  for (int i = 0; i < na; i++) {
+    uint64_t carry = 0;
+    for (int j = 0; j < nb; j++) {
+      carry += (uint64_t)a[i] * b[j] + r[i + j];
+      r[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r[i + nb] = (uint32_t)carry;
+  }
+  return trim(r, na + nb);
+}
+
+static inline int clz32(uint32_t x) {
+#ifdef __GNUC__
+  return __builtin_clz(x);
+#else
+  int n = 0;
+  for (; !(x & 0x80000000u); x <<= 1) n++;
+  return n;
+#endif
+}
+
+// Knuth's algorithm D (TAOCP 4.3.1), as in Hacker's Delight: both are
+// shifted until the top digit of the divisor has its high bit set, then
+// each estimated quotient digit is at most two too big.
+int jack_digits_divmod(const uint32_t* a, int na, const uint32_t* b, int nb,
+                       uint32_t* q, uint32_t* r, int* nr) {
+  if (na < nb) {
+    for (int i = 0; i < na; i++) r[i] = a[i];
+    *nr = na;
+    return 0;
+  }
+  if (nb == 1) {
+    uint64_t rest = 0;
+    for (int i = na - 1; i >= 0; i--) {
+      rest = rest << 32 | a[i];
+      q[i] = (uint32_t)(rest / b[0]);
+      rest %= b[0];
+    }
+    r[0] = (uint32_t)rest;
+    *nr = trim(r, 1);
+    return trim(q, na);
+  }
+  uint32_t* u = malloc(sizeof(*u) * (na + 1 + nb));
+  assert(u);
+  uint32_t* v = u + na + 1;
+  int s = clz32(b[nb - 1]);
+  for (int i = nb - 1; i > 0; i--) {
+    v[i] = b[i] << s | (uint32_t)((uint64_t)b[i - 1] >> (32 - s));
+  }
+  v[0] = b[0] << s;
+  u[na] = (uint32_t)((uint64_t)a[na - 1] >> (32 - s));
+  for (int i = na - 1; i > 0; i--) {
+    u[i] = a[i] << s | (uint32_t)((uint64_t)a[i - 1] >> (32 - s));
+  }
+  u[0] = a[0] << s;
+
+  for (int j = na - nb; j >= 0; j--) {
+    uint64_t top = (uint64_t)u[j + nb] << 32 | u[j + nb - 1];
+    uint64_t qhat = top / v[nb - 1], rhat = top % v[nb - 1];
+    while (qhat >> 32 || qhat * v[nb - 2] > (rhat << 32 | u[j + nb - 2])) {
+      qhat--;
+      rhat += v[nb - 1];
+      if (rhat >> 32) break;
+    }
+    // Multiply and subtract, then add back the one time in 2^32 that qhat
+    // was still one too big.
+    int64_t t;
+    uint64_t k = 0;
+    for (int i = 0; i < nb; i++) {
+      uint64_t p = qhat * v[i];
+      t = (int64_t)u[i + j] - (int64_t)k - (int64_t)(p & 0xffffffff);
+      u[i + j] = (uint32_t)t;
+      k = (p >> 32) - (uint64_t)(t >> 32);
+    }
+    t = (int64_t)u[j + nb] - (int64_t)k;
+    u[j + nb] = (uint32_t)t;
+    q[j] = (uint32_t)qhat;
+    if (t < 0) {
+      q[j]--;
+      k = 0;
+      for (int i = 0; i < nb; i++) {
+        k += (uint64_t)u[i + j] + v[i];
+        u[i + j] = (uint32_t)k;
+        k >>= 32;
+      }
+      u[j + nb] += (uint32_t)k;
+    }
+  }
+  for (int i = 0; i < nb; i++) {
+    r[i] = u[i] >> s | (uint32_t)((uint64_t)u[i + 1] << (32 - s));
+  }
+  free(u);
+  *nr = trim(r, nb);
+  return trim(q, na - nb + 1);
+}
@@ -0,0 +1,58 @@
+#ifndef JACK_NUMBER_H
+#define JACK_NUMBER_H
+
+#include "types.h"
+
+// Exact rational arithmetic on 64 bit numerators and denominators.  Ratios
+// are always normalized: the denominator is positive, it shares no factor
+// with the numerator, and the numerator isn't INT64_MIN so it can be
+// negated.  Integers are ratios with a denominator of 1.
+typedef struct {
+  int64_t num;
+  int64_t den;
+} jack_ratio_t;
+
+// A Rational value is a boxed ratio whose denominator is at least 2.  Whole
+// results are always Integers, so every number has one representation.
+typedef struct {
+  jack_object_t object;
+  jack_ratio_t ratio;
+} jack_rational_t;
+
+// Each returns false if the result doesn't fit a normalized ratio.  The
+// divisor of div and mod must not be zero.  mod truncates like C's %.
+bool jack_ratio_add(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r);
+bool jack_ratio_sub(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r);
+bool jack_ratio_mul(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r);
+bool jack_ratio_div(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r);
+bool jack_ratio_mod(jack_ratio_t a, jack_ratio_t b, jack_ratio_t* r);
+
+// -1, 0 or 1.
+int jack_ratio_compare(jack_ratio_t a, jack_ratio_t b);
+
+// Binary GCD.  gcd(0, b) is b.
+uint64_t jack_gcd(uint64_t a, uint64_t b);
+
+// Magnitudes of big integers: arrays of 32 bit digits, least significant
+// first.  Each returns the length of its result without leading zeros, and
+// r must not overlap the operands.
+
+// -1, 0 or 1.  Neither may have leading zeros.
+int jack_digits_compare(const uint32_t* a, int na, const uint32_t* b, int nb);
+
+// a + b, r has room for max(na, nb) + 1 digits.
+int jack_digits_add(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* r);
+
+// a - b where a >= b, r has room for na digits.
+int jack_digits_sub(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* r);
+
+// a * b, r has room for na + nb digits.
+int jack_digits_mul(const uint32_t* a, int na, const uint32_t* b, int nb, uint32_t* r);
+
+// a / b into q, with room for na digits, and a % b into r, with room for
+// nb.  b has no leading zeros and isn't zero.  The length of the remainder
+// is stored in *nr.
+int jack_digits_divmod(const uint32_t* a, int na, const uint32_t* b, int nb,
+                       uint32_t* q, uint32_t* r, int* nr);
+
+#endif
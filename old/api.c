@@ -4,154 +4,350 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "api.h"
 #include "intern.h"
+#include "heap.h"
+#include "mem.h"
+
+static bool is_immediate(jack_value_t* value) {
+  return (uintptr_t)value & JACK_IMMEDIATE_MASK;
+}
+
+// The count of a frozen value changes under other threads, the type bits
+// sharing its word never do.
+static jack_type_t box_type(jack_value_t* value) {
+  return __atomic_load_n(&value->type, __ATOMIC_RELAXED) & JACK_TYPE_MASK;
+}
 
 static jack_type_t get_type(jack_value_t* value) {
-  return value ? value->type & JACK_TYPE_MASK : Nil;
+  if (is_immediate(value)) return (uintptr_t)value & 1 ? Integer : Boolean;
+  return value ? box_type(value) : Nil;
+}
+
+static intptr_t get_integer(jack_value_t* value) {
+  return is_immediate(value) ? (intptr_t)value >> 1 : value->integer;
 }
 
-static void free_value(jack_value_t* value);
+// Lists, maps and functions are the only values that can form cycles.
+static bool is_container(jack_value_t* value) {
+  return value && !is_immediate(value) && box_type(value) >= List;
+}
+
+// The cycle collector keeps a color for each container in the low bits of
+// value->gc, two flags, and a trial reference count above them.
+enum {
+  GC_BLACK,   // In use, or not being looked at
+  GC_PURPLE,  // Possible root of a garbage cycle
+  GC_GRAY,    // Looked at by a collection, could be garbage
+  GC_PENDING, // Known to be in use, references not walked yet
+  GC_WHITE,   // Garbage, being torn down
+};
+#define GC_COLOR 7
+#define GC_BUFFERED 8 // In gc->roots
+#define GC_MEMBER 16  // In gc->members
+#define GC_QUEUED 32  // In gc->dying
+#define GC_FROZEN 64  // Immutable and counted atomically, see jack_freeze
+#define GC_WALKED 128 // Reached by walk_graph
+#define GC_COUNT_SHIFT 8
+#define GC_COUNT_MAX (UINT32_MAX >> GC_COUNT_SHIFT)
+
+// Keeps the collector's slow paths out of the counting fast path.
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+static int gc_color(jack_value_t* value) {
+  return value->gc & GC_COLOR;
+}
+
+static void free_value(jack_heap_t* heap, jack_value_t* value);
+static void gc_append(jack_heap_t* heap, jack_gc_array_t* array, jack_value_t* value);
+static void gc_touch(jack_heap_t* heap, jack_value_t* value);
+static void gc_possible_root(jack_heap_t* heap, jack_value_t* value);
+
+// Frozen values can be shared by states on other threads, so their counts
+// change atomically.  The collector leaves them alone.
+NOINLINE static jack_value_t* ref_frozen(jack_value_t *value) {
+  __atomic_add_fetch(&value->ref_count, JACK_REF_COUNT, __ATOMIC_RELAXED);
+  return value;
+}
 
-static jack_value_t* ref_value(jack_value_t *value) {
-  if (!value) return value;
+NOINLINE static jack_value_t* unref_frozen(jack_heap_t* heap, jack_value_t *value) {
+  if (__atomic_sub_fetch(&value->ref_count, JACK_REF_COUNT, __ATOMIC_ACQ_REL) >= JACK_REF_COUNT) {
+    return value;
+  }
+  free_value(heap, value);
+  return NULL;
+}
+
+static inline jack_value_t* ref_value(jack_heap_t* heap, jack_value_t *value) {
+  if (!value || is_immediate(value)) return value;
+  if (value->gc & GC_FROZEN) return ref_frozen(value);
   value->ref_count += JACK_REF_COUNT;
+  if (value->gc & GC_COLOR) gc_touch(heap, value);
   return value;
 }
 
-// TODO: make static again.
-jack_value_t* unref_value(jack_value_t *value) {
+static inline jack_value_t* unref_value(jack_heap_t* heap, jack_value_t *value) {
   if (!value) return NULL;
+  if (is_immediate(value)) return value;
+  if (value->gc & GC_FROZEN) return unref_frozen(heap, value);
   value->ref_count -= JACK_REF_COUNT;
-  if (value->ref_count >= JACK_REF_COUNT) return value;
-  free_value(value);
+  if (value->ref_count >= JACK_REF_COUNT) {
+    if (jack_heap_gc(heap)->enabled && is_container(value)) gc_possible_root(heap, value);
+    return value;
+  }
+  free_value(heap, value);
   return NULL;
 }
 
-static jack_value_t* new_integer(intptr_t integer) {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = Integer;
+static void free_pending(jack_heap_t* heap, int budget);
+
+static jack_value_t* new_box(jack_heap_t* heap, jack_type_t type) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  // With a free budget, big frees are finished a bit at a time here.
+  if (gc->dying.length && !gc->freeing) free_pending(heap, gc->free_budget);
+  jack_value_t *value = jack_heap_alloc(heap, sizeof(*value));
+  value->type = type;
+  value->gc = 0;
+  return value;
+}
+
+static jack_value_t* new_integer(jack_heap_t* heap, intptr_t integer) {
+  if (integer >= INTPTR_MIN / 2 && integer <= INTPTR_MAX / 2) {
+    return (jack_value_t*)((uintptr_t)integer << 1 | 1);
+  }
+  jack_value_t *value = new_box(heap, Integer);
   value->integer = integer;
   return value;
 }
 
 static jack_value_t* new_boolean(bool boolean) {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = Boolean;
-  value->boolean = boolean;
-  return value;
+  return boolean ? JACK_TRUE : JACK_FALSE;
+}
+
+// Bytes owning room for `capacity`, of which the first `size` are used.
+static jack_bytes_t* bytes_alloc(jack_heap_t* heap, size_t size, size_t capacity) {
+  assert(capacity <= INT_MAX);
+  jack_bytes_t *bytes = jack_heap_alloc(heap, sizeof(*bytes) + capacity);
+  bytes->size = size;
+  bytes->capacity = capacity;
+  bytes->data = bytes->bytes;
+  bytes->parent = NULL;
+  bytes->release = NULL;
+  bytes->userdata = NULL;
+  return bytes;
 }
 
-static jack_value_t* new_buffer(size_t size, const char* data) {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = Buffer;
-  value->buffer = malloc(sizeof(*value->buffer) + size);
-  value->buffer->size = size;
+static jack_value_t* new_buffer(jack_heap_t* heap, size_t size, const char* data) {
+  jack_value_t *value = new_box(heap, Buffer);
+  value->bytes = bytes_alloc(heap, size, size);
   if (data) {
-    memcpy(value->buffer->data, data, size);
+    memcpy(value->bytes->data, data, size);
   }
   else {
-    memset(value->buffer->data, 0, size);
+    memset(value->bytes->data, 0, size);
   }
   return value;
 }
 
-static jack_value_t* new_symbol(size_t size, const char* data) {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = Symbol;
+static jack_value_t* new_external(jack_heap_t* heap, char* data, size_t size, jack_release_t* release, void* userdata) {
+  jack_value_t *value = new_box(heap, Buffer);
+  value->bytes = bytes_alloc(heap, size, 0);
+  value->bytes->data = data;
+  value->bytes->release = release;
+  value->bytes->userdata = userdata;
+  return value;
+}
+
+// Slices of slices point into the same parent, so freeing one never goes
+// more than one buffer deep.
+static jack_value_t* new_slice(jack_heap_t* heap, jack_value_t* buffer, int start, int size) {
+  jack_bytes_t *of = buffer->bytes;
+  jack_value_t *value = new_box(heap, Buffer);
+  value->bytes = bytes_alloc(heap, size, 0);
+  value->bytes->data = of->data + start;
+  value->bytes->parent = ref_value(heap, of->parent ? of->parent : buffer);
+  return value;
+}
+
+static jack_value_t* new_symbol(jack_heap_t* heap, size_t size, const char* data) {
+  jack_value_t *value = new_box(heap, Symbol);
   value->buffer = jack_intern(size, data);
   return value;
 }
 
-static jack_value_t* new_list() {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = List;
-  value->list = malloc(sizeof(*value->list));
+static jack_value_t* new_list(jack_heap_t* heap) {
+  jack_value_t *value = new_box(heap, List);
+  value->list = jack_heap_alloc(heap, sizeof(*value->list));
   memset(value->list, 0, sizeof(*value->list));
   return value;
 }
 
-static jack_value_t* new_map(int num_buckets) {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = Map;
-  size_t size = sizeof(jack_map_t) + sizeof(jack_pair_t*) * num_buckets;
-  value->map = malloc(size);
-  memset(value->map, 0, size);
-  value->map->num_buckets = num_buckets;
+// Allocate an empty table big enough for `capacity` pairs.
+static void map_alloc(jack_heap_t* heap, jack_map_t* map, int capacity) {
+  int bits = 3;
+  while ((1 << bits) < capacity) bits++;
+  map->capacity = 1 << bits;
+  map->shift = 64 - bits;
+  size_t size = sizeof(jack_pair_t) * map->capacity;
+  map->pairs = jack_heap_alloc(heap, size);
+  memset(map->pairs, 0, size);
+}
+
+static jack_value_t* new_map(jack_heap_t* heap, int num_buckets) {
+  jack_value_t *value = new_box(heap, Map);
+  value->map = jack_heap_alloc(heap, sizeof(*value->map));
+  value->map->length = 0;
+  map_alloc(heap, value->map, num_buckets);
   return value;
 }
 
-static jack_value_t* new_function(jack_call_t *call, int slots) {
-  jack_value_t *value = malloc(sizeof(*value));
-  value->type = Function;
-  value->function = malloc(sizeof(*value->function));
+static jack_state_t* new_state(jack_heap_t* heap, int slots);
+
+static jack_value_t* new_function(jack_heap_t* heap, jack_call_t *call, int slots) {
+  jack_value_t *value = new_box(heap, Function);
+  value->function = jack_heap_alloc(heap, sizeof(*value->function));
   value->function->call = call;
-  value->function->state = jack_new_state(slots);
+  value->function->state = new_state(heap, slots);
   value->function->name = NULL;
   return value;
 }
 
-static void free_list(jack_list_t* list) {
-  jack_node_t* node = list->head;
-  while (node) {
-    jack_node_t* next = node->next;
-    unref_value(node->value);
-    free(node);
-    node = next;
+// Boxes of containers are only released once neither the free queue nor
+// the cycle collector points at them.
+static void release_box(jack_heap_t* heap, jack_value_t* value) {
+  if (value->gc & (GC_QUEUED | GC_BUFFERED | GC_MEMBER)) return;
+  jack_heap_release(heap, value, sizeof(*value));
+}
+
+static void release_state(jack_state_t* state);
+
+// Whether a dead container still holds references.  A dead map keeps the
+// slot to go on from in shift, which lookups no longer need.
+static bool holds_references(jack_value_t* value) {
+  switch (value->type) {
+    case List:
+      return value->list->length;
+    case Map: {
+      jack_map_t *map = value->map;
+      while (map->shift < map->capacity && !map->pairs[map->shift].key) map->shift++;
+      return map->shift < map->capacity;
+    }
+    default:
+      return value->function->state->stack->top;
   }
-  free(list);
 }
 
-static void free_map(jack_map_t* map) {
-  int i;
-  for (i = 0; i < map->num_buckets; ++i) {
-    jack_pair_t* pair = map->buckets[i];
-    while (pair) {
-      jack_pair_t* next = pair->next;
-      unref_value(pair->key);
-      unref_value(pair->value);
-      free(pair);
-      pair = next;
+// Take the next reference a dead container holds, there must be one.
+static jack_value_t* take_reference(jack_value_t* value) {
+  switch (value->type) {
+    case List: {
+      jack_list_t *list = value->list;
+      return list->items[(list->head + --list->length) & (list->capacity - 1)];
+    }
+    case Map: {
+      jack_pair_t *pair = &value->map->pairs[value->map->shift];
+      jack_value_t *child = pair->value ? pair->value : pair->key;
+      if (pair->value) pair->value = NULL;
+      else pair->key = NULL;
+      return child;
+    }
+    default: {
+      jack_stack_t *stack = value->function->state->stack;
+      return stack->values[--stack->top];
     }
   }
-  free(map);
 }
 
-static void free_function(jack_function_t* function) {
-  jack_free_state(function->state);
-  free(function);
+// Release what an emptied container owns, then its box.
+static void free_container(jack_heap_t* heap, jack_value_t* value) {
+  switch (value->type) {
+    case List: {
+      jack_list_t *list = value->list;
+      jack_heap_release(heap, list->items, sizeof(*list->items) * list->capacity);
+      jack_heap_release(heap, list, sizeof(*list));
+      break;
+    }
+    case Map: {
+      jack_map_t *map = value->map;
+      jack_heap_release(heap, map->pairs, sizeof(*map->pairs) * map->capacity);
+      jack_heap_release(heap, map, sizeof(*map));
+      break;
+    }
+    default:
+      release_state(value->function->state);
+      jack_heap_release(heap, value->function, sizeof(*value->function));
+      break;
+  }
+  value->gc &= ~GC_QUEUED;
+  release_box(heap, value);
+}
+
+// Empty the queued containers, dropping about `budget` references.  Each
+// container is left as soon as one of its references dies too, and picked
+// up again once that one is done.  Going deep first keeps the queue no
+// longer than the structure is deep, and nothing recurses on the C stack.
+static void free_pending(jack_heap_t* heap, int budget) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  jack_gc_array_t *dying = &gc->dying;
+  if (!budget) budget = INT_MAX;
+  gc->freeing = true;
+  while (dying->length && budget > 0) {
+    jack_value_t *value = dying->values[--dying->length];
+    int length = dying->length;
+    while (budget > 0 && dying->length == length && holds_references(value)) {
+      budget--;
+      unref_value(heap, take_reference(value));
+    }
+    if (!holds_references(value)) {
+      free_container(heap, value);
+      continue;
+    }
+    // Not empty yet, it goes back under the reference that just died, if any.
+    gc_append(heap, dying, value);
+    if (dying->length > length + 1) {
+      dying->values[length + 1] = dying->values[length];
+      dying->values[length] = value;
+    }
+  }
+  gc->freeing = false;
 }
 
-static void free_value(jack_value_t* value) {
+static void free_value(jack_heap_t* heap, jack_value_t* value) {
   assert(value); // Don't pass in nil values
   assert(value->ref_count < JACK_REF_COUNT);
-  // printf(" FREE ");
-  // jack_dump_value(value);
-  // printf("\n");
-  // Recursivly unref children.
-  // Also free nested resources.
   switch (value->type) {
     case Integer: case Boolean: case Nil:
+      // Only integers too big to be immediate end up here.
       break;
-    case Buffer:
-      free(value->buffer);
+    case Buffer: {
+      jack_bytes_t *bytes = value->bytes;
+      jack_value_t *parent = bytes->parent;
+      if (bytes->release) bytes->release(bytes->userdata, bytes->data, bytes->size);
+      jack_heap_release(heap, bytes, sizeof(*bytes) + bytes->capacity);
+      unref_value(heap, parent);
       break;
+    }
     case Symbol:
       jack_unintern(value->buffer);
       break;
-    case List:
-      free_list(value->list);
-      break;
-    case Map:
-      free_map(value->map);
-      break;
-    case Function:
-      free_function(value->function);
-      break;
+    case List: case Map: case Function: {
+      // Containers are emptied from a queue instead of recursively.
+      jack_gc_t *gc = jack_heap_gc(heap);
+      if (value->type == Map) value->map->shift = 0;
+      value->gc |= GC_QUEUED;
+      gc_append(heap, &gc->dying, value);
+      if (!gc->freeing) free_pending(heap, gc->free_budget);
+      return;
+    }
   }
-  free(value);
+  jack_heap_release(heap, value, sizeof(*value));
 }
 
 // Constant is the nearest prime to 2^64 / phi
@@ -161,231 +357,879 @@ static uint64_t hash_integer(uint64_t integer) {
   return 11400714819674759057UL * (integer ^ integer >> 3);
 }
 
+// Immediates hash their encoded bits, symbols reuse the hash cached by the
+// interner and other boxed values hash their payload.
+static uint64_t hash_value(jack_value_t *value) {
+  if (is_immediate(value)) return hash_integer((uintptr_t)value);
+  if (get_type(value) == Symbol) return jack_symbol_hash(value->buffer);
+  return hash_integer(value->integer);
+}
+
 // Equality is defined as the same type and same value.  Since  symbols are
-// interned, this works for them too.
+// interned, this works for them too.  Immediates are equal when their bits
+// are, and an integer is only boxed when it can't be immediate.
 static bool value_is_equal(jack_value_t *one, jack_value_t *two) {
+  if (is_immediate(one) || is_immediate(two)) return one == two;
   return (get_type(one) == get_type(two)) &&
          one->buffer == two->buffer;
 }
 
+static size_t stack_size(int length) {
+  return sizeof(jack_stack_t) + sizeof(jack_value_t*) * length;
+}
+
+// Grow the stack so there are at least `slots` free slots above top.  It at
+// least doubles each time so pushing stays amortized O(1).
+static jack_stack_t* stack_grow(jack_state_t* state, int slots) {
+  jack_stack_t *stack = state->stack;
+  if (slots > JACK_STACK_MAX - stack->top) return NULL;
+  int length = stack->length ? stack->length * 2 : 8;
+  while (length < stack->top + slots) length *= 2;
+  if (length > JACK_STACK_MAX) length = JACK_STACK_MAX;
+  stack = jack_heap_realloc(state->heap, stack,
+    stack_size(stack->length), stack_size(length));
+  memset(stack->values + stack->length, 0,
+    sizeof(jack_value_t*) * (length - stack->length));
+  stack->length = length;
+  return state->stack = stack;
+}
+
+static inline jack_stack_t* state_reserve(jack_state_t* state, int slots) {
+  jack_stack_t *stack = state->stack;
+  if (stack->top + slots <= stack->length) return stack;
+  stack = stack_grow(state, slots);
+  assert(stack); // Stack overflow
+  return stack;
+}
+
+// Give memory back after deep recursion.  Halving only once less than a
+// quarter is used keeps a stack hovering around one size from thrashing.
+static void state_shrink(jack_state_t* state) {
+  jack_stack_t *stack = state->stack;
+  if (stack->length <= JACK_STACK_SHRINK || stack->top >= stack->length / 4) {
+    return;
+  }
+  int length = stack->length / 2;
+  state->stack = jack_heap_realloc(state->heap, stack,
+    stack_size(stack->length), stack_size(length));
+  state->stack->length = length;
+}
+
 static jack_value_t* state_pop(jack_state_t* state) {
   jack_stack_t *stack = state->stack;
-  assert(stack->top > 0);
+  assert(stack->top > state->base);
   return stack->values[--stack->top];
 }
 
 static jack_value_t* state_push(jack_state_t* state, jack_value_t* value) {
+  jack_stack_t *stack = state_reserve(state, 1);
+  return stack->values[stack->top++] = value;
+}
+
+// Push into a slot already made room for with state_reserve.
+static jack_value_t* state_push_reserved(jack_state_t* state, jack_value_t* value) {
   jack_stack_t *stack = state->stack;
   assert(stack->top < stack->length);
-  // TODO: grow the slots if space runs out.
   return stack->values[stack->top++] = value;
 }
 
 static jack_value_t* state_get(jack_state_t* state, int index) {
   jack_stack_t *stack = state->stack;
-  if (index < 0) index += stack->top;
-  assert(index >= 0 && index < stack->length);
+  index += index < 0 ? stack->top : state->base;
+  assert(index >= state->base && index < stack->top);
   jack_value_t *value = stack->values[index];
   return value;
 }
 
+static bool gc_unwalked(jack_value_t* value);
+static void gc_walk(jack_heap_t* heap, jack_value_t* value);
+
 static jack_value_t* state_get_as(jack_state_t* state, jack_type_t type, int index) {
   jack_value_t *value = state_get(state, index);
   assert(get_type(value) == type);
+  // Whatever a container holds can be moved anywhere from here on, so one
+  // that a collection hasn't walked yet has to be walked now.
+  if (type >= List && gc_unwalked(value)) gc_walk(state->heap, value);
+  return value;
+}
+
+// Same as state_get_as, for changing the value.  Frozen ones never change.
+static jack_value_t* state_get_mutable(jack_state_t* state, jack_type_t type, int index) {
+  jack_value_t *value = state_get_as(state, type, index);
+  assert(!(value->gc & GC_FROZEN));
   return value;
 }
 
 static jack_value_t* new_value(jack_state_t *state, jack_value_t *value) {
-  ref_value(state_push(state, value));
+  ref_value(state->heap, state_push(state, value));
   return value;
 }
 
-// Append a value to the tail of a list.
-static void list_push(jack_list_t* list, jack_value_t* value) {
-  jack_node_t *node = malloc(sizeof(*node));
-  node->value = value;
-  node->next = NULL;
-  node->prev = list->tail;
-  if (list->tail) {
-    list->tail->next = node;
-    list->tail = node;
-  }
-  else {
-    list->head = list->tail = node;
+// Address of the item at position i, which must be in range.
+static jack_value_t** list_at(jack_list_t* list, int i) {
+  return &list->items[(list->head + i) & (list->capacity - 1)];
+}
+
+// Double the ring buffer, unwrapping the items to the start of the new one.
+static void list_grow(jack_heap_t* heap, jack_list_t* list) {
+  int capacity = list->capacity ? list->capacity * 2 : 4;
+  jack_value_t **items = jack_heap_alloc(heap, sizeof(*items) * capacity);
+  int i;
+  for (i = 0; i < list->length; ++i) {
+    items[i] = *list_at(list, i);
   }
-  list->length++;
+  jack_heap_release(heap, list->items, sizeof(*items) * list->capacity);
+  list->items = items;
+  list->capacity = capacity;
+  list->head = 0;
+}
+
+// Append a value to the tail of a list.
+static void list_push(jack_heap_t* heap, jack_list_t* list, jack_value_t* value) {
+  if (list->length == list->capacity) list_grow(heap, list);
+  *list_at(list, list->length++) = value;
 }
 
 // Insert a value to the head of a list
-static void list_insert(jack_list_t* list, jack_value_t* value) {
-  jack_node_t *node = malloc(sizeof(*node));
-  node->value = value;
-  node->next = list->head;
-  node->prev = NULL;
-  if (list->head) {
-    list->head->prev = node;
-    list->head = node;
-  }
-  else {
-    list->head = list->tail = node;
-  }
+static void list_insert(jack_heap_t* heap, jack_list_t* list, jack_value_t* value) {
+  if (list->length == list->capacity) list_grow(heap, list);
+  list->head = (list->head - 1) & (list->capacity - 1);
+  list->items[list->head] = value;
   list->length++;
 }
 
 // Pop a value from the tail of a list.
 static jack_value_t* list_pop(jack_list_t* list) {
-  jack_node_t* tail = list->tail;
-  if (!tail) return NULL;
-  jack_node_t *prev = list->tail = tail->prev;
-  jack_value_t* value = tail->value;
-  free(tail);
-  if (prev) prev->next = NULL;
-  else list->head = NULL;
-  list->length--;
-  return value;
+  if (!list->length) return NULL;
+  return *list_at(list, --list->length);
 }
 
 // Shift a value from the head of a list
 static jack_value_t* list_shift(jack_list_t* list) {
-  jack_node_t* head = list->head;
-  if (!head) return NULL;
-  jack_node_t* next = list->head = head->next;
-  jack_value_t* value = head->value;
-  free(head);
-  if (next) next->prev = NULL;
-  else list->tail = NULL;
+  if (!list->length) return NULL;
+  jack_value_t* value = list->items[list->head];
+  list->head = (list->head + 1) & (list->capacity - 1);
   list->length--;
   return value;
 }
 
-static bool map_set(jack_map_t* map, jack_value_t* key, jack_value_t* value) {
+// Turn a possibly negative position into an index, or -1 if out of range.
+static int list_index(jack_list_t* list, int position) {
+  if (position < 0) position += list->length;
+  return position >= 0 && position < list->length ? position : -1;
+}
+
+// How far the pair at `index` is from its home slot.
+static int map_distance(jack_map_t* map, int index) {
+  int home = map->pairs[index].hash >> map->shift;
+  return (index - home) & (map->capacity - 1);
+}
+
+// Find the slot holding key, or -1 if it's not in the map.
+static int map_find(jack_map_t* map, jack_value_t* key, uint64_t hash) {
+  int mask = map->capacity - 1;
+  int index = hash >> map->shift;
+  int distance;
+  for (distance = 0; ; ++distance) {
+    jack_pair_t *pair = &map->pairs[index];
+    // Robin hood keeps probe sequences sorted by distance, so we can stop as
+    // soon as we pass a pair that is closer to home than the key would be.
+    if (!pair->key || map_distance(map, index) < distance) return -1;
+    if (pair->hash == hash && value_is_equal(key, pair->key)) return index;
+    index = (index + 1) & mask;
+  }
+}
 
-  // Look for the key in the hash bucket
-  jack_pair_t **parent = &(map->buckets[hash_integer(key->integer) % map->num_buckets]);
-  jack_pair_t *pair = *parent;
-  while (pair) {
-    // If the key is already in the slot,
-    if (value_is_equal(key, pair->key)) {
-      // Replace the value with the new value
-      unref_value(pair->value);
-      pair->value = value;
-      return false;
+// Insert a pair known not to be in the map.  Takes from the rich (pairs close
+// to their home slot) and gives to the poor (the pair being inserted).
+static void map_insert(jack_map_t* map, jack_pair_t pair) {
+  int mask = map->capacity - 1;
+  int index = pair.hash >> map->shift;
+  int distance = 0;
+  while (map->pairs[index].key) {
+    int existing = map_distance(map, index);
+    if (existing < distance) {
+      jack_pair_t swap = map->pairs[index];
+      map->pairs[index] = pair;
+      pair = swap;
+      distance = existing;
     }
-    // Otherwise keep looking.
-    parent = &pair->next;
-    pair = *parent;
+    index = (index + 1) & mask;
+    distance++;
   }
+  map->pairs[index] = pair;
+}
 
-  // If it wasn't there, append to the list.
-  pair = malloc(sizeof(*pair));
-  pair->key = key;
-  pair->value = value;
-  pair->next = NULL;
-  *parent = pair;
+static void map_resize(jack_heap_t* heap, jack_map_t* map, int capacity) {
+  jack_pair_t* pairs = map->pairs;
+  int i, old_capacity = map->capacity;
+  map_alloc(heap, map, capacity);
+  for (i = 0; i < old_capacity; ++i) {
+    if (pairs[i].key) map_insert(map, pairs[i]);
+  }
+  jack_heap_release(heap, pairs, sizeof(*pairs) * old_capacity);
+}
+
+static bool map_set(jack_heap_t* heap, jack_map_t* map, jack_value_t* key, jack_value_t* value) {
+  uint64_t hash = hash_value(key);
+  int index = map_find(map, key, hash);
+
+  // If the key is already in the map, replace the value with the new value.
+  if (index >= 0) {
+    jack_pair_t *pair = &map->pairs[index];
+    unref_value(heap, pair->value);
+    pair->value = value;
+    unref_value(heap, key);
+    return false;
+  }
+
+  // Grow once the table is three quarters full.
+  if ((map->length + 1) * 4 > map->capacity * 3) {
+    map_resize(heap, map, map->capacity * 2);
+  }
+  map_insert(map, (jack_pair_t){ .key = key, .value = value, .hash = hash });
+  map->length++;
   return true;
 }
 
-static bool map_set_symbol(jack_map_t* map, const char* symbol, jack_value_t* value) {
-  jack_value_t* key = ref_value(new_symbol(strlen(symbol), symbol));
-  return map_set(map, key, value);
+static bool map_set_symbol(jack_heap_t* heap, jack_map_t* map, const char* symbol, jack_value_t* value) {
+  jack_value_t* key = ref_value(heap, new_symbol(heap, strlen(symbol), symbol));
+  return map_set(heap, map, key, value);
 }
 
 static jack_value_t* map_get(jack_map_t* map, jack_value_t* key) {
-  // Look for the key in the hash bucket
-  jack_pair_t *pair = map->buckets[hash_integer(key->integer) % map->num_buckets];
-  while (pair) {
-    // When the key is found, return the corresponding value.
-    if (value_is_equal(key, pair->key)) return pair->value;
-    // Otherwise keep looking.
-    pair = pair->next;
-  }
+  int index = map_find(map, key, hash_value(key));
   // If the key is not found, return NULL.
-  return NULL;
+  return index >= 0 ? map->pairs[index].value : NULL;
 }
 
-static jack_value_t* map_get_symbol(jack_map_t* map, const char* symbol) {
-  jack_value_t* key = ref_value(new_symbol(strlen(symbol), symbol));
+static jack_value_t* map_get_symbol(jack_heap_t* heap, jack_map_t* map, const char* symbol) {
+  jack_value_t* key = ref_value(heap, new_symbol(heap, strlen(symbol), symbol));
   jack_value_t* value = map_get(map, key);
-  unref_value(key);
+  unref_value(heap, key);
   return value;
 }
 
-static bool map_delete(jack_map_t* map, jack_value_t* key) {
-  // Look for the key in the hash bucket
-  jack_pair_t **parent = &(map->buckets[hash_integer(key->integer) % map->num_buckets]);
-  jack_pair_t *pair = *parent;
-  while (pair) {
-    if (value_is_equal(key, pair->key)) {
-      *parent = pair->next;
-      unref_value(pair->value);
-      return true;
-    }
-    // Otherwise keep looking.
-    parent = &pair->next;
-    pair = *parent;
+static bool map_delete(jack_heap_t* heap, jack_map_t* map, jack_value_t* key) {
+  int mask = map->capacity - 1;
+  int index = map_find(map, key, hash_value(key));
+  if (index < 0) return false;
+  unref_value(heap, map->pairs[index].key);
+  unref_value(heap, map->pairs[index].value);
+
+  // Shift the rest of the probe sequence back one slot so there's no need
+  // for tombstones.
+  for (;;) {
+    int next = (index + 1) & mask;
+    if (!map->pairs[next].key || !map_distance(map, next)) break;
+    map->pairs[index] = map->pairs[next];
+    index = next;
   }
-  return false;
+  map->pairs[index].key = NULL;
+  map->pairs[index].value = NULL;
+  map->length--;
+  return true;
 }
 
-static bool map_delete_symbol(jack_map_t* map, const char* symbol) {
-  jack_value_t* key = ref_value(new_symbol(strlen(symbol), symbol));
-  bool res = map_delete(map, key);
-  unref_value(key);
+static bool map_delete_symbol(jack_heap_t* heap, jack_map_t* map, const char* symbol) {
+  jack_value_t* key = ref_value(heap, new_symbol(heap, strlen(symbol), symbol));
+  bool res = map_delete(heap, map, key);
+  unref_value(heap, key);
   return res;
 }
 
+static jack_state_t* new_state(jack_heap_t* heap, int slots) {
+  jack_state_t *state = jack_heap_alloc(heap, sizeof(*state));
+  memset(state, 0, sizeof(*state));
+  state->heap = heap;
+  jack_heap_ref(heap);
+  size_t size = stack_size(slots);
+  jack_stack_t *stack = state->stack = jack_heap_alloc(heap, size);
+  memset(stack, 0, size);
+  stack->length = slots;
+  stack->top = 0;
+  return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   CYCLE COLLECTOR
+////////////////////////////////////////////////////////////////////////////////
+
+// Trial deletion after Bacon and Rajan, "Concurrent Cycle Collection in
+// Reference Counted Systems".  A container whose count drops without
+// reaching zero is buffered as a possible root of a garbage cycle.  A
+// collection gathers every container reachable from the roots and takes
+// away the references those members hold on each other.  Members with
+// references left over are held from outside, and so is everything they
+// reach.  The rest is garbage.
+//
+// Each phase runs a bounded number of units at a time with the program
+// running in between, and trial counts are kept apart in value->gc so the
+// real counts stay right.  The program can only get at a member through a
+// stack: a new reference to one marks it in use, and reaching a container
+// through the API walks it on the spot so nothing it holds can move out
+// unseen.  The stack of a function should only change while it's called.
+enum {
+  GC_IDLE,
+  GC_ROOTS,    // Take the buffered roots that are still purple
+  GC_MARK,     // Gather everything reachable from them
+  GC_SUBTRACT, // Take away the references members hold on each other
+  GC_SCAN,     // Walk out from the members with references left over
+  GC_HOLD,     // The rest is garbage, hold it while it's torn down
+  GC_CLEAR,    // Drop the references the garbage holds
+  GC_RELEASE,  // Free the garbage and put everything else back
+};
+
+// Boxes of members and buffered roots outlive their count reaching zero.
+static bool gc_dead(jack_value_t* value) {
+  return value->ref_count < JACK_REF_COUNT;
+}
+
+static void gc_set_color(jack_value_t* value, int color) {
+  value->gc = (value->gc & ~GC_COLOR) | color;
+}
+
+static void gc_append(jack_heap_t* heap, jack_gc_array_t* array, jack_value_t* value) {
+  if (array->length == array->size) {
+    int size = array->size ? array->size * 2 : 16;
+    array->values = jack_heap_realloc(heap, array->values,
+      sizeof(*array->values) * array->size, sizeof(*array->values) * size);
+    array->size = size;
+  }
+  array->values[array->length++] = value;
+}
+
+// Number of references a container holds and the i-th of them, which may be
+// nil or immediate.  Maps have a key and a value for every slot.
+static int gc_degree(jack_value_t* value) {
+  switch (get_type(value)) {
+    case List: return value->list->length;
+    case Map: return value->map->capacity * 2;
+    default: return value->function->state->stack->top;
+  }
+}
+
+static jack_value_t* gc_child(jack_value_t* value, int i) {
+  switch (get_type(value)) {
+    case List: return *list_at(value->list, i);
+    case Map: {
+      jack_pair_t *pair = &value->map->pairs[i / 2];
+      return i & 1 ? pair->value : pair->key;
+    }
+    default: return value->function->state->stack->values[i];
+  }
+}
+
+// Mark a gray member as in use.  Before the scan starts it finds pending
+// members by itself.
+static void gc_shade(jack_heap_t* heap, jack_value_t* value) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  gc_set_color(value, GC_PENDING);
+  if (gc->phase == GC_SCAN) gc_append(heap, &gc->pending, value);
+}
+
+// A new reference to a container.  A root that is referenced again isn't
+// the last way into a cycle after all.
+NOINLINE static void gc_touch(jack_heap_t* heap, jack_value_t* value) {
+  int color = gc_color(value);
+  if (color == GC_PURPLE) gc_set_color(value, GC_BLACK);
+  else if (color == GC_GRAY) gc_shade(heap, value);
+}
+
+NOINLINE static void gc_possible_root(jack_heap_t* heap, jack_value_t* value) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  int color = gc_color(value);
+  if (color == GC_WHITE) return;
+  // Members get their color back when the collection is done.
+  if (color == GC_BLACK && !(value->gc & GC_MEMBER)) gc_set_color(value, GC_PURPLE);
+  if (value->gc & GC_BUFFERED) return;
+  value->gc |= GC_BUFFERED;
+  gc_append(heap, &gc->roots, value);
+}
+
+static bool gc_unwalked(jack_value_t* value) {
+  int color = gc_color(value);
+  return color == GC_GRAY || color == GC_PENDING;
+}
+
+// Walk a member in one go, for when the program reaches it.
+NOINLINE static void gc_walk(jack_heap_t* heap, jack_value_t* value) {
+  int degree = gc_degree(value);
+  for (int i = 0; i < degree; ++i) {
+    jack_value_t *child = gc_child(value, i);
+    if (is_container(child) && gc_color(child) == GC_GRAY) gc_shade(heap, child);
+  }
+  gc_set_color(value, GC_BLACK);
+}
+
+static void gc_add_member(jack_heap_t* heap, jack_gc_t* gc, jack_value_t* value) {
+  uint32_t count = value->ref_count / JACK_REF_COUNT;
+  if (count > GC_COUNT_MAX) count = GC_COUNT_MAX;
+  value->gc = (value->gc & GC_BUFFERED) | GC_MEMBER | GC_GRAY | count << GC_COUNT_SHIFT;
+  gc_append(heap, &gc->members, value);
+  gc_append(heap, &gc->pending, value);
+  gc->stats.objects_visited++;
+}
+
+// Take away one reference held by another member.  Saturated counts are
+// left alone, such members are simply kept.
+static void gc_subtract(jack_value_t* value) {
+  uint32_t count = value->gc >> GC_COUNT_SHIFT;
+  if (count && count < GC_COUNT_MAX) value->gc -= 1 << GC_COUNT_SHIFT;
+}
+
+// Drop up to `budget` references held by the garbage container in
+// gc->current, which is done once it's empty.  Returns the budget left.
+// Values only the garbage held are freed the usual way, all at once.
+static int gc_clear(jack_heap_t* heap, jack_gc_t* gc, int budget) {
+  jack_value_t *value = gc->current;
+  switch (get_type(value)) {
+    case List: {
+      jack_list_t *list = value->list;
+      for (; list->length && budget > 0; --budget) {
+        unref_value(heap, list_pop(list));
+      }
+      if (!list->length) gc->current = NULL;
+      break;
+    }
+    case Map: {
+      jack_map_t *map = value->map;
+      for (; gc->child < map->capacity && budget > 0; --budget) {
+        jack_pair_t *pair = &map->pairs[gc->child++];
+        if (!pair->key) continue;
+        unref_value(heap, pair->key);
+        unref_value(heap, pair->value);
+        pair->key = pair->value = NULL;
+      }
+      if (gc->child == map->capacity) {
+        map->length = 0;
+        gc->current = NULL;
+      }
+      break;
+    }
+    default: {
+      jack_state_t *state = value->function->state;
+      for (; state->stack->top && budget > 0; --budget) {
+        unref_value(heap, state_pop(state));
+      }
+      if (!state->stack->top) gc->current = NULL;
+      break;
+    }
+  }
+  return budget;
+}
+
+// Start walking the references of a member if it has the given color.
+static void gc_begin(jack_gc_t* gc, jack_value_t* value, int color) {
+  if (gc_dead(value) || gc_color(value) != color) return;
+  gc->current = value;
+  gc->child = 0;
+}
+
+// Fetch the next reference of gc->current.  Returns false and ends the
+// walk once it's done or the member no longer has the given color.
+static bool gc_next(jack_gc_t* gc, int color, jack_value_t** child) {
+  jack_value_t *value = gc->current;
+  if (gc_dead(value) || gc_color(value) != color || gc->child >= gc_degree(value)) {
+    gc->current = NULL;
+    return false;
+  }
+  *child = gc_child(value, gc->child++);
+  return true;
+}
+
+// Do about `budget` units of work, one for each root, member or reference
+// looked at.  Returns true if a collection finished.
+static bool gc_work(jack_heap_t* heap, jack_gc_t* gc, int budget) {
+  jack_stats_t before, after;
+  // Counts have to be settled while the collector looks at them, so pending
+  // frees are finished first and none are left queued during the step.
+  int free_budget = gc->free_budget;
+  gc->free_budget = 0;
+  free_pending(heap, INT_MAX);
+  jack_heap_stats(heap, &before);
+  gc->stats.steps++;
+  bool finished = false;
+  while (budget > 0 && !finished) {
+    jack_value_t *value;
+    switch (gc->phase) {
+      case GC_IDLE:
+        if (!gc->roots.length) {
+          budget = 0;
+          break;
+        }
+        gc->phase = GC_ROOTS;
+        // While taking roots, child counts the ones kept in the buffer.
+        gc->cursor = gc->child = 0;
+        break;
+
+      case GC_ROOTS:
+        if (gc->cursor == gc->roots.length) {
+          gc->roots.length = gc->child;
+          gc->current = NULL;
+          gc->phase = GC_MARK;
+          break;
+        }
+        budget--;
+        gc->stats.roots_scanned++;
+        value = gc->roots.values[gc->cursor++];
+        if (value->gc & GC_MEMBER) {
+          // Buffered again after it was taken, keep it for next time.
+          gc->roots.values[gc->child++] = value;
+          break;
+        }
+        value->gc &= ~GC_BUFFERED;
+        if (gc_dead(value)) release_box(heap, value);
+        else if (gc_color(value) == GC_PURPLE) gc_add_member(heap, gc, value);
+        break;
+
+      case GC_MARK:
+        if (gc->current) {
+          if (!gc_next(gc, GC_GRAY, &value)) break;
+          budget--;
+          // Frozen containers are never members, other threads may be
+          // counting them.  They can't be part of a new cycle anyway.
+          if (is_container(value) && !(value->gc & (GC_MEMBER | GC_FROZEN))) {
+            gc_add_member(heap, gc, value);
+          }
+        }
+        else if (gc->pending.length) {
+          budget--;
+          gc_begin(gc, gc->pending.values[--gc->pending.length], GC_GRAY);
+        }
+        else {
+          gc->cursor = 0;
+          gc->phase = GC_SUBTRACT;
+        }
+        break;
+
+      case GC_SUBTRACT:
+        if (gc->current) {
+          if (!gc_next(gc, GC_GRAY, &value)) break;
+          budget--;
+          if (is_container(value) && gc_color(value) == GC_GRAY) gc_subtract(value);
+        }
+        else if (gc->cursor < gc->members.length) {
+          budget--;
+          gc_begin(gc, gc->members.values[gc->cursor++], GC_GRAY);
+        }
+        else {
+          gc->cursor = 0;
+          gc->phase = GC_SCAN;
+        }
+        break;
+
+      case GC_SCAN:
+        if (gc->current) {
+          jack_value_t *walked = gc->current;
+          if (!gc_next(gc, GC_PENDING, &value)) {
+            if (!gc_dead(walked) && gc_color(walked) == GC_PENDING) {
+              gc_set_color(walked, GC_BLACK);
+            }
+            break;
+          }
+          budget--;
+          if (is_container(value) && gc_color(value) == GC_GRAY) gc_shade(heap, value);
+          break;
+        }
+        if (gc->pending.length) value = gc->pending.values[--gc->pending.length];
+        else if (gc->cursor < gc->members.length) value = gc->members.values[gc->cursor++];
+        else {
+          gc->cursor = 0;
+          gc->phase = GC_HOLD;
+          break;
+        }
+        budget--;
+        if (!gc_dead(value) && gc_color(value) == GC_GRAY && value->gc >> GC_COUNT_SHIFT) {
+          gc_set_color(value, GC_PENDING);
+        }
+        gc_begin(gc, value, GC_PENDING);
+        break;
+
+      case GC_HOLD:
+        // What's still gray can't be reached any more, so nothing changes
+        // it between steps from here on.
+        if (gc->cursor == gc->members.length) {
+          gc->cursor = 0;
+          gc->phase = GC_CLEAR;
+          break;
+        }
+        budget--;
+        value = gc->members.values[gc->cursor++];
+        if (!gc_dead(value) && gc_color(value) == GC_GRAY) {
+          gc_set_color(value, GC_WHITE);
+          value->ref_count += JACK_REF_COUNT;
+        }
+        break;
+
+      case GC_CLEAR:
+        if (gc->current) {
+          budget = gc_clear(heap, gc, budget);
+        }
+        else if (gc->cursor < gc->members.length) {
+          budget--;
+          value = gc->members.values[gc->cursor++];
+          if (gc_color(value) == GC_WHITE) {
+            gc->current = value;
+            gc->child = 0;
+          }
+        }
+        else {
+          gc->cursor = 0;
+          gc->phase = GC_RELEASE;
+        }
+        break;
+
+      case GC_RELEASE: {
+        if (gc->cursor == gc->members.length) {
+          gc->members.length = 0;
+          gc->phase = GC_IDLE;
+          gc->stats.collections++;
+          finished = true;
+          break;
+        }
+        budget--;
+        value = gc->members.values[gc->cursor++];
+        int color = gc_color(value);
+        value->gc &= GC_BUFFERED | GC_QUEUED;
+        if (color == GC_WHITE) {
+          // Empty by now, dropping the hold frees it.
+          gc->stats.objects_freed++;
+          value->ref_count -= JACK_REF_COUNT;
+          free_value(heap, value);
+        }
+        else if (gc_dead(value)) {
+          release_box(heap, value);
+        }
+        else if (value->gc & GC_BUFFERED) {
+          gc_set_color(value, GC_PURPLE);
+        }
+        break;
+      }
+    }
+  }
+  gc->free_budget = free_budget;
+  jack_heap_stats(heap, &after);
+  gc->stats.bytes_reclaimed += after.released_bytes - before.released_bytes;
+  return finished;
+}
+
+// Automatic steps, run from jack_pop.
+static void gc_auto(jack_heap_t* heap) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  if (gc->phase != GC_IDLE || gc->roots.length >= JACK_GC_THRESHOLD) {
+    gc_work(heap, gc, gc->budget);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//   SHARING
+////////////////////////////////////////////////////////////////////////////////
+
+// Values go to another heap by handing over the blocks they're in, and
+// frozen values are shared as they are.  Either way the whole graph is
+// walked first, with the collector idle so the walk can use trial counts.
+
+static void walk_reach(jack_heap_t* heap, jack_value_t* value, jack_gc_array_t* seen) {
+  if (!value || is_immediate(value) || (value->gc & GC_FROZEN)) return;
+  if (!(value->gc & GC_WALKED)) {
+    value->gc = (value->gc & ((1 << GC_COUNT_SHIFT) - 1)) | GC_WALKED;
+    gc_append(heap, seen, value);
+  }
+  if (value->gc >> GC_COUNT_SHIFT < GC_COUNT_MAX) value->gc += 1 << GC_COUNT_SHIFT;
+}
+
+// Gather the boxes reachable from `values` into `seen`, marked as walked and
+// with the number of references to them found on the way as trial count.
+// Frozen values are left out, and so is everything they hold.  Returns
+// false if there's a function among them, those are bound to their state.
+static bool walk_graph(jack_heap_t* heap, jack_value_t** values, int num, jack_gc_array_t* seen) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  while (gc->phase != GC_IDLE) gc_work(heap, gc, INT_MAX);
+  bool found = true;
+  for (int i = 0; i < num; ++i) walk_reach(heap, values[i], seen);
+  for (int i = 0; i < seen->length; ++i) {
+    jack_value_t *value = seen->values[i];
+    jack_type_t type = get_type(value);
+    if (type == Function) found = false;
+    if (type == Buffer) walk_reach(heap, value->bytes->parent, seen);
+    if (type != List && type != Map) continue;
+    int degree = gc_degree(value);
+    for (int j = 0; j < degree; ++j) walk_reach(heap, gc_child(value, j), seen);
+  }
+  return found;
+}
+
+// Clear the marks walk_graph left and forget the array.  Values leaving the
+// collector's hands (`gone`) are taken out of the roots buffer and get
+// `flags` for all their bookkeeping.
+static void walk_done(jack_heap_t* heap, jack_gc_array_t* seen, bool gone, uint32_t flags) {
+  jack_gc_t *gc = jack_heap_gc(heap);
+  bool buffered = false;
+  for (int i = 0; gone && i < seen->length; ++i) {
+    buffered |= seen->values[i]->gc & GC_BUFFERED;
+  }
+  if (buffered) {
+    int kept = 0;
+    for (int i = 0; i < gc->roots.length; ++i) {
+      jack_value_t *value = gc->roots.values[i];
+      if (!(value->gc & GC_WALKED)) gc->roots.values[kept++] = value;
+    }
+    gc->roots.length = kept;
+  }
+  for (int i = 0; i < seen->length; ++i) {
+    jack_value_t *value = seen->values[i];
+    value->gc = gone ? flags : value->gc & ((1 << GC_COUNT_SHIFT) - 1) & ~GC_WALKED;
+  }
+  jack_heap_release(heap, seen->values, sizeof(*seen->values) * seen->size);
+}
+
+// Move the counters of the blocks a value is made of.  Only the ones that
+// didn't come from a pool change anything.
+static void adopt_value(jack_heap_t* from, jack_heap_t* to, jack_value_t* value) {
+  jack_heap_adopt(from, to, value, sizeof(*value));
+  switch (get_type(value)) {
+    case Buffer:
+      jack_heap_adopt(from, to, value->bytes, sizeof(*value->bytes) + value->bytes->capacity);
+      break;
+    case List:
+      jack_heap_adopt(from, to, value->list, sizeof(*value->list));
+      jack_heap_adopt(from, to, value->list->items, sizeof(*value->list->items) * value->list->capacity);
+      break;
+    case Map:
+      jack_heap_adopt(from, to, value->map, sizeof(*value->map));
+      jack_heap_adopt(from, to, value->map->pairs, sizeof(*value->map->pairs) * value->map->capacity);
+      break;
+    default:
+      break;
+  }
+}
+
+// Give the graph of `values` to another heap, if nothing outside it holds
+// any part of it.  Otherwise the sender could still reach what's moved.
+static bool hand_over(jack_heap_t* from, jack_heap_t* to, jack_value_t** values, int num) {
+  assert(jack_heap_compatible(from, to));
+  jack_gc_array_t seen = {NULL, 0, 0};
+  bool owned = walk_graph(from, values, num, &seen);
+  for (int i = 0; owned && i < seen.length; ++i) {
+    jack_value_t *value = seen.values[i];
+    owned = value->gc >> GC_COUNT_SHIFT == (uint32_t)value->ref_count / JACK_REF_COUNT;
+  }
+  for (int i = 0; owned && i < seen.length; ++i) {
+    adopt_value(from, to, seen.values[i]);
+  }
+  walk_done(from, &seen, owned, 0);
+  if (owned) jack_heap_lend(from, to);
+  return owned;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //   PUBLIC API
 ////////////////////////////////////////////////////////////////////////////////
 
 jack_state_t* jack_new_state(int slots) {
-  jack_state_t *state = malloc(sizeof(*state));
-  memset(state, 0, sizeof(*state));
-  size_t size = sizeof(jack_stack_t) + sizeof(jack_value_t*) * slots;
-  jack_stack_t *stack = state->stack = malloc(size);
-  memset(stack, 0, size);
-  stack->length = slots;
-  stack->top = 0;
+  return jack_new_state_with(slots, NULL, NULL);
+}
+jack_state_t* jack_new_state_with(int slots, jack_alloc_t *alloc, void *userdata) {
+  jack_heap_t *heap = jack_heap_new(alloc, userdata);
+  jack_state_t *state = new_state(heap, slots);
+  // The state holds the only reference now.
+  jack_heap_unref(heap);
   return state;
 }
-void jack_xmove(jack_state_t *from, jack_state_t *to, int num) {
+bool jack_xmove(jack_state_t *from, jack_state_t *to, int num) {
   jack_stack_t *a = from->stack;
-  jack_stack_t *b = to->stack;
-  // Make sure there is room to move the items.
-  assert(a->top >= num && b->top + num <= b->length);
+  assert(a->top - from->base >= num);
+  // Values belong to the heap they were allocated from, going to another
+  // one hands them over.
+  if (from->heap != to->heap && !hand_over(from->heap, to->heap, a->values + a->top - num, num)) {
+    return false;
+  }
+  jack_stack_t *b = state_reserve(to, num);
   a->top -= num;
   for (int i = 0; i < num; ++i) {
     b->values[b->top++] = a->values[a->top + i];
     a->values[a->top + i] = NULL;
   }
+  return true;
+}
+
+bool jack_freeze(jack_state_t *state, int index) {
+  jack_value_t *value = state_get(state, index);
+  jack_gc_array_t seen = {NULL, 0, 0};
+  bool frozen = walk_graph(state->heap, &value, 1, &seen);
+  walk_done(state->heap, &seen, frozen, GC_FROZEN);
+  return frozen;
+}
+
+bool jack_is_frozen(jack_state_t *state, int index) {
+  jack_value_t *value = state_get(state, index);
+  return !value || is_immediate(value) || (value->gc & GC_FROZEN);
 }
 
 void jack_free_state(jack_state_t *state) {
+  jack_heap_t *heap = state->heap;
   for (int i = 0; i < state->stack->top; ++i) {
-    unref_value(state->stack->values[i]);
-  }
-  free(state->stack);
-  jack_malloc_node_t *node = state->head;
-  while (node) {
-    jack_malloc_node_t *next = node->next;
-    free(node);
-    node = next;
+    unref_value(heap, state->stack->values[i]);
   }
-  free(state);
+  // The heap may go away with this state, so finish freeing now.
+  free_pending(heap, INT_MAX);
+  release_state(state);
 }
 
+// Function states are released here once their stack has been emptied.
+static void release_state(jack_state_t* state) {
+  jack_heap_t *heap = state->heap;
+  jack_heap_release(heap, state->stack, stack_size(state->stack->length));
+  jack_arena_free(heap, &state->arena);
+  jack_heap_release(heap, state, sizeof(*state));
+  jack_heap_unref(heap);
+}
 
 void* jack_malloc(jack_state_t *state, size_t size) {
-  jack_malloc_node_t *node = malloc(sizeof(*node) + size);
-  node->next = NULL;
-  if (state->tail) {
-    state->tail->next = node;
-  }
-  else {
-    state->head = node;
+  return jack_arena_alloc(state->heap, &state->arena, size);
+}
+
+void jack_malloc_reset(jack_state_t *state) {
+  jack_arena_reset(state->heap, &state->arena);
+}
+
+void jack_get_stats(jack_state_t *state, jack_stats_t *stats) {
+  jack_heap_stats(state->heap, stats);
+}
+
+void jack_set_free_budget(jack_state_t *state, int budget) {
+  jack_heap_gc(state->heap)->free_budget = budget;
+}
+
+void jack_free_pending(jack_state_t *state) {
+  free_pending(state->heap, INT_MAX);
+}
+
+void jack_gc_enable(jack_state_t *state, int budget) {
+  jack_gc_t *gc = jack_heap_gc(state->heap);
+  gc->enabled = true;
+  gc->budget = budget;
+}
+
+bool jack_gc_step(jack_state_t *state, int budget) {
+  jack_gc_t *gc = jack_heap_gc(state->heap);
+  if (gc->phase == GC_IDLE && !gc->roots.length) return false;
+  return gc_work(state->heap, gc, budget);
+}
+
+void jack_gc_collect(jack_state_t *state) {
+  jack_gc_t *gc = jack_heap_gc(state->heap);
+  // Finishing a collection can buffer new roots, go until there are none.
+  while (gc->phase != GC_IDLE || gc->roots.length) {
+    gc_work(state->heap, gc, INT_MAX);
   }
-  state->tail = node;
-  return &(node->data);
+}
+
+void jack_gc_stats(jack_state_t *state, jack_gc_stats_t *stats) {
+  jack_gc_t *gc = jack_heap_gc(state->heap);
+  *stats = gc->stats;
+  stats->roots = gc->roots.length;
 }
 
 void jack_dump_value(jack_value_t *value) {
@@ -393,26 +1237,26 @@ void jack_dump_value(jack_value_t *value) {
   switch (type) {
     case Nil:
       printf("(nil)");
+      break;
     case Symbol:
       printf(":%.*s", value->buffer->size, value->buffer->data);
       break;
     case Integer:
-      printf("%ld", value->integer);
+      printf("%ld", get_integer(value));
       break;
     case Boolean:
-      printf("%s", value->boolean ? "true" : "false");
+      printf("%s", value == JACK_TRUE ? "true" : "false");
       break;
     case Buffer:
-      printf("Buffer[%d] %p", value->buffer->size, value->buffer->data);
+      printf("Buffer[%d] %p", value->bytes->size, value->bytes->data);
       break;
     case List: {
-      jack_node_t *node = value->list->head;
+      jack_list_t *list = value->list;
       printf("[");
-      int count = 0;
-      while (node) {
-        if (count++) printf(", ");
-        jack_dump_value(node->value);
-        node = node->next;
+      int i;
+      for (i = 0; i < list->length; ++i) {
+        if (i) printf(", ");
+        jack_dump_value(*list_at(list, i));
       }
       printf("]");
       break;
@@ -421,15 +1265,13 @@ void jack_dump_value(jack_value_t *value) {
       jack_map_t *map = value->map;
       printf("{");
       int i, count = 0;
-      for (i = 0; i < map->num_buckets; ++i) {
-        jack_pair_t *pair = map->buckets[i];
-        while (pair) {
-          if (count++) printf(", ");
-          jack_dump_value(pair->key);
-          printf(": ");
-          jack_dump_value(pair->value);
-          pair = pair->next;
-        }
+      for (i = 0; i < map->capacity; ++i) {
+        jack_pair_t *pair = &map->pairs[i];
+        if (!pair->key) continue;
+        if (count++) printf(", ");
+        jack_dump_value(pair->key);
+        printf(": ");
+        jack_dump_value(pair->value);
       }
       printf("}");
       break;
@@ -443,10 +1285,14 @@ void jack_dump_value(jack_value_t *value) {
 
 void jack_dump_state(jack_state_t *state) {
   int i;
-  printf("state: %p (%d/%d)", state, state->stack->top, state->stack->length);
-  for (i = 0; i < state->stack->top; ++i) {
-    jack_value_t* value = state->stack->values[i];
-    if (value) {
+  printf("state: %p (%d/%d)", state, state->stack->top - state->base, state->stack->length);
+  for (i = 0; i < state->stack->top - state->base; ++i) {
+    jack_value_t* value = state->stack->values[state->base + i];
+    if (is_immediate(value)) {
+      printf("\n%d: ", i);
+      jack_dump_value(value);
+    }
+    else if (value) {
       printf("\n%d: (%d) ", i, value->ref_count / JACK_REF_COUNT);
       jack_dump_value(value);
     }
@@ -462,7 +1308,7 @@ void jack_new_nil(jack_state_t *state) {
 }
 
 void jack_new_integer(jack_state_t *state, intptr_t integer) {
-  new_value(state, new_integer(integer));
+  new_value(state, new_integer(state->heap, integer));
 };
 
 void jack_new_boolean(jack_state_t *state, bool boolean) {
@@ -470,16 +1316,100 @@ void jack_new_boolean(jack_state_t *state, bool boolean) {
 };
 
 char* jack_new_buffer(jack_state_t *state, size_t length, const char* data) {
-  return new_value(state, new_buffer(length, data))->buffer->data;
+  return new_value(state, new_buffer(state->heap, length, data))->bytes->data;
 };
 
+void jack_new_buffer_external(jack_state_t *state, char* data, size_t length, jack_release_t *release, void *userdata) {
+  new_value(state, new_external(state->heap, data, length, release, userdata));
+}
+
+bool jack_new_slice(jack_state_t *state, int index, int start, int length) {
+  jack_value_t *buffer = state_get_as(state, Buffer, index);
+  int size = buffer->bytes->size;
+  bool valid = start >= 0 && length >= 0 && start <= size && length <= size - start;
+  new_value(state, valid ? new_slice(state->heap, buffer, start, length) : NULL);
+  return valid;
+}
+
+// Appending to a buffer nothing else holds happens in place, with the
+// capacity at least doubled when it runs out, so building one up a piece at
+// a time stays linear.  Everything else gets a new buffer.
+void jack_buffer_concat(jack_state_t *state) {
+  jack_heap_t *heap = state->heap;
+  jack_value_t *left = state_get_as(state, Buffer, -2);
+  jack_bytes_t *a = left->bytes, *b = state_get_as(state, Buffer, -1)->bytes;
+  assert(b->size <= INT_MAX - a->size);
+  int size = a->size + b->size;
+  if (left->ref_count < 2 * JACK_REF_COUNT && !(left->gc & GC_FROZEN) && a->data == a->bytes) {
+    if (size > a->capacity) {
+      int capacity = a->capacity > INT_MAX / 2 ? INT_MAX : a->capacity * 2;
+      if (capacity < size) capacity = size;
+      a = left->bytes = jack_heap_realloc(heap, a, sizeof(*a) + a->capacity, sizeof(*a) + capacity);
+      a->capacity = capacity;
+      a->data = a->bytes;
+    }
+    memcpy(a->data + a->size, b->data, b->size);
+    a->size = size;
+    jack_pop(state);
+    return;
+  }
+  jack_value_t *value = new_box(heap, Buffer);
+  value->bytes = bytes_alloc(heap, size, size);
+  memcpy(value->bytes->data, a->data, a->size);
+  memcpy(value->bytes->data + a->size, b->data, b->size);
+  jack_popn(state, 2);
+  new_value(state, value);
+}
+
+void jack_buffer_repeat(jack_state_t *state, int count) {
+  jack_bytes_t *bytes = state_get_as(state, Buffer, -1)->bytes;
+  assert(count >= 0 && (!count || bytes->size <= INT_MAX / count));
+  jack_value_t *value = new_box(state->heap, Buffer);
+  value->bytes = bytes_alloc(state->heap, bytes->size * count, bytes->size * count);
+  jack_mem_repeat(value->bytes->data, bytes->data, bytes->size, count);
+  jack_pop(state);
+  new_value(state, value);
+}
+
+bool jack_buffer_equal(jack_state_t *state, int a, int b) {
+  jack_bytes_t *one = state_get_as(state, Buffer, a)->bytes;
+  jack_bytes_t *two = state_get_as(state, Buffer, b)->bytes;
+  return one->size == two->size && jack_mem_equal(one->data, two->data, one->size);
+}
+
+int jack_buffer_casecmp(jack_state_t *state, int a, int b) {
+  jack_bytes_t *one = state_get_as(state, Buffer, a)->bytes;
+  jack_bytes_t *two = state_get_as(state, Buffer, b)->bytes;
+  int order = jack_mem_casecmp(one->data, two->data, one->size < two->size ? one->size : two->size);
+  return order ? order : one->size - two->size;
+}
+
+int jack_buffer_find(jack_state_t *state, int index, int start, const char *needle, int length) {
+  jack_bytes_t *bytes = state_get_as(state, Buffer, index)->bytes;
+  if (start < 0 || start > bytes->size) return -1;
+  const char *found = jack_mem_find(bytes->data + start, bytes->size - start, needle, length);
+  return found ? found - bytes->data : -1;
+}
+
+int jack_buffer_find_byte(jack_state_t *state, int index, int start, char byte) {
+  jack_bytes_t *bytes = state_get_as(state, Buffer, index)->bytes;
+  if (start < 0 || start > bytes->size) return -1;
+  const char *found = jack_mem_chr(bytes->data + start, bytes->size - start, byte);
+  return found ? found - bytes->data : -1;
+}
+
+uint64_t jack_buffer_hash(jack_state_t *state, int index) {
+  jack_bytes_t *bytes = state_get_as(state, Buffer, index)->bytes;
+  return jack_mem_hash(bytes->data, bytes->size);
+}
+
 void jack_new_symbol(jack_state_t *state, const char* symbol) {
-  new_value(state, new_symbol(strlen(symbol), symbol));
+  new_value(state, new_symbol(state->heap, strlen(symbol), symbol));
 };
 
 
 jack_function_t* jack_new_function(jack_state_t *state, jack_call_t *call, int argc) {
-  jack_value_t* value = new_function(call, argc + 10);
+  jack_value_t* value = new_function(state->heap, call, argc + 10);
   jack_xmove(state, value->function->state, argc);
   return new_value(state, value)->function;
 }
@@ -504,6 +1434,7 @@ static int do_call(jack_state_t* state, jack_function_t* function, int argc) {
     // Reset the function's state
     jack_popn(function->state, new_top - old_top);
   }
+  state_shrink(function->state);
 
   return retc;
 }
@@ -512,45 +1443,91 @@ int jack_function_call(jack_state_t *state, int index, int argc) {
   return do_call(state, state_get_as(state, Function, index)->function, argc);
 }
 
+// Plain C functions run directly on the caller's stack.  The callee gets a
+// state whose base is the first argument, so nothing is allocated or copied
+// on the way in.  On the way out the results slide down over the arguments
+// and whatever else the callee left behind.
 int jack_call(jack_state_t *state, jack_call_t *call, int argc) {
-  jack_value_t* value = new_function(call, argc + 10);
-  int retc = do_call(state, value->function, argc);
-  free_value(value);
+  assert(state->stack->top - state->base >= argc);
+  jack_state_t frame = *state;
+  frame.data = NULL;
+  frame.base = state->stack->top - argc;
+
+  int retc = call(&frame);
+
+  // The stack may have moved and the arena may have new blocks.
+  state->stack = frame.stack;
+  state->arena = frame.arena;
+
+  jack_stack_t *stack = state->stack;
+  int first = stack->top - retc;
+  assert(first >= frame.base);
+  for (int i = frame.base; i < first; ++i) {
+    unref_value(state->heap, stack->values[i]);
+  }
+  for (int i = 0; i < retc; ++i) {
+    stack->values[frame.base + i] = stack->values[first + i];
+  }
+  stack->top = frame.base + retc;
+  state_shrink(state);
   return retc;
 }
 
 void jack_new_list(jack_state_t *state) {
-  new_value(state, new_list());
+  new_value(state, new_list(state->heap));
 }
 int jack_list_length(jack_state_t *state, int index) {
   jack_list_t* list = state_get_as(state, List, index)->list;
   return list->length;
 }
 int jack_list_push(jack_state_t *state, int index) {
-  jack_list_t* list = state_get_as(state, List, index)->list;
-  list_push(list, state_pop(state));
+  jack_list_t* list = state_get_mutable(state, List, index)->list;
+  list_push(state->heap, list, state_pop(state));
   return list->length;
 }
 int jack_list_insert(jack_state_t *state, int index) {
-  jack_list_t* list = state_get_as(state, List, index)->list;
-  list_insert(list, state_pop(state));
+  jack_list_t* list = state_get_mutable(state, List, index)->list;
+  list_insert(state->heap, list, state_pop(state));
   return list->length;
 }
 int jack_list_pop(jack_state_t *state, int index) {
-  jack_list_t* list = state_get_as(state, List, index)->list;
+  jack_list_t* list = state_get_mutable(state, List, index)->list;
   state_push(state, list_pop(list));
   return list->length;
 }
 int jack_list_shift(jack_state_t *state, int index) {
-  jack_list_t* list = state_get_as(state, List, index)->list;
+  jack_list_t* list = state_get_mutable(state, List, index)->list;
   state_push(state, list_shift(list));
   return list->length;
 }
+bool jack_list_get(jack_state_t *state, int index, int position) {
+  jack_list_t* list = state_get_as(state, List, index)->list;
+  int i = list_index(list, position);
+  new_value(state, i >= 0 ? *list_at(list, i) : NULL);
+  return i >= 0;
+}
+bool jack_list_set(jack_state_t *state, int index, int position) {
+  jack_list_t* list = state_get_mutable(state, List, index)->list;
+  jack_value_t* value = state_pop(state);
+  int i = list_index(list, position);
+  if (i < 0) {
+    unref_value(state->heap, value);
+    return false;
+  }
+  jack_value_t** item = list_at(list, i);
+  unref_value(state->heap, *item);
+  *item = value;
+  return true;
+}
+
+// Iterators keep the list in slot 0 of their own state and the position of
+// the next item in state->data.  The position is checked against the length
+// on every step in case the list changed.
 static int list_forward(jack_state_t *state) {
-  jack_node_t* node = state->data;
-  if (node) {
-    new_value(state, node->value);
-    state->data = node->next;
+  jack_list_t* list = state_get_as(state, List, 0)->list;
+  int *position = state->data;
+  if (*position < list->length) {
+    new_value(state, *list_at(list, (*position)++));
   }
   else {
     jack_new_nil(state);
@@ -558,10 +1535,11 @@ static int list_forward(jack_state_t *state) {
   return 1;
 }
 static int list_backward(jack_state_t *state) {
-  jack_node_t* node = state->data;
-  if (node) {
-    new_value(state, node->value);
-    state->data = node->prev;
+  jack_list_t* list = state_get_as(state, List, 0)->list;
+  int *position = state->data;
+  if (*position >= list->length) *position = list->length - 1;
+  if (*position >= 0) {
+    new_value(state, *list_at(list, (*position)--));
   }
   else {
     jack_new_nil(state);
@@ -569,102 +1547,113 @@ static int list_backward(jack_state_t *state) {
   return 1;
 }
 void jack_list_forward(jack_state_t *state) {
-  jack_list_t* list = state_get_as(state, List, -1)->list;
+  state_get_as(state, List, -1);
   jack_function_t* iter = jack_new_function(state, list_forward, 1);
+  int *position = jack_malloc(iter->state, sizeof(*position));
+  *position = 0;
   iter->name = "list-forward";
-  iter->state->data = list->head;
+  iter->state->data = position;
 }
 void jack_list_backward(jack_state_t *state) {
   jack_list_t* list = state_get_as(state, List, -1)->list;
   jack_function_t* iter = jack_new_function(state, list_backward, 1);
+  int *position = jack_malloc(iter->state, sizeof(*position));
+  *position = list->length - 1;
   iter->name = "list-backward";
-  iter->state->data = list->tail;
+  iter->state->data = position;
 }
 
 
 
 void jack_new_map(jack_state_t *state, int num_buckets) {
-  new_value(state, new_map(num_buckets));
+  new_value(state, new_map(state->heap, num_buckets));
 }
 int jack_map_length(jack_state_t *state, int index) {
   jack_map_t* map = state_get_as(state, Map, index)->map;
   return map->length;
 }
 bool jack_map_set(jack_state_t *state, int index) {
-  jack_map_t* map = state_get_as(state, Map, index)->map;
+  jack_map_t* map = state_get_mutable(state, Map, index)->map;
   jack_value_t* value = state_pop(state);
   jack_value_t* key = state_pop(state);
-  return map_set(map, key, value);
+  return map_set(state->heap, map, key, value);
 }
 bool jack_map_set_symbol(jack_state_t *state, int index, const char* symbol) {
-  jack_map_t* map = state_get_as(state, Map, index)->map;
+  jack_map_t* map = state_get_mutable(state, Map, index)->map;
   jack_value_t* value = state_pop(state);
-  return map_set_symbol(map, symbol, value);
+  return map_set_symbol(state->heap, map, symbol, value);
 }
 bool jack_map_get(jack_state_t *state, int index) {
   jack_map_t* map = state_get_as(state, Map, index)->map;
   jack_value_t* key = state_pop(state);
   jack_value_t* value = map_get(map, key);
-  unref_value(key);
+  unref_value(state->heap, key);
   new_value(state, value);
   return (bool)value;
 }
 bool jack_map_get_symbol(jack_state_t *state, int index, const char* symbol) {
   jack_map_t* map = state_get_as(state, Map, index)->map;
-  jack_value_t* value = map_get_symbol(map, symbol);
+  jack_value_t* value = map_get_symbol(state->heap, map, symbol);
   new_value(state, value);
   return (bool)value;
 }
 bool jack_map_has(jack_state_t *state, int index) {
   jack_map_t* map = state_get_as(state, Map, index)->map;
-  return (bool)map_get(map, state_pop(state));
+  jack_value_t* key = state_pop(state);
+  bool found = map_find(map, key, hash_value(key)) >= 0;
+  unref_value(state->heap, key);
+  return found;
 }
 bool jack_map_has_symbol(jack_state_t *state, int index, const char* symbol) {
   jack_map_t* map = state_get_as(state, Map, index)->map;
-  return (bool)map_get_symbol(map, symbol);
+  jack_value_t* key = ref_value(state->heap, new_symbol(state->heap, strlen(symbol), symbol));
+  bool found = map_find(map, key, hash_value(key)) >= 0;
+  unref_value(state->heap, key);
+  return found;
 }
 bool jack_map_delete(jack_state_t *state, int index) {
-  jack_map_t* map = state_get_as(state, Map, index)->map;
-  return map_delete(map, state_pop(state));
+  jack_map_t* map = state_get_mutable(state, Map, index)->map;
+  jack_value_t* key = state_pop(state);
+  bool found = map_delete(state->heap, map, key);
+  unref_value(state->heap, key);
+  return found;
 }
 bool jack_map_delete_symbol(jack_state_t *state, int index, const char* symbol) {
-  jack_map_t* map = state_get_as(state, Map, index)->map;
-  return map_delete_symbol(map, symbol);
+  jack_map_t* map = state_get_mutable(state, Map, index)->map;
+  return map_delete_symbol(state->heap, map, symbol);
 }
 
-typedef struct {
-  int bucket;
-  jack_pair_t* pair;
-} jack_map_iterator_t;
-
+// Iteration walks the table in slot order.  Changing the map while
+// iterating may skip or repeat pairs.
 static int map_iterate(jack_state_t *state) {
-  jack_map_iterator_t *iter = state->data;
+  int *index = state->data;
   jack_map_t* map = state_get_as(state, Map, 0)->map;
-  while (!iter->pair) {
-    if (iter->bucket >= map->num_buckets) {
-      jack_new_nil(state);
-      jack_new_nil(state);
-      return 2;
-    }
-    iter->pair = map->buckets[iter->bucket++];
+  state_reserve(state, 2);
+  while (*index < map->capacity) {
+    jack_pair_t *pair = &map->pairs[(*index)++];
+    if (!pair->key) continue;
+    ref_value(state->heap, state_push_reserved(state, pair->key));
+    ref_value(state->heap, state_push_reserved(state, pair->value));
+    return 2;
   }
-  new_value(state, iter->pair->key);
-  new_value(state, iter->pair->value);
-  iter->pair = iter->pair->next;
+  state_push_reserved(state, NULL);
+  state_push_reserved(state, NULL);
   return 2;
 }
 void jack_map_iterate(jack_state_t *state) {
   state_get_as(state, Map, -1);
   jack_function_t* iter = jack_new_function(state, map_iterate, 1);
-  jack_map_iterator_t *iterator = jack_malloc(state, sizeof(*iterator));
-  iterator->bucket = 0;
-  iterator->pair = NULL;
+  int *index = jack_malloc(iter->state, sizeof(*index));
+  *index = 0;
   iter->name = "map-iterate";
-  iter->state->data = iterator;
+  iter->state->data = index;
 }
 
 void jack_pop(jack_state_t *state) {
-  unref_value(state_pop(state));
+  jack_value_t *value = unref_value(state->heap, state_pop(state));
+  // Dropping a container that lives on is what makes a possible root, so
+  // this is where automatic collector steps run.
+  if (jack_heap_gc(state->heap)->budget && is_container(value)) gc_auto(state->heap);
 }
 
 void jack_popn(jack_state_t *state, int count) {
@@ -675,7 +1664,12 @@ void jack_popn(jack_state_t *state, int count) {
 
 
 void jack_dup(jack_state_t *state, int index) {
-  ref_value(state_push(state, state_get(state, index)));
+  ref_value(state->heap, state_push(state, state_get(state, index)));
+}
+
+bool jack_checkstack(jack_state_t *state, int slots) {
+  jack_stack_t *stack = state->stack;
+  return stack->top + slots <= stack->length || stack_grow(state, slots);
 }
 
 jack_type_t jack_get_type(jack_state_t *state, int index) {
@@ -683,10 +1677,10 @@ jack_type_t jack_get_type(jack_state_t *state, int index) {
 }
 
 intptr_t jack_get_integer(jack_state_t *state, int index) {
-  return state_get_as(state, Integer, index)->integer;
+  return get_integer(state_get_as(state, Integer, index));
 }
 bool jack_get_boolean(jack_state_t *state, int index) {
-  return state_get_as(state, Boolean, index)->boolean;
+  return state_get_as(state, Boolean, index) == JACK_TRUE;
 }
 const char* jack_get_symbol(jack_state_t *state, int index, int *size) {
   jack_buffer_t* buffer = state_get_as(state, Symbol, index)->buffer;
@@ -694,7 +1688,13 @@ const char* jack_get_symbol(jack_state_t *state, int index, int *size) {
   return buffer->data;
 }
 char* jack_get_buffer(jack_state_t *state, int index, int* size) {
-  jack_buffer_t* buffer = state_get_as(state, Buffer, index)->buffer;
-  *size = buffer->size;
-  return buffer->data;
+  jack_bytes_t* bytes = state_get_as(state, Buffer, index)->bytes;
+  assert(!bytes->parent); // Slices are read only
+  *size = bytes->size;
+  return bytes->data;
+}
+const char* jack_get_bytes(jack_state_t *state, int index, int* size) {
+  jack_bytes_t* bytes = state_get_as(state, Buffer, index)->bytes;
+  *size = bytes->size;
+  return bytes->data;
 }
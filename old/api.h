@@ -5,12 +5,52 @@
 #include <stdbool.h>
 #include "types.h"
 
-// TODO: remove this function
-jack_value_t* unref_value(jack_value_t *value);
-
+// Root states can run on different threads at the same time.  A root state,
+// the function states made from it and every value in their heap belong to
+// whichever thread is using the state, and only one may at a time; that is
+// why reference counts are plain integers.  The exceptions are symbols,
+// which the intern table locks for, and frozen values (see jack_freeze).
+// sched.h hands states to worker threads by these rules, and jack_xmove
+// passes values between them.
+
+// Slots is only the initial stack size, stacks grow as needed.
 jack_state_t* jack_new_state(int slots);
+// Same as jack_new_state, but all memory for the state and its values comes
+// from `alloc`.  Function states created from it share the same allocator.
+// Values can only be moved between states sharing an allocator.
+jack_state_t* jack_new_state_with(int slots, jack_alloc_t *alloc, void *userdata);
 void jack_free_state(jack_state_t *state);
+// Scratch memory owned by the state.  It stays valid until the state is
+// freed or jack_malloc_reset releases all of it in one step.
 void* jack_malloc(jack_state_t *state, size_t size);
+void jack_malloc_reset(jack_state_t *state);
+// Read the allocation counters of the heap behind state.
+void jack_get_stats(jack_state_t *state, jack_stats_t *stats);
+
+// Dropping the last reference to a list, map or function frees it, and
+// everything only it held, from a queue instead of recursing, so any depth
+// is fine.  With a budget above zero only about that many references are
+// dropped at once and the rest is left for later frees and allocations to
+// finish.  0, the default, frees everything right away.
+void jack_set_free_budget(jack_state_t *state, int budget);
+// Finish everything left to free by a budget.
+void jack_free_pending(jack_state_t *state);
+
+// Optional cycle collector for the heap behind state, by trial deletion.
+// Once enabled, lists, maps and functions whose count drops without
+// reaching zero are remembered as possible roots of garbage cycles.  Work is
+// done in steps of a given budget, about one unit per container or
+// reference looked at, so the program only ever pauses for that long.
+// With a budget above zero, jack_pop also runs steps by itself once
+// JACK_GC_THRESHOLD roots are waiting.  Reaching a container that a
+// collection is in the middle of walks it in one go.
+void jack_gc_enable(jack_state_t *state, int budget);
+// Do about `budget` units of collector work.  Returns true if a collection
+// finished during the step.
+bool jack_gc_step(jack_state_t *state, int budget);
+// Finish the collection in progress and collect until no roots are left.
+void jack_gc_collect(jack_state_t *state);
+void jack_gc_stats(jack_state_t *state, jack_gc_stats_t *stats);
 
 void jack_dump_value(jack_value_t *value);
 void jack_dump_state(jack_state_t *state);
@@ -23,6 +63,40 @@ void jack_new_boolean(jack_state_t *state, bool boolean);
 char* jack_new_buffer(jack_state_t *state, size_t length, const char* data);
 void jack_new_symbol(jack_state_t *state, const char* symbol);
 
+// Buffers can also be views of bytes they don't own.  Neither kind is ever
+// copied.
+
+// Wrap memory the caller owns.  `release`, if not NULL, gets it back once
+// the buffer is freed, on whichever thread drops the last reference.
+// [0,+1] Pushes buffer on stack.
+void jack_new_buffer_external(jack_state_t *state, char* data, size_t length, jack_release_t *release, void *userdata);
+// Push a read only slice of `length` bytes from `start` in the buffer at
+// index, which it keeps alive.  It sees later writes to that buffer.
+// Pushes NULL if the range doesn't fit.  Returns true if it did.
+// [0,+1] Pushes slice on stack.
+bool jack_new_slice(jack_state_t *state, int index, int start, int length);
+// Replace the two buffers on top with one holding both.  When nothing else
+// holds the first one it is appended to in place, so a loop appending to a
+// buffer is amortized O(n) overall.
+// [-2,+1] Pops two buffers, pushes the concatenation.
+void jack_buffer_concat(jack_state_t *state);
+// Replace the buffer on top with `count` copies of it end to end.
+// [-1,+1] Pops buffer, pushes the repetition.
+void jack_buffer_repeat(jack_state_t *state, int count);
+
+// These read buffers with the primitives in mem.h, vectorized where the CPU
+// allows.  [0,0] No changes to stack.
+
+// True if both buffers hold the same bytes.
+bool jack_buffer_equal(jack_state_t *state, int a, int b);
+// Order two buffers ignoring ASCII case, a shorter one first when it is a
+// prefix of the other.  Returns <0, 0 or >0.
+int jack_buffer_casecmp(jack_state_t *state, int a, int b);
+// Position of the first `needle` at or after start, or -1.
+int jack_buffer_find(jack_state_t *state, int index, int start, const char *needle, int length);
+int jack_buffer_find_byte(jack_state_t *state, int index, int start, char byte);
+// Hash of the bytes, see jack_mem_hash.
+uint64_t jack_buffer_hash(jack_state_t *state, int index);
 
 // Create a new function wrapping a C function.
 // [-n,+1] Pop partial application values, push a new jack function on the stack.
@@ -35,7 +109,7 @@ int jack_function_call(jack_state_t *state, int index, int argc);
 // [-n,+m] Pop's argc items from stack and pushes retc items on.
 int jack_call(jack_state_t *state, jack_call_t *call, int argc);
 
-// List is a doubly linked list of jack values
+// List is a ring buffer of jack values, O(1) at both ends and by position.
 // All operations work with list at stack[index].
 // If the list if empty when reading, NULL is put on stack.
 
@@ -57,6 +131,15 @@ int jack_list_pop(jack_state_t *state, int index);
 // Move from head of list to top of stack.  Returns new length.
 // [0,+1] Pushes value on stack.
 int jack_list_shift(jack_state_t *state, int index);
+// Push the item at position, negative positions count back from the tail.
+// Pushes NULL if the position is out of range.
+// Returns true if the position was in range.
+// [0,+1] Pushes value on stack.
+bool jack_list_get(jack_state_t *state, int index, int position);
+// Replace the item at position with the top of stack.
+// Returns false (and drops the value) if the position is out of range.
+// [-1,0] Pops value from stack.
+bool jack_list_set(jack_state_t *state, int index, int position);
 // Replaces list at top of stack with forward iterator
 // [-1,+1] Pops list, Pushes iterator function.
 void jack_list_forward(jack_state_t *state);
@@ -68,7 +151,8 @@ void jack_list_backward(jack_state_t *state);
 // Map is an unordered collection of unique keys with associated values.
 // All operations work with map at stack[index] and value at top.
 
-// Create a new empty map with `num_buckets` sized hashtable.
+// Create a new empty map with room for about `num_buckets` entries.
+// The hashtable grows automatically as entries are added.
 // [0,+1] Pushes map on stack
 void jack_new_map(jack_state_t *state, int num_buckets);
 // Read the length of the map quickly.
@@ -110,15 +194,39 @@ void jack_popn(jack_state_t *state, int count);
 // Duplicate value in stack at [index] and push to top of stack.
 // [0,+1] Pushes duplicate on stack.
 void jack_dup(jack_state_t *state, int index);
+// Make sure there is room for `slots` more values so a burst of pushes
+// won't have to grow (and move) the stack.  Returns false if that would
+// overflow JACK_STACK_MAX.
+// [0,0] No changes to stack.
+bool jack_checkstack(jack_state_t *state, int slots);
 
 
 // [-x,0] [0,+x] Move num items from one stack to another. (preserving order)
-void jack_xmove(jack_state_t *from, jack_state_t *to, int num);
+// Between root states with separate heaps (but the same allocator, which
+// then has to be thread safe) the values and everything they hold are
+// handed over without copying.  That only works for lists, maps, buffers,
+// symbols and numbers held by nothing but the moved values themselves, or
+// frozen values, and walks the whole graph to check.  Returns false and
+// moves nothing otherwise.  The calling thread must own both states, a
+// state shared as a mailbox needs a lock.
+bool jack_xmove(jack_state_t *from, jack_state_t *to, int num);
+// Make the value at index, and everything it holds, immutable so several
+// states can share it, each on its own thread.  Changing a frozen list or
+// map, or writing to a frozen buffer, isn't allowed.  Counts on frozen
+// values are atomic and the cycle collector skips them, so cycles that were
+// frozen are never freed.  Returns false, freezing nothing, if a function
+// is reachable from the value.
+// [0,0] No changes to stack.
+bool jack_freeze(jack_state_t *state, int index);
+bool jack_is_frozen(jack_state_t *state, int index);
 
 jack_type_t jack_get_type(jack_state_t *state, int index);
 intptr_t jack_get_integer(jack_state_t *state, int index);
 bool jack_get_boolean(jack_state_t *state, int index);
 const char* jack_get_symbol(jack_state_t *state, int index, int* size);
+// Writable bytes of a buffer, which can't be a slice.
 char* jack_get_buffer(jack_state_t *state, int index, int* size);
+// Bytes of any buffer, slices too.
+const char* jack_get_bytes(jack_state_t *state, int index, int* size);
 
 #endif
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "heap.h"
+
+#define ALIGN 8
+#define NUM_CLASSES (JACK_POOL_LIMIT / ALIGN)
+
+// Freed small objects are threaded through their first word.
+struct chunk {
+  struct chunk *next;
+};
+
+// Slabs are never returned while the heap is alive.  They are chained so the
+// heap can release them all when it is destroyed.
+struct slab {
+  struct slab *next;
+};
+
+struct jack_heap_s {
+  jack_gc_t gc; // Must come first, see jack_heap_gc.
+  jack_alloc_t *alloc;
+  void *userdata;
+  int refs;  // States using the heap
+  int holds; // Heaps holding on to this one, plus one while refs is above 0
+  jack_heap_t **lenders; // Heaps whose memory values here may be living in
+  int lenders_length;
+  int lenders_size;
+  struct chunk *pools[NUM_CLASSES];
+  struct slab *slabs;
+  jack_stats_t stats;
+};
+
+struct jack_arena_block_s {
+  struct jack_arena_block_s *next;
+  size_t size; // Usable bytes in data.
+  size_t used;
+  char data[];
+};
+
+static void* default_alloc(void *userdata, void *ptr, size_t old_size, size_t new_size) {
+  (void)userdata;
+  (void)old_size;
+  if (!new_size) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, new_size);
+}
+
+// All traffic to the underlying allocator goes through here for the stats.
+static void* raw_realloc(jack_heap_t *heap, void *ptr, size_t old_size, size_t new_size) {
+  void *result = heap->alloc(heap->userdata, ptr, old_size, new_size);
+  assert(result || !new_size);
+  if (!ptr) {
+    heap->stats.allocations++;
+    heap->stats.total_allocations++;
+  }
+  else if (!new_size) {
+    heap->stats.allocations--;
+  }
+  heap->stats.bytes += new_size - old_size;
+  if (heap->stats.bytes > heap->stats.peak_bytes) {
+    heap->stats.peak_bytes = heap->stats.bytes;
+  }
+  return result;
+}
+
+jack_heap_t* jack_heap_new(jack_alloc_t *alloc, void *userdata) {
+  if (!alloc) alloc = default_alloc;
+  jack_heap_t *heap = alloc(userdata, NULL, 0, sizeof(*heap));
+  memset(heap, 0, sizeof(*heap));
+  heap->alloc = alloc;
+  heap->userdata = userdata;
+  heap->refs = 1;
+  heap->holds = 1;
+  return heap;
+}
+
+void jack_heap_ref(jack_heap_t *heap) {
+  heap->refs++;
+}
+
+// Holds are dropped from whichever thread lets go last, so they're atomic.
+static void heap_drop(jack_heap_t *heap) {
+  if (__atomic_sub_fetch(&heap->holds, 1, __ATOMIC_ACQ_REL)) return;
+  struct slab *slab = heap->slabs;
+  while (slab) {
+    struct slab *next = slab->next;
+    raw_realloc(heap, slab, JACK_SLAB_SIZE, 0);
+    slab = next;
+  }
+  heap->alloc(heap->userdata, heap, sizeof(*heap), 0);
+}
+
+// Once no state is left, nothing here can point into a lender any more.
+// Values that went on to other heaps made those hold the lenders too.
+void jack_heap_unref(jack_heap_t *heap) {
+  if (--heap->refs) return;
+  jack_gc_array_t *arrays[] = {
+    &heap->gc.roots, &heap->gc.members, &heap->gc.pending, &heap->gc.dying
+  };
+  for (int i = 0; i < 4; ++i) {
+    jack_heap_release(heap, arrays[i]->values, sizeof(*arrays[i]->values) * arrays[i]->size);
+  }
+  for (int i = 0; i < heap->lenders_length; ++i) {
+    heap_drop(heap->lenders[i]);
+  }
+  jack_heap_release(heap, heap->lenders, sizeof(*heap->lenders) * heap->lenders_size);
+  heap_drop(heap);
+}
+
+bool jack_heap_compatible(jack_heap_t *a, jack_heap_t *b) {
+  return a->alloc == b->alloc && a->userdata == b->userdata;
+}
+
+static void hold(jack_heap_t *heap, jack_heap_t *lender) {
+  if (lender == heap) return;
+  for (int i = 0; i < heap->lenders_length; ++i) {
+    if (heap->lenders[i] == lender) return;
+  }
+  if (heap->lenders_length == heap->lenders_size) {
+    int size = heap->lenders_size ? heap->lenders_size * 2 : 4;
+    heap->lenders = jack_heap_realloc(heap, heap->lenders,
+      sizeof(*heap->lenders) * heap->lenders_size, sizeof(*heap->lenders) * size);
+    heap->lenders_size = size;
+  }
+  heap->lenders[heap->lenders_length++] = lender;
+  __atomic_add_fetch(&lender->holds, 1, __ATOMIC_RELAXED);
+}
+
+void jack_heap_lend(jack_heap_t *from, jack_heap_t *to) {
+  hold(to, from);
+  for (int i = 0; i < from->lenders_length; ++i) {
+    hold(to, from->lenders[i]);
+  }
+}
+
+void jack_heap_adopt(jack_heap_t *from, jack_heap_t *to, void *ptr, size_t size) {
+  if (!ptr || (size && size <= JACK_POOL_LIMIT)) return;
+  from->stats.allocations--;
+  from->stats.bytes -= size;
+  to->stats.allocations++;
+  to->stats.bytes += size;
+  if (to->stats.bytes > to->stats.peak_bytes) {
+    to->stats.peak_bytes = to->stats.bytes;
+  }
+}
+
+static int size_class(size_t size) {
+  return (size + ALIGN - 1) / ALIGN - 1;
+}
+
+// Carve a fresh slab into chunks for one size class.
+static void pool_fill(jack_heap_t *heap, int class) {
+  size_t size = (class + 1) * ALIGN;
+  struct slab *slab = raw_realloc(heap, NULL, 0, JACK_SLAB_SIZE);
+  slab->next = heap->slabs;
+  heap->slabs = slab;
+  char *start = (char*)slab + ALIGN;
+  char *end = (char*)slab + JACK_SLAB_SIZE;
+  for (; start + size <= end; start += size) {
+    struct chunk *chunk = (struct chunk*)start;
+    chunk->next = heap->pools[class];
+    heap->pools[class] = chunk;
+  }
+}
+
+void* jack_heap_alloc(jack_heap_t *heap, size_t size) {
+  if (!size || size > JACK_POOL_LIMIT) return raw_realloc(heap, NULL, 0, size);
+  int class = size_class(size);
+  if (heap->pools[class]) heap->stats.pool_hits++;
+  else pool_fill(heap, class);
+  struct chunk *chunk = heap->pools[class];
+  heap->pools[class] = chunk->next;
+  return chunk;
+}
+
+void jack_heap_release(jack_heap_t *heap, void *ptr, size_t size) {
+  if (!ptr) return;
+  heap->stats.released_bytes += size;
+  if (!size || size > JACK_POOL_LIMIT) {
+    raw_realloc(heap, ptr, size, 0);
+    return;
+  }
+  int class = size_class(size);
+  struct chunk *chunk = ptr;
+  chunk->next = heap->pools[class];
+  heap->pools[class] = chunk;
+}
+
+void* jack_heap_realloc(jack_heap_t *heap, void *ptr, size_t old_size, size_t new_size) {
+  if (!ptr) return jack_heap_alloc(heap, new_size);
+  if (old_size > JACK_POOL_LIMIT && new_size > JACK_POOL_LIMIT) {
+    return raw_realloc(heap, ptr, old_size, new_size);
+  }
+  void *result = jack_heap_alloc(heap, new_size);
+  memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+  jack_heap_release(heap, ptr, old_size);
+  return result;
+}
+
+void jack_heap_stats(jack_heap_t *heap, jack_stats_t *stats) {
+  *stats = heap->stats;
+}
+
+void* jack_arena_alloc(jack_heap_t *heap, jack_arena_t *arena, size_t size) {
+  size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+  struct jack_arena_block_s *block = arena->head;
+  if (!block || block->used + size > block->size) {
+    // Start a new block, big enough for oversized requests.
+    size_t capacity = size > JACK_ARENA_SIZE ? size : JACK_ARENA_SIZE;
+    block = raw_realloc(heap, NULL, 0, sizeof(*block) + capacity);
+    block->size = capacity;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+  }
+  void *result = block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+void jack_arena_reset(jack_heap_t *heap, jack_arena_t *arena) {
+  struct jack_arena_block_s *block = arena->head;
+  if (!block) return;
+  // Keep the oldest block, it's the one every arena needs.
+  while (block->next) {
+    struct jack_arena_block_s *next = block->next;
+    raw_realloc(heap, block, sizeof(*block) + block->size, 0);
+    block = next;
+  }
+  block->used = 0;
+  arena->head = block;
+}
+
+void jack_arena_free(jack_heap_t *heap, jack_arena_t *arena) {
+  jack_arena_reset(heap, arena);
+  if (arena->head) {
+    raw_realloc(heap, arena->head, sizeof(*arena->head) + arena->head->size, 0);
+    arena->head = NULL;
+  }
+}
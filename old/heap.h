@@ -0,0 +1,88 @@
+#ifndef JACK_HEAP_H
+#define JACK_HEAP_H
+
+#include "types.h"
+
+// Objects up to this size come from per-size-class free lists, carved out of
+// JACK_SLAB_SIZE blocks.  Everything bigger goes straight to the allocator.
+#ifndef JACK_POOL_LIMIT
+#define JACK_POOL_LIMIT 64
+#endif
+#ifndef JACK_SLAB_SIZE
+#define JACK_SLAB_SIZE 4096
+#endif
+// Size of the blocks the per-state scratch arena bumps through.
+#ifndef JACK_ARENA_SIZE
+#define JACK_ARENA_SIZE 1024
+#endif
+
+// Collections only start on their own once this many possible roots are
+// waiting, see jack_gc_enable.
+#ifndef JACK_GC_THRESHOLD
+#define JACK_GC_THRESHOLD 1000
+#endif
+
+// Values the cycle collector in api.c holds on to between steps.
+typedef struct {
+  jack_value_t **values;
+  int length;
+  int size;
+} jack_gc_array_t;
+
+// Everything the free queue and the cycle collector keep between steps.
+// There is one per heap since values can move between all the states
+// sharing it.
+typedef struct {
+  bool enabled;
+  int budget;              // Work done by jack_pop while roots wait, or 0
+  int phase;
+  int cursor;              // Next entry of roots or members to look at
+  jack_value_t *current;   // Container whose references are being walked
+  int child;               // Next reference of current
+  jack_gc_array_t roots;   // Containers that may be part of garbage cycles
+  jack_gc_array_t members; // Containers the current collection looks at
+  jack_gc_array_t pending; // Members known to be in use, still to walk
+  jack_gc_stats_t stats;
+  jack_gc_array_t dying;   // Dead containers still holding references
+  int free_budget;         // References dropped per free or allocation, or 0
+  bool freeing;            // Inside free_pending, queue instead of draining
+} jack_gc_t;
+
+jack_heap_t* jack_heap_new(jack_alloc_t *alloc, void *userdata);
+// Take and drop references to a heap, one for each state using it.  It is
+// destroyed with the last one, unless other heaps still hold on to it.
+void jack_heap_ref(jack_heap_t *heap);
+void jack_heap_unref(jack_heap_t *heap);
+
+// Values handed from one heap to another stay in the blocks they were given,
+// and are released into the pools of whichever heap frees them.  Blocks can
+// only change hands between heaps sharing an allocator.
+bool jack_heap_compatible(jack_heap_t *a, jack_heap_t *b);
+// Make `to` hold on to `from`, and everything `from` holds on to, until the
+// last state of `to` is gone, so small blocks carved from their slabs stay
+// valid.  This is never undone earlier, a heap that receives from many
+// short lived ones keeps all of their slabs.
+void jack_heap_lend(jack_heap_t *from, jack_heap_t *to);
+// Move the counters of a block handed over from one heap to another.
+void jack_heap_adopt(jack_heap_t *from, jack_heap_t *to, void *ptr, size_t size);
+
+// Allocate and release blocks.  Callers pass the size back when releasing so
+// small objects can be returned to their free list.
+void* jack_heap_alloc(jack_heap_t *heap, size_t size);
+void* jack_heap_realloc(jack_heap_t *heap, void *ptr, size_t old_size, size_t new_size);
+void jack_heap_release(jack_heap_t *heap, void *ptr, size_t size);
+void jack_heap_stats(jack_heap_t *heap, jack_stats_t *stats);
+
+// The collector state is the first thing in a heap, so reaching it on every
+// count that drops costs nothing.
+static inline jack_gc_t* jack_heap_gc(jack_heap_t *heap) {
+  return (jack_gc_t*)heap;
+}
+
+// Bump allocate from an arena.  Everything is released at once by reset
+// (which keeps the first block around for reuse) or free.
+void* jack_arena_alloc(jack_heap_t *heap, jack_arena_t *arena, size_t size);
+void jack_arena_reset(jack_heap_t *heap, jack_arena_t *arena);
+void jack_arena_free(jack_heap_t *heap, jack_arena_t *arena);
+
+#endif
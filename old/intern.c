@@ -1,43 +1,98 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 
+#ifndef JACK_NO_THREADS
+#include <pthread.h>
+#endif
+
 #include "intern.h"
+#include "mem.h"
 
 // bucket for string interning with ref-count
 struct bucket {
   int count;
-  unsigned long hash;
+  uint64_t hash;
   struct bucket *next;
   jack_buffer_t buffer;
 };
 
-static struct bucket* internment[JACK_INTERNMENT_SIZE];
+// Symbols are the one thing states on different threads share, so the table
+// is split into JACK_INTERN_SHARDS shards picked by the top bits of the hash,
+// each behind its own lock.  A shard starts with its part of
+// JACK_INTERNMENT_SIZE buckets (rounded up to a power of two) and doubles
+// whenever it holds more symbols than buckets.
+struct shard {
+#ifndef JACK_NO_THREADS
+  pthread_mutex_t lock;
+#endif
+  struct bucket **buckets;
+  int size;
+  int count;
+};
+
+#ifndef JACK_NO_THREADS
+#define SHARD_INIT {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0}
+#define LOCK(shard) pthread_mutex_lock(&(shard)->lock)
+#define UNLOCK(shard) pthread_mutex_unlock(&(shard)->lock)
+#else
+#define SHARD_INIT {NULL, 0, 0}
+#define LOCK(shard) ((void)0)
+#define UNLOCK(shard) ((void)0)
+#endif
+
+// One initializer for each of the 16 shards.
+#define S4 SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT
+static struct shard internment[JACK_INTERN_SHARDS] = {S4, S4, S4, S4};
+#undef S4
 
-// djb2 with xor modification http://www.cse.yorku.ca/~oz/hash.html
-static unsigned long string_hash(int size, const char* string) {
-  return 0;
-  unsigned long hash = 5381;
-  int i;
-  for (i = 0; i < size; ++i) {
-    // hash * 33 xor c
-    hash = ((hash << 5) + hash) ^ string[i];
+static struct shard* shard_of(uint64_t hash) {
+  return &internment[hash >> (64 - JACK_INTERN_SHARD_BITS)];
+}
+
+static struct bucket* bucket_of(jack_buffer_t *buffer) {
+  return (struct bucket*)((char*)buffer - offsetof(struct bucket, buffer));
+}
+
+// Called with the shard locked.
+static void shard_resize(struct shard *shard, int size) {
+  struct bucket **old = shard->buckets;
+  int i, old_size = shard->size;
+  shard->buckets = calloc(size, sizeof(*shard->buckets));
+  shard->size = size;
+  for (i = 0; i < old_size; ++i) {
+    struct bucket *bucket = old[i];
+    while (bucket) {
+      struct bucket *next = bucket->next;
+      int index = bucket->hash & (size - 1);
+      bucket->next = shard->buckets[index];
+      shard->buckets[index] = bucket;
+      bucket = next;
+    }
   }
-  return hash;
+  free(old);
 }
 
 jack_buffer_t* jack_intern(int len, const char *string) {
-  unsigned long hash = string_hash(len, string);
-  int index = hash % JACK_INTERNMENT_SIZE;
-  struct bucket *bucket = internment[index];
+  uint64_t hash = jack_mem_hash(string, len);
+  struct shard *shard = shard_of(hash);
+  LOCK(shard);
+  if (!shard->buckets) {
+    int size = 1;
+    while (size * JACK_INTERN_SHARDS < JACK_INTERNMENT_SIZE) size <<= 1;
+    shard_resize(shard, size);
+  }
+  int index = hash & (shard->size - 1);
+  struct bucket *bucket = shard->buckets[index];
   while (bucket) {
     if (bucket->hash == hash && bucket->buffer.size == len &&
-      strncmp(string, bucket->buffer.data, len) == 0) {
+      jack_mem_equal(string, bucket->buffer.data, len)) {
       bucket->count++;
+      UNLOCK(shard);
       return &bucket->buffer;
     }
-    if (!bucket->next) break;
     bucket = bucket->next;
   }
   struct bucket *new_bucket = malloc(sizeof(*bucket) + len);
@@ -45,28 +100,33 @@ jack_buffer_t* jack_intern(int len, const char *string) {
   memcpy(new_bucket->buffer.data, string, len);
   new_bucket->buffer.size = len;
   new_bucket->hash = hash;
-  new_bucket->next = NULL;
-  if (bucket) {
-    bucket->next = new_bucket;
-  }
-  else {
-    internment[index] = new_bucket;
+  new_bucket->next = shard->buckets[index];
+  shard->buckets[index] = new_bucket;
+  if (++shard->count > shard->size) {
+    shard_resize(shard, shard->size * 2);
   }
+  UNLOCK(shard);
   return &new_bucket->buffer;
 }
 
 void jack_unintern(jack_buffer_t *buffer) {
-  unsigned long hash = string_hash(buffer->size, buffer->data);
-  int index = hash % JACK_INTERNMENT_SIZE;
-  struct bucket **parent = &(internment[index]);
+  struct bucket *target = bucket_of(buffer);
+  struct shard *shard = shard_of(target->hash);
+  // The count is only touched with the shard locked, another thread could be
+  // finding the symbol again right now.
+  LOCK(shard);
+  if (--target->count) {
+    UNLOCK(shard);
+    return;
+  }
+  struct bucket **parent = &shard->buckets[target->hash & (shard->size - 1)];
   struct bucket *bucket = *parent;
   while (bucket) {
-    if (bucket->hash == hash) {
-      if (!--bucket->count) {
-        struct bucket *next = bucket->next;
-        free(bucket);
-        *parent = next;
-      }
+    if (bucket == target) {
+      *parent = bucket->next;
+      free(bucket);
+      shard->count--;
+      UNLOCK(shard);
       return;
     }
     parent = &bucket->next;
@@ -75,15 +135,24 @@ void jack_unintern(jack_buffer_t *buffer) {
   assert(0); // No such string!
 }
 
+uint64_t jack_symbol_hash(jack_buffer_t *buffer) {
+  return bucket_of(buffer)->hash;
+}
+
 void jack_dump_internment() {
-  int i;
-  for (i = 0; i < JACK_INTERNMENT_SIZE; ++i) {
-    struct bucket *bucket = internment[i];
-    printf("%d: ", i);
-    while (bucket) {
-      printf("%.*s(%d) ", bucket->buffer.size, bucket->buffer.data, bucket->count);
-      bucket = bucket->next;
+  int i, j;
+  for (j = 0; j < JACK_INTERN_SHARDS; ++j) {
+    struct shard *shard = &internment[j];
+    LOCK(shard);
+    for (i = 0; i < shard->size; ++i) {
+      struct bucket *bucket = shard->buckets[i];
+      printf("%d.%d: ", j, i);
+      while (bucket) {
+        printf("%.*s(%d) ", bucket->buffer.size, bucket->buffer.data, bucket->count);
+        bucket = bucket->next;
+      }
+      printf("\n");
     }
-    printf("\n");
+    UNLOCK(shard);
   }
 }
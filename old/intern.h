@@ -3,12 +3,21 @@
 
 #include "types.h"
 
+// Initial number of buckets, the table grows as symbols are added.
 #ifndef JACK_INTERNMENT_SIZE
 #define JACK_INTERNMENT_SIZE 1024
 #endif
 
+// The table is split in 1 << JACK_INTERN_SHARD_BITS shards, each with its own
+// lock, so states running on different threads can intern at the same time.
+// Build with JACK_NO_THREADS to leave the locks out.
+#define JACK_INTERN_SHARD_BITS 4
+#define JACK_INTERN_SHARDS (1 << JACK_INTERN_SHARD_BITS)
+
 jack_buffer_t* jack_intern(int len, const char *string);
 void jack_unintern(jack_buffer_t *buffer);
+// Hash of an interned symbol, computed once when it was first interned.
+uint64_t jack_symbol_hash(jack_buffer_t *buffer);
 void jack_dump_internment();
 
 #endif
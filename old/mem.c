@@ -0,0 +1,393 @@
+#include <string.h>
+#include <assert.h>
+
+#include "mem.h"
+
+#if !defined(JACK_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+// Vector code is built for its instruction set function by function, so the
+// rest of the file still runs on any x86.
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static uint64_t read64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int lower(unsigned char c) {
+  return (unsigned)(c - 'A') < 26 ? c + 32 : c;
+}
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits.
+static uint64_t mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), carry = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  carry += lo < t;
+  return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + carry);
+#endif
+}
+
+// Inputs of at least LONG_HASH bytes are first run through eight 64 bit
+// lanes, a 64 byte stripe at a time, in a way vectors can do several lanes
+// of at once: each lane adds the product of the two halves of its word
+// xored with a key, and its neighbour adds the word itself.  The lanes get
+// scrambled after every STRIPES stripes so no bits pile up, and are folded
+// into the hash before the rest goes through the short path.
+#define LONG_HASH 256
+#define STRIPE 64
+#define STRIPES 16
+
+static const uint64_t keys[8] = {
+  0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, 0xc2b2ae3d27d4eb4full,
+  0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull, 0x85ebca77c2b2ae63ull, 0xff51afd7ed558ccdull,
+};
+
+static void scramble(uint64_t acc[8]) {
+  for (int i = 0; i < 8; ++i) {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= keys[7 - i];
+    acc[i] *= 0x9e3779b1;
+  }
+}
+
+static bool scalar_equal(const char *a, const char *b, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    if (read64(a + i) != read64(b + i)) return false;
+  }
+  for (; i < size; ++i) {
+    if (a[i] != b[i]) return false;
+  }
+  return true;
+}
+
+static int scalar_casecmp(const char *a, const char *b, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    int x = lower(a[i]), y = lower(b[i]);
+    if (x != y) return x - y;
+  }
+  return 0;
+}
+
+// Eight bytes at a time: a byte of x is zero where the word matched, and
+// (x - ones) & ~x has the high bit set in the first such byte.
+static const char* scalar_chr(const char *data, size_t size, char byte) {
+  const uint64_t ones = 0x0101010101010101ull, highs = ones << 7;
+  uint64_t pattern = ones * (unsigned char)byte;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t x = read64(data + i) ^ pattern;
+    if ((x - ones) & ~x & highs) break;
+  }
+  for (; i < size; ++i) {
+    if (data[i] == byte) return data + i;
+  }
+  return NULL;
+}
+
+// Needles of at least two bytes, no longer than data.
+static const char* scalar_find(const char *data, size_t size, const char *needle, size_t length) {
+  const char *end = data + size - length + 1, *p = data;
+  while ((p = scalar_chr(p, end - p, needle[0]))) {
+    if (scalar_equal(p + 1, needle + 1, length - 1)) return p;
+    p++;
+  }
+  return NULL;
+}
+
+static void scalar_stripes(uint64_t acc[8], const char *data, size_t stripes) {
+  for (; stripes; --stripes, data += STRIPE) {
+    for (int i = 0; i < 8; ++i) {
+      uint64_t value = read64(data + i * 8), key = value ^ keys[i];
+      acc[i ^ 1] += value;
+      acc[i] += (key & 0xffffffff) * (key >> 32);
+    }
+  }
+}
+
+// Copy the first piece, then everything so far, doubling each time.  The
+// copies are memcpy's, already vectorized, and beat storing the piece from a
+// register over and over at every size tried, so every level uses this.
+static void repeat(char *dest, const char *data, size_t size, size_t count) {
+  size_t done = size, total = size * count;
+  memcpy(dest, data, size);
+  while (done < total) {
+    size_t step = done < total - done ? done : total - done;
+    memcpy(dest + done, dest, step);
+    done += step;
+  }
+}
+
+#ifdef SIMD_X86
+
+#define LOAD128(p) _mm_loadu_si128((const __m128i*)(p))
+#define LOAD256(p) _mm256_loadu_si256((const __m256i*)(p))
+
+TARGET("sse2") static bool sse2_equal(const char *a, const char *b, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(a + i), LOAD128(b + i))) != 0xffff) return false;
+  }
+  return scalar_equal(a + i, b + i, size - i);
+}
+
+// ASCII letters to lower case: signed compares leave bytes above 127 alone.
+TARGET("sse2") static inline __m128i sse2_lower(__m128i x) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), x));
+  return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+TARGET("sse2") static int sse2_casecmp(const char *a, const char *b, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i same = _mm_cmpeq_epi8(sse2_lower(LOAD128(a + i)), sse2_lower(LOAD128(b + i)));
+    int mask = _mm_movemask_epi8(same) ^ 0xffff;
+    if (mask) {
+      i += __builtin_ctz(mask);
+      return lower(a[i]) - lower(b[i]);
+    }
+  }
+  return scalar_casecmp(a + i, b + i, size - i);
+}
+
+TARGET("sse2") static const char* sse2_chr(const char *data, size_t size, char byte) {
+  __m128i pattern = _mm_set1_epi8(byte);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(data + i), pattern));
+    if (mask) return data + i + __builtin_ctz(mask);
+  }
+  return scalar_chr(data + i, size - i, byte);
+}
+
+// Compare the first and last byte of the needle with 16 places at once, and
+// only check the middle where both match.
+TARGET("sse2") static const char* sse2_find(const char *data, size_t size, const char *needle, size_t length) {
+  __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[length - 1]);
+  size_t i = 0;
+  for (; i + length + 15 <= size; i += 16) {
+    __m128i starts = _mm_cmpeq_epi8(first, LOAD128(data + i));
+    __m128i ends = _mm_cmpeq_epi8(last, LOAD128(data + i + length - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(starts, ends));
+    for (; mask; mask &= mask - 1) {
+      const char *p = data + i + __builtin_ctz(mask);
+      if (sse2_equal(p + 1, needle + 1, length - 2)) return p;
+    }
+  }
+  return size - i < length ? NULL : scalar_find(data + i, size - i, needle, length);
+}
+
+// _mm_mul_epu32 multiplies the low halves of each 64 bit lane, so the key is
+// shuffled to line its high halves up with them.
+TARGET("sse2") static void sse2_stripes(uint64_t acc[8], const char *data, size_t stripes) {
+  __m128i sums[4], secret[4];
+  for (int i = 0; i < 4; ++i) {
+    sums[i] = LOAD128(acc + i * 2);
+    secret[i] = LOAD128(keys + i * 2);
+  }
+  for (; stripes; --stripes, data += STRIPE) {
+    for (int i = 0; i < 4; ++i) {
+      __m128i value = LOAD128(data + i * 16);
+      __m128i key = _mm_xor_si128(value, secret[i]);
+      __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+      sums[i] = _mm_add_epi64(sums[i], _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+      sums[i] = _mm_add_epi64(sums[i], product);
+    }
+  }
+  for (int i = 0; i < 4; ++i) _mm_storeu_si128((__m128i*)(acc + i * 2), sums[i]);
+}
+
+// GCC can turn a call at the end of an AVX2 function into a jump without
+// clearing the upper halves of the ymm registers, and SSE code run after
+// that pays for it on every instruction.  The AVX2 versions clear them
+// before falling back.
+TARGET("avx2") static bool avx2_equal(const char *a, const char *b, size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(a + i), LOAD256(b + i))) != 0xffffffff) return false;
+  }
+  _mm256_zeroupper();
+  return sse2_equal(a + i, b + i, size - i);
+}
+
+TARGET("avx2") static inline __m256i avx2_lower(__m256i x) {
+  __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+                                   _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+  return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+TARGET("avx2") static int avx2_casecmp(const char *a, const char *b, size_t size) {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i same = _mm256_cmpeq_epi8(avx2_lower(LOAD256(a + i)), avx2_lower(LOAD256(b + i)));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(same);
+    if (mask) {
+      i += __builtin_ctz(mask);
+      return lower(a[i]) - lower(b[i]);
+    }
+  }
+  _mm256_zeroupper();
+  return sse2_casecmp(a + i, b + i, size - i);
+}
+
+TARGET("avx2") static const char* avx2_chr(const char *data, size_t size, char byte) {
+  __m256i pattern = _mm256_set1_epi8(byte);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(data + i), pattern));
+    if (mask) return data + i + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return sse2_chr(data + i, size - i, byte);
+}
+
+TARGET("avx2") static const char* avx2_find(const char *data, size_t size, const char *needle, size_t length) {
+  __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[length - 1]);
+  size_t i = 0;
+  for (; i + length + 31 <= size; i += 32) {
+    __m256i starts = _mm256_cmpeq_epi8(first, LOAD256(data + i));
+    __m256i ends = _mm256_cmpeq_epi8(last, LOAD256(data + i + length - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(starts, ends));
+    for (; mask; mask &= mask - 1) {
+      const char *p = data + i + __builtin_ctz(mask);
+      if (avx2_equal(p + 1, needle + 1, length - 2)) return p;
+    }
+  }
+  _mm256_zeroupper();
+  return size - i < length ? NULL : sse2_find(data + i, size - i, needle, length);
+}
+
+// Same as sse2_stripes, _mm256_shuffle_epi32 works on each 128 bit half.
+TARGET("avx2") static void avx2_stripes(uint64_t acc[8], const char *data, size_t stripes) {
+  __m256i sums[2], secret[2];
+  for (int i = 0; i < 2; ++i) {
+    sums[i] = LOAD256(acc + i * 4);
+    secret[i] = LOAD256(keys + i * 4);
+  }
+  for (; stripes; --stripes, data += STRIPE) {
+    for (int i = 0; i < 2; ++i) {
+      __m256i value = LOAD256(data + i * 32);
+      __m256i key = _mm256_xor_si256(value, secret[i]);
+      __m256i product = _mm256_mul_epu32(key, _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+      sums[i] = _mm256_add_epi64(sums[i], _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+      sums[i] = _mm256_add_epi64(sums[i], product);
+    }
+  }
+  for (int i = 0; i < 2; ++i) _mm256_storeu_si256((__m256i*)(acc + i * 4), sums[i]);
+}
+
+#endif
+
+struct ops {
+  jack_mem_level_t level;
+  bool (*equal)(const char *a, const char *b, size_t size);
+  int (*casecmp)(const char *a, const char *b, size_t size);
+  const char* (*chr)(const char *data, size_t size, char byte);
+  const char* (*find)(const char *data, size_t size, const char *needle, size_t length);
+  void (*stripes)(uint64_t acc[8], const char *data, size_t stripes);
+};
+
+static const struct ops levels[] = {
+  {JACK_MEM_SCALAR, scalar_equal, scalar_casecmp, scalar_chr, scalar_find, scalar_stripes},
+#ifdef SIMD_X86
+  {JACK_MEM_SSE2, sse2_equal, sse2_casecmp, sse2_chr, sse2_find, sse2_stripes},
+  {JACK_MEM_AVX2, avx2_equal, avx2_casecmp, avx2_chr, avx2_find, avx2_stripes},
+#endif
+};
+
+// Picked on first use.  Every level gives the same answers, so a thread
+// seeing another one for a moment does no harm.
+static const struct ops *ops;
+
+static jack_mem_level_t supported(void) {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return JACK_MEM_AVX2;
+  if (__builtin_cpu_supports("sse2")) return JACK_MEM_SSE2;
+#endif
+  return JACK_MEM_SCALAR;
+}
+
+jack_mem_level_t jack_mem_use(jack_mem_level_t level) {
+  jack_mem_level_t best = supported();
+  if (level > best) level = best;
+  __atomic_store_n(&ops, &levels[level], __ATOMIC_RELEASE);
+  return level;
+}
+
+static const struct ops* current(void) {
+  const struct ops *use = __atomic_load_n(&ops, __ATOMIC_ACQUIRE);
+  return use ? use : &levels[jack_mem_use(JACK_MEM_AVX2)];
+}
+
+jack_mem_level_t jack_mem_level(void) {
+  return current()->level;
+}
+
+// Most symbols are shorter than a vector, and not worth the indirect call.
+bool jack_mem_equal(const char *a, const char *b, size_t size) {
+  return size < 16 ? scalar_equal(a, b, size) : current()->equal(a, b, size);
+}
+
+int jack_mem_casecmp(const char *a, const char *b, size_t size) {
+  return current()->casecmp(a, b, size);
+}
+
+const char* jack_mem_chr(const char *data, size_t size, char byte) {
+  return current()->chr(data, size, byte);
+}
+
+const char* jack_mem_find(const char *data, size_t size, const char *needle, size_t length) {
+  if (!length) return data;
+  if (length > size) return NULL;
+  if (length == 1) return jack_mem_chr(data, size, needle[0]);
+  return current()->find(data, size, needle, length);
+}
+
+// Short inputs get a wyhash style hash: mix 16 bytes per round with one
+// wide multiply.  Constants are wyhash's default secret.
+uint64_t jack_mem_hash(const char *data, size_t size) {
+  const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull;
+  const uint64_t s2 = 0x8ebc6af09c88c6e3ull, s3 = 0x589965cc75374cc3ull;
+  uint64_t hash = s0 ^ (uint64_t)size;
+  size_t i = 0;
+  if (size >= LONG_HASH) {
+    const struct ops *use = current();
+    uint64_t acc[8];
+    memcpy(acc, keys, sizeof(acc));
+    for (size_t left = size / STRIPE; left;) {
+      size_t stripes = left < STRIPES ? left : STRIPES;
+      use->stripes(acc, data + i, stripes);
+      i += stripes * STRIPE;
+      left -= stripes;
+      if (stripes == STRIPES) scramble(acc);
+    }
+    for (int lane = 0; lane < 8; lane += 2) {
+      hash = mum(acc[lane] ^ s1, acc[lane + 1] ^ hash);
+    }
+  }
+  for (; i + 16 <= size; i += 16) {
+    hash = mum(read64(data + i) ^ s1, read64(data + i + 8) ^ hash);
+  }
+  if (i + 8 <= size) {
+    hash = mum(read64(data + i) ^ s1, hash ^ s2);
+    i += 8;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, size - i);
+  return mum(mum(tail ^ s2, hash ^ s3), s1 ^ (uint64_t)size);
+}
+
+void jack_mem_repeat(char *dest, const char *data, size_t size, size_t count) {
+  if (size && count) repeat(dest, data, size, count);
+}
@@ -0,0 +1,40 @@
+#ifndef JACK_MEM_H
+#define JACK_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Byte string primitives behind buffers and the interner.  Each comes in a
+// portable version and, on x86, SSE2 and AVX2 versions picked on first use
+// by what the CPU supports.  Build with JACK_NO_SIMD to leave those out.
+// All levels give the same results, hashes included, so switching between
+// them never invalidates a table.
+
+typedef enum {
+  JACK_MEM_SCALAR,
+  JACK_MEM_SSE2,
+  JACK_MEM_AVX2,
+} jack_mem_level_t;
+
+// Use the best level up to `level` the CPU supports, and return it.  Meant
+// for benchmarks and tests, the default is the best there is.
+jack_mem_level_t jack_mem_use(jack_mem_level_t level);
+jack_mem_level_t jack_mem_level(void);
+
+bool jack_mem_equal(const char *a, const char *b, size_t size);
+// Compare with ASCII letters folded to lower case.  Returns <0, 0 or >0 like
+// memcmp does.
+int jack_mem_casecmp(const char *a, const char *b, size_t size);
+// First `byte` in data, or NULL.
+const char* jack_mem_chr(const char *data, size_t size, char byte);
+// First place `needle` starts in data, or NULL.  An empty needle is found
+// right at the start.
+const char* jack_mem_find(const char *data, size_t size, const char *needle, size_t length);
+// 64 bit hash, the same on every run and every level.
+uint64_t jack_mem_hash(const char *data, size_t size);
+// Fill dest with `count` copies of the `size` bytes at data.  They can't
+// overlap.  This one is memcpy at every level.
+void jack_mem_repeat(char *dest, const char *data, size_t size, size_t count);
+
+#endif
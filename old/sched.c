@@ -0,0 +1,239 @@
+// pthreads and sysconf are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sched.h"
+
+struct task {
+  jack_state_t *state;
+  jack_task_t *run;
+  void *userdata;
+};
+
+// Every worker has a ring of tasks behind its own lock.  The owner takes the
+// newest from the tail, while its state is still in cache.  Thieves take the
+// oldest from the head, and tasks that yielded go back on the head so the
+// owner gets to everything else first.  Capacity is zero or a power of two.
+struct worker {
+  pthread_mutex_t lock;
+  struct task *tasks;
+  int head;
+  int length;
+  int capacity;
+  jack_sched_t *sched;
+  pthread_t thread;
+  uint64_t seed; // Picks where stealing starts
+  jack_sched_stats_t stats;
+};
+
+// queued, pending, sleeping and next are only touched with atomics.  Workers
+// go to sleep on wake with lock held after checking queued, and spawns check
+// sleeping after raising queued, so no wakeup gets lost between the two.
+struct jack_sched_s {
+  struct worker *workers;
+  int count;
+  int next;     // Worker the next spawn from outside goes to
+  int queued;   // Tasks sitting in a ring
+  int pending;  // Tasks spawned and not done yet
+  int sleeping; // Workers waiting on wake
+  bool stopping;
+  pthread_key_t self; // Worker running on the current thread, if any
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+};
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ADD(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_SEQ_CST)
+// Counters only their worker writes, but stats may read at any time.
+#define COUNT(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+
+static void push(struct worker *worker, struct task task, bool tail) {
+  pthread_mutex_lock(&worker->lock);
+  if (worker->length == worker->capacity) {
+    int capacity = worker->capacity ? worker->capacity * 2 : 16;
+    struct task *tasks = malloc(sizeof(*tasks) * capacity);
+    for (int i = 0; i < worker->length; ++i) {
+      tasks[i] = worker->tasks[(worker->head + i) & (worker->capacity - 1)];
+    }
+    free(worker->tasks);
+    worker->tasks = tasks;
+    worker->capacity = capacity;
+    worker->head = 0;
+  }
+  int mask = worker->capacity - 1;
+  if (tail) {
+    worker->tasks[(worker->head + worker->length) & mask] = task;
+  }
+  else {
+    worker->head = (worker->head - 1) & mask;
+    worker->tasks[worker->head] = task;
+  }
+  worker->length++;
+  pthread_mutex_unlock(&worker->lock);
+}
+
+static bool take(struct worker *worker, struct task *task, bool tail) {
+  pthread_mutex_lock(&worker->lock);
+  bool found = worker->length > 0;
+  if (found) {
+    int mask = worker->capacity - 1;
+    worker->length--;
+    if (tail) {
+      *task = worker->tasks[(worker->head + worker->length) & mask];
+    }
+    else {
+      *task = worker->tasks[worker->head];
+      worker->head = (worker->head + 1) & mask;
+    }
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return found;
+}
+
+// Look through the other workers, starting at a random one.
+static bool steal(struct worker *self, struct task *task) {
+  jack_sched_t *sched = self->sched;
+  self->seed ^= self->seed << 13;
+  self->seed ^= self->seed >> 7;
+  self->seed ^= self->seed << 17;
+  int start = self->seed % sched->count;
+  for (int i = 0; i < sched->count; ++i) {
+    struct worker *victim = &sched->workers[(start + i) % sched->count];
+    if (victim != self && take(victim, task, false)) {
+      COUNT(self->stats.steals);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called after a task was put in a ring.
+static void announce(jack_sched_t *sched) {
+  ADD(sched->queued, 1);
+  if (LOAD(sched->sleeping)) {
+    pthread_mutex_lock(&sched->lock);
+    pthread_cond_signal(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+  }
+}
+
+static void* work(void *data) {
+  struct worker *self = data;
+  jack_sched_t *sched = self->sched;
+  pthread_setspecific(sched->self, self);
+  struct task task;
+  for (;;) {
+    if (take(self, &task, true) || steal(self, &task)) {
+      ADD(sched->queued, -1);
+      COUNT(self->stats.runs);
+      if (task.run(task.state, task.userdata)) {
+        push(self, task, false);
+        announce(sched);
+      }
+      else if (!ADD(sched->pending, -1)) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_broadcast(&sched->done);
+        pthread_mutex_unlock(&sched->lock);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&sched->lock);
+    ADD(sched->sleeping, 1);
+    // queued can dip below zero for a moment when a task is taken before
+    // its spawn got to announce it.
+    while (LOAD(sched->queued) <= 0 && !sched->stopping) {
+      COUNT(self->stats.sleeps);
+      pthread_cond_wait(&sched->wake, &sched->lock);
+    }
+    ADD(sched->sleeping, -1);
+    bool stopping = sched->stopping;
+    pthread_mutex_unlock(&sched->lock);
+    if (stopping) return NULL;
+  }
+}
+
+jack_sched_t* jack_sched_new(int workers) {
+  if (workers <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? cpus : 1;
+  }
+  jack_sched_t *sched = calloc(1, sizeof(*sched));
+  sched->workers = calloc(workers, sizeof(*sched->workers));
+  sched->count = workers;
+  pthread_key_create(&sched->self, NULL);
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->wake, NULL);
+  pthread_cond_init(&sched->done, NULL);
+  for (int i = 0; i < workers; ++i) {
+    struct worker *worker = &sched->workers[i];
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->sched = sched;
+    worker->seed = 0x9e3779b97f4a7c15ull * (i + 1);
+  }
+  for (int i = 0; i < workers; ++i) {
+    int error = pthread_create(&sched->workers[i].thread, NULL, work, &sched->workers[i]);
+    assert(!error);
+    (void)error;
+  }
+  return sched;
+}
+
+void jack_sched_spawn(jack_sched_t *sched, jack_state_t *state, jack_task_t *task, void *userdata) {
+  ADD(sched->pending, 1);
+  struct worker *worker = pthread_getspecific(sched->self);
+  if (!worker) {
+    worker = &sched->workers[(unsigned)(ADD(sched->next, 1) - 1) % sched->count];
+  }
+  push(worker, (struct task){state, task, userdata}, true);
+  announce(sched);
+}
+
+void jack_sched_wait(jack_sched_t *sched) {
+  pthread_mutex_lock(&sched->lock);
+  while (LOAD(sched->pending)) {
+    pthread_cond_wait(&sched->done, &sched->lock);
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void jack_sched_free(jack_sched_t *sched) {
+  jack_sched_wait(sched);
+  pthread_mutex_lock(&sched->lock);
+  sched->stopping = true;
+  pthread_cond_broadcast(&sched->wake);
+  pthread_mutex_unlock(&sched->lock);
+  // Workers still running may be looking in the rings of finished ones.
+  for (int i = 0; i < sched->count; ++i) {
+    pthread_join(sched->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < sched->count; ++i) {
+    pthread_mutex_destroy(&sched->workers[i].lock);
+    free(sched->workers[i].tasks);
+  }
+  pthread_cond_destroy(&sched->done);
+  pthread_cond_destroy(&sched->wake);
+  pthread_mutex_destroy(&sched->lock);
+  pthread_key_delete(sched->self);
+  free(sched->workers);
+  free(sched);
+}
+
+int jack_sched_workers(jack_sched_t *sched) {
+  return sched->count;
+}
+
+void jack_sched_stats(jack_sched_t *sched, jack_sched_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < sched->count; ++i) {
+    jack_sched_stats_t *counts = &sched->workers[i].stats;
+    stats->runs += __atomic_load_n(&counts->runs, __ATOMIC_RELAXED);
+    stats->steals += __atomic_load_n(&counts->steals, __ATOMIC_RELAXED);
+    stats->sleeps += __atomic_load_n(&counts->sleeps, __ATOMIC_RELAXED);
+  }
+}
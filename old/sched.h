@@ -0,0 +1,39 @@
+#ifndef JACK_SCHED_H
+#define JACK_SCHED_H
+
+#include "types.h"
+
+// Runs tasks on a pool of worker threads.  Every task is bound to a root
+// state (see the ownership rules in api.h): the scheduler hands the state to
+// one worker at a time, so nothing in its heap needs atomic counts.  Idle
+// workers steal from busy ones.
+
+// One step of a task.  Return true to be run again later, like a coroutine
+// yielding, or false when done.  The state is the caller's again once the
+// task is done.
+typedef bool (jack_task_t)(jack_state_t *state, void *userdata);
+
+typedef struct jack_sched_s jack_sched_t;
+
+typedef struct {
+  size_t runs;   // Task steps run
+  size_t steals; // Tasks taken from another worker's queue
+  size_t sleeps; // Times a worker found nothing to do and waited
+} jack_sched_stats_t;
+
+// Start `workers` threads, or one per online CPU when 0.
+jack_sched_t* jack_sched_new(int workers);
+// Queue a task.  From inside a task it goes on the current worker's queue,
+// otherwise they are dealt out in turn.  A state must not have more than one
+// task queued or running at once.
+void jack_sched_spawn(jack_sched_t *sched, jack_state_t *state, jack_task_t *task, void *userdata);
+// Block until every task spawned so far is done.
+void jack_sched_wait(jack_sched_t *sched);
+// Wait for the tasks, then stop the workers.
+void jack_sched_free(jack_sched_t *sched);
+int jack_sched_workers(jack_sched_t *sched);
+// Totals over all workers.  Runs and steals are exact once jack_sched_wait
+// returns.
+void jack_sched_stats(jack_sched_t *sched, jack_sched_stats_t *stats);
+
+#endif
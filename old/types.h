@@ -13,16 +13,48 @@
 struct jack_value_s;
 struct jack_stack_s;
 
-typedef struct jack_malloc_node_s {
-  struct jack_malloc_node_s *next;
-  char data[];
-} jack_malloc_node_t;
+// Allocator hook.  Called with ptr NULL to allocate, new_size 0 to free and
+// both set to resize.  old_size is always the size the block was given.
+typedef void* (jack_alloc_t)(void *userdata, void *ptr, size_t old_size, size_t new_size);
+
+// Counters for everything a heap has taken from its allocator.
+typedef struct {
+  size_t allocations;       // Blocks currently held
+  size_t bytes;             // Bytes currently held
+  size_t peak_bytes;        // Most bytes held at once
+  size_t total_allocations; // Calls that returned a new block
+  size_t pool_hits;         // Small objects reused from a free list
+  size_t released_bytes;    // Total handed back with jack_heap_release
+} jack_stats_t;
+
+// Counters kept by the cycle collector, see jack_gc_step.
+typedef struct {
+  size_t collections;     // Collections finished
+  size_t steps;           // Calls that did collector work
+  size_t roots_scanned;   // Possible roots taken from the buffer
+  size_t objects_visited; // Containers looked at by a collection
+  size_t objects_freed;   // Containers found to be garbage
+  size_t bytes_reclaimed; // Released while tearing the garbage down
+  size_t roots;           // Possible roots waiting for the next collection
+} jack_gc_stats_t;
+
+// Shared by a state and every function state created from it.
+typedef struct jack_heap_s jack_heap_t;
+
+// Scratch memory handed out by jack_malloc.
+typedef struct {
+  struct jack_arena_block_s *head;
+} jack_arena_t;
 
+// Native calls made with jack_call get a state that is a window on the
+// caller's stack.  Slot 0 is stack->values[base] and everything at or above
+// base belongs to the call.
 typedef struct {
   void* data;
-  jack_malloc_node_t *head;
-  jack_malloc_node_t *tail;
+  jack_heap_t *heap;
+  jack_arena_t arena;
   struct jack_stack_s *stack;
+  int base;
 } jack_state_t;
 
 typedef int (jack_call_t)(jack_state_t *state);
@@ -38,39 +70,59 @@ typedef enum {
   Function,
 } jack_type_t;
 
-// Nodes in the doubly linked list
-typedef struct jack_node_s {
-  struct jack_value_s *value;
-  struct jack_node_s *prev;
-  struct jack_node_s *next;
-} jack_node_t;
-
-// The list container
+// The list container is a growable ring buffer of value pointers.  Item i
+// lives at items[(head + i) & (capacity - 1)], so both ends are O(1) and
+// indexing is direct.  Capacity is zero or a power of two.
 typedef struct {
   int length;
-  jack_node_t *head;
-  jack_node_t *tail;
+  int capacity;
+  int head;
+  struct jack_value_s **items;
 } jack_list_t;
 
-// Pairs in the singly-linked lists in the hastable buckets.
-typedef struct jack_pair_s {
+// Pairs are stored inline in the hash table.  A NULL key marks an empty slot.
+// The full hash is kept so resizing and probing never rehash keys.
+typedef struct {
   struct jack_value_s *key;
   struct jack_value_s *value;
-  struct jack_pair_s *next;
+  uint64_t hash;
 } jack_pair_t;
 
-// Map container as a hash table of pair chains.
+// Map container as an open addressing hash table with robin hood probing.
+// Capacity is always a power of two and the table doubles when it gets
+// three quarters full.  Deleting shifts the following pairs back instead of
+// leaving tombstones.
 typedef struct {
   int length;
-  int num_buckets;
-  jack_pair_t* buckets[];
+  int capacity;
+  int shift; // 64 - log2(capacity), the home slot of a hash is hash >> shift
+  jack_pair_t* pairs;
 } jack_map_t;
 
+// Interned symbol data, see intern.h.
 typedef struct {
   int size;
   char data[];
 } jack_buffer_t;
 
+// Gives the memory of an external buffer back once the buffer is freed.
+typedef void (jack_release_t)(void *userdata, char *data, size_t size);
+
+// Bytes of a buffer value.  Most own their data, `capacity` bytes right
+// after the header, so appending has room to grow.  A slice points into the
+// data of another buffer and holds a reference to it, and an external
+// buffer points at memory that `release` hands back.  Neither owns data,
+// their capacity is 0.
+typedef struct {
+  int size;
+  int capacity;
+  char *data;
+  struct jack_value_s *parent; // Slices only
+  jack_release_t *release;     // External buffers only, may be NULL
+  void *userdata;
+  char bytes[];
+} jack_bytes_t;
+
 typedef struct {
   jack_call_t* call;
   jack_state_t* state;
@@ -84,16 +136,41 @@ typedef struct jack_value_s {
     jack_type_t type;
     int ref_count;
   };
+  // Bookkeeping for the cycle collector, only used by containers.  It fits
+  // in what would otherwise be padding.
+  uint32_t gc;
   union {
     bool boolean;
     intptr_t integer;
     jack_buffer_t *buffer;
+    jack_bytes_t *bytes;
     jack_list_t *list;
     jack_map_t *map;
     jack_function_t *function;
   };
 } jack_value_t;
 
+// Integers and booleans are not boxed.  They're stored directly in the value
+// pointer with one of the low two bits set, which malloc'd pointers never
+// have.  Integers too large for the remaining bits fall back to a box.
+//   ...xxxx1  Integer, shift right one bit to get the value.
+//   ...00010  false
+//   ...00110  true
+#define JACK_IMMEDIATE_MASK 3
+#define JACK_FALSE ((jack_value_t*)2)
+#define JACK_TRUE  ((jack_value_t*)6)
+
+// Stacks grow on demand, so the stack pointer of a state can change on any
+// push.  Growing past JACK_STACK_MAX slots is a stack overflow.  Stacks
+// longer than JACK_STACK_SHRINK slots are halved again when a call returns
+// with less than a quarter of them in use.
+#ifndef JACK_STACK_MAX
+#define JACK_STACK_MAX (1 << 20)
+#endif
+#ifndef JACK_STACK_SHRINK
+#define JACK_STACK_SHRINK 1024
+#endif
+
 typedef struct jack_stack_s {
   int length; // Total number of slots in the stack.
   int top;    // Number of used slots / index to first empty slot.
@@ -0,0 +1,185 @@
+// sigaction and setitimer are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "profile.h"
+
+// Only jack-profile has an interpreter that publishes where it is, and the
+// pointer to its VM this needs lives in vm.c.
+#ifdef JACK_PROFILE
+
+// A bounded queue after Dmitry Vyukov's: every slot has a sequence number
+// that says whose turn it is.  A slot at position p is free for the writer
+// that claims p when its sequence is p, and holds that writer's sample once
+// it is p + 1.  Writers claim positions with a CAS on head, only the dump
+// moves tail, so neither the interpreters nor the dump ever wait.  Slots
+// keep their sequence less their own index, so a new ring is all zeros and
+// calloc's pages are only touched once samples land in them.
+typedef struct {
+  uint64_t sequence;
+  uint32_t weight;
+  uint32_t depth;
+  const jack_proto_t* protos[JACK_PROFILE_DEPTH];
+  uint32_t pcs[JACK_PROFILE_DEPTH]; // Instruction index in each proto
+} sample_t;
+
+static sample_t* ring;
+static uint64_t head;
+static uint64_t tail;
+static uint64_t recorded;
+static uint64_t dropped;
+static struct sigaction saved;
+
+static inline uint64_t sequence(const sample_t* sample) {
+  return __atomic_load_n(&sample->sequence, __ATOMIC_ACQUIRE) + (uint64_t)(sample - ring);
+}
+
+static inline void set_sequence(sample_t* sample, uint64_t sequence) {
+  __atomic_store_n(&sample->sequence, sequence - (uint64_t)(sample - ring), __ATOMIC_RELEASE);
+}
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define BUMP(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+
+
+// The SIGPROF handler.  Ticks outside the interpreter, or while it is
+// between frames, aren't recorded.
+static void tick(int signal) {
+  (void)signal;
+  const jack_vm_t* vm = jack_profile_vm;
+  const jack_proto_t* proto = vm ? vm->running : NULL;
+  if (!proto || !LOAD(ring)) return;
+  uint64_t position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  sample_t* sample;
+  for (;;) {
+    sample = &ring[position & (JACK_PROFILE_SAMPLES - 1)];
+    int64_t turn = (int64_t)(sequence(sample) - position);
+    if (turn < 0) {
+      BUMP(dropped, 1);
+      return;
+    }
+    if (!turn && __atomic_compare_exchange_n(&head, &position, position + 1, false,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+    if (turn) position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  }
+  // Innermost first.  The published instruction can be a step behind or
+  // ahead of the prototype, and is only trusted inside it.  Callers' pc
+  // points past the CALL they are in.
+  const uint32_t* pc = vm->at;
+  int depth = 0;
+  sample->protos[depth] = proto;
+  sample->pcs[depth++] = pc >= proto->code && pc < proto->code + proto->ncode ?
+                         pc - proto->code : 0;
+  for (int i = vm->depth - 1; i >= 0 && depth < JACK_PROFILE_DEPTH; i--) {
+    const jack_frame_t* frame = &vm->frames[i];
+    sample->protos[depth] = frame->proto;
+    sample->pcs[depth++] = frame->pc - frame->proto->code - 1;
+  }
+  sample->depth = depth;
+  sample->weight = 1;
+  BUMP(recorded, 1);
+  set_sequence(sample, position + 1);
+}
+
+bool jack_profile_start(int hz) {
+  if (ring || hz <= 0 || hz > 1000000) return false;
+  ring = calloc(JACK_PROFILE_SAMPLES, sizeof(*ring));
+  if (!ring) return false;
+  head = tail = recorded = dropped = 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = tick;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  struct itimerval timer = {{0, 1000000 / hz}, {0, 1000000 / hz}};
+  if (sigaction(SIGPROF, &action, &saved) || setitimer(ITIMER_PROF, &timer, NULL)) {
+    free(ring);
+    ring = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Samples already in the ring stay there for the dump.
+void jack_profile_stop(void) {
+  struct itimerval timer = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  sigaction(SIGPROF, &saved, NULL);
+}
+
+static void append(char** line, size_t* length, size_t* size, const char* text, size_t n) {
+  if (*length + n + 1 > *size) {
+    *size = (*length + n + 1) * 2;
+    *line = realloc(*line, *size);
+  }
+  memcpy(*line + *length, text, n);
+  *length += n;
+  (*line)[*length] = 0;
+}
+
+typedef struct {
+  char* stack;
+  uint64_t weight;
+} entry_t;
+
+static int by_stack(const void* a, const void* b) {
+  return strcmp(((const entry_t*)a)->stack, ((const entry_t*)b)->stack);
+}
+
+void jack_profile_dump(FILE* out, bool lines) {
+  if (!ring) return;
+  entry_t* entries = NULL;
+  size_t count = 0, capacity = 0;
+  for (;;) {
+    sample_t* sample = &ring[tail & (JACK_PROFILE_SAMPLES - 1)];
+    if (sequence(sample) != tail + 1) break;
+    char* line = NULL;
+    size_t length = 0, size = 0;
+    for (int i = sample->depth - 1; i >= 0; i--) {
+      const jack_proto_t* proto = sample->protos[i];
+      const char* name = proto->name ? proto->name : "?";
+      char at[16] = "";
+      if (lines && proto->lines) snprintf(at, sizeof(at), ":%u", proto->lines[sample->pcs[i]]);
+      else if (lines) snprintf(at, sizeof(at), "+%u", sample->pcs[i]);
+      append(&line, &length, &size, name, strlen(name));
+      append(&line, &length, &size, at, strlen(at));
+      if (i) append(&line, &length, &size, ";", 1);
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      entries = realloc(entries, sizeof(*entries) * capacity);
+    }
+    entries[count++] = (entry_t){ line, sample->weight };
+    // Hand the slot back to the writers, one lap ahead.
+    set_sequence(sample, tail + JACK_PROFILE_SAMPLES);
+    tail++;
+  }
+  // Equal stacks end up next to each other.
+  if (count) qsort(entries, count, sizeof(*entries), by_stack);
+  for (size_t i = 0; i < count; i++) {
+    uint64_t weight = entries[i].weight;
+    while (i + 1 < count && !strcmp(entries[i].stack, entries[i + 1].stack)) {
+      free(entries[i++].stack);
+      weight += entries[i].weight;
+    }
+    fprintf(out, "%s %llu\n", entries[i].stack, (unsigned long long)weight);
+    free(entries[i].stack);
+  }
+  free(entries);
+}
+
+void jack_profile_stats(jack_profile_stats_t* stats) {
+  stats->samples = __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef JACK_PROFILE_H
+#define JACK_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+// Sampling profiler for the interpreter.  On every SIGPROF tick the
+// handler records the call stack of the VM running on the thread it
+// interrupted into a lock-free ring.  Interpreters built with JACK_PROFILE
+// publish the running prototype and instruction in the VM for it, with a
+// few plain stores on calls, returns and jumps, and never check for ticks.
+// So every thread running a VM is sampled in proportion to the CPU time it
+// uses.  Without JACK_PROFILE the interpreter has no trace of any of this.
+// Needs gcc or clang.
+
+// Innermost frames kept per sample, deeper stacks lose their outer frames.
+#ifndef JACK_PROFILE_DEPTH
+#define JACK_PROFILE_DEPTH 32
+#endif
+// Samples the ring holds until jack_profile_dump drains it, later ones are
+// dropped and counted.  Must be a power of two.
+#ifndef JACK_PROFILE_SAMPLES
+#define JACK_PROFILE_SAMPLES 16384
+#endif
+// Sampling rate jack-profile uses.
+#ifndef JACK_PROFILE_HZ
+#define JACK_PROFILE_HZ 500
+#endif
+
+// The VM whose interpreter runs on this thread, if any.
+extern __thread jack_vm_t* jack_profile_vm;
+
+typedef struct {
+  uint64_t samples; // Recorded so far
+  uint64_t dropped; // Lost to a full ring
+} jack_profile_stats_t;
+
+// Start sampling `hz` times a second of CPU time.  Returns false if the
+// timer can't be set up, or the profiler is already running.
+bool jack_profile_start(int hz);
+void jack_profile_stop(void);
+// Drain the ring and write one line per distinct stack, outermost function
+// first, in the collapsed format flame graph tools read:
+//   main;fib;fib 42
+// With `lines` every frame also gets its source line, or its instruction
+// index when the prototype has no line info, as in fib:3 or fib+5.
+void jack_profile_dump(FILE* out, bool lines);
+void jack_profile_stats(jack_profile_stats_t* stats);
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "symbol.h"
+
+// Open addressing table of symbol pointers.  The size is a power of two and
+// it doubles when half full, so probe sequences stay short.
+static const jack_symbol_t** table;
+static int table_size;
+static int table_count;
+
+// FNV-1a, good enough for identifiers and cheap on short strings.
+static uint32_t hash_bytes(const char* data, int size) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < size; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void table_resize(int size) {
+  const jack_symbol_t** old = table;
+  int old_size = table_size;
+  table = calloc(size, sizeof(*table));
+  assert(table);
+  table_size = size;
+  for (int i = 0; i < old_size; i++) {
+    const jack_symbol_t* symbol = old[i];
+    if (!symbol) continue;
+    uint32_t j = hash_bytes(symbol->data, symbol->size) & (size - 1);
+    while (table[j]) j = (j + 1) & (size - 1);
+    table[j] = symbol;
+  }
+  free(old);
+}
+
+const jack_symbol_t* jack_intern(const char* data, int size) {
+  if ((table_count + 1) * 2 > table_size) {
+    table_resize(table_size ? table_size * 2 : 64);
+  }
+  uint32_t i = hash_bytes(data, size) & (table_size - 1);
+  for (; table[i]; i = (i + 1) & (table_size - 1)) {
+    const jack_symbol_t* symbol = table[i];
+    if (symbol->size == size && !memcmp(symbol->data, data, size)) {
+      return symbol;
+    }
+  }
+  // The bytes live right after the header, with a terminating zero so they
+  // can be handed to C.
+  jack_symbol_t* symbol = malloc(sizeof(*symbol) + size + 1);
+  assert(symbol);
+  char* bytes = (char*)(symbol + 1);
+  memcpy(bytes, data, size);
+  bytes[size] = 0;
+  symbol->object.type = Symbol;
+  symbol->size = size;
+  symbol->data = bytes;
+  table[i] = symbol;
+  table_count++;
+  return symbol;
+}
+
+void jack_intern_free(void) {
+  for (int i = 0; i < table_size; i++) {
+    free((void*)table[i]);
+  }
+  free(table);
+  table = NULL;
+  table_size = table_count = 0;
+}
@@ -0,0 +1,11 @@
+#ifndef JACK_SYMBOL_H
+#define JACK_SYMBOL_H
+
+#include "types.h"
+
+// Interned symbols are unique by content, so scripts can compare them by
+// identity.  They live until jack_intern_free is called.
+const jack_symbol_t* jack_intern(const char* data, int size);
+void jack_intern_free(void);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// Slices, external bytes and concatenation of buffers in old/api.c.
+
+static int releases = 0;
+
+static void release(void *userdata, char *data, size_t size) {
+  assert(userdata == &releases && size == 5 && !memcmp(data, "hello", 5));
+  releases++;
+}
+
+static jack_stats_t stats(jack_state_t *state) {
+  jack_stats_t stats;
+  jack_get_stats(state, &stats);
+  return stats;
+}
+
+int main() {
+  jack_state_t *state = jack_new_state(10);
+  int size;
+
+  // Slices share the bytes and keep the buffer alive.
+  jack_new_list(state);
+  jack_new_buffer(state, 11, "hello world");
+  assert(jack_new_slice(state, -1, 6, 5));
+  assert(jack_new_slice(state, -1, 1, 3));
+  assert(!memcmp(jack_get_bytes(state, -1, &size), "orl", 3) && size == 3);
+  jack_get_buffer(state, -3, &size)[7] = 'O';
+  assert(jack_get_bytes(state, -1, &size)[0] == 'O');
+  assert(!jack_new_slice(state, -3, 6, 6));
+  assert(jack_get_type(state, -1) == Nil);
+  assert(!jack_new_slice(state, -4, -1, 2));
+  jack_popn(state, 3);
+  assert(jack_new_slice(state, -2, 11, 0));
+  jack_pop(state);
+  jack_list_push(state, -3);
+  size_t released = stats(state).released_bytes;
+  jack_pop(state); // Only the slice in the list holds the buffer now
+  assert(stats(state).released_bytes == released);
+  jack_list_get(state, -1, 0);
+  assert(!memcmp(jack_get_bytes(state, -1, &size), "wOrld", 5));
+  jack_popn(state, 2);
+  assert(stats(state).released_bytes > released);
+
+  // External bytes go back to their owner once.
+  char hello[] = "hello";
+  jack_new_buffer_external(state, hello, 5, release, &releases);
+  assert(jack_get_buffer(state, -1, &size) == hello && size == 5);
+  assert(jack_new_slice(state, -1, 1, 2));
+  jack_pop(state);
+  assert(releases == 0);
+  jack_pop(state);
+  assert(releases == 1);
+  jack_new_buffer_external(state, NULL, 0, NULL, NULL);
+  jack_pop(state);
+
+  // Appending to a buffer only the stack holds grows it in place, doubling,
+  // so a million appends only allocate a few dozen times.
+  jack_new_buffer(state, 3, "abc");
+  jack_new_buffer(state, 0, NULL);
+  size_t allocations = stats(state).total_allocations;
+  for (int i = 0; i < 1000000; ++i) {
+    jack_dup(state, -2);
+    jack_buffer_concat(state);
+  }
+  assert(stats(state).total_allocations - allocations < 64);
+  const char *data = jack_get_bytes(state, -1, &size);
+  assert(size == 3000000 && !memcmp(data + 2999997, "abc", 3));
+  jack_popn(state, 2);
+
+  // Anything else held gets copied, the original is left alone.
+  jack_new_buffer(state, 2, "ab");
+  jack_dup(state, -1);
+  jack_new_buffer(state, 2, "cd");
+  jack_buffer_concat(state);
+  assert(!memcmp(jack_get_bytes(state, -1, &size), "abcd", 4) && size == 4);
+  assert(jack_get_bytes(state, -2, &size) && size == 2);
+  jack_pop(state);
+  assert(jack_new_slice(state, -1, 1, 1));
+  jack_dup(state, -1);
+  jack_buffer_concat(state);
+  assert(!memcmp(jack_get_bytes(state, -1, &size), "bb", 2) && size == 2);
+  jack_popn(state, 2);
+
+  // Buffer * Integer, and reading buffers with the primitives in mem.h.
+  jack_new_buffer(state, 3, "Abc");
+  jack_buffer_repeat(state, 100);
+  data = jack_get_bytes(state, -1, &size);
+  assert(size == 300 && !memcmp(data + 297, "Abc", 3));
+  assert(jack_buffer_find(state, -1, 0, "cAb", 3) == 2);
+  assert(jack_buffer_find(state, -1, 291, "cAb", 3) == 293);
+  assert(jack_buffer_find(state, -1, 297, "cAb", 3) == -1);
+  assert(jack_buffer_find_byte(state, -1, 1, 'A') == 3);
+  assert(jack_buffer_find_byte(state, -1, 0, 'x') == -1);
+  jack_new_buffer(state, 3, "aBC");
+  jack_buffer_repeat(state, 100);
+  assert(!jack_buffer_equal(state, -1, -2));
+  assert(jack_buffer_casecmp(state, -1, -2) == 0);
+  assert(jack_new_slice(state, -2, 0, 299));
+  assert(jack_buffer_casecmp(state, -1, -2) < 0);
+  jack_pop(state);
+  jack_new_buffer(state, 0, NULL);
+  jack_buffer_repeat(state, 5);
+  jack_buffer_repeat(state, 0);
+  assert(jack_get_bytes(state, -1, &size) && size == 0);
+  jack_pop(state);
+  jack_dup(state, -2);
+  jack_dup(state, -2);
+  jack_buffer_concat(state);
+  assert(jack_new_slice(state, -1, 300, 300));
+  assert(jack_buffer_equal(state, -1, -3));
+  assert(jack_buffer_hash(state, -1) == jack_buffer_hash(state, -3));
+  assert(jack_buffer_hash(state, -1) != jack_buffer_hash(state, -4));
+  jack_popn(state, 4);
+
+  // A slice moves to another heap along with its buffer, or not at all.
+  jack_state_t *other = jack_new_state(10);
+  jack_new_buffer(state, 5, "hello");
+  assert(jack_new_slice(state, -1, 1, 3));
+  assert(!jack_xmove(state, other, 1));
+  assert(jack_xmove(state, other, 2));
+  jack_free_state(state);
+  assert(!memcmp(jack_get_bytes(other, -1, &size), "ell", 3) && size == 3);
+  jack_free_state(other);
+  return 0;
+}
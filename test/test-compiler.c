@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../vm.h"
+#include "../symbol.h"
+#include "../compiler.h"
+
+// Compile and run source, returning the value of its last statement.  It
+// is taken off the stack, since its prototype is freed.
+static jack_value_t run(jack_vm_t* vm, const char* source) {
+  char error[256];
+  jack_proto_t* proto = jack_compile(source, strlen(source), "test",
+                                     error, sizeof(error));
+  if (!proto) {
+    printf("%s\n", error);
+    assert(0);
+  }
+  vm->stack[0] = jack_object(jack_new_map(vm, 0));
+  int retc = jack_run(vm, proto);
+  jack_free_proto(proto);
+  jack_value_t result = retc ? vm->stack[0] : JACK_NIL;
+  vm->stack[0] = JACK_NIL;
+  return result;
+}
+
+static jack_value_t sym(const char* name) {
+  return jack_object(jack_intern(name, strlen(name)));
+}
+
+static int objects(jack_vm_t* vm) {
+  int count = 0;
+  for (jack_gcheader_t* header = vm->objects; header; header = header->next) count++;
+  return count;
+}
+
+// Thread objects, and how many of them still hold stacks.
+static int threads(jack_vm_t* vm, int* with_stacks) {
+  int count = 0;
+  *with_stacks = 0;
+  for (jack_gcheader_t* header = vm->objects; header; header = header->next) {
+    jack_object_t* object = (jack_object_t*)(header + 1);
+    if (object->type != Thread) continue;
+    count++;
+    if (((jack_thread_t*)object)->stack) ++*with_stacks;
+  }
+  return count;
+}
+
+static void check_error(const char* source, const char* expected) {
+  char error[256];
+  assert(!jack_compile(source, strlen(source), "test", error, sizeof(error)));
+  if (!strstr(error, expected)) {
+    printf("%s\n", error);
+    assert(0);
+  }
+}
+
+int main() {
+  jack_vm_t vm;
+  jack_vm_init(&vm);
+
+  // Expressions and folding
+  assert(run(&vm, "1 + 2 * 3") == jack_integer(7));
+  assert(run(&vm, "(1 + 2) * 3 - -4") == jack_integer(13));
+  assert(run(&vm, "vars a = 7\n a / 2 * 2 + a % 2 * 100") == jack_integer(107));
+  assert(run(&vm, "vars a = 100000\n a * 3 + 1") == jack_integer(300001));
+  assert(run(&vm, "1 < 2 and 3 >= 3 and not (2 <= 1)") == JACK_TRUE);
+  assert(run(&vm, "vars a = 2\n a > 1 and a != 3") == JACK_TRUE);
+  assert(run(&vm, "vars a\n a or :x") == sym("x"));
+  assert(run(&vm, "vars a = false\n a and :x") == JACK_FALSE);
+  assert(run(&vm, "vars a = \"b\"\n a == :b") == JACK_TRUE);
+
+  // Ordering a value that isn't a number.  Branches test the negation, so
+  // each test has to be its exact opposite: anything that isn't a number
+  // sorts after the numbers.
+  assert(run(&vm,
+    "vars x = :foo, r = 0\n"
+    "if x < 1 { r = r + 1 } else { r = r + 2 }\n"
+    "if x >= 1 { r = r + 10 } else { r = r + 20 }\n"
+    "if x <= 1 { r = r + 100 } else { r = r + 200 }\n"
+    "if x > 1 { r = r + 1000 } else { r = r + 2000 }\n"
+    "if 1 < x { r = r + 10000 } else { r = r + 20000 }\n"
+    "r") == jack_integer(11212));
+  assert(run(&vm, "vars x = :foo, y = 1\n x < y or y >= x or not (y < x)") == JACK_FALSE);
+  assert(run(&vm, "vars x = :foo\n x < 1 == not (x >= 1) and x > 1 == not (x <= 1)") == JACK_TRUE);
+  assert(run(&vm, "vars x = :foo, n = 0\n while x < 3 { n = n + 1\n x = 5 }\n n") == jack_integer(0));
+  assert(run(&vm, "vars x = 0, n = 0\n while x < 3 { n = n + 1\n x = :done }\n n") == jack_integer(1));
+
+  // A variable only exists after its initializer, which sees what the name
+  // meant before, and never the slot's leftovers.  Function literals can
+  // still call themselves.
+  assert(run(&vm,
+    "vars f = {| vars a = :secret\n return 1 }, g = {| vars b = b\n return b }\n"
+    "f()\n g()") == JACK_NIL);
+  assert(run(&vm, "vars x = 10, y\n if true { vars x = x + 1\n y = x }\n y * 100 + x") == jack_integer(1110));
+  assert(run(&vm, "vars fact = {n| if n < 2 { return 1 }\n return n * fact(n - 1) }\n fact(10)") == jack_integer(3628800));
+
+  // Integer overflow.  Results past the tagged range are boxed and come
+  // back to tagged integers.
+  if (sizeof(intptr_t) == 8) {
+    const char* max = "vars max = 4611686018427387903, i = 0\n";
+    char source[512];
+    snprintf(source, sizeof(source), "%s%s", max, "max + 1 - 2 == max - 1");
+    assert(run(&vm, source) == JACK_TRUE);
+    snprintf(source, sizeof(source), "%s%s", max,
+             "vars a = max + max, b = max * 2\n a == b and a > max and -a < -max");
+    assert(run(&vm, source) == JACK_TRUE);
+    snprintf(source, sizeof(source), "%s%s", max, "vars m = -max - 1\n m - 1 + 1 == m and m - 1 < m");
+    assert(run(&vm, source) == JACK_TRUE);
+    // Negating the lowest tagged constant isn't folded, it's boxed at run time.
+    assert(run(&vm, "-(-4611686018427387903 - 1) == 4611686018427387903 + 1 and "
+                    "-(-4611686018427387903 - 1) > 0") == JACK_TRUE);
+    snprintf(source, sizeof(source), "%s%s", max, "vars m = max + max\n m / max");
+    assert(run(&vm, source) == jack_integer(2));
+    snprintf(source, sizeof(source), "%s%s", max,
+             "while i < max + 3 { i = i + max }\n i - max * 2");
+    assert(run(&vm, source) == jack_integer(0));
+    snprintf(source, sizeof(source), "%s%s", max,
+             "vars m = {}\n m[max + 1] = 1\n m[max + 1] = m[max + 1] + 1\n"
+             "m[max + 1] == 2 and (max + 1) in m and not ((max + 2) in m)");
+    assert(run(&vm, source) == JACK_TRUE);
+    // Past a word they are big integers, exact and back to words again.
+    snprintf(source, sizeof(source), "%s%s", max, "max * 4 / 4 == max and max * 4 - max * 3 == max");
+    assert(run(&vm, source) == JACK_TRUE);
+    snprintf(source, sizeof(source), "%s%s", max,
+             "vars x = max * max, y = x * x\n"
+             "y / x == x and x / max == max and (x + 7) % max == 7 and (-x - 7) % max == -7");
+    assert(run(&vm, source) == JACK_TRUE);
+    snprintf(source, sizeof(source), "%s%s", max,
+             "vars m = max * 2 + 1\n m * 2 / 2 == m and m * 2 > m and -m * 2 < -m and m + 1 != m");
+    assert(run(&vm, source) == JACK_TRUE);
+    snprintf(source, sizeof(source), "%s%s", max, "vars m = -max * 2 - 2\n m / -1 + m");
+    assert(run(&vm, source) == jack_integer(0));
+    // Big integers are beyond every word and Rational, equal by value and
+    // keys by value.
+    snprintf(source, sizeof(source), "%s%s", max,
+             "vars x = max * max, h = {}\n h[x] = 1\n h[max * max] = h[x] + 1\n"
+             "h[x] == 2 and #h == 1 and x == max * max and x > max * 4 and -x < 1 / 3 "
+             "and x > 1 / 3 and x - 1 < x and x < :foo");
+    assert(run(&vm, source) == JACK_TRUE);
+    // Rationals stay 64 bit, one past that is still an error.
+    snprintf(source, sizeof(source), "%s%s", max, "vars x = max * max, y = x + 1\n y / x");
+    assert(jack_iserror(run(&vm, source)));
+    snprintf(source, sizeof(source), "%s%s", max, "vars x = max * max\n x * 2 / (x * 3) == 2 / 3");
+    assert(run(&vm, source) == JACK_TRUE);
+  }
+
+  // Division is exact, fractions are Rationals and whole results Integers.
+  assert(run(&vm, "vars a = 6\n a / 3 + a / 4 * 2") == jack_integer(5));
+  assert(jack_typeof(run(&vm, "vars a = 1\n a / 3")) == Rational);
+  assert(run(&vm,
+    "vars third = 1 / 3, sixth = 1 / 6, half = 1 / 2\n"
+    "third + sixth == half and half - third == sixth and third * half == sixth "
+    "and sixth / third == half and third < half and -half < -third and "
+    "half >= 1 / 2 and half <= 1 and half > 0 and -1 < -half and "
+    "half != third and 7 / 2 % 1 == half and -7 / 2 % 1 == -half") == JACK_TRUE);
+  // Map keys are numbers by value, not by box.
+  assert(run(&vm,
+    "vars m = {}\n m[1 / 3] = :third\n m[2 / 6] = :also\n"
+    "m[1 / 3] == :also and (1 / 3) in m and not ((2 / 3) in m) and m[-1 / 3] == nil") == JACK_TRUE);
+  assert(run(&vm,
+    "vars x = 0, i = 1\n"
+    "while i <= 20 { x = x + 1 / (i * (i + 1))\n i = i + 1 }\n"
+    "x * 21") == jack_integer(20));
+  assert(jack_iserror(run(&vm,
+    "vars x = 1 / 3037000499, y = 1 / 3037000493\n x * y * y")));
+  assert(jack_iserror(run(&vm, "vars x = 1 / 3\n x / 0")));
+  {
+    // Boxes a long loop throws away are collected as it goes, the 600000
+    // it makes never pile up.
+    jack_collect(&vm);
+    int before = objects(&vm);
+    assert(run(&vm,
+      "vars x = 0, i = 0\n"
+      "while i < 300000 { x = x + 1 / 3\n i = i + 1 }\n"
+      "x") == jack_integer(100000));
+    assert(objects(&vm) - before < 60000);
+    jack_collect(&vm);
+    assert(objects(&vm) == before);
+  }
+
+  // Control flow
+  assert(run(&vm,
+    "vars i = 0, sum = 0\n"
+    "while i < 10 {\n"
+    "  if i % 2 == 0 { sum = sum + i } else if i == 5 { sum = sum + 100 }\n"
+    "  i = i + 1\n"
+    "}\n"
+    "sum") == jack_integer(120));
+  assert(run(&vm, "vars f = {x| if x { return :yes } :no }\n f(false)") ==
+         sym("no"));
+
+  // Comparisons against numbers on either side, in loops whose condition
+  // is repeated at the bottom
+  assert(run(&vm,
+    "vars n = 0, i = 0\n"
+    "while i < 10 { if 3 < i and i <= 7 { n = n + 1 }\n i = i + 1 }\n"
+    "while 0 <= i and i >= 5 { n = n + 10\n i = i - 1 }\n"
+    "vars j = 0\n"
+    "while j <= i and not (j > 100) { j = j + 2 }\n"
+    "n * 100 + j") == jack_integer(6406));
+  assert(run(&vm,
+    "vars i = 0, limit = 5, sum = 0\n"
+    "while i < limit { sum = sum + i\n i = i + 1 }\n"
+    "while limit >= i + 2 { sum = 0 }\n"
+    "sum") == jack_integer(10));
+
+  // Maps
+  assert(run(&vm, "vars m = {a: 1, b: 2}\n m.c = 3\n m.a + m[:b] + m.c") ==
+         jack_integer(6));
+  assert(run(&vm, "vars m = {}\n m[1] = 2\n m[m[1] - 1] + #m") ==
+         jack_integer(3));
+  assert(run(&vm, "vars m = {k: nil}\n :k in m and not (:j in m)") ==
+         JACK_TRUE);
+
+  // Map literals are copies of a template.  Copies own their values, and
+  // keys added to one don't show up in the template or other copies.
+  static const char make[] =
+    "vars make = {x| {a: 1, b: x, c: :s, d: nil, b: x + 1, a: x} }\n"
+    "vars p = make(5), q = make(6)\n"
+    "p.e = 7\n q.c = :t\n"
+    "vars r = make(1)\n";
+  char source[512];
+  snprintf(source, sizeof(source), "%s%s", make,
+           "p.a * 1000 + p.b * 100 + q.a * 10 + r.b + #p * 10000 + #r * 100000");
+  assert(run(&vm, source) == jack_integer(400000 + 50000 + 5000 + 600 + 60 + 2));
+  snprintf(source, sizeof(source), "%s%s", make,
+           "q.c == :t and r.c == :s and :d in r and not (:e in r or :e in q)");
+  assert(run(&vm, source) == JACK_TRUE);
+  assert(run(&vm,
+    "vars make = {| {a: 1, b: 2} }, get = {m| m.b }\n"
+    "vars p = make(), q = make(), sum = 0\n"
+    "q.c = 3\n"
+    "sum = get(p) + get(q) + get(make())\n"
+    "p.b = 10\n"
+    "sum * 100 + get(p) + get(make())") == jack_integer(610 + 2));
+
+  // One field access sees maps of different layouts, and maps that grow
+  // between accesses, so its inline cache has to notice every change.
+  vm.cache_hits = vm.cache_misses = 0;
+  assert(run(&vm,
+    "vars get = {m| m.a }, set = {m, v| m.a = v }\n"
+    "vars p = {a: 1}, q = {b: 2, a: 3}, r = {b: 4}, sum = 0, i = 0\n"
+    "while i < 10 {\n"
+    "  sum = sum + get(p) + get(q)\n"
+    "  if get(r) == nil { sum = sum + 1000 }\n"
+    "  set(p, i)\n"
+    "  r[i] = i\n"
+    "  i = i + 1\n"
+    "}\n"
+    "set(r, 5)\n"
+    "sum + get(r)") == jack_integer(1 + 45 - 9 + 30 + 10000 + 5));
+  assert(vm.cache_hits > 0 && vm.cache_misses > 0);
+
+  // Closures share their variables
+  assert(run(&vm,
+    "vars counter = {| vars n = 0\n {| n = n + 1 } }\n"
+    "vars a = counter(), b = counter()\n"
+    "a() a() b()\n"
+    "a() * 10 + b()") == jack_integer(32));
+  assert(run(&vm,
+    "vars fs = {}, i = 0\n"
+    "while i < 3 { vars j = i\n fs[i] = {| j }\n i = i + 1 }\n"
+    "fs[0]() + fs[1]() * 10 + fs[2]() * 100") == jack_integer(210));
+  assert(run(&vm,
+    "vars cache = {}, fib\n"
+    "fib = {i|\n"
+    "  if i <= 2 { return 1 }\n"
+    "  if i in cache { return cache[i] }\n"
+    "  cache[i] = fib(i - 1) + fib(i - 2)\n"
+    "}\n"
+    "fib(42)") == jack_integer(267914296));
+
+  {
+    // Records copied from a literal, closures and the variables they
+    // capture are collected like everything else.  A loop making them
+    // doesn't grow.
+    jack_collect(&vm);
+    int before = objects(&vm);
+    assert(run(&vm,
+      "vars i = 0, total = 0\n"
+      "while i < 100000 {\n"
+      "  vars p = {x: i, y: 1, z: 2}\n"
+      "  vars n = i\n"
+      "  vars get = {| n + p.y }\n"
+      "  total = total + get() - p.x\n"
+      "  i = i + 1\n"
+      "}\n"
+      "total") == jack_integer(100000));
+    assert(objects(&vm) - before < 50000);
+    jack_collect(&vm);
+    assert(objects(&vm) == before);
+  }
+
+  // Threads.  Each yield hands a value out and gets the next resume's in,
+  // from any depth of calls.
+  assert(run(&vm,
+    "vars t = thread({n|\n"
+    "  vars total = 0\n"
+    "  while true { total = total + yield(total * n) }\n"
+    "})\n"
+    "resume(t, 10) resume(t, 1) resume(t, 2) resume(t, 3)") == jack_integer(60));
+  assert(run(&vm,
+    "vars walk\n"
+    "walk = {n| if n > 0 { walk(n - 1) yield(n) } }\n"
+    "vars t = thread({| walk(100) return :done })\n"
+    "vars sum = 0, v = resume(t)\n"
+    "while v != :done { sum = sum + v\n v = resume(t) }\n"
+    "sum") == jack_integer(5050));
+  // Threads resuming threads, and closures over a suspended thread's
+  // variables used from outside it.
+  assert(run(&vm,
+    "vars inner = thread({| yield(1) yield(2) })\n"
+    "vars outer = thread({| vars x = 5\n yield({| x = x + 1 }) yield(resume(inner) + resume(inner) + x) })\n"
+    "vars bump = resume(outer)\n"
+    "bump() bump()\n"
+    "resume(outer)") == jack_integer(10));
+  {
+    // A thread per job: each gives its stacks back when it returns, deep
+    // ones included, and is collected once nothing refers to it.  Neither
+    // piles up over a long run.
+    jack_collect(&vm);
+    int with_stacks, before = threads(&vm, &with_stacks);
+    assert(run(&vm,
+      "vars deep\n deep = {n| if n > 0 { return deep(n - 1) + 1 }\n return 0 }\n"
+      "vars i = 0, sum = 0\n"
+      "while i < 30000 {\n"
+      "  vars t = thread({n| yield(n)\n return n * 2 + deep(i % 100) - i % 100 })\n"
+      "  sum = sum + resume(t, i) + resume(t)\n"
+      "  i = i + 1\n"
+      "}\n"
+      "sum") == jack_integer(1349955000));
+    assert(threads(&vm, &with_stacks) - before < 10000 && !with_stacks);
+    assert(vm.nspare <= JACK_SPARE_THREADS);
+    jack_collect(&vm);
+    assert(threads(&vm, &with_stacks) == before);
+  }
+  {
+    // Threads left suspended go too, with their stacks.  Closures still
+    // using their variables keep working.
+    jack_collect(&vm);
+    int with_stacks, before = threads(&vm, &with_stacks);
+    assert(run(&vm,
+      "vars counters = {}, i = 0\n"
+      "while i < 20000 {\n"
+      "  vars t = thread({n| vars count = n\n yield({| count = count + 1 })\n :never })\n"
+      "  counters[i % 100] = resume(t, i)\n"
+      "  i = i + 1\n"
+      "}\n"
+      "vars sum = 0\n i = 0\n"
+      "while i < 100 { sum = sum + counters[i]() + counters[i]()\n i = i + 1 }\n"
+      "sum") == jack_integer(2 * (19900 * 100 + 4950) + 300));
+    assert(threads(&vm, &with_stacks) - before < 10000);
+    jack_collect(&vm);
+    assert(threads(&vm, &with_stacks) == before && !with_stacks);
+  }
+  assert(jack_iserror(run(&vm, "vars t = thread({| yield(1) })\n resume(t) resume(t)\n resume(t)")));
+  assert(jack_iserror(run(&vm, "yield(1)")));
+  assert(jack_iserror(run(&vm, "thread(1)")));
+  assert(jack_iserror(run(&vm, "resume({| 1 })")));
+  {
+    // Resumed from C
+    char error[256];
+    const char* source = "{a, b| vars c = yield(a + b)\n c * 2 }";
+    jack_proto_t* proto = jack_compile(source, strlen(source), "test", error, sizeof(error));
+    assert(proto);
+    vm.stack[0] = jack_object(jack_new_map(&vm, 0));
+    assert(jack_run(&vm, proto) == 1);
+    jack_thread_t* thread = jack_new_thread(&vm, vm.stack[0]);
+    jack_value_t args[] = { jack_integer(3), jack_integer(4) }, results[2];
+    assert(jack_resume(&vm, thread, args, 2, results, 2) == 1);
+    assert(results[0] == jack_integer(7) && results[1] == JACK_NIL);
+    assert(thread->status == ThreadSuspended);
+    assert(jack_resume(&vm, thread, results, 1, results, 1) == 1);
+    assert(results[0] == jack_integer(14) && thread->status == ThreadDead);
+    assert(jack_resume(&vm, thread, NULL, 0, results, 1) == 1 && jack_iserror(results[0]));
+    assert(!jack_new_thread(&vm, jack_integer(1)));
+    jack_free_proto(proto);
+  }
+
+  // Errors
+  check_error("x = 1", "test:1: Assignment to undeclared variable x");
+  check_error("vars a\n(a", "test:2: Expected ')'");
+  check_error("1 = 2", "Can't assign");
+  check_error("\"abc", "Unfinished string");
+
+  jack_vm_free(&vm);
+  jack_intern_free();
+  return 0;
+}
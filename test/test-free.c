@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// Freeing deep structures from the queue in old/api.c, without recursion.
+
+#define DEPTH 1000000
+
+// Leave a list nested DEPTH deep on top of the stack.  The scratch list
+// holds the outermost one while the next is wrapped around it.
+static void nest(jack_state_t *state) {
+  jack_new_list(state);
+  jack_new_list(state);
+  jack_list_push(state, -2);
+  for (int i = 1; i < DEPTH; i++) {
+    jack_new_list(state);
+    jack_list_pop(state, -2);
+    jack_list_push(state, -2);
+    jack_list_push(state, -2);
+  }
+}
+
+static size_t released(jack_state_t *state) {
+  jack_stats_t stats;
+  jack_get_stats(state, &stats);
+  return stats.released_bytes;
+}
+
+int main() {
+  jack_state_t *state = jack_new_state(10);
+
+  // All at once, the default.
+  nest(state);
+  size_t before = released(state);
+  jack_pop(state);
+  size_t all = released(state) - before;
+  printf("freeing %d nested lists released %zu bytes\n", DEPTH, all);
+  assert(all >= DEPTH * (sizeof(jack_value_t) + sizeof(jack_list_t)));
+
+  // Spread over later allocations, each going on with about 100 references.
+  jack_set_free_budget(state, 100);
+  nest(state);
+  before = released(state);
+  jack_pop(state);
+  size_t first = released(state) - before;
+  for (int i = 0; i < 1000; i++) {
+    jack_new_list(state);
+    jack_pop(state);
+  }
+  size_t later = released(state) - before;
+  printf("budget 100: %zu bytes at the pop, %zu after 1000 allocations\n", first, later);
+  assert(first < all / 1000 && later > first && later < all);
+  jack_free_pending(state);
+  // The 1000 empty lists were freed on the way.
+  assert(released(state) - before == all + 1000 * (sizeof(jack_value_t) + sizeof(jack_list_t)));
+
+  // Maps and functions too, with the budget still set when the state goes
+  // away holding them.
+  jack_new_list(state);
+  jack_new_integer(state, 0);
+  jack_list_push(state, -2);
+  for (int i = 0; i < DEPTH / 2; i++) {
+    jack_new_map(state, 4);
+    jack_list_pop(state, -2);
+    jack_map_set_symbol(state, -2, "next");
+    jack_new_function(state, NULL, 1);
+    jack_list_push(state, -2);
+  }
+  jack_free_state(state);
+  return 0;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// The cycle collector in old/api.c: cycles through lists, maps and
+// functions, and collections stepped in small pieces while the program
+// changes the values being looked at.
+
+#define ROUNDS 300
+#define RING 4
+
+static size_t freed(jack_state_t *state) {
+  jack_gc_stats_t stats;
+  jack_gc_stats(state, &stats);
+  return stats.objects_freed;
+}
+
+// Leave a ring of `length` lists on the stack, each holding `id` and then
+// the next one.
+static void ring(jack_state_t *state, int length, int id) {
+  for (int i = 0; i < length; i++) {
+    jack_new_list(state);
+    jack_new_integer(state, id);
+    jack_list_push(state, -2);
+  }
+  for (int i = 0; i < length; i++) {
+    jack_dup(state, -length + (i + 1) % length);
+    jack_list_push(state, -length - 1 + i);
+  }
+  jack_popn(state, length - 1);
+}
+
+// Go round the ring on top of the stack, checking every list in it.
+static void check_ring(jack_state_t *state, int length, int id) {
+  jack_dup(state, -1);
+  for (int i = 0; i < length; i++) {
+    assert(jack_list_length(state, -1) == 2);
+    jack_list_get(state, -1, 0);
+    assert(jack_get_integer(state, -1) == id);
+    jack_pop(state);
+    jack_list_get(state, -1, 1);
+  }
+  jack_popn(state, length + 1);
+}
+
+// Length of the list a function was made with.
+static int captured(jack_state_t *state) {
+  jack_new_integer(state, jack_list_length(state, 0));
+  return 1;
+}
+
+int main() {
+  jack_state_t *state = jack_new_state(10);
+  jack_gc_enable(state, 0);
+  size_t before = freed(state);
+
+  // A list holding itself, once garbage and once held from the stack.
+  jack_new_list(state);
+  jack_dup(state, -1);
+  jack_list_push(state, -2);
+  jack_pop(state);
+  jack_new_list(state);
+  jack_dup(state, -1);
+  jack_list_push(state, -2);
+  jack_dup(state, -1);
+  jack_pop(state);
+  jack_gc_collect(state);
+  assert(freed(state) - before == 1);
+  assert(jack_list_length(state, -1) == 1);
+  jack_list_get(state, -1, 0);
+  assert(jack_get_type(state, -1) == List && jack_list_length(state, -1) == 1);
+  jack_popn(state, 2);
+  jack_gc_collect(state);
+  assert(freed(state) - before == 2);
+
+  // Two maps holding each other as a value, and two as a key.
+  before = freed(state);
+  jack_new_map(state, 4);
+  jack_new_map(state, 4);
+  jack_dup(state, -1);
+  jack_map_set_symbol(state, -3, "next");
+  jack_dup(state, -2);
+  jack_map_set_symbol(state, -2, "next");
+  jack_popn(state, 2);
+  jack_new_map(state, 4);
+  jack_new_map(state, 4);
+  jack_dup(state, -1);
+  jack_new_integer(state, 1);
+  jack_map_set(state, -4);
+  jack_dup(state, -2);
+  jack_new_integer(state, 2);
+  jack_map_set(state, -3);
+  jack_popn(state, 2);
+  jack_gc_collect(state);
+  assert(freed(state) - before == 4);
+
+  // A list holding the function made with it, once garbage and once held.
+  before = freed(state);
+  for (int i = 0; i < 2; i++) {
+    jack_new_list(state);
+    jack_dup(state, -1);
+    jack_new_function(state, captured, 1);
+    jack_list_push(state, -2);
+    if (!i) jack_pop(state);
+  }
+  jack_dup(state, -1);
+  jack_pop(state);
+  jack_gc_collect(state);
+  assert(freed(state) - before == 2);
+  jack_list_get(state, -1, 0);
+  assert(jack_function_call(state, -1, 0) == 1 && jack_get_integer(state, -1) == 1);
+  jack_popn(state, 3);
+  jack_gc_collect(state);
+  assert(freed(state) - before == 4);
+
+  // Small steps with the program going on in between.  Most rings are
+  // dropped at once, every third is kept in a list for a while first, and
+  // the kept ones are looked at and changed while collections run.
+  before = freed(state);
+  jack_new_list(state);
+  int kept = 0, first = 0, garbage = 0;
+  for (int i = 0; i < ROUNDS; i++) {
+    ring(state, RING, i);
+    if (i % 3) {
+      jack_pop(state);
+      garbage++;
+    }
+    else {
+      jack_list_push(state, -2);
+      kept++;
+    }
+    // Make the kept list a possible root, and take a link out of the
+    // newest kept ring and put it back.
+    jack_dup(state, -1);
+    jack_pop(state);
+    jack_list_get(state, -1, -1);
+    jack_list_pop(state, -1);
+    jack_gc_step(state, 5);
+    jack_list_push(state, -2);
+    jack_pop(state);
+    if (i % 7 == 6) {
+      // The oldest kept ring turns into garbage halfway through.
+      jack_list_shift(state, -1);
+      check_ring(state, RING, first);
+      jack_pop(state);
+      first += 3;
+      kept--;
+      garbage++;
+    }
+    jack_gc_step(state, 5);
+  }
+  jack_gc_collect(state);
+  assert(freed(state) - before == (size_t)garbage * RING);
+  assert(jack_list_length(state, -1) == kept);
+  for (int i = 0; i < kept; i++) {
+    jack_list_get(state, -1, i);
+    check_ring(state, RING, first + i * 3);
+    jack_pop(state);
+  }
+  jack_pop(state);
+  jack_gc_collect(state);
+  assert(freed(state) - before == (size_t)(garbage + kept) * RING);
+
+  jack_gc_stats_t stats;
+  jack_gc_stats(state, &stats);
+  printf("%zu collections in %zu steps freed %zu containers\n",
+         stats.collections, stats.steps, stats.objects_freed);
+  jack_free_state(state);
+  return 0;
+}
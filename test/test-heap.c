@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../old/api.h"
+#include "../old/heap.h"
+
+// The pools and scratch arena in old/heap.c, on an allocator that counts
+// what it hands out so nothing can go missing unnoticed.
+
+typedef struct {
+  size_t blocks;
+  size_t bytes;
+} counter_t;
+
+static void* counting(void *userdata, void *ptr, size_t old_size, size_t new_size) {
+  counter_t *counter = userdata;
+  counter->bytes += new_size - old_size;
+  if (!ptr) counter->blocks++;
+  if (!new_size) {
+    counter->blocks--;
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, new_size);
+}
+
+static jack_stats_t stats_of(jack_heap_t *heap) {
+  jack_stats_t stats;
+  jack_heap_stats(heap, &stats);
+  return stats;
+}
+
+int main() {
+  counter_t counter = { 0, 0 };
+  jack_heap_t *heap = jack_heap_new(counting, &counter);
+
+  // One block of every size up to the pool limit takes a slab per size
+  // class, and the first block of each is a miss.
+  void *blocks[JACK_POOL_LIMIT + 1];
+  for (int size = 1; size <= JACK_POOL_LIMIT; size++) {
+    blocks[size] = jack_heap_alloc(heap, size);
+    assert(((uintptr_t)blocks[size] & 7) == 0);
+    memset(blocks[size], size, size);
+  }
+  jack_stats_t stats = stats_of(heap);
+  int classes = JACK_POOL_LIMIT / 8;
+  assert(stats.allocations == (size_t)classes && stats.bytes == (size_t)classes * JACK_SLAB_SIZE);
+  assert(stats.pool_hits == (size_t)(JACK_POOL_LIMIT - classes));
+  for (int size = 1; size <= JACK_POOL_LIMIT; size++) {
+    assert(((unsigned char*)blocks[size])[size - 1] == size);
+  }
+
+  // Released blocks are reused by their own class, most recent first.
+  for (int size = 1; size <= JACK_POOL_LIMIT; size++) jack_heap_release(heap, blocks[size], size);
+  stats = stats_of(heap);
+  assert(stats.released_bytes == JACK_POOL_LIMIT * (JACK_POOL_LIMIT + 1) / 2);
+  assert(jack_heap_alloc(heap, 8) == blocks[8]);
+  assert(jack_heap_alloc(heap, 64) == blocks[64]);
+  assert(stats_of(heap).pool_hits == stats.pool_hits + 2);
+  assert(stats_of(heap).allocations == stats.allocations);
+
+  // Enough of one class to need more slabs.
+  enum { MANY = 2 * JACK_SLAB_SIZE / 16 };
+  void *many[MANY];
+  for (int i = 0; i < MANY; i++) many[i] = jack_heap_alloc(heap, 16);
+  assert(stats_of(heap).allocations > stats.allocations);
+  for (int i = 0; i < MANY; i++) jack_heap_release(heap, many[i], 16);
+
+  // Big blocks go straight to the allocator and come back from it.
+  stats = stats_of(heap);
+  char *big = jack_heap_alloc(heap, 1000);
+  assert(stats_of(heap).allocations == stats.allocations + 1);
+  assert(stats_of(heap).bytes == stats.bytes + 1000);
+  big = jack_heap_realloc(heap, big, 1000, 5000);
+  assert(stats_of(heap).bytes == stats.bytes + 5000 && stats_of(heap).peak_bytes >= stats.bytes + 5000);
+  // Shrinking into the pools copies what fits.
+  big[0] = 'x';
+  char *small = jack_heap_realloc(heap, big, 5000, 40);
+  assert(small[0] == 'x');
+  assert(stats_of(heap).allocations == stats.allocations && stats_of(heap).bytes == stats.bytes);
+  jack_heap_release(heap, small, 40);
+
+  // The arena keeps its first block over a reset and frees the rest.
+  jack_arena_t arena = { NULL };
+  stats = stats_of(heap);
+  char *first = jack_arena_alloc(heap, &arena, 3);
+  char *second = jack_arena_alloc(heap, &arena, 5);
+  assert(second == first + 8);
+  for (int i = 0; i < 10; i++) jack_arena_alloc(heap, &arena, JACK_ARENA_SIZE / 2);
+  jack_arena_alloc(heap, &arena, JACK_ARENA_SIZE * 3);
+  assert(stats_of(heap).allocations > stats.allocations + 1);
+  jack_arena_reset(heap, &arena);
+  assert(stats_of(heap).allocations == stats.allocations + 1);
+  assert(jack_arena_alloc(heap, &arena, 3) == first);
+  jack_arena_free(heap, &arena);
+  assert(stats_of(heap).allocations == stats.allocations && !arena.head);
+
+  // Everything, slabs included, goes back with the heap.
+  jack_heap_unref(heap);
+  assert(counter.blocks == 0 && counter.bytes == 0);
+
+  // The same through a state, with jack_malloc as the arena.
+  jack_state_t *state = jack_new_state_with(10, counting, &counter);
+  for (int i = 0; i < 100; i++) {
+    jack_new_list(state);
+    memset(jack_malloc(state, 100), 0, 100);
+  }
+  jack_popn(state, 100);
+  jack_malloc_reset(state);
+  jack_get_stats(state, &stats);
+  assert(stats.released_bytes > 0 && stats.pool_hits > 0);
+  jack_free_state(state);
+  assert(counter.blocks == 0 && counter.bytes == 0);
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../vm.h"
+#include "../symbol.h"
+#include "../compiler.h"
+#include "../image.h"
+
+static const char* path = "test/test-image.jkc";
+static const char* copy_path = "test/test-image-copy.jkc";
+
+static const char source[] =
+  "vars cache = {}, fib\n"
+  "fib = {i|\n"
+  "  if i <= 2 { return 1 }\n"
+  "  if i in cache { return cache[i] }\n"
+  "  cache[i] = fib(i - 1) + fib(i - 2)\n"
+  "}\n"
+  "vars m = {name: \"fib\"}\n"
+  "m.value = fib(60) + 123456789012\n"
+  "m";
+
+static jack_value_t run(jack_vm_t* vm, const jack_proto_t* proto) {
+  vm->stack[0] = jack_object(jack_new_map(vm, 0));
+  assert(jack_run(vm, proto) == 1);
+  return vm->stack[0];
+}
+
+static jack_value_t sym(const char* name) {
+  return jack_object(jack_intern(name, strlen(name)));
+}
+
+static void write_image(const char* path, const jack_proto_t* proto) {
+  FILE* file = fopen(path, "wb");
+  assert(file);
+  assert(!jack_image_write(proto, file));
+  fclose(file);
+}
+
+int main() {
+  char error[256];
+  jack_vm_t vm;
+  jack_vm_init(&vm);
+
+  jack_proto_t* proto = jack_compile(source, sizeof(source) - 1, "fib",
+                                     error, sizeof(error));
+  assert(proto);
+  write_image(path, proto);
+
+  jack_image_t* image = jack_image_open(path, error, sizeof(error));
+  assert(image);
+  const jack_proto_t* main = jack_image_main(image);
+  assert(!strcmp(main->name, "main"));
+  assert(main->ncode == proto->ncode);
+  assert(!memcmp(main->code, proto->code, sizeof(*main->code) * main->ncode));
+  assert(!memcmp(main->lines, proto->lines, sizeof(*main->lines) * main->ncode));
+  assert(main->nprotos == 1 && !strcmp(main->protos[0]->name, "fib"));
+
+  // Symbols are only interned, and templates built, once the code uses them.
+  for (int i = 0; i < main->nsymbols; i++) assert(!main->symbols[i]);
+  assert(main->ntemplates == 1 && !main->templates[0]);
+  jack_map_t* m = (jack_map_t*)jack_toobject(run(&vm, main));
+  assert(jack_map_get(m, sym("name")) == sym("fib"));
+  assert(jack_map_get(m, sym("value")) ==
+         jack_integer(1548008755920 + 123456789012));
+  for (int i = 0; i < main->nsymbols; i++) assert(main->symbols[i]);
+  assert(main->templates[0]->length == 1);
+
+  // Writing a loaded image gives the same bytes back.  The image is mapped,
+  // so it can't be overwritten while open.
+  FILE* file = fopen(path, "rb");
+  assert(file);
+  static char original[4096], copy[4096];
+  size_t size = fread(original, 1, sizeof(original), file);
+  fclose(file);
+  write_image(copy_path, main);
+  file = fopen(copy_path, "rb");
+  assert(fread(copy, 1, sizeof(copy), file) == size);
+  fclose(file);
+  assert(!memcmp(original, copy, size));
+  jack_image_close(image);
+
+  // A truncated image is refused.
+  file = fopen(path, "wb");
+  fwrite(original, 1, size - 8, file);
+  fclose(file);
+  assert(!jack_image_open(path, error, sizeof(error)));
+  assert(strstr(error, "Not a valid image"));
+
+  remove(path);
+  remove(copy_path);
+  jack_free_proto(proto);
+  jack_vm_free(&vm);
+  jack_intern_free();
+  return 0;
+}
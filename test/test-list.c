@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// The ring buffer behind lists in old/api.c.  Each check compares the list
+// against a plain array of what it should hold.
+
+static jack_list_t* top_list(jack_state_t *state) {
+  return state->stack->values[state->stack->top - 1]->list;
+}
+
+static void check(jack_state_t *state, const intptr_t *expected, int length) {
+  assert(jack_list_length(state, -1) == length);
+  for (int i = 0; i < length; i++) {
+    assert(jack_list_get(state, -1, i));
+    assert(jack_get_integer(state, -1) == expected[i]);
+    jack_pop(state);
+    assert(jack_list_get(state, -1, i - length));
+    assert(jack_get_integer(state, -1) == expected[i]);
+    jack_pop(state);
+  }
+  assert(!jack_list_get(state, -1, length) && jack_get_type(state, -1) == Nil);
+  jack_pop(state);
+  assert(!jack_list_get(state, -1, -length - 1));
+  jack_pop(state);
+}
+
+static void push(jack_state_t *state, intptr_t integer) {
+  jack_new_integer(state, integer);
+  jack_list_push(state, -2);
+}
+
+static void insert(jack_state_t *state, intptr_t integer) {
+  jack_new_integer(state, integer);
+  jack_list_insert(state, -2);
+}
+
+static intptr_t shift(jack_state_t *state) {
+  jack_list_shift(state, -1);
+  intptr_t integer = jack_get_integer(state, -1);
+  jack_pop(state);
+  return integer;
+}
+
+int main() {
+  jack_state_t *state = jack_new_state(10);
+  jack_new_list(state);
+  jack_list_t *list = top_list(state);
+  intptr_t expected[64];
+
+  // An empty list has nothing at any position.
+  check(state, expected, 0);
+  jack_list_pop(state, -1);
+  assert(jack_get_type(state, -1) == Nil);
+  jack_pop(state);
+
+  // Fill to capacity, then shift and push so the items wrap around the end
+  // of the buffer.
+  for (int i = 0; i < 8; i++) push(state, i);
+  assert(list->capacity == 8);
+  for (int i = 0; i < 5; i++) assert(shift(state) == i);
+  for (int i = 8; i < 13; i++) push(state, i);
+  assert(list->capacity == 8 && list->head + list->length > list->capacity);
+  for (int i = 0; i < 8; i++) expected[i] = i + 5;
+  check(state, expected, 8);
+
+  // Growing while wrapped keeps the order.
+  push(state, 13);
+  assert(list->capacity == 16);
+  expected[8] = 13;
+  check(state, expected, 9);
+
+  // Inserting at the head wraps the other way.
+  for (int i = 0; i < 9; i++) shift(state);
+  assert(jack_list_length(state, -1) == 0 && list->head > 0);
+  for (int i = 0; i < 3; i++) push(state, i);
+  for (int i = 1; i <= 13; i++) insert(state, -i);
+  assert(list->capacity == 16 && list->head + list->length > list->capacity);
+  for (int i = 0; i < 13; i++) expected[i] = i - 13;
+  for (int i = 0; i < 3; i++) expected[13 + i] = i;
+  check(state, expected, 16);
+  insert(state, -14);
+  assert(list->capacity == 32);
+  for (int i = 0; i < 16; i++) expected[16 - i] = expected[15 - i];
+  expected[0] = -14;
+  check(state, expected, 17);
+
+  // Setting by position, negative ones from the tail.
+  jack_new_integer(state, 100);
+  assert(jack_list_set(state, -2, -1));
+  jack_new_integer(state, 200);
+  assert(jack_list_set(state, -2, 0));
+  jack_new_integer(state, 300);
+  assert(!jack_list_set(state, -2, -18));
+  jack_new_integer(state, 400);
+  assert(!jack_list_set(state, -2, 17));
+  expected[16] = 100;
+  expected[0] = 200;
+  check(state, expected, 17);
+
+  // Emptying from both ends.
+  int length = 17, first = 0;
+  while (length) {
+    jack_list_pop(state, -1);
+    assert(jack_get_integer(state, -1) == expected[first + --length]);
+    jack_pop(state);
+    if (!length) break;
+    assert(shift(state) == expected[first++]);
+    length--;
+  }
+  check(state, expected, 0);
+
+  jack_free_state(state);
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// The robin hood map in old/api.c, checked through the API and against the
+// order its probe sequences have to keep.
+
+#define KEYS 2000
+
+static jack_map_t* top_map(jack_state_t *state) {
+  return state->stack->values[state->stack->top - 1]->map;
+}
+
+static int distance(jack_map_t *map, int index) {
+  int home = map->pairs[index].hash >> map->shift;
+  return (index - home) & (map->capacity - 1);
+}
+
+// Without tombstones every pair is at most one slot further from home than
+// the one before it, and a pair right after an empty slot is at home.
+static void check_order(jack_map_t *map) {
+  int mask = map->capacity - 1, length = 0;
+  for (int i = 0; i < map->capacity; i++) {
+    if (!map->pairs[i].key) continue;
+    length++;
+    int before = (i - 1) & mask;
+    if (!map->pairs[before].key) assert(distance(map, i) == 0);
+    else assert(distance(map, i) <= distance(map, before) + 1);
+  }
+  assert(length == map->length);
+}
+
+static void set(jack_state_t *state, int key, int value) {
+  jack_new_integer(state, key);
+  jack_new_integer(state, value);
+  jack_map_set(state, -3);
+}
+
+static bool has(jack_state_t *state, int key) {
+  jack_new_integer(state, key);
+  return jack_map_has(state, -2);
+}
+
+static intptr_t get(jack_state_t *state, int key) {
+  jack_new_integer(state, key);
+  assert(jack_map_get(state, -2));
+  intptr_t value = jack_get_integer(state, -1);
+  jack_pop(state);
+  return value;
+}
+
+static bool delete(jack_state_t *state, int key) {
+  jack_new_integer(state, key);
+  return jack_map_delete(state, -2);
+}
+
+int main() {
+  jack_state_t *state = jack_new_state(10);
+  jack_new_map(state, 0);
+  jack_map_t *map = top_map(state);
+
+  // Every key stays reachable across each resize.
+  int capacity = map->capacity;
+  for (int i = 0; i < KEYS; i++) {
+    set(state, i, i * 2);
+    assert(map->length * 4 <= map->capacity * 3);
+    if (map->capacity != capacity) {
+      capacity = map->capacity;
+      check_order(map);
+      for (int j = 0; j <= i; j++) assert(get(state, j) == j * 2);
+    }
+  }
+  assert(jack_map_length(state, -1) == KEYS);
+  // Replacing doesn't add.
+  set(state, 7, 70);
+  assert(get(state, 7) == 70 && jack_map_length(state, -1) == KEYS);
+
+  // Deleting shifts the rest of the probe sequence back.
+  for (int i = 0; i < KEYS; i += 2) {
+    assert(delete(state, i));
+    check_order(map);
+  }
+  assert(!delete(state, 0) && jack_map_length(state, -1) == KEYS / 2);
+  for (int i = 0; i < KEYS; i++) {
+    assert(has(state, i) == (i & 1));
+    if (i & 1 && i != 7) assert(get(state, i) == i * 2);
+  }
+
+  // Churn through many more keys than fit, a table with tombstones would
+  // have to grow or slow down.
+  capacity = map->capacity;
+  for (int round = 0; round < 100; round++) {
+    int base = KEYS + round * 500;
+    for (int i = 0; i < 500; i++) set(state, base + i, round);
+    for (int i = 0; i < 500; i++) assert(delete(state, base + (i * 7) % 500));
+    assert(!has(state, base));
+  }
+  check_order(map);
+  assert(map->capacity == capacity && jack_map_length(state, -1) == KEYS / 2);
+  for (int i = 1; i < KEYS; i += 2) assert(get(state, i) == (i == 7 ? 70 : i * 2));
+  assert(!has(state, KEYS + 99 * 500));
+
+  // Symbol keys take the same path.
+  jack_new_integer(state, 1);
+  jack_map_set_symbol(state, -2, "one");
+  assert(jack_map_has_symbol(state, -1, "one"));
+  assert(jack_map_delete_symbol(state, -1, "one") && !jack_map_has_symbol(state, -1, "one"));
+  check_order(map);
+
+  jack_free_state(state);
+  return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../old/mem.h"
+
+// The byte primitives in old/mem.c at every level the CPU has, against
+// plain loops, over every size and offset that reaches a vector tail.
+
+#define SIZE 600
+
+static int lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c + 32 : (unsigned char)c;
+}
+
+static int sign(int x) {
+  return (x > 0) - (x < 0);
+}
+
+static const char* find(const char *data, size_t size, const char *needle, size_t length) {
+  for (size_t i = 0; i + length <= size; ++i) {
+    if (!memcmp(data + i, needle, length)) return data + i;
+  }
+  return NULL;
+}
+
+static void check(const char *a, const char *b, uint64_t *hashes) {
+  for (size_t offset = 0; offset < 33; offset += 11) {
+    for (size_t size = 0; size + offset <= SIZE; ++size) {
+      const char *x = a + offset, *y = b + offset;
+      assert(jack_mem_equal(x, y, size) == !memcmp(x, y, size));
+      int order = 0;
+      for (size_t i = 0; i < size && !order; ++i) order = lower(x[i]) - lower(y[i]);
+      assert(sign(jack_mem_casecmp(x, y, size)) == sign(order));
+      assert(jack_mem_chr(x, size, 'z') == memchr(x, 'z', size));
+      for (size_t length = 0; length < 40 && length <= size; length += 3) {
+        const char *needle = x + size - length;
+        assert(jack_mem_find(x, size, needle, length) == find(x, size, needle, length));
+        assert(jack_mem_find(x, size, "zq", 2) == find(x, size, "zq", 2));
+      }
+      uint64_t hash = jack_mem_hash(x, size);
+      if (!offset) {
+        if (hashes[size]) assert(hashes[size] == hash);
+        hashes[size] = hash;
+      }
+    }
+  }
+}
+
+int main() {
+  static char a[SIZE + 64], b[SIZE + 64], out[SIZE * 8];
+  static uint64_t hashes[SIZE + 1];
+  srand(7);
+  for (int i = 0; i < SIZE + 64; ++i) a[i] = "abczqABCZ\x80"[rand() % 10];
+
+  for (int level = JACK_MEM_SCALAR; level <= JACK_MEM_AVX2; ++level) {
+    if ((int)jack_mem_use(level) != level) break;
+    // Equal, then differing in case only, then in one byte near the end.
+    memcpy(b, a, sizeof(b));
+    check(a, b, hashes);
+    for (int i = 0; i < SIZE + 64; ++i) b[i] = a[i] ^ (lower(a[i]) != (unsigned char)a[i] ? 32 : 0);
+    check(a, b, hashes);
+    b[SIZE - 3] = 'q';
+    check(a, b, hashes);
+
+    for (size_t size = 1; size <= 40; ++size) {
+      for (size_t count = 0; count * size <= sizeof(out) && count < 70; ++count) {
+        memset(out, 0, sizeof(out));
+        jack_mem_repeat(out, a, size, count);
+        for (size_t i = 0; i < size * count; ++i) assert(out[i] == a[i % size]);
+        assert(size * count == sizeof(out) || !out[size * count]);
+      }
+    }
+  }
+
+  // Long inputs go through the striped path, which still has to notice a
+  // single bit anywhere.
+  uint64_t hash = jack_mem_hash(a, SIZE);
+  a[SIZE / 2] ^= 1;
+  assert(jack_mem_hash(a, SIZE) != hash);
+  printf("level %d\n", jack_mem_level());
+  return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include "../number.h"
+
+// Random ratios checked against a straightforward reference: the exact
+// result in 128 bits, reduced with Euclid's algorithm.
+
+static uint64_t state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next(void) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dull;
+}
+
+// Between 1 and 63 random bits, so small values are as common as large.
+static int64_t random_int(void) {
+  uint64_t bits = next() % 63 + 1;
+  return (int64_t)(next() >> (64 - bits));
+}
+
+#ifdef __SIZEOF_INT128__
+typedef __int128 wide_t;
+typedef unsigned __int128 uwide_t;
+
+static uwide_t euclid(uwide_t a, uwide_t b) {
+  while (b) {
+    uwide_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static bool reference(wide_t n, wide_t d, jack_ratio_t* r) {
+  if (d < 0) n = -n, d = -d;
+  wide_t g = euclid(n < 0 ? -n : n, d);
+  n /= g, d /= g;
+  if (n <= INT64_MIN || n > INT64_MAX || d > INT64_MAX) return false;
+  *r = (jack_ratio_t){ (int64_t)n, (int64_t)d };
+  return true;
+}
+
+static jack_ratio_t random_ratio(void) {
+  jack_ratio_t r;
+  int64_t n = random_int(), d = next() % 4 ? random_int() : 1;
+  if (next() & 1) n = -n;
+  if (!d) d = 1;
+  assert(reference(n, d, &r));
+  return r;
+}
+
+static void check(bool ok, jack_ratio_t r, bool expected_ok, jack_ratio_t expected) {
+  assert(ok == expected_ok);
+  if (ok) assert(r.num == expected.num && r.den == expected.den);
+}
+
+// Up to n random digits, the top one often small or zero.
+static int random_digits(uint32_t* a, int n) {
+  n = next() % n + 1;
+  for (int i = 0; i < n; i++) a[i] = (uint32_t)next();
+  a[n - 1] >>= next() % 32;
+  if (!(next() % 8)) a[n - 1] = 0;
+  while (n && !a[n - 1]) n--;
+  return n;
+}
+
+static uwide_t to_wide(const uint32_t* a, int n) {
+  uwide_t x = 0;
+  while (n--) x = x << 32 | a[n];
+  return x;
+}
+
+// Big integer digits, against 128 bit arithmetic while they fit and
+// against each other beyond.
+static void check_digits(void) {
+  uint32_t a[40], b[40], q[40], r[40], p[80], s[80];
+  for (int i = 0; i < 100000; i++) {
+    int na = random_digits(a, 2), nb = random_digits(b, 2), nq, nr, n;
+    uwide_t x = to_wide(a, na), y = to_wide(b, nb);
+    assert(jack_digits_compare(a, na, b, nb) == (x > y) - (x < y));
+    n = jack_digits_add(a, na, b, nb, s);
+    assert(to_wide(s, n) == x + y && (!n || s[n - 1]));
+    n = jack_digits_mul(a, na, b, nb, p);
+    assert(to_wide(p, n) == x * y && (!n || p[n - 1]));
+    if (x >= y) {
+      n = jack_digits_sub(a, na, b, nb, s);
+      assert(to_wide(s, n) == x - y && (!n || s[n - 1]));
+    }
+    if (!nb) continue;
+    nq = jack_digits_divmod(a, na, b, nb, q, r, &nr);
+    assert(to_wide(q, nq) == x / y && to_wide(r, nr) == x % y);
+  }
+  // a == q * b + r and r < b, on divisors picked to hit the add back step.
+  for (int i = 0; i < 20000; i++) {
+    int na = random_digits(a, 40), nb = random_digits(b, 20), nq, nr, n;
+    if (!nb) continue;
+    if (i & 1) {
+      for (int j = 0; j < nb; j++) b[j] = j == nb - 1 ? 0x80000000u : j < 2 ? 0xffffffffu : 0;
+    }
+    nq = jack_digits_divmod(a, na, b, nb, q, r, &nr);
+    assert(jack_digits_compare(r, nr, b, nb) < 0);
+    n = jack_digits_mul(q, nq, b, nb, p);
+    n = jack_digits_add(p, n, r, nr, s);
+    assert(jack_digits_compare(s, n, a, na) == 0);
+  }
+}
+
+int main() {
+  check_digits();
+
+  // Binary GCD
+  assert(jack_gcd(0, 0) == 0 && jack_gcd(0, 12) == 12 && jack_gcd(12, 0) == 12);
+  assert(jack_gcd(12, 18) == 6 && jack_gcd(17, 5) == 1);
+  assert(jack_gcd(UINT64_MAX, UINT64_MAX - 1) == 1);
+  for (int i = 0; i < 10000; i++) {
+    uint64_t a = next() >> (next() % 64), b = next() >> (next() % 64);
+    assert(jack_gcd(a, b) == (uint64_t)euclid(a, b));
+  }
+
+  int overflows = 0;
+  for (int i = 0; i < 200000; i++) {
+    jack_ratio_t a = random_ratio(), b = random_ratio(), r, e;
+    wide_t an = a.num, ad = a.den, bn = b.num, bd = b.den;
+    bool ok, expected;
+
+    ok = jack_ratio_add(a, b, &r);
+    check(ok, r, expected = reference(an * bd + bn * ad, ad * bd, &e), e);
+    overflows += !expected;
+    ok = jack_ratio_sub(a, b, &r);
+    check(ok, r, reference(an * bd - bn * ad, ad * bd, &e), e);
+    ok = jack_ratio_mul(a, b, &r);
+    check(ok, r, reference(an * bn, ad * bd, &e), e);
+
+    wide_t x = an * bd, y = bn * ad;
+    assert(jack_ratio_compare(a, b) == (x > y) - (x < y));
+    assert(jack_ratio_compare(a, a) == 0);
+    if (!b.num) continue;
+    ok = jack_ratio_div(a, b, &r);
+    check(ok, r, reference(an * bd, ad * bn, &e), e);
+    ok = jack_ratio_mod(a, b, &r);
+    check(ok, r, reference(x % y, ad * bd, &e), e);
+  }
+  // Both outcomes should be well covered.
+  printf("%d of 200000 additions overflowed\n", overflows);
+  assert(overflows > 2000 && overflows < 198000);
+  return 0;
+}
+#else
+int main() {
+  printf("No 128 bit integers for the reference, skipped\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../old/api.h"
+#include "../old/sched.h"
+
+// Many states interning the same symbols at once on the worker threads of
+// old/sched.c, yielding between rounds.
+
+#define STATES 32
+#define ROUNDS 20
+#define SYMBOLS 200
+
+struct job {
+  int round;
+  const char *first; // Where "symbol-0" lives
+};
+
+static jack_sched_t *sched;
+static jack_state_t *states[STATES], *children[STATES];
+static struct job jobs[STATES], child_jobs[STATES];
+
+static bool child(jack_state_t *state, void *userdata) {
+  struct job *job = userdata;
+  int size;
+  jack_new_symbol(state, "symbol-0");
+  job->first = jack_get_symbol(state, -1, &size);
+  job->round++;
+  return false;
+}
+
+static bool intern(jack_state_t *state, void *userdata) {
+  struct job *job = userdata;
+  char name[32];
+  // Alternate between filling and emptying the table.
+  if (job->round % 2 == 0) {
+    for (int i = 0; i < SYMBOLS; ++i) {
+      snprintf(name, sizeof(name), "symbol-%d", i);
+      jack_new_symbol(state, name);
+    }
+    int size;
+    const char *first = jack_get_symbol(state, -SYMBOLS, &size);
+    assert(size == 8 && !memcmp(first, "symbol-0", 8));
+    job->first = first;
+  }
+  else {
+    jack_popn(state, SYMBOLS);
+  }
+  // Tasks can spawn more tasks, on a state of their own.
+  if (job->round == 3) {
+    int i = job - jobs;
+    children[i] = jack_new_state(10);
+    jack_sched_spawn(sched, children[i], child, &child_jobs[i]);
+  }
+  return ++job->round < ROUNDS;
+}
+
+int main() {
+  // Keeps symbol-0 interned so every state must find the same one.
+  int size;
+  jack_state_t *holder = jack_new_state(10);
+  jack_new_symbol(holder, "symbol-0");
+  const char *first = jack_get_symbol(holder, -1, &size);
+
+  sched = jack_sched_new(4);
+  assert(jack_sched_workers(sched) == 4);
+  for (int i = 0; i < STATES; ++i) {
+    states[i] = jack_new_state(10);
+    jack_sched_spawn(sched, states[i], intern, &jobs[i]);
+  }
+  jack_sched_wait(sched);
+  for (int i = 0; i < STATES; ++i) {
+    assert(jobs[i].round == ROUNDS && child_jobs[i].round == 1);
+    assert(jobs[i].first == first && child_jobs[i].first == first);
+    jack_free_state(states[i]);
+    jack_free_state(children[i]);
+  }
+
+  jack_sched_stats_t stats;
+  jack_sched_stats(sched, &stats);
+  printf("%zu runs, %zu steals, %zu sleeps\n", stats.runs, stats.steals, stats.sleeps);
+  assert(stats.runs == STATES * (ROUNDS + 1));
+  jack_sched_free(sched);
+  jack_free_state(holder);
+  return 0;
+}
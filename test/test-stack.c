@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// Native calls on a window of the caller's stack, and stacks growing and
+// shrinking around them, in old/api.c.
+
+#define DEPTH 5000
+
+// Sum, product and number of two integer arguments.
+static int stats(jack_state_t *state) {
+  intptr_t a = jack_get_integer(state, 0), b = jack_get_integer(state, 1);
+  jack_new_integer(state, a + b);
+  jack_new_integer(state, a * b);
+  jack_new_integer(state, 2);
+  return 3;
+}
+
+// Calls stats on its two arguments and on their results, leaving garbage
+// under the results for jack_call to clean up.
+static int nested(jack_state_t *state) {
+  jack_new_symbol(state, "junk");
+  jack_dup(state, 0);
+  jack_dup(state, 1);
+  assert(jack_call(state, stats, 2) == 3);
+  jack_pop(state); // The count
+  assert(jack_call(state, stats, 2) == 3);
+  assert(jack_get_integer(state, 0) == 3 && jack_get_integer(state, 1) == 4);
+  return 3;
+}
+
+// Pushes far past the stack it was given, keeps the last two.
+static int spill(jack_state_t *state) {
+  assert(jack_checkstack(state, DEPTH));
+  int length = state->stack->length;
+  for (int i = 0; i < DEPTH; i++) jack_new_integer(state, i);
+  assert(state->stack->length == length);
+  for (int i = 0; i < DEPTH; i++) jack_new_integer(state, i);
+  return 2;
+}
+
+// Sum of 1..n, one call deeper for each.
+static int triangle(jack_state_t *state) {
+  intptr_t n = jack_get_integer(state, 0);
+  if (!n) {
+    assert(state->stack->length > DEPTH);
+    return 1;
+  }
+  jack_new_integer(state, n - 1);
+  assert(jack_call(state, triangle, 1) == 1);
+  jack_new_integer(state, jack_get_integer(state, -1) + n);
+  return 1;
+}
+
+int main() {
+  jack_state_t *state = jack_new_state(4);
+  jack_new_symbol(state, "below");
+
+  // Results slide down over the arguments and whatever the callee left.
+  jack_new_integer(state, 3);
+  jack_new_integer(state, 4);
+  assert(jack_call(state, nested, 2) == 3);
+  assert(jack_get_integer(state, -3) == 7 + 12);
+  assert(jack_get_integer(state, -2) == 7 * 12);
+  assert(jack_get_integer(state, -1) == 2);
+  jack_popn(state, 3);
+  int size;
+  assert(jack_get_type(state, -1) == Symbol && jack_get_symbol(state, -1, &size) && size == 5);
+
+  // The callee grows the stack, the caller sees it moved.
+  jack_new_integer(state, 1);
+  assert(jack_call(state, spill, 1) == 2);
+  assert(jack_get_integer(state, -1) == DEPTH - 1 && jack_get_integer(state, -2) == DEPTH - 2);
+  jack_popn(state, 2);
+  assert(jack_get_type(state, -1) == Symbol);
+
+  // Each return with little of it in use halves a big stack again, down to
+  // JACK_STACK_SHRINK.
+  int length = state->stack->length;
+  assert(length > JACK_STACK_SHRINK);
+  jack_new_integer(state, 1);
+  jack_new_integer(state, 2);
+  jack_call(state, stats, 2);
+  jack_popn(state, 3);
+  assert(state->stack->length == length / 2);
+  for (int i = 0; i < 10; i++) {
+    jack_new_integer(state, 1);
+    jack_new_integer(state, 2);
+    jack_call(state, stats, 2);
+    jack_popn(state, 3);
+  }
+  assert(state->stack->length == JACK_STACK_SHRINK);
+
+  // Deep recursion through jack_call, each frame a window on the last.  The
+  // stack shrinks back on the way out.
+  jack_new_integer(state, DEPTH);
+  assert(jack_call(state, triangle, 1) == 1);
+  assert(jack_get_integer(state, -1) == (intptr_t)DEPTH * (DEPTH + 1) / 2);
+  assert(state->stack->length == JACK_STACK_SHRINK);
+  jack_pop(state);
+
+  // Making room past the limit fails without changing anything.
+  length = state->stack->length;
+  assert(!jack_checkstack(state, JACK_STACK_MAX));
+  assert(state->stack->length == length);
+  assert(jack_checkstack(state, 100) && state->stack->length >= 102);
+
+  jack_free_state(state);
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../types.h"
+
+static const jack_symbol_t name = JACK_SYMBOL("name");
+
+int main() {
+  printf("jack_value_t = %lu\n", sizeof(jack_value_t));
+  printf("jack_object_t = %lu\n", sizeof(jack_object_t));
+  printf("jack_symbol_t = %lu\n", sizeof(jack_symbol_t));
+  assert(sizeof(jack_value_t) == sizeof(void*));
+
+  // Immediates
+  assert(jack_typeof(JACK_NIL) == Nil);
+  assert(jack_typeof(JACK_FALSE) == Boolean);
+  assert(jack_typeof(JACK_TRUE) == Boolean);
+  assert(jack_boolean(true) == JACK_TRUE);
+  assert(jack_boolean(false) == JACK_FALSE);
+
+  intptr_t max = INTPTR_MAX >> 1, min = INTPTR_MIN >> 1;
+  intptr_t integers[] = { 0, 1, -1, 42, -100, max, min };
+  for (int i = 0; i < (int)(sizeof(integers) / sizeof(*integers)); ++i) {
+    jack_value_t value = jack_integer(integers[i]);
+    assert(jack_typeof(value) == Integer);
+    assert(jack_tointeger(value) == integers[i]);
+    assert(jack_tobool(value));
+  }
+
+  // Boxed values
+  jack_value_t symbol = jack_object(&name);
+  assert(jack_typeof(symbol) == Symbol);
+  assert(jack_isobject(symbol, Symbol));
+  assert(!jack_isobject(JACK_NIL, Symbol));
+  assert(jack_tosymbol(symbol) == &name);
+
+  jack_value_t error = jack_error(&name);
+  assert(jack_typeof(error) == Error);
+  assert(jack_iserror(error));
+  assert(!jack_isobject(error, Symbol));
+  assert(jack_tosymbol(error) == &name);
+
+  // Truthiness
+  assert(!jack_tobool(JACK_NIL));
+  assert(!jack_tobool(JACK_FALSE));
+  assert(jack_tobool(JACK_TRUE));
+  assert(jack_tobool(symbol));
+  assert(jack_tobool(error));
+  return 0;
+}
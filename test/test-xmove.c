@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../old/api.h"
+
+// Handing values over between states with their own heaps, and sharing
+// frozen ones, in old/api.c.
+
+static size_t bytes(jack_state_t *state) {
+  jack_stats_t stats;
+  jack_get_stats(state, &stats);
+  return stats.bytes;
+}
+
+// {name: :message, id: id, body: <1000 bytes>, tags: [:a, :b, big]}
+static void message(jack_state_t *state, int id) {
+  jack_new_map(state, 4);
+  jack_new_symbol(state, "message");
+  jack_map_set_symbol(state, -2, "name");
+  jack_new_integer(state, id);
+  jack_map_set_symbol(state, -2, "id");
+  memset(jack_new_buffer(state, 1000, NULL), 'x', 1000);
+  jack_map_set_symbol(state, -2, "body");
+  jack_new_list(state);
+  jack_new_symbol(state, "a");
+  jack_list_push(state, -2);
+  jack_new_symbol(state, "b");
+  jack_list_push(state, -2);
+  jack_new_integer(state, INTPTR_MAX);
+  jack_list_push(state, -2);
+  jack_map_set_symbol(state, -2, "tags");
+}
+
+static void check(jack_state_t *state, int index, int id) {
+  int size;
+  jack_dup(state, index);
+  jack_map_get_symbol(state, -1, "id");
+  assert(jack_get_integer(state, -1) == id);
+  jack_pop(state);
+  jack_map_get_symbol(state, -1, "body");
+  assert(jack_get_buffer(state, -1, &size)[999] == 'x' && size == 1000);
+  jack_pop(state);
+  jack_map_get_symbol(state, -1, "tags");
+  jack_list_get(state, -1, 2);
+  assert(jack_get_integer(state, -1) == INTPTR_MAX);
+  jack_popn(state, 3);
+}
+
+int main() {
+  jack_state_t *a = jack_new_state(10);
+  jack_state_t *b = jack_new_state(10);
+
+  // The whole message changes hands, and the big blocks are counted by b.
+  message(a, 1);
+  size_t before = bytes(a);
+  assert(jack_xmove(a, b, 1));
+  assert(bytes(a) < before - 1000);
+  check(b, -1, 1);
+
+  // Nothing moves while part of the graph is held from outside it.
+  message(a, 2);
+  jack_map_get_symbol(a, -1, "tags");
+  assert(!jack_xmove(a, b, 1));
+  jack_dup(a, -2);
+  assert(!jack_xmove(a, b, 2));
+  jack_pop(a);
+  // The tags are held by the message and the stack, both moving.
+  assert(jack_xmove(a, b, 2));
+  jack_pop(b);
+  check(b, -1, 2);
+
+  // Functions are bound to the state they were made in.
+  jack_new_list(a);
+  jack_new_function(a, NULL, 0);
+  jack_list_push(a, -2);
+  assert(!jack_xmove(a, b, 1));
+  assert(!jack_freeze(a, -1));
+  jack_pop(a);
+
+  // Containers the collector buffered leave its roots when they move.
+  jack_gc_enable(a, 0);
+  message(a, 3);
+  jack_map_get_symbol(a, -1, "tags");
+  jack_pop(a);
+  jack_gc_stats_t stats;
+  jack_gc_stats(a, &stats);
+  assert(stats.roots == 1);
+  assert(jack_xmove(a, b, 1));
+  jack_gc_stats(a, &stats);
+  assert(stats.roots == 0);
+  jack_gc_collect(a);
+  check(b, -1, 3);
+
+  // Frozen values are shared, b and c each hold the same one.
+  jack_state_t *c = jack_new_state(10);
+  message(a, 4);
+  assert(jack_freeze(a, -1) && jack_is_frozen(a, -1));
+  jack_map_get_symbol(a, -1, "tags");
+  assert(jack_is_frozen(a, -1));
+  jack_pop(a);
+  jack_dup(a, -1);
+  assert(jack_xmove(a, b, 1));
+  assert(jack_xmove(a, c, 1));
+  check(b, -1, 4);
+  check(c, -1, 4);
+
+  // b and c still have values living in a's slabs after a is gone, and then
+  // c has some of b's too.
+  jack_free_state(a);
+  check(b, 0, 1);
+  assert(jack_xmove(b, c, 4));
+  jack_free_state(b);
+  for (int id = 1; id <= 4; ++id) check(c, id - 5, id);
+  jack_free_state(c);
+  return 0;
+}
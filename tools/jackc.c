@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../compiler.h"
+#include "../image.h"
+#include "../symbol.h"
+
+// Compile a script ahead of time into an image `jack` can map and run.
+//
+//   jackc script.jack script.jkc
+
+static char* read_file(const char* path, size_t* size) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* data = malloc(length + 1);
+  *size = fread(data, 1, length, file);
+  data[*size] = 0;
+  fclose(file);
+  return data;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s script.jack image.jkc\n", argv[0]);
+    return 1;
+  }
+  size_t size;
+  char* source = read_file(argv[1], &size);
+  if (!source) {
+    fprintf(stderr, "Can't read %s\n", argv[1]);
+    return 1;
+  }
+  char error[256];
+  jack_proto_t* proto = jack_compile(source, size, argv[1], error, sizeof(error));
+  free(source);
+  if (!proto) {
+    fprintf(stderr, "%s\n", error);
+    return 1;
+  }
+  FILE* file = fopen(argv[2], "wb");
+  int status = !file || jack_image_write(proto, file) || fclose(file);
+  if (status) fprintf(stderr, "Can't write %s\n", argv[2]);
+  jack_free_proto(proto);
+  jack_intern_free();
+  return status;
+}
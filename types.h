@@ -0,0 +1,132 @@
+#ifndef JACK_TYPES_H
+#define JACK_TYPES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+  Nil,      // Nothing, also the initial value of every slot
+  Error,    // Contagious type that causes all operations to return Error
+  Boolean,  // True or False
+  Integer,  // Signed integer
+  Rational, // Exact fraction that isn't whole, see number.h
+  Function, // C API Function
+  Symbol,   // Immutable interned data
+  List,     // Linked-list of Values
+  Map,      // Hash-map of values (weak key for boxed types)
+  Code,     // Bytecode
+  Closure,  // Bytecode with captured upvalues
+  Upvalue,  // Captured variable, only ever referenced by closures
+  Thread,   // Coroutine with its own value and frame stacks
+} jack_type_t;
+
+// A value is a single machine word.  The low bits say how to read the rest:
+//
+//   ...xxxxxxx1  Integer, shift right one bit to get the signed value
+//   ...00000000  Nil (the all zero word, so zeroed memory is all nil)
+//   ...00000010  false
+//   ...00001010  true
+//   ...ppppp000  Pointer to a boxed value, the header has the type
+//   ...ppppp100  Error, pointer to the symbol holding the message
+//
+// Boxed values are therefore always 8 byte aligned.
+typedef uintptr_t jack_value_t;
+
+#define JACK_NIL   ((jack_value_t)0x0)
+#define JACK_FALSE ((jack_value_t)0x2)
+#define JACK_TRUE  ((jack_value_t)0xa)
+
+#define JACK_TAG_MASK    7
+#define JACK_TAG_OBJECT  0
+#define JACK_TAG_BOOLEAN 2
+#define JACK_TAG_ERROR   4
+
+#ifdef __GNUC__
+#define JACK_ALIGNED __attribute__((aligned(8)))
+#else
+#define JACK_ALIGNED
+#endif
+
+// Common header of every boxed value.
+typedef struct {
+  jack_type_t type;
+} JACK_ALIGNED jack_object_t;
+
+typedef struct {
+  jack_object_t object;
+  int size;
+  const char* data;
+} jack_symbol_t;
+
+#define JACK_SYMBOL(STRING) { { Symbol }, sizeof(STRING) - 1, STRING }
+
+// Integers too big for a tagged word are boxed, with Integer as the object
+// type.  While it fits a word the box holds the value itself and length is
+// 0.  Beyond that it is a big integer: value is its sign, 1 or -1, and the
+// magnitude is length 32 bit digits, least significant first.  Arithmetic
+// only boxes a result outside the tagged range and only makes it big
+// outside a word, so every integer has exactly one representation.
+typedef struct {
+  jack_object_t object;
+  int length;
+  intptr_t value;
+  uint32_t digits[];
+} jack_integer_t;
+
+static inline jack_value_t jack_integer(intptr_t integer) {
+  return (uintptr_t)integer << 1 | 1;
+}
+
+static inline intptr_t jack_tointeger(jack_value_t value) {
+  return (intptr_t)value >> 1;
+}
+
+static inline bool jack_isinteger(jack_value_t value) {
+  return value & 1;
+}
+
+static inline jack_value_t jack_boolean(bool boolean) {
+  return boolean ? JACK_TRUE : JACK_FALSE;
+}
+
+static inline jack_value_t jack_object(const void* object) {
+  return (uintptr_t)object;
+}
+
+static inline jack_object_t* jack_toobject(jack_value_t value) {
+  return (jack_object_t*)value;
+}
+
+static inline bool jack_isobject(jack_value_t value, jack_type_t type) {
+  return value && !(value & JACK_TAG_MASK) &&
+         jack_toobject(value)->type == type;
+}
+
+static inline jack_symbol_t* jack_tosymbol(jack_value_t value) {
+  return (jack_symbol_t*)(value & ~(uintptr_t)JACK_TAG_MASK);
+}
+
+static inline jack_value_t jack_error(const jack_symbol_t* message) {
+  return (uintptr_t)message | JACK_TAG_ERROR;
+}
+
+static inline bool jack_iserror(jack_value_t value) {
+  return (value & JACK_TAG_MASK) == JACK_TAG_ERROR;
+}
+
+static inline jack_type_t jack_typeof(jack_value_t value) {
+  if (value & 1) return Integer;
+  switch (value & JACK_TAG_MASK) {
+    case JACK_TAG_OBJECT: return value ? jack_toobject(value)->type : Nil;
+    case JACK_TAG_BOOLEAN: return Boolean;
+    default: return Error;
+  }
+}
+
+// Only nil and false are falsy.  Those are the only values that are 2 or 0,
+// so or-ing in the false bit tells them apart from everything else.
+static inline bool jack_tobool(jack_value_t value) {
+  return (value | JACK_FALSE) != JACK_FALSE;
+}
+
+#endif
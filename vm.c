@@ -0,0 +1,1589 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Labels-as-values is a GNU extension (gcc, clang, tcc).  Everything else
+// falls back to a plain switch.  Define JACK_SWITCH_DISPATCH to force the
+// fallback for benchmarking.
+#if defined(__GNUC__) && !defined(JACK_SWITCH_DISPATCH)
+#define JACK_COMPUTED_GOTO
+#endif
+
+#include "vm.h"
+#include "image.h"
+#include "number.h"
+#ifdef JACK_PROFILE
+#include "profile.h"
+#endif
+
+#if defined(JACK_TRACE) || defined(JACK_PROFILE_PAIRS)
+static const char* opnames[] = {
+  [END] = "END",
+  [ISLT] = "ISLT", [ISGE] = "ISGE", [ISEQV] = "ISEQV", [ISNEV] = "ISNEV",
+  [ISEQS] = "ISEQS", [ISNES] = "ISNES", [ISEQN] = "ISEQN", [ISNEN] = "ISNEN",
+  [ISEQP] = "ISEQP", [ISNEP] = "ISNEP",
+  [ISLTN] = "ISLTN", [ISGEN] = "ISGEN", [ISLEN] = "ISLEN", [ISGTN] = "ISGTN",
+  [ISTC] = "ISTC", [ISFC] = "ISFC", [IST] = "IST", [ISF] = "ISF",
+  [MOV] = "MOV", [NOT] = "NOT", [UNM] = "UNM", [LEN] = "LEN", [ITER] = "ITER",
+  [ADDVN] = "ADDVN", [SUBVN] = "SUBVN", [MULVN] = "MULVN",
+  [DIVVN] = "DIVVN", [MODVN] = "MODVN",
+  [ADDNV] = "ADDNV", [SUBNV] = "SUBNV", [MULNV] = "MULNV",
+  [DIVNV] = "DIVNV", [MODNV] = "MODNV",
+  [ADDVV] = "ADDVV", [SUBVV] = "SUBVV", [MULVV] = "MULVV",
+  [DIVVV] = "DIVVV", [MODVV] = "MODVV",
+  [KERR] = "KERR", [KSYM] = "KSYM", [KSHORT] = "KSHORT", [KNUM] = "KNUM",
+  [KPRI] = "KPRI", [KNIL] = "KNIL",
+  [UGET] = "UGET", [USETV] = "USETV", [UCLO] = "UCLO",
+  [FNEW] = "FNEW", [CALL] = "CALL", [RET] = "RET",
+  [MNEW] = "MNEW", [MDUP] = "MDUP", [MGETV] = "MGETV", [MGETS] = "MGETS", [MGETB] = "MGETB",
+  [MSETV] = "MSETV", [MSETS] = "MSETS", [MSETB] = "MSETB", [MHAS] = "MHAS",
+  [TNEW] = "TNEW", [RESUME] = "RESUME", [YIELD] = "YIELD",
+  [ADDLT] = "ADDLT", [ADDGE] = "ADDGE", [ADDLTN] = "ADDLTN", [ADDLEN] = "ADDLEN",
+  [JMP] = "JMP",
+};
+#endif
+
+#ifdef JACK_TRACE
+#define TRACE(PC, BC) \
+  printf("%04d %-6s A=%d B=%d C=%d D=%d\n", (int)((PC) - proto->code), \
+    opnames[OPGETOP(BC)], OPGETA(BC), OPGETB(BC), OPGETC(BC), OPGETD(BC))
+#else
+#define TRACE(PC, BC)
+#endif
+
+// Count which opcode follows which, to find out which sequences are worth
+// fusing into one instruction.
+#ifdef JACK_PROFILE_PAIRS
+static uint64_t pairs[JACK_OPCODES][JACK_OPCODES];
+static int last_op;
+#define PROFILE(BC) \
+  pairs[last_op][OPGETOP(BC)]++; \
+  last_op = OPGETOP(BC);
+#else
+#define PROFILE(BC)
+#endif
+
+// The profiler's signal handler records where the interpreter is by itself,
+// from the frame stack and the running prototype and instruction published
+// here.  The prototype is stored on calls, returns and thread switches, and
+// is NULL while the frames move.  The instruction is stored on those and on
+// taken jumps, which include every loop's back edge.  These are plain
+// stores, dispatch never tests for ticks.  The handler only trusts an
+// instruction inside the prototype, so the two can land in either order.
+// It runs on this thread, so a compiler barrier is all the fences need.
+#ifdef JACK_PROFILE
+// Defined here rather than in profile.c so it is reached without going
+// through the GOT for the thread's offset.
+__thread jack_vm_t* jack_profile_vm;
+#define FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define PUBLISH(PROTO, PC) \
+  vm->at = (PC); \
+  vm->running = (PROTO);
+#define PUBLISH_PC(PC) vm->at = (PC);
+#define UNPUBLISH() \
+  vm->running = NULL; \
+  FENCE();
+#else
+#define FENCE()
+#define PUBLISH(PROTO, PC)
+#define PUBLISH_PC(PC)
+#define UNPUBLISH()
+#endif
+
+#ifdef JACK_COMPUTED_GOTO
+#define CASE(OP) L_##OP
+#define NEXT() do { \
+    bc = *pc; TRACE(pc, bc); PROFILE(bc); pc++; \
+    goto *dispatch[OPGETOP(bc)]; \
+  } while (0)
+#define DISPATCH() NEXT();
+#define DISPATCH_END()
+#else
+#define CASE(OP) case OP
+#define NEXT() continue
+#define DISPATCH() for (;;) { \
+    bc = *pc; TRACE(pc, bc); PROFILE(bc); pc++; \
+    switch (OPGETOP(bc)) {
+#define DISPATCH_END() \
+     default: \
+      printf("Invalid opcode %d at %d\n", OPGETOP(bc), (int)(pc - proto->code)); \
+      return 0; \
+    } \
+  }
+#endif
+
+// Take the JMP after a test if COND holds, otherwise step over it.
+#define BRANCH(COND) \
+  if (COND) { \
+    pc += OPGETD(*pc) + 1; \
+    PUBLISH_PC(pc); \
+  } \
+  else pc++; \
+  NEXT();
+
+// Go on in a saved frame.
+#define RESTORE(FRAME) \
+  proto = (FRAME)->proto; \
+  closure = (FRAME)->closure; \
+  pc = (FRAME)->pc; \
+  base = vm->stack + (FRAME)->base; \
+  ks = proto->symbols; \
+  kn = proto->numbers; \
+  caches = proto->caches; \
+  PUBLISH(proto, pc);
+
+// ADDVN, on its own and as the first half of a superinstruction.
+#define ADD_VN() \
+  base[OPGETA(bc)] = add(vm, base[OPGETB(bc)], jack_integer(kn[OPGETC(bc)]));
+
+// Symbol and template constants of image prototypes are made the first
+// time they are used.  Compiled prototypes have them all up front.
+#define KSYMBOL(I) (ks[I] ? ks[I] : jack_image_symbol(proto, I))
+#define KTEMPLATE(I) \
+  (proto->templates[I] ? proto->templates[I] : jack_image_template(proto, I))
+
+static const jack_symbol_t not_a_number = JACK_SYMBOL("Not a Number");
+static const jack_symbol_t division_by_zero = JACK_SYMBOL("Division by zero");
+static const jack_symbol_t integer_overflow = JACK_SYMBOL("Integer overflow");
+static const jack_symbol_t no_length = JACK_SYMBOL("No length");
+static const jack_symbol_t not_iterable = JACK_SYMBOL("Not iterable");
+static const jack_symbol_t not_a_function = JACK_SYMBOL("Not a Function");
+static const jack_symbol_t not_a_map = JACK_SYMBOL("Not a Map");
+static const jack_symbol_t invalid_key = JACK_SYMBOL("Invalid key");
+static const jack_symbol_t not_a_thread = JACK_SYMBOL("Not a Thread");
+static const jack_symbol_t not_suspended = JACK_SYMBOL("Thread not suspended");
+static const jack_symbol_t not_in_thread = JACK_SYMBOL("Yield outside a thread");
+
+// Indexed by the primitive operand of KPRI, ISEQP and ISNEP.
+static const jack_value_t primitives[] = {
+  [PriNil] = JACK_NIL,
+  [PriFalse] = JACK_FALSE,
+  [PriTrue] = JACK_TRUE,
+};
+
+// Allocate an object owned by the VM.  It is freed by the collector once
+// nothing refers to it, which may happen right here for older ones.
+static void* vm_alloc(jack_vm_t* vm, size_t size) {
+  if (vm->allocated >= vm->threshold) jack_collect(vm);
+  jack_gcheader_t* header = malloc(sizeof(*header) + size);
+  assert(header);
+  header->next = vm->objects;
+  header->marked = false;
+  vm->objects = header;
+  vm->allocated += sizeof(*header) + size;
+  return header + 1;
+}
+
+typedef enum { Add, Sub, Mul, Div, Mod } jack_arith_t;
+typedef enum { Lt, Ge, Le, Gt } jack_order_t;
+
+// The fast paths of the ops are small functions that must be inlined even
+// when optimizing for size.
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Overflow checked word arithmetic, true when the result doesn't fit.
+#ifdef __GNUC__
+#define ADD_OVERFLOW(X, Y, R) __builtin_add_overflow(X, Y, R)
+#define SUB_OVERFLOW(X, Y, R) __builtin_sub_overflow(X, Y, R)
+#define MUL_OVERFLOW(X, Y, R) __builtin_mul_overflow(X, Y, R)
+#else
+static bool ADD_OVERFLOW(intptr_t x, intptr_t y, intptr_t* r) {
+  if (y > 0 ? x > INTPTR_MAX - y : x < INTPTR_MIN - y) return true;
+  *r = x + y;
+  return false;
+}
+
+static bool SUB_OVERFLOW(intptr_t x, intptr_t y, intptr_t* r) {
+  if (y < 0 ? x > INTPTR_MAX + y : x < INTPTR_MIN + y) return true;
+  *r = x - y;
+  return false;
+}
+
+static bool MUL_OVERFLOW(intptr_t x, intptr_t y, intptr_t* r) {
+  if (x > 0 ? (y > 0 ? x > INTPTR_MAX / y : y < INTPTR_MIN / x)
+            : (y > 0 ? x < INTPTR_MIN / y : x && y < INTPTR_MAX / x)) {
+    return true;
+  }
+  *r = x * y;
+  return false;
+}
+#endif
+
+// The value of a tagged or boxed integer that fits a word.
+static bool to_word(jack_value_t value, intptr_t* word) {
+  if (jack_isinteger(value)) *word = jack_tointeger(value);
+  else if (jack_isobject(value, Integer) && !((jack_integer_t*)value)->length) {
+    *word = ((jack_integer_t*)value)->value;
+  }
+  else return false;
+  return true;
+}
+
+static inline bool is_integer(jack_value_t value) {
+  return jack_isinteger(value) || jack_isobject(value, Integer);
+}
+
+static inline bool is_big(jack_value_t value) {
+  return jack_isobject(value, Integer) && ((jack_integer_t*)value)->length;
+}
+
+// Tag the integer if it fits, box it if it doesn't.
+static jack_value_t integer(jack_vm_t* vm, intptr_t value) {
+  if (value >= INTPTR_MIN >> 1 && value <= INTPTR_MAX >> 1) return jack_integer(value);
+  jack_integer_t* box = vm_alloc(vm, sizeof(*box));
+  box->object.type = Integer;
+  box->length = 0;
+  box->value = value;
+  return jack_object(box);
+}
+
+static jack_value_t rational(jack_vm_t* vm, jack_ratio_t ratio);
+
+// Any integer as a sign and magnitude.  Words are spread over the two
+// digits kept here, so a big_t must stay where to_big put it.
+typedef struct {
+  bool negative;
+  int length;
+  const uint32_t* digits;
+  uint32_t word[2];
+} big_t;
+
+static void to_big(jack_value_t value, big_t* big) {
+  intptr_t word;
+  if (to_word(value, &word)) {
+    uint64_t magnitude = word < 0 ? -(uint64_t)word : (uint64_t)word;
+    big->negative = word < 0;
+    big->word[0] = (uint32_t)magnitude;
+    big->word[1] = (uint32_t)(magnitude >> 32);
+    big->length = big->word[1] ? 2 : big->word[0] ? 1 : 0;
+    big->digits = big->word;
+  } else {
+    const jack_integer_t* box = (const jack_integer_t*)value;
+    big->negative = box->value < 0;
+    big->length = box->length;
+    big->digits = box->digits;
+  }
+}
+
+// The integer with this sign and magnitude, tagged, boxed or big.
+static jack_value_t make_integer(jack_vm_t* vm, bool negative, const uint32_t* digits,
+                                 int length) {
+  if (length <= 2) {
+    uint64_t magnitude = length ? digits[0] : 0;
+    if (length == 2) magnitude |= (uint64_t)digits[1] << 32;
+    if (magnitude <= (uint64_t)INTPTR_MAX) {
+      return integer(vm, negative ? -(intptr_t)magnitude : (intptr_t)magnitude);
+    }
+    if (negative && magnitude == (uint64_t)INTPTR_MAX + 1) return integer(vm, INTPTR_MIN);
+  }
+  jack_integer_t* box = vm_alloc(vm, sizeof(*box) + sizeof(*digits) * length);
+  box->object.type = Integer;
+  box->length = length;
+  box->value = negative ? -1 : 1;
+  memcpy(box->digits, digits, sizeof(*digits) * length);
+  return jack_object(box);
+}
+
+// The ratio n/d of two magnitudes, reduced.  Rationals stay within 64 bits,
+// so one that doesn't fit is an "Integer overflow" error.
+static jack_value_t big_ratio(jack_vm_t* vm, bool negative, const uint32_t* n, int nn,
+                              const uint32_t* d, int nd) {
+  // Euclid on copies of the two, then both divided by what's left.
+  int size = nn > nd ? nn : nd;
+  uint32_t* scratch = malloc(sizeof(*scratch) * 5 * size);
+  assert(scratch);
+  uint32_t *a = scratch, *b = a + size, *q = b + size, *x = q + size, *y = x + size;
+  int na = nn, nb = nd, nx, ny;
+  memcpy(a, n, sizeof(*a) * nn);
+  memcpy(b, d, sizeof(*b) * nd);
+  while (nb) {
+    int nr;
+    jack_digits_divmod(a, na, b, nb, q, x, &nr);
+    memcpy(a, b, sizeof(*a) * nb);
+    memcpy(b, x, sizeof(*b) * nr);
+    na = nb;
+    nb = nr;
+  }
+  nx = jack_digits_divmod(n, nn, a, na, x, q, &nb);
+  ny = jack_digits_divmod(d, nd, a, na, y, q, &nb);
+  uint64_t num = 0, den = 0;
+  for (int i = nx - 1; i >= 0 && i < 2; i--) num = num << 32 | x[i];
+  for (int i = ny - 1; i >= 0 && i < 2; i--) den = den << 32 | y[i];
+  free(scratch);
+  if (nx > 2 || ny > 2 || num > INT64_MAX || den > INT64_MAX) {
+    return jack_error(&integer_overflow);
+  }
+  return rational(vm, (jack_ratio_t){ negative ? -(int64_t)num : (int64_t)num, den });
+}
+
+// Slow path for integers that don't fit a word, or whose result doesn't.
+// The digits are worked out in scratch memory and only the result is
+// allocated, so nothing half done is there for the collector to free.
+static jack_value_t big_arith(jack_vm_t* vm, jack_value_t b, jack_value_t c,
+                              jack_arith_t op) {
+  big_t x, y;
+  to_big(b, &x);
+  to_big(c, &y);
+  if ((op == Div || op == Mod) && !y.length) return jack_error(&division_by_zero);
+  int size = x.length + y.length + 1, n, nr;
+  uint32_t* r = malloc(sizeof(*r) * 2 * size);
+  assert(r);
+  uint32_t* rest = r + size;
+  bool negative = x.negative;
+  jack_value_t result = JACK_NIL;
+  switch (op) {
+    case Add:
+    case Sub:
+      if ((op == Sub) != (x.negative == y.negative)) {
+        n = jack_digits_add(x.digits, x.length, y.digits, y.length, r);
+      } else if (jack_digits_compare(x.digits, x.length, y.digits, y.length) >= 0) {
+        n = jack_digits_sub(x.digits, x.length, y.digits, y.length, r);
+      } else {
+        n = jack_digits_sub(y.digits, y.length, x.digits, x.length, r);
+        negative = (op == Sub) != y.negative;
+      }
+      result = make_integer(vm, negative, r, n);
+      break;
+    case Mul:
+      n = jack_digits_mul(x.digits, x.length, y.digits, y.length, r);
+      result = make_integer(vm, x.negative != y.negative, r, n);
+      break;
+    case Div:
+    case Mod:
+      n = jack_digits_divmod(x.digits, x.length, y.digits, y.length, r, rest, &nr);
+      if (op == Mod) result = make_integer(vm, x.negative, rest, nr);
+      else if (!nr) result = make_integer(vm, x.negative != y.negative, r, n);
+      else {
+        result = big_ratio(vm, x.negative != y.negative, x.digits, x.length, y.digits,
+                           y.length);
+      }
+      break;
+  }
+  free(r);
+  return result;
+}
+
+// Any number as a ratio.
+static bool to_ratio(jack_value_t value, jack_ratio_t* ratio) {
+  intptr_t word;
+  if (to_word(value, &word)) *ratio = (jack_ratio_t){ word, 1 };
+  else if (jack_isobject(value, Rational)) *ratio = ((jack_rational_t*)value)->ratio;
+  else return false;
+  return true;
+}
+
+// Whole ratios become integers, the rest are boxed.
+static jack_value_t rational(jack_vm_t* vm, jack_ratio_t ratio) {
+  if (ratio.den == 1) {
+    if (ratio.num < INTPTR_MIN || ratio.num > INTPTR_MAX) {
+      return jack_error(&integer_overflow);
+    }
+    return integer(vm, (intptr_t)ratio.num);
+  }
+  jack_rational_t* box = vm_alloc(vm, sizeof(*box));
+  box->object.type = Rational;
+  box->ratio = ratio;
+  return jack_object(box);
+}
+
+// Slow path for Rationals and division that isn't exact.
+static jack_value_t ratio_arith(jack_vm_t* vm, jack_value_t b, jack_value_t c,
+                                jack_arith_t op) {
+  static bool (*const ops[])(jack_ratio_t, jack_ratio_t, jack_ratio_t*) = {
+    [Add] = jack_ratio_add, [Sub] = jack_ratio_sub, [Mul] = jack_ratio_mul,
+    [Div] = jack_ratio_div, [Mod] = jack_ratio_mod,
+  };
+  jack_ratio_t x, y, r;
+  if (!to_ratio(b, &x) || !to_ratio(c, &y)) {
+    bool numbers = (is_integer(b) || jack_isobject(b, Rational)) &&
+                   (is_integer(c) || jack_isobject(c, Rational));
+    return jack_error(numbers ? &integer_overflow : &not_a_number);
+  }
+  if ((op == Div || op == Mod) && !y.num) return jack_error(&division_by_zero);
+  if (x.num == INT64_MIN || y.num == INT64_MIN || !ops[op](x, y, &r)) {
+    return jack_error(&integer_overflow);
+  }
+  return rational(vm, r);
+}
+
+// Shared slow path for all the binary ops.  Errors are contagious and anything
+// that isn't a number is "Not a Number".  Integer results beyond the tagged
+// range are boxed and results beyond a word are big integers.  Division is
+// exact, it gives a Rational unless the divisor goes into the dividend.
+// Rationals are 64 bit, one past that is an "Integer overflow" error.
+static jack_value_t arith(jack_vm_t* vm, jack_value_t b, jack_value_t c,
+                          jack_arith_t op) {
+  if (jack_iserror(b)) return b;
+  if (jack_iserror(c)) return c;
+  intptr_t x, y, r = 0;
+  if (!to_word(b, &x) || !to_word(c, &y)) {
+    if (is_integer(b) && is_integer(c)) return big_arith(vm, b, c, op);
+    return ratio_arith(vm, b, c, op);
+  }
+  switch (op) {
+    case Add:
+      if (ADD_OVERFLOW(x, y, &r)) return big_arith(vm, b, c, Add);
+      break;
+    case Sub:
+      if (SUB_OVERFLOW(x, y, &r)) return big_arith(vm, b, c, Sub);
+      break;
+    case Mul:
+      if (MUL_OVERFLOW(x, y, &r)) return big_arith(vm, b, c, Mul);
+      break;
+    case Div:
+    case Mod:
+      if (!y) return jack_error(&division_by_zero);
+      if (y == -1) {
+        if (op == Mod) return jack_integer(0);
+        if (x == INTPTR_MIN) return big_arith(vm, b, c, Div);
+      }
+      if (op == Div && x % y) return ratio_arith(vm, b, c, Div);
+      r = op == Div ? x / y : x % y;
+      break;
+  }
+  return integer(vm, r);
+}
+
+// Add, subtract and multiply work on the tagged words while both operands
+// are tagged and the result fits, see jack_integer().  Only overflow out of
+// the tagged range and other types go to arith().
+//
+// Building with JACK_UNCHECKED_ARITH drops the overflow checks, so tagged
+// results wrap around, to measure what the checks cost: make bench-arith.
+#ifdef JACK_UNCHECKED_ARITH
+#undef ADD_OVERFLOW
+#undef SUB_OVERFLOW
+#undef MUL_OVERFLOW
+#define ADD_OVERFLOW(X, Y, R) (*(R) = (intptr_t)((uintptr_t)(X) + (uintptr_t)(Y)), false)
+#define SUB_OVERFLOW(X, Y, R) (*(R) = (intptr_t)((uintptr_t)(X) - (uintptr_t)(Y)), false)
+#define MUL_OVERFLOW(X, Y, R) (*(R) = (intptr_t)((uintptr_t)(X) * (uintptr_t)(Y)), false)
+#endif
+
+static ALWAYS_INLINE jack_value_t add(jack_vm_t* vm, jack_value_t b, jack_value_t c) {
+  intptr_t r;
+  if (b & c & 1 && !ADD_OVERFLOW((intptr_t)b, (intptr_t)(c - 1), &r)) return r;
+  return arith(vm, b, c, Add);
+}
+
+static ALWAYS_INLINE jack_value_t sub(jack_vm_t* vm, jack_value_t b, jack_value_t c) {
+  intptr_t r;
+  if (b & c & 1 && !SUB_OVERFLOW((intptr_t)b, (intptr_t)(c - 1), &r)) return r;
+  return arith(vm, b, c, Sub);
+}
+
+static ALWAYS_INLINE jack_value_t mul(jack_vm_t* vm, jack_value_t b, jack_value_t c) {
+  intptr_t r;
+  if (b & c & 1 && !MUL_OVERFLOW(jack_tointeger(b), (intptr_t)(c - 1), &r)) {
+    return r + 1;
+  }
+  return arith(vm, b, c, Mul);
+}
+
+// A big integer is beyond every word and Rational, so only its sign matters
+// unless both are big.
+static int compare_big(jack_value_t a, jack_value_t d) {
+  const jack_integer_t *x = (const jack_integer_t*)a, *y = (const jack_integer_t*)d;
+  if (!is_big(d)) return is_integer(d) || jack_isobject(d, Rational) ? (int)x->value : -1;
+  if (!is_big(a)) return is_integer(a) || jack_isobject(a, Rational) ? -(int)y->value : 1;
+  if (x->value != y->value) return x->value < y->value ? -1 : 1;
+  return (int)x->value * jack_digits_compare(x->digits, x->length, y->digits, y->length);
+}
+
+// Slow path of the ordered comparisons, when either side isn't a tagged
+// integer.  Anything that isn't a number sorts after every number and level
+// with anything else that isn't, so that every test stays the exact
+// opposite of its negation: the compiler branches on ISGE for a < b.
+static bool compare(jack_value_t a, jack_value_t d, jack_order_t order) {
+  jack_ratio_t x, y;
+  bool numbers = to_ratio(a, &x), numberd = to_ratio(d, &y);
+  int c;
+  if (is_big(a) || is_big(d)) c = compare_big(a, d);
+  else if (!numbers || !numberd) c = numberd - numbers;
+  else if (x.den == 1 && y.den == 1) c = (x.num > y.num) - (x.num < y.num);
+  else c = jack_ratio_compare(x, y);
+  switch (order) {
+    case Lt: return c < 0;
+    case Ge: return c >= 0;
+    case Le: return c <= 0;
+    case Gt: return c > 0;
+  }
+  return false;
+}
+
+// Boxed numbers are equal by value.  Each number has one representation,
+// so they are only ever equal to a box of the same type.
+static bool equal_boxed(jack_value_t a, jack_value_t d) {
+  if (jack_isobject(a, Integer) && jack_isobject(d, Integer)) {
+    const jack_integer_t *x = (const jack_integer_t*)a, *y = (const jack_integer_t*)d;
+    return x->length == y->length && x->value == y->value &&
+           !memcmp(x->digits, y->digits, sizeof(*x->digits) * x->length);
+  }
+  if (jack_isobject(a, Rational) && jack_isobject(d, Rational)) {
+    jack_ratio_t x = ((jack_rational_t*)a)->ratio, y = ((jack_rational_t*)d)->ratio;
+    return x.num == y.num && x.den == y.den;
+  }
+  return false;
+}
+
+// Values are equal when they are the same word, except boxed numbers.
+static ALWAYS_INLINE bool equal(jack_value_t a, jack_value_t d) {
+  return a == d || equal_boxed(a, d);
+}
+
+jack_map_t* jack_new_map(jack_vm_t* vm, int capacity) {
+  jack_map_t* map = vm_alloc(vm, sizeof(*map));
+  jack_map_init(map, capacity);
+  vm->allocated += sizeof(jack_value_t) * 2 * map->capacity;
+  return map;
+}
+
+jack_map_t* jack_dup_map(jack_vm_t* vm, const jack_map_t* template) {
+  jack_map_t* map = vm_alloc(vm, sizeof(*map) + sizeof(jack_value_t) * template->capacity);
+  jack_map_copy_template(map, template, (jack_value_t*)(map + 1));
+  return map;
+}
+
+// Map ops share these.  Errors in either operand are passed through, and
+// nil (or an error) can't be a key.
+static jack_value_t map_get(jack_value_t map, jack_value_t key) {
+  if (!jack_isobject(map, Map)) {
+    return jack_iserror(map) ? map : jack_error(&not_a_map);
+  }
+  if (jack_iserror(key)) return key;
+  return jack_map_get((const jack_map_t*)jack_toobject(map), key);
+}
+
+static void map_set(jack_value_t map, jack_value_t key, jack_value_t value) {
+  if (jack_isobject(map, Map) && key && !jack_iserror(key)) {
+    jack_map_set((jack_map_t*)jack_toobject(map), key, value);
+  }
+}
+
+static jack_value_t map_has(jack_value_t key, jack_value_t map) {
+  if (!jack_isobject(map, Map)) {
+    return jack_iserror(map) ? map : jack_error(&not_a_map);
+  }
+  if (!key || jack_iserror(key)) {
+    return jack_iserror(key) ? key : jack_error(&invalid_key);
+  }
+  return jack_boolean(jack_map_has((const jack_map_t*)jack_toobject(map), key));
+}
+
+// Inline cache misses of MGETS and MSETS do the full lookup and remember
+// where the key is for next time.
+static jack_value_t cached_get(jack_vm_t* vm, jack_value_t map, jack_value_t key,
+                               uint32_t* cache) {
+  vm->cache_misses++;
+  if (!jack_isobject(map, Map)) return map_get(map, key);
+  const jack_map_t* m = (const jack_map_t*)jack_toobject(map);
+  int index = jack_map_index(m, key);
+  if (index < 0) return JACK_NIL;
+  *cache = index;
+  return m->values[index];
+}
+
+static void cached_set(jack_vm_t* vm, jack_value_t map, jack_value_t key,
+                       jack_value_t value, uint32_t* cache) {
+  vm->cache_misses++;
+  if (!jack_isobject(map, Map)) return;
+  *cache = jack_map_set((jack_map_t*)jack_toobject(map), key, value);
+}
+
+// Find or create the open upvalue for a stack slot.  The open list is kept
+// sorted so the search stops early and closing can stop at the first slot
+// below the level.
+static jack_upval_t* find_upval(jack_vm_t* vm, int index) {
+  jack_upval_t** link = &vm->open;
+  while (*link && (*link)->index > index) link = &(*link)->next;
+  if (*link && (*link)->index == index) return *link;
+  jack_upval_t* upval = vm_alloc(vm, sizeof(*upval));
+  upval->object.type = Upvalue;
+  upval->index = index;
+  upval->ref = &vm->stack[index];
+  upval->value = JACK_NIL;
+  upval->next = *link;
+  *link = upval;
+  return upval;
+}
+
+static void close_upvals(jack_vm_t* vm, int level) {
+  while (vm->open && vm->open->index >= level) {
+    jack_upval_t* upval = vm->open;
+    upval->value = *upval->ref;
+    upval->ref = &upval->value;
+    vm->open = upval->next;
+  }
+}
+
+// The upvalues are opened before the closure is allocated, so a collection
+// in between finds them on the open list and the closure is never seen
+// half made.
+static jack_value_t new_closure(jack_vm_t* vm, const jack_proto_t* proto,
+                                const jack_closure_t* parent, int base) {
+  for (int i = 0; i < proto->nupvals; i++) {
+    if (proto->upvals[i].local) find_upval(vm, base + proto->upvals[i].index);
+  }
+  jack_closure_t* closure = vm_alloc(vm,
+    sizeof(*closure) + sizeof(*closure->upvals) * proto->nupvals);
+  closure->object.type = Closure;
+  closure->proto = proto;
+  for (int i = 0; i < proto->nupvals; i++) {
+    const jack_upvaldesc_t* desc = &proto->upvals[i];
+    closure->upvals[i] = desc->local ? find_upval(vm, base + desc->index)
+                                     : parent->upvals[desc->index];
+  }
+  return jack_object(closure);
+}
+
+uint32_t* jack_new_caches(const uint32_t* code, int ncode) {
+  for (int i = 0; i < ncode; i++) {
+    if (OPGETOP(code[i]) == MGETS || OPGETOP(code[i]) == MSETS) {
+      uint32_t* caches = calloc(ncode, sizeof(*caches));
+      assert(caches);
+      return caches;
+    }
+  }
+  return NULL;
+}
+
+void jack_vm_init(jack_vm_t* vm) {
+  vm->size = JACK_STACK_SIZE;
+  vm->stack = calloc(vm->size, sizeof(*vm->stack));
+  vm->max_depth = JACK_FRAMES_SIZE;
+  vm->frames = malloc(sizeof(*vm->frames) * vm->max_depth);
+  vm->depth = 0;
+  vm->open = NULL;
+  vm->objects = NULL;
+  vm->cache_hits = vm->cache_misses = 0;
+  vm->main = (jack_thread_t){ .object = { Thread }, .status = ThreadRunning };
+  vm->thread = &vm->main;
+  vm->nspare = 0;
+  vm->allocated = 0;
+  vm->threshold = JACK_GC_MIN;
+  vm->gray = NULL;
+  vm->ngray = vm->maxgray = 0;
+  vm->running = NULL;
+  vm->at = NULL;
+}
+
+// Hand the stacks of a thread that is done with them to the spares, or
+// free them.  Stacks a deep thread grew aren't worth keeping around.
+// Spares are cleared, the collector doesn't look at them and whatever was
+// left on them may go.
+static void retire(jack_vm_t* vm, jack_thread_t* thread) {
+  if (!thread->stack) return;
+  if (vm->nspare < JACK_SPARE_THREADS && thread->size <= JACK_STACK_SIZE &&
+      thread->max_depth <= JACK_FRAMES_SIZE) {
+    memset(thread->stack, 0, sizeof(*thread->stack) * thread->size);
+    vm->spare[vm->nspare++] = (jack_stacks_t){
+      thread->stack, thread->size, thread->frames, thread->max_depth
+    };
+  }
+  else {
+    free(thread->stack);
+    free(thread->frames);
+  }
+  thread->stack = NULL;
+  thread->frames = NULL;
+}
+
+static void free_object(jack_vm_t* vm, jack_gcheader_t* header) {
+  jack_object_t* object = (jack_object_t*)(header + 1);
+  if (object->type == Map) jack_map_clear((jack_map_t*)object);
+  if (object->type == Thread) retire(vm, (jack_thread_t*)object);
+  free(header);
+}
+
+void jack_vm_free(jack_vm_t* vm) {
+  jack_gcheader_t* header = vm->objects;
+  while (header) {
+    jack_gcheader_t* next = header->next;
+    free_object(vm, header);
+    header = next;
+  }
+  while (vm->nspare) {
+    free(vm->spare[--vm->nspare].stack);
+    free(vm->spare[vm->nspare].frames);
+  }
+  free(vm->stack);
+  free(vm->frames);
+  free(vm->gray);
+}
+
+// Mark a value and queue it to have its own references marked, unless it
+// has none.  Only objects from vm_alloc are marked.  Symbols, prototypes
+// and natives are owned elsewhere, as is the main thread, which is a root.
+static void mark(jack_vm_t* vm, jack_value_t value) {
+  if (!value || value & JACK_TAG_MASK) return;
+  jack_object_t* object = jack_toobject(value);
+  switch (object->type) {
+    case Integer: case Rational: case Map: case Closure: case Upvalue: case Thread:
+      break;
+    default:
+      return;
+  }
+  if (object == &vm->main.object) return;
+  jack_gcheader_t* header = (jack_gcheader_t*)object - 1;
+  if (header->marked) return;
+  header->marked = true;
+  if (object->type == Integer || object->type == Rational) return;
+  if (vm->ngray == vm->maxgray) {
+    vm->maxgray = vm->maxgray ? vm->maxgray * 2 : 256;
+    vm->gray = realloc(vm->gray, sizeof(*vm->gray) * vm->maxgray);
+    assert(vm->gray);
+  }
+  vm->gray[vm->ngray++] = object;
+}
+
+// The running thread's stacks are the VM's.  Which frame is running isn't
+// known here, so every slot of a stack is marked, including whatever is
+// left above the top.  Dead threads have given their stacks away.
+static void mark_thread(jack_vm_t* vm, jack_thread_t* thread) {
+  if (thread->status == ThreadDead) return;
+  const jack_value_t* stack = thread->stack;
+  const jack_frame_t* frames = thread->frames;
+  const jack_upval_t* open = thread->open;
+  int size = thread->size, depth = thread->depth;
+  if (thread == vm->thread) {
+    stack = vm->stack;
+    frames = vm->frames;
+    open = vm->open;
+    size = vm->size;
+    depth = vm->depth;
+  }
+  for (int i = 0; i < size; i++) mark(vm, stack[i]);
+  for (int i = 0; i < depth; i++) mark(vm, jack_object(frames[i].closure));
+  for (; open; open = open->next) mark(vm, jack_object(open));
+  mark(vm, jack_object(thread->frame.closure));
+  if (thread->resumer) mark(vm, jack_object(thread->resumer));
+}
+
+static void traverse(jack_vm_t* vm, jack_object_t* object) {
+  switch (object->type) {
+    case Map:
+      {
+        const jack_map_t* map = (const jack_map_t*)object;
+        for (int i = 0; i < map->capacity; i++) {
+          if (!map->keys[i]) continue;
+          mark(vm, map->keys[i]);
+          mark(vm, map->values[i]);
+        }
+      }
+      break;
+    case Closure:
+      {
+        const jack_closure_t* closure = (const jack_closure_t*)object;
+        for (int i = 0; i < closure->proto->nupvals; i++) {
+          mark(vm, jack_object(closure->upvals[i]));
+        }
+      }
+      break;
+    case Upvalue:
+      mark(vm, *((const jack_upval_t*)object)->ref);
+      break;
+    case Thread:
+      mark_thread(vm, (jack_thread_t*)object);
+      break;
+    default:
+      break;
+  }
+}
+
+// Roughly what an object holds on to, to pace the collector.
+static size_t object_size(const jack_object_t* object) {
+  size_t size = sizeof(jack_gcheader_t);
+  switch (object->type) {
+    case Integer:
+      return size + sizeof(jack_integer_t) +
+             sizeof(uint32_t) * ((const jack_integer_t*)object)->length;
+    case Rational:
+      return size + sizeof(jack_rational_t);
+    case Map:
+      {
+        const jack_map_t* map = (const jack_map_t*)object;
+        return size + sizeof(*map) +
+               sizeof(jack_value_t) * map->capacity * (map->shared_keys ? 1 : 2);
+      }
+    case Closure:
+      return size + sizeof(jack_closure_t) +
+             sizeof(jack_upval_t*) * ((const jack_closure_t*)object)->proto->nupvals;
+    case Upvalue:
+      return size + sizeof(jack_upval_t);
+    case Thread:
+      {
+        const jack_thread_t* thread = (const jack_thread_t*)object;
+        size += sizeof(*thread);
+        if (thread->stack) size += sizeof(*thread->stack) * thread->size;
+        if (thread->frames) size += sizeof(*thread->frames) * thread->max_depth;
+        return size;
+      }
+    default:
+      return size;
+  }
+}
+
+static bool marked(const void* object) {
+  return ((const jack_gcheader_t*)object - 1)->marked;
+}
+
+// Mark and sweep.  Marking goes through the gray queue rather than
+// recursing, so long chains of maps can't overflow the C stack.
+void jack_collect(jack_vm_t* vm) {
+  mark_thread(vm, &vm->main);
+  mark(vm, jack_object(vm->thread));
+  while (vm->ngray) traverse(vm, vm->gray[--vm->ngray]);
+  // Closures may still use the open upvalues of a thread that is about to
+  // go, those get the value from its stack before it does.
+  for (jack_gcheader_t* header = vm->objects; header; header = header->next) {
+    jack_thread_t* thread = (jack_thread_t*)(header + 1);
+    if (header->marked || thread->object.type != Thread) continue;
+    for (jack_upval_t* upval = thread->open; upval; upval = upval->next) {
+      if (!marked(upval)) continue;
+      upval->value = *upval->ref;
+      upval->ref = &upval->value;
+    }
+  }
+  size_t live = 0;
+  jack_gcheader_t** link = &vm->objects;
+  while (*link) {
+    jack_gcheader_t* header = *link;
+    if (header->marked) {
+      header->marked = false;
+      live += object_size((const jack_object_t*)(header + 1));
+      link = &header->next;
+    }
+    else {
+      *link = header->next;
+      free_object(vm, header);
+    }
+  }
+  vm->allocated = live;
+  vm->threshold = live / 100 * JACK_GC_PAUSE;
+  if (vm->threshold < JACK_GC_MIN) vm->threshold = JACK_GC_MIN;
+}
+
+// Make room for `slots` values starting at `base`, returning the new base.
+// New slots start out as nil, open upvalues follow their slots.
+static jack_value_t* vm_grow(jack_vm_t* vm, jack_value_t* base, int slots) {
+  int offset = base - vm->stack;
+  int size = vm->size;
+  while (offset + slots > size) size *= 2;
+  vm->stack = realloc(vm->stack, sizeof(*vm->stack) * size);
+  assert(vm->stack);
+  memset(vm->stack + vm->size, 0, sizeof(*vm->stack) * (size - vm->size));
+  vm->size = size;
+  for (jack_upval_t* upval = vm->open; upval; upval = upval->next) {
+    upval->ref = &vm->stack[upval->index];
+  }
+  return vm->stack + offset;
+}
+
+static void vm_grow_frames(jack_vm_t* vm) {
+  vm->max_depth *= 2;
+  vm->frames = realloc(vm->frames, sizeof(*vm->frames) * vm->max_depth);
+  assert(vm->frames);
+}
+
+jack_thread_t* jack_new_thread(jack_vm_t* vm, jack_value_t function) {
+  jack_frame_t start = { 0 };
+  if (jack_isobject(function, Closure)) {
+    start.closure = (const jack_closure_t*)jack_toobject(function);
+    start.proto = start.closure->proto;
+  }
+  else if (jack_isobject(function, Code)) {
+    start.proto = (const jack_proto_t*)jack_toobject(function);
+  }
+  else {
+    return NULL;
+  }
+  jack_thread_t* thread = vm_alloc(vm, sizeof(*thread));
+  *thread = (jack_thread_t){
+    .object = { Thread },
+    .status = ThreadSuspended,
+    .frame = start,
+  };
+  if (vm->nspare) {
+    const jack_stacks_t* spare = &vm->spare[--vm->nspare];
+    thread->stack = spare->stack;
+    thread->size = spare->size;
+    thread->frames = spare->frames;
+    thread->max_depth = spare->max_depth;
+  }
+  else {
+    thread->size = JACK_THREAD_STACK_SIZE;
+    thread->stack = calloc(thread->size, sizeof(*thread->stack));
+    thread->max_depth = JACK_THREAD_FRAMES_SIZE;
+    thread->frames = malloc(sizeof(*thread->frames) * thread->max_depth);
+    assert(thread->stack && thread->frames);
+    vm->allocated += sizeof(*thread->stack) * thread->size +
+                     sizeof(*thread->frames) * thread->max_depth;
+  }
+  return thread;
+}
+
+// Park the running thread's stacks and run on those of `to` instead.
+static void switch_to(jack_vm_t* vm, jack_thread_t* to) {
+  jack_thread_t* from = vm->thread;
+  from->stack = vm->stack;
+  from->size = vm->size;
+  from->frames = vm->frames;
+  from->depth = vm->depth;
+  from->max_depth = vm->max_depth;
+  from->open = vm->open;
+  vm->stack = to->stack;
+  vm->size = to->size;
+  vm->frames = to->frames;
+  vm->depth = to->depth;
+  vm->max_depth = to->max_depth;
+  vm->open = to->open;
+  vm->thread = to;
+}
+
+// Give `n` values to the thread just switched to, see jack_thread_t.frame,
+// and return the frame it goes on in.
+static const jack_frame_t* deliver(jack_vm_t* vm, const jack_value_t* values, int n) {
+  jack_frame_t* frame = &vm->thread->frame;
+  jack_value_t* slots;
+  int want;
+  if (frame->pc) {
+    slots = vm->stack + frame->base + OPGETA(frame->pc[-1]);
+    want = frame->want;
+  }
+  else {
+    // The function goes in the first slot with its frame after it, as for
+    // a call, which keeps a closure alive while it runs.
+    const jack_proto_t* proto = frame->proto;
+    if (proto->slots + 1 > vm->size) vm_grow(vm, vm->stack, proto->slots + 1);
+    vm->stack[0] = frame->closure ? jack_object(frame->closure) : jack_object(proto);
+    slots = vm->stack + 1;
+    want = proto->params;
+    frame->pc = proto->code;
+    frame->base = 1;
+  }
+  for (int i = 0; i < want; i++) slots[i] = i < n ? values[i] : JACK_NIL;
+  return frame;
+}
+
+// Run proto on the running thread.  With `thread` set, resume that instead
+// with the `n` values at *values, until it yields or returns to C.  Returns
+// the number of values returned, which *values points at.
+static int execute(jack_vm_t* vm, const jack_proto_t* proto, jack_thread_t* thread,
+                   const jack_value_t** values, int n) {
+#ifdef JACK_COMPUTED_GOTO
+  static void* const dispatch[] = {
+    [END] = &&L_END,
+    [ISLT] = &&L_ISLT, [ISGE] = &&L_ISGE,
+    [ISEQV] = &&L_ISEQV, [ISNEV] = &&L_ISNEV,
+    [ISEQS] = &&L_ISEQS, [ISNES] = &&L_ISNES,
+    [ISEQN] = &&L_ISEQN, [ISNEN] = &&L_ISNEN,
+    [ISEQP] = &&L_ISEQP, [ISNEP] = &&L_ISNEP,
+    [ISLTN] = &&L_ISLTN, [ISGEN] = &&L_ISGEN,
+    [ISLEN] = &&L_ISLEN, [ISGTN] = &&L_ISGTN,
+    [ISTC] = &&L_ISTC, [ISFC] = &&L_ISFC, [IST] = &&L_IST, [ISF] = &&L_ISF,
+    [MOV] = &&L_MOV, [NOT] = &&L_NOT, [UNM] = &&L_UNM,
+    [LEN] = &&L_LEN, [ITER] = &&L_ITER,
+    [ADDVN] = &&L_ADDVN, [SUBVN] = &&L_SUBVN, [MULVN] = &&L_MULVN,
+    [DIVVN] = &&L_DIVVN, [MODVN] = &&L_MODVN,
+    [ADDNV] = &&L_ADDNV, [SUBNV] = &&L_SUBNV, [MULNV] = &&L_MULNV,
+    [DIVNV] = &&L_DIVNV, [MODNV] = &&L_MODNV,
+    [ADDVV] = &&L_ADDVV, [SUBVV] = &&L_SUBVV, [MULVV] = &&L_MULVV,
+    [DIVVV] = &&L_DIVVV, [MODVV] = &&L_MODVV,
+    [KERR] = &&L_KERR, [KSYM] = &&L_KSYM, [KSHORT] = &&L_KSHORT,
+    [KNUM] = &&L_KNUM, [KPRI] = &&L_KPRI, [KNIL] = &&L_KNIL,
+    [UGET] = &&L_UGET, [USETV] = &&L_USETV, [UCLO] = &&L_UCLO,
+    [FNEW] = &&L_FNEW, [CALL] = &&L_CALL, [RET] = &&L_RET,
+    [MNEW] = &&L_MNEW, [MDUP] = &&L_MDUP,
+    [MGETV] = &&L_MGETV, [MGETS] = &&L_MGETS,
+    [MGETB] = &&L_MGETB, [MSETV] = &&L_MSETV, [MSETS] = &&L_MSETS,
+    [MSETB] = &&L_MSETB, [MHAS] = &&L_MHAS,
+    [TNEW] = &&L_TNEW, [RESUME] = &&L_RESUME, [YIELD] = &&L_YIELD,
+    [ADDLT] = &&L_ADDLT, [ADDGE] = &&L_ADDGE,
+    [ADDLTN] = &&L_ADDLTN, [ADDLEN] = &&L_ADDLEN,
+    [JMP] = &&L_JMP,
+  };
+#endif
+  // Everything the hot loop needs is kept in locals so it can live in
+  // registers.  They are reloaded from the frame stack on return.
+  const uint32_t* pc;
+  jack_value_t* base;
+  const jack_closure_t* closure;
+  const jack_closure_t* callee;
+  const jack_symbol_t* const* ks;
+  const intptr_t* kn;
+  uint32_t* caches;
+  jack_map_t* map;
+  uint32_t bc;
+  jack_value_t A, B, C, D;
+  jack_value_t* results;
+  const jack_value_t* args;
+  const jack_frame_t* frame;
+  jack_thread_t* resumer;
+  int i;
+
+  if (thread) {
+    // No frame to go on in, leaving the thread returns to C.
+    vm->thread->frame.pc = NULL;
+    args = *values;
+    goto resume;
+  }
+  pc = proto->code;
+  base = vm->stack;
+  closure = NULL;
+  ks = proto->symbols;
+  kn = proto->numbers;
+  caches = proto->caches;
+  if (proto->slots > vm->size) base = vm_grow(vm, base, proto->slots);
+  PUBLISH(proto, pc);
+
+  DISPATCH()
+
+  CASE(END):
+    return 0;
+
+  // Comparison ops take the JMP that follows them when the condition holds
+  // and skip over it otherwise, so a branch is a single dispatch.  Integers
+  // keep their order when tagged, so they are compared without decoding.
+  // Everything else is compared by identity since symbols are interned,
+  // apart from boxed numbers.  Those are never equal to a tagged integer,
+  // which includes every number constant.
+  CASE(ISLT):
+    A = base[OPGETA(bc)];
+    D = base[OPGETD(bc)];
+    BRANCH(A & D & 1 ? (intptr_t)A < (intptr_t)D : compare(A, D, Lt));
+  CASE(ISGE):
+    A = base[OPGETA(bc)];
+    D = base[OPGETD(bc)];
+    BRANCH(A & D & 1 ? (intptr_t)A >= (intptr_t)D : compare(A, D, Ge));
+  CASE(ISEQV):
+    BRANCH(equal(base[OPGETA(bc)], base[OPGETD(bc)]));
+  CASE(ISNEV):
+    BRANCH(!equal(base[OPGETA(bc)], base[OPGETD(bc)]));
+  CASE(ISEQS):
+    BRANCH(base[OPGETA(bc)] == jack_object(KSYMBOL(OPGETD(bc))));
+  CASE(ISNES):
+    BRANCH(base[OPGETA(bc)] != jack_object(KSYMBOL(OPGETD(bc))));
+  CASE(ISEQN):
+    BRANCH(base[OPGETA(bc)] == jack_integer(kn[OPGETD(bc)]));
+  CASE(ISNEN):
+    BRANCH(base[OPGETA(bc)] != jack_integer(kn[OPGETD(bc)]));
+  CASE(ISEQP):
+    BRANCH(base[OPGETA(bc)] == primitives[OPGETD(bc)]);
+  CASE(ISNEP):
+    BRANCH(base[OPGETA(bc)] != primitives[OPGETD(bc)]);
+  CASE(ISLTN):
+    A = base[OPGETA(bc)];
+    D = jack_integer(kn[OPGETD(bc)]);
+    BRANCH(A & 1 ? (intptr_t)A < (intptr_t)D : compare(A, D, Lt));
+  CASE(ISGEN):
+    A = base[OPGETA(bc)];
+    D = jack_integer(kn[OPGETD(bc)]);
+    BRANCH(A & 1 ? (intptr_t)A >= (intptr_t)D : compare(A, D, Ge));
+  CASE(ISLEN):
+    A = base[OPGETA(bc)];
+    D = jack_integer(kn[OPGETD(bc)]);
+    BRANCH(A & 1 ? (intptr_t)A <= (intptr_t)D : compare(A, D, Le));
+  CASE(ISGTN):
+    A = base[OPGETA(bc)];
+    D = jack_integer(kn[OPGETD(bc)]);
+    BRANCH(A & 1 ? (intptr_t)A > (intptr_t)D : compare(A, D, Gt));
+
+  // Unary test and copy ops
+  CASE(ISTC):
+    D = base[OPGETD(bc)];
+    if (jack_tobool(D)) base[OPGETA(bc)] = D;
+    BRANCH(jack_tobool(D));
+  CASE(ISFC):
+    D = base[OPGETD(bc)];
+    if (!jack_tobool(D)) base[OPGETA(bc)] = D;
+    BRANCH(!jack_tobool(D));
+  CASE(IST):
+    BRANCH(jack_tobool(base[OPGETD(bc)]));
+  CASE(ISF):
+    BRANCH(!jack_tobool(base[OPGETD(bc)]));
+
+  // Unary ops
+  CASE(MOV):
+    base[OPGETA(bc)] = base[OPGETD(bc)];
+    NEXT();
+  CASE(NOT):
+    base[OPGETA(bc)] = jack_boolean(!jack_tobool(base[OPGETD(bc)]));
+    NEXT();
+  CASE(UNM):
+    base[OPGETA(bc)] = sub(vm, jack_integer(0), base[OPGETD(bc)]);
+    NEXT();
+  CASE(LEN):
+    D = base[OPGETD(bc)];
+    base[OPGETA(bc)] = jack_isobject(D, Symbol) ? jack_integer(jack_tosymbol(D)->size) :
+                       jack_isobject(D, Map) ? jack_integer(((jack_map_t*)jack_toobject(D))->length) :
+                       jack_iserror(D) ? D :
+                       jack_error(&no_length);
+    NEXT();
+  CASE(ITER):
+    D = base[OPGETD(bc)];
+    base[OPGETA(bc)] = jack_iserror(D) ? D : jack_error(&not_iterable);
+    NEXT();
+
+  // Binary ops.  Add, subtract and multiply have overflow checked fast
+  // paths for tagged integers, everything else (including division by
+  // zero) goes through arith().
+  CASE(ADDVN):
+    ADD_VN();
+    NEXT();
+  CASE(SUBVN):
+    base[OPGETA(bc)] = sub(vm, base[OPGETB(bc)], jack_integer(kn[OPGETC(bc)]));
+    NEXT();
+  CASE(MULVN):
+    base[OPGETA(bc)] = mul(vm, base[OPGETB(bc)], jack_integer(kn[OPGETC(bc)]));
+    NEXT();
+  CASE(DIVVN):
+  CASE(MODVN):
+    base[OPGETA(bc)] = arith(vm, base[OPGETB(bc)], jack_integer(kn[OPGETC(bc)]),
+                             (jack_arith_t)(OPGETOP(bc) - ADDVN));
+    NEXT();
+
+  CASE(ADDNV):
+    base[OPGETA(bc)] = add(vm, jack_integer(kn[OPGETC(bc)]), base[OPGETB(bc)]);
+    NEXT();
+  CASE(SUBNV):
+    base[OPGETA(bc)] = sub(vm, jack_integer(kn[OPGETC(bc)]), base[OPGETB(bc)]);
+    NEXT();
+  CASE(MULNV):
+    base[OPGETA(bc)] = mul(vm, jack_integer(kn[OPGETC(bc)]), base[OPGETB(bc)]);
+    NEXT();
+  CASE(DIVNV):
+  CASE(MODNV):
+    base[OPGETA(bc)] = arith(vm, jack_integer(kn[OPGETC(bc)]), base[OPGETB(bc)],
+                             (jack_arith_t)(OPGETOP(bc) - ADDNV));
+    NEXT();
+
+  CASE(ADDVV):
+    base[OPGETA(bc)] = add(vm, base[OPGETB(bc)], base[OPGETC(bc)]);
+    NEXT();
+  CASE(SUBVV):
+    base[OPGETA(bc)] = sub(vm, base[OPGETB(bc)], base[OPGETC(bc)]);
+    NEXT();
+  CASE(MULVV):
+    base[OPGETA(bc)] = mul(vm, base[OPGETB(bc)], base[OPGETC(bc)]);
+    NEXT();
+  CASE(DIVVV):
+  CASE(MODVV):
+    base[OPGETA(bc)] = arith(vm, base[OPGETB(bc)], base[OPGETC(bc)],
+                             (jack_arith_t)(OPGETOP(bc) - ADDVV));
+    NEXT();
+
+  // Constant ops
+  CASE(KERR):
+    base[OPGETA(bc)] = jack_error(KSYMBOL(OPGETD(bc)));
+    NEXT();
+  CASE(KSYM):
+    base[OPGETA(bc)] = jack_object(KSYMBOL(OPGETD(bc)));
+    NEXT();
+  CASE(KSHORT):
+    base[OPGETA(bc)] = jack_integer(OPGETD(bc));
+    NEXT();
+  CASE(KNUM):
+    base[OPGETA(bc)] = jack_integer(kn[OPGETD(bc)]);
+    NEXT();
+  CASE(KPRI):
+    base[OPGETA(bc)] = primitives[OPGETD(bc)];
+    NEXT();
+  CASE(KNIL):
+    for (i = OPGETA(bc); i <= OPGETD(bc); i++) base[i] = JACK_NIL;
+    NEXT();
+
+  // Upvalue and function ops
+  CASE(UGET):
+    base[OPGETA(bc)] = *closure->upvals[OPGETD(bc)]->ref;
+    NEXT();
+  CASE(USETV):
+    *closure->upvals[OPGETA(bc)]->ref = base[OPGETD(bc)];
+    NEXT();
+  CASE(UCLO):
+    close_upvals(vm, base - vm->stack + OPGETA(bc));
+    pc += OPGETD(bc);
+    NEXT();
+  CASE(FNEW):
+    {
+      const jack_proto_t* child = proto->protos[OPGETD(bc)];
+      base[OPGETA(bc)] = child->nupvals ?
+        new_closure(vm, child, closure, base - vm->stack) :
+        jack_object(child);
+    }
+    NEXT();
+  CASE(CALL):
+    A = base[OPGETA(bc)];
+    if (jack_isobject(A, Function)) {
+      const jack_native_t* native = (const jack_native_t*)jack_toobject(A);
+      results = &base[OPGETA(bc)];
+      results[0] = native->call(vm, results + 1, OPGETC(bc));
+      for (i = 1; i < OPGETB(bc); i++) results[i] = JACK_NIL;
+      NEXT();
+    }
+    if (jack_isobject(A, Closure)) {
+      callee = (const jack_closure_t*)jack_toobject(A);
+      A = jack_object(callee->proto);
+    }
+    else if (jack_isobject(A, Code)) {
+      callee = NULL;
+    }
+    else {
+      if (!jack_iserror(A)) base[OPGETA(bc)] = jack_error(&not_a_function);
+      NEXT();
+    }
+    if (vm->depth == vm->max_depth) {
+      UNPUBLISH();
+      vm_grow_frames(vm);
+    }
+    vm->frames[vm->depth] = (jack_frame_t){
+      .proto = proto,
+      .closure = closure,
+      .pc = pc,
+      .base = base - vm->stack,
+      .want = OPGETB(bc),
+    };
+    FENCE();
+    vm->depth++;
+    base += OPGETA(bc) + 1;
+    closure = callee;
+    proto = (const jack_proto_t*)jack_toobject(A);
+    if (base + proto->slots > vm->stack + vm->size) {
+      base = vm_grow(vm, base, proto->slots);
+    }
+    for (i = OPGETC(bc); i < proto->params; i++) base[i] = JACK_NIL;
+    pc = proto->code;
+    ks = proto->symbols;
+    kn = proto->numbers;
+    caches = proto->caches;
+    PUBLISH(proto, pc);
+    NEXT();
+  CASE(RET):
+    if (vm->open && vm->open->index >= base - vm->stack) {
+      close_upvals(vm, base - vm->stack);
+    }
+    results = &base[OPGETA(bc)];
+    n = OPGETD(bc);
+    if (!vm->depth) {
+      if (vm->thread->resumer) {
+        // A thread's function returning ends it, the results go back to
+        // whoever resumed it.
+        thread = vm->thread;
+        thread->status = ThreadDead;
+        args = results;
+        goto leave;
+      }
+      memmove(vm->stack, results, sizeof(*results) * n);
+      return n;
+    }
+    // Results go where the function was, padded with nil.
+    frame = &vm->frames[--vm->depth];
+    for (i = 0; i < frame->want; i++) {
+      base[i - 1] = i < n ? results[i] : JACK_NIL;
+    }
+    RESTORE(frame);
+    NEXT();
+
+  // Map ops
+  CASE(MNEW):
+    base[OPGETA(bc)] = jack_object(jack_new_map(vm, OPGETD(bc)));
+    NEXT();
+  CASE(MDUP):
+    map = jack_dup_map(vm, KTEMPLATE(OPGETD(bc)));
+    base[OPGETA(bc)] = jack_object(map);
+    NEXT();
+  CASE(MGETV):
+    base[OPGETA(bc)] = map_get(base[OPGETB(bc)], base[OPGETC(bc)]);
+    NEXT();
+  // The cache holds the slot where the key was found last time.  It
+  // is right whenever the map has the same layout as then, whichever map
+  // it is, and checking that costs one compare of the key.
+  CASE(MGETS):
+    B = base[OPGETB(bc)];
+    C = jack_object(KSYMBOL(OPGETC(bc)));
+    n = caches[pc - 1 - proto->code];
+    map = (jack_map_t*)jack_toobject(B);
+    if (jack_isobject(B, Map) && n < map->capacity && map->keys[n] == C) {
+      vm->cache_hits++;
+      base[OPGETA(bc)] = map->values[n];
+      NEXT();
+    }
+    base[OPGETA(bc)] = cached_get(vm, B, C, &caches[pc - 1 - proto->code]);
+    NEXT();
+  CASE(MGETB):
+    base[OPGETA(bc)] = map_get(base[OPGETB(bc)], jack_integer(OPGETC(bc)));
+    NEXT();
+  CASE(MSETV):
+    map_set(base[OPGETB(bc)], base[OPGETC(bc)], base[OPGETA(bc)]);
+    NEXT();
+  CASE(MSETS):
+    B = base[OPGETB(bc)];
+    C = jack_object(KSYMBOL(OPGETC(bc)));
+    n = caches[pc - 1 - proto->code];
+    map = (jack_map_t*)jack_toobject(B);
+    if (jack_isobject(B, Map) && n < map->capacity && map->keys[n] == C) {
+      vm->cache_hits++;
+      map->values[n] = base[OPGETA(bc)];
+      NEXT();
+    }
+    cached_set(vm, B, C, base[OPGETA(bc)], &caches[pc - 1 - proto->code]);
+    NEXT();
+  CASE(MSETB):
+    map_set(base[OPGETB(bc)], jack_integer(OPGETC(bc)), base[OPGETA(bc)]);
+    NEXT();
+  CASE(MHAS):
+    base[OPGETA(bc)] = map_has(base[OPGETB(bc)], base[OPGETC(bc)]);
+    NEXT();
+
+  // Thread ops.  The thread that stops running saves where it goes on in
+  // its own frame, the other one continues from its saved frame.
+  CASE(TNEW):
+    D = base[OPGETD(bc)];
+    thread = jack_new_thread(vm, D);
+    base[OPGETA(bc)] = thread ? jack_object(thread) :
+                       jack_iserror(D) ? D : jack_error(&not_a_function);
+    NEXT();
+  CASE(RESUME):
+    A = base[OPGETA(bc)];
+    if (!jack_isobject(A, Thread) ||
+        ((jack_thread_t*)jack_toobject(A))->status != ThreadSuspended) {
+      base[OPGETA(bc)] = jack_iserror(A) ? A :
+                         jack_isobject(A, Thread) ? jack_error(&not_suspended) :
+                         jack_error(&not_a_thread);
+      NEXT();
+    }
+    thread = (jack_thread_t*)jack_toobject(A);
+    vm->thread->frame = (jack_frame_t){
+      proto, closure, pc, base - vm->stack, OPGETB(bc)
+    };
+    args = &base[OPGETA(bc) + 1];
+    n = OPGETC(bc);
+  resume:
+    UNPUBLISH();
+    thread->resumer = vm->thread;
+    vm->thread->status = ThreadNormal;
+    thread->status = ThreadRunning;
+    switch_to(vm, thread);
+    frame = deliver(vm, args, n);
+    FENCE();
+    RESTORE(frame);
+    NEXT();
+  CASE(YIELD):
+    thread = vm->thread;
+    if (!thread->resumer) {
+      base[OPGETA(bc)] = jack_error(&not_in_thread);
+      NEXT();
+    }
+    thread->frame = (jack_frame_t){
+      proto, closure, pc, base - vm->stack, OPGETB(bc)
+    };
+    thread->status = ThreadSuspended;
+    args = &base[OPGETA(bc) + 1];
+    n = OPGETC(bc);
+  leave:
+    UNPUBLISH();
+    resumer = thread->resumer;
+    thread->resumer = NULL;
+    switch_to(vm, resumer);
+    resumer->status = ThreadRunning;
+    if (!resumer->frame.pc) {
+      *values = args;
+      return n;
+    }
+    frame = deliver(vm, args, n);
+    if (thread->status == ThreadDead) retire(vm, thread);
+    FENCE();
+    RESTORE(frame);
+    NEXT();
+
+  // Superinstructions do the add, then decode the test in the next word.
+  CASE(ADDLT):
+    ADD_VN();
+    bc = *pc++;
+    A = base[OPGETA(bc)];
+    D = base[OPGETD(bc)];
+    BRANCH(A & D & 1 ? (intptr_t)A < (intptr_t)D : compare(A, D, Lt));
+  CASE(ADDGE):
+    ADD_VN();
+    bc = *pc++;
+    A = base[OPGETA(bc)];
+    D = base[OPGETD(bc)];
+    BRANCH(A & D & 1 ? (intptr_t)A >= (intptr_t)D : compare(A, D, Ge));
+  CASE(ADDLTN):
+    ADD_VN();
+    bc = *pc++;
+    A = base[OPGETA(bc)];
+    D = jack_integer(kn[OPGETD(bc)]);
+    BRANCH(A & 1 ? (intptr_t)A < (intptr_t)D : compare(A, D, Lt));
+  CASE(ADDLEN):
+    ADD_VN();
+    bc = *pc++;
+    A = base[OPGETA(bc)];
+    D = jack_integer(kn[OPGETD(bc)]);
+    BRANCH(A & 1 ? (intptr_t)A <= (intptr_t)D : compare(A, D, Le));
+
+  CASE(JMP):
+    pc += OPGETD(bc);
+    PUBLISH_PC(pc);
+    NEXT();
+
+  DISPATCH_END()
+}
+
+#ifdef JACK_PROFILE
+// What the profiler saw before an interpreter started on this thread, put
+// back when it returns.  A native function can run another.
+typedef struct {
+  jack_vm_t* vm;
+  const jack_proto_t* running;
+  const uint32_t* at;
+} outer_t;
+
+static outer_t enter(jack_vm_t* vm) {
+  outer_t outer = { jack_profile_vm, vm->running, vm->at };
+  vm->running = NULL;
+  FENCE();
+  jack_profile_vm = vm;
+  return outer;
+}
+
+static void leave(jack_vm_t* vm, outer_t outer) {
+  jack_profile_vm = NULL;
+  FENCE();
+  vm->at = outer.at;
+  vm->running = outer.running;
+  FENCE();
+  jack_profile_vm = outer.vm;
+}
+#endif
+
+int jack_run(jack_vm_t* vm, const jack_proto_t* proto) {
+  const jack_value_t* values;
+#ifdef JACK_PROFILE
+  outer_t outer = enter(vm);
+  int n = execute(vm, proto, NULL, &values, 0);
+  leave(vm, outer);
+#else
+  int n = execute(vm, proto, NULL, &values, 0);
+#endif
+  memset(vm->stack + n, 0, sizeof(*vm->stack) * (vm->size - n));
+  return n;
+}
+
+int jack_resume(jack_vm_t* vm, jack_thread_t* thread, const jack_value_t* args,
+                int argc, jack_value_t* results, int want) {
+  jack_value_t error = jack_error(&not_suspended);
+  const jack_value_t* values = args;
+  bool resumed = thread->status == ThreadSuspended;
+#ifdef JACK_PROFILE
+  outer_t outer = enter(vm);
+  int n = resumed ? execute(vm, NULL, thread, &values, argc) : 1;
+  leave(vm, outer);
+#else
+  int n = resumed ? execute(vm, NULL, thread, &values, argc) : 1;
+#endif
+  if (!resumed) values = &error;
+  for (int i = 0; i < want; i++) results[i] = i < n ? values[i] : JACK_NIL;
+  // The values were on its stacks until now.
+  if (resumed && thread->status == ThreadDead) retire(vm, thread);
+  return n;
+}
+
+#ifdef JACK_PROFILE_PAIRS
+void jack_dump_pairs(FILE* out, int top) {
+  uint64_t total = 0;
+  for (int a = 0; a < JACK_OPCODES; a++) {
+    for (int b = 0; b < JACK_OPCODES; b++) total += pairs[a][b];
+  }
+  if (!total) return;
+  // Repeatedly pick the largest count left, there are only a few thousand.
+  static bool shown[JACK_OPCODES][JACK_OPCODES];
+  memset(shown, 0, sizeof(shown));
+  for (int n = 0; n < top; n++) {
+    int best_a = 0, best_b = 0;
+    for (int a = 0; a < JACK_OPCODES; a++) {
+      for (int b = 0; b < JACK_OPCODES; b++) {
+        if (!shown[a][b] && pairs[a][b] > pairs[best_a][best_b]) {
+          best_a = a;
+          best_b = b;
+        }
+      }
+    }
+    if (shown[best_a][best_b] || !pairs[best_a][best_b]) break;
+    shown[best_a][best_b] = true;
+    fprintf(out, "%-6s %-6s %12llu %5.1f%%\n", opnames[best_a], opnames[best_b],
+            (unsigned long long)pairs[best_a][best_b],
+            100.0 * pairs[best_a][best_b] / total);
+  }
+}
+#endif
+
+// Nine decimal digits at a time, from the remainders of dividing by 10^9.
+static void dump_big(const jack_integer_t* big) {
+  static const uint32_t billion = 1000000000;
+  int n = big->length, chunks = 0, nr;
+  uint32_t* scratch = malloc(sizeof(*scratch) * (n * 4 + 1));
+  assert(scratch);
+  uint32_t *a = scratch, *q = a + n, *out = q + n;
+  memcpy(a, big->digits, sizeof(*a) * n);
+  while (n) {
+    uint32_t rest[1] = { 0 };
+    int nq = jack_digits_divmod(a, n, &billion, 1, q, rest, &nr);
+    out[chunks++] = rest[0];
+    memcpy(a, q, sizeof(*a) * nq);
+    n = nq;
+  }
+  printf("%s%u", big->value < 0 ? "-" : "", out[--chunks]);
+  while (chunks) printf("%09u", out[--chunks]);
+  free(scratch);
+}
+
+void jack_dump_value(jack_value_t value) {
+  switch (jack_typeof(value)) {
+    case Nil:
+      printf("nil");
+      break;
+    case Boolean:
+      printf("%s", value == JACK_TRUE ? "true" : "false");
+      break;
+    case Integer:
+      if (is_big(value)) dump_big((const jack_integer_t*)value);
+      else {
+        printf("%ld", (long)(jack_isinteger(value) ? jack_tointeger(value)
+                                                   : ((jack_integer_t*)value)->value));
+      }
+      break;
+    case Rational:
+      printf("%lld/%lld", (long long)((jack_rational_t*)value)->ratio.num,
+             (long long)((jack_rational_t*)value)->ratio.den);
+      break;
+    case Symbol:
+      printf(":%.*s", jack_tosymbol(value)->size, jack_tosymbol(value)->data);
+      break;
+    case Error:
+      printf("Error: %.*s", jack_tosymbol(value)->size, jack_tosymbol(value)->data);
+      break;
+    case Code:
+      printf("<%s>", ((const jack_proto_t*)jack_toobject(value))->name);
+      break;
+    case Closure:
+      printf("<%s>", ((const jack_closure_t*)jack_toobject(value))->proto->name);
+      break;
+    case Function:
+      printf("<%s>", ((const jack_native_t*)jack_toobject(value))->name);
+      break;
+    case Map:
+      printf("<map %p>", (void*)jack_toobject(value));
+      break;
+    case Thread:
+      printf("<thread %p>", (void*)jack_toobject(value));
+      break;
+    default:
+      printf("Unknown");
+  }
+}
@@ -0,0 +1,433 @@
+#ifndef JACK_VM_H
+#define JACK_VM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "types.h"
+#include "map.h"
+
+// Where a closure finds one of its upvalues when it is created: either a
+// slot in the frame running FNEW or one of that function's own upvalues.
+typedef struct {
+  uint8_t local;
+  uint8_t index;
+} jack_upvaldesc_t;
+
+// A function prototype is the immutable part of a script function: the
+// bytecode, its constant tables and the number of slots its frame needs.
+// Values of type Code point straight at their prototype.
+typedef struct jack_proto {
+  jack_object_t object;
+  const char* name;
+  int params;  // Number of arguments, missing ones are set to nil
+  int slots;   // Frame size, must cover every slot the code touches
+  int ncode;
+  const uint32_t* code;
+  int nsymbols;
+  const jack_symbol_t* const* symbols;
+  int nnumbers;
+  const intptr_t* numbers;
+  int nprotos;
+  const struct jack_proto* const* protos;
+  int nupvals;
+  const jack_upvaldesc_t* upvals;
+  int ntemplates;
+  const jack_map_t* const* templates; // Maps copied by MDUP
+  const uint32_t* lines; // Source line of each instruction, or NULL
+  // Inline cache of each instruction, required if the code uses MGETS or
+  // MSETS.  Starts zeroed.
+  uint32_t* caches;
+  // Set for prototypes loaded from an image.  Their symbols are interned and
+  // templates built on first use, entries of `symbols` and `templates` are
+  // NULL until then.
+  const struct jack_image* image;
+  const uint32_t* symbol_ids;
+} jack_proto_t;
+
+// A captured variable.  While the frame that declared it is running it is
+// open and `ref` points at that stack slot, which is kept up to date when
+// the stack moves.  Once the frame is gone the value is copied in, `ref`
+// points at it and it is closed.  Threads keep their own stacks, so code
+// on one can use the open upvalues of another through `ref` as well.
+typedef struct jack_upval {
+  jack_object_t object;
+  int index;
+  jack_value_t* ref;
+  jack_value_t value;
+  struct jack_upval* next; // Next open upvalue, sorted by descending index
+} jack_upval_t;
+
+// FNEW on a prototype with upvalues creates a closure.  Prototypes without
+// any are used as functions directly, so creating them never allocates.
+typedef struct {
+  jack_object_t object;
+  const jack_proto_t* proto;
+  jack_upval_t* upvals[];
+} jack_closure_t;
+
+struct jack_vm;
+
+// Native function.  Gets the arguments in place and returns one result.
+typedef jack_value_t (jack_native_call_t)(struct jack_vm* vm,
+                                          const jack_value_t* args, int argc);
+
+typedef struct {
+  jack_object_t object;
+  const char* name;
+  jack_native_call_t* call;
+} jack_native_t;
+
+#define JACK_NATIVE(NAME, CALL) { { Function }, NAME, CALL }
+
+// Saved state of a caller while a callee runs.  The callee's frame starts
+// right after the slot that held the function, so arguments are passed in
+// place and the results are written back starting at that same slot.
+typedef struct {
+  const jack_proto_t* proto;
+  const jack_closure_t* closure;
+  const uint32_t* pc;
+  int base; // Offset into the value stack, which may move when it grows.
+  int want; // Number of results the caller expects.
+} jack_frame_t;
+
+typedef enum {
+  ThreadSuspended, // Not started yet, or waiting in a YIELD
+  ThreadRunning,
+  ThreadNormal,    // Waiting in a RESUME for the thread it resumed
+  ThreadDead,      // Its function returned
+} jack_status_t;
+
+// A coroutine.  It owns a value stack, a frame stack and its open upvalues,
+// and the VM runs on those while it is resumed.  Switching threads only
+// swaps those pointers in and out of the VM, nothing on the stacks moves.
+typedef struct jack_thread {
+  jack_object_t object;
+  jack_status_t status;
+  // Stacks, valid while the thread isn't the one running.  The running
+  // thread's are in the VM.
+  jack_value_t* stack;
+  int size;
+  jack_frame_t* frames;
+  int depth;
+  int max_depth;
+  jack_upval_t* open;
+  // Where it goes on when switched back to, with `want` values for the
+  // RESUME or YIELD just before `pc`.  Before the first run pc is NULL and
+  // the values are the arguments of the function in proto and closure.
+  // While resuming from C rather than RESUME pc is NULL too.
+  jack_frame_t frame;
+  struct jack_thread* resumer; // Thread to return to
+} jack_thread_t;
+
+// Every object the VM allocates is chained through this header, in front
+// of the object itself, so the collector can sweep them.
+typedef struct jack_gcheader {
+  struct jack_gcheader* next;
+  bool marked;
+} JACK_ALIGNED jack_gcheader_t;
+
+#ifndef JACK_STACK_SIZE
+#define JACK_STACK_SIZE 256
+#endif
+#ifndef JACK_FRAMES_SIZE
+#define JACK_FRAMES_SIZE 32
+#endif
+// Threads start out small, they grow the same way.  The stacks of up to
+// JACK_SPARE_THREADS finished or collected threads are kept for new ones,
+// as long as they stayed within JACK_STACK_SIZE and JACK_FRAMES_SIZE.
+#ifndef JACK_THREAD_STACK_SIZE
+#define JACK_THREAD_STACK_SIZE 32
+#endif
+#ifndef JACK_THREAD_FRAMES_SIZE
+#define JACK_THREAD_FRAMES_SIZE 4
+#endif
+#ifndef JACK_SPARE_THREADS
+#define JACK_SPARE_THREADS 64
+#endif
+// An allocation collects once the VM holds JACK_GC_PAUSE percent of what
+// the last collection left, and at least JACK_GC_MIN bytes.
+#ifndef JACK_GC_MIN
+#define JACK_GC_MIN (1 << 20)
+#endif
+#ifndef JACK_GC_PAUSE
+#define JACK_GC_PAUSE 200
+#endif
+
+// Stacks of a dead thread, kept for the next new one.
+typedef struct {
+  jack_value_t* stack;
+  int size;
+  jack_frame_t* frames;
+  int max_depth;
+} jack_stacks_t;
+
+// Interpreter state.  The value stack is one contiguous array shared by all
+// frames.  Both it and the frame stack grow geometrically, so calls don't
+// allocate in steady state.
+typedef struct jack_vm {
+  jack_value_t* stack;
+  int size;
+  jack_frame_t* frames;
+  int depth;
+  int max_depth;
+  jack_upval_t* open;
+  jack_gcheader_t* objects;
+  // MGETS and MSETS remember where they last found their key.  These count
+  // how often that was right, for tuning.
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  jack_thread_t main;    // Stacks the VM starts on, jack_run runs here
+  jack_thread_t* thread; // Running thread, whose stacks are the ones above
+  jack_stacks_t spare[JACK_SPARE_THREADS]; // For new threads to take
+  int nspare;
+  // Bytes allocated since the last collection plus what it left, and how
+  // many make the next allocation collect first.
+  size_t allocated;
+  size_t threshold;
+  jack_object_t** gray; // Marked objects whose references aren't yet
+  int ngray;
+  int maxgray;
+  // Where interpreters built with JACK_PROFILE are, for the profiler: the
+  // running prototype, NULL while none is or the frames are changing, and
+  // the instruction it was at on its last call, return or jump.
+  const jack_proto_t* running;
+  const uint32_t* at;
+} jack_vm_t;
+
+typedef enum {
+
+  END, // Stop execution
+
+  // Comparison ops
+  // --------------
+  // The next instruction is always a JMP, which is taken if the condition
+  // holds and skipped otherwise.  Both happen in one dispatch.
+  //
+  // OP   | A   | D   | Description
+  //------+-----+-----+--------------
+  ISLT,  // var | var | Jump if A < D
+  ISGE,  // var | var | Jump if A ≥ D
+  ISEQV, // var | var | Jump if A = D
+  ISNEV, // var | var | Jump if A ≠ D
+  ISEQS, // var | str | Jump if A = D
+  ISNES, // var | str | Jump if A ≠ D
+  ISEQN, // var | num | Jump if A = D
+  ISNEN, // var | num | Jump if A ≠ D
+  ISEQP, // var | pri | Jump if A = D
+  ISNEP, // var | pri | Jump if A ≠ D
+  ISLTN, // var | num | Jump if A < D
+  ISGEN, // var | num | Jump if A ≥ D
+  ISLEN, // var | num | Jump if A ≤ D
+  ISGTN, // var | num | Jump if A > D
+
+  // Unary Test and Copy ops
+  // -----------------------
+  // Like the comparison ops these are always followed by a JMP
+  //
+  // OP  | A   | D   | Description
+  //-----+-----+-----+------------------------------------
+  ISTC, // dst | var | Copy D to A and jump, if D is true
+  ISFC, // dst | var | Copy D to A and jump, if D is false
+  IST,  //     | var | Jump if D is true
+  ISF,  //     | var | Jump if D is false
+
+  // Unary ops
+  // ---------
+  // OP  | A   | D   | Description
+  //-----+-----+-----+----------------------------
+  MOV,  // dst | var | Copy D to A
+  NOT,  // dst | var | Set A to boolean not of D
+  UNM,  // dst | var | Set A to -D (unary minus)
+  LEN,  // dst | var | Set A to length of D
+  ITER, // dst | var | Set A to iterator or D
+
+  // Binary ops
+  // ------------------+-------------
+  // Symbol + Symbol   | Concatenate
+  // Symbol * Integer  | Repeat
+  // Integer + Integer | Add
+  // Integer - Integer | Subtract
+  // Integer / Integer | Divide
+  // Integer % Integer | Modulus
+  //
+  // OP   | A   | B     | C     | Description
+  //------+-----+-------+-------+--------------
+  ADDVN, // dst | var   | num   | A = B + C
+  SUBVN, // dst | var   | num   | A = B - C
+  MULVN, // dst | var   | num   | A = B * C
+  DIVVN, // dst | var   | num   | A = B / C
+  MODVN, // dst | var   | num   | A = B % C
+  ADDNV, // dst | var   | num   | A = C + B
+  SUBNV, // dst | var   | num   | A = C - B
+  MULNV, // dst | var   | num   | A = C * B
+  DIVNV, // dst | var   | num   | A = C / B
+  MODNV, // dst | var   | num   | A = C % B
+  ADDVV, // dst | var   | var   | A = B + C
+  SUBVV, // dst | var   | var   | A = B - C
+  MULVV, // dst | var   | var   | A = B * C
+  DIVVV, // dst | var   | var   | A = B / C
+  MODVV, // dst | var   | var   | A = B % C
+
+  // Constant ops
+  // ------------
+  // OP     | A     | D     | Description
+  //--------+-------+-------+----------------------------------
+  KERR,    // dst   | sym   | Set A to error constant D
+  KSYM,    // dst   | sym   | Set A to symbol constant D
+  KSHORT,  // dst   | lits  | Set A to 16 bit signed integer D
+  KNUM,    // dst   | num   | Set A to number constant D
+  KPRI,    // dst   | pri   | Set A to primitive D
+  KNIL,    // base  | base  | Set slots A to D to nil
+
+  // Upvalue and Function ops
+  // ------------------------
+  // OP     | A     | B     | C/D   | Description
+  //--------+-------+-------+-------+-----------------------------------------
+  UGET,    // dst   |       | uv    | Set A to upvalue D
+  USETV,   // uv    |       | var   | Set upvalue A to D
+  UCLO,    // rbase |       | jump  | Close upvalues for slots ≥ A, jump D
+  FNEW,    // dst   |       | func  | Create new function from prototype D
+  CALL,    // base  | lit   | lit   | A, ..., A+B-1 = A(A+1, ..., A+C)
+  RET,     // base  |       | lit   | Return A, ..., A+D-1
+
+  // Map ops
+  // -------
+  // OP     | A     | B     | C/D   | Description
+  //--------+-------+-------+-------+-----------------------------------------
+  MNEW,    // dst   |       | lit   | Set A to new map with D hash buckets
+  MDUP,    // dst   |       | map   | Set A to duplicated template map D
+  MGETV,   // dst   | var   | var   | A = B[C]
+  MGETS,   // dst   | var   | sym   | A = B[C]
+  MGETB,   // dst   | var   | lit   | A = B[C]
+  MSETV,   // var   | var   | var   | B[C] = A
+  MSETS,   // var   | var   | sym   | B[C] = A
+  MSETB,   // var   | var   | lit   | B[C] = A
+  MHAS,    // dst   | var   | var   | A = B in C
+
+  // Thread ops
+  // ----------
+  // RESUME and YIELD pass values the same way CALL does.  The values given
+  // to a RESUME are the results of the YIELD the thread is waiting in, or
+  // the arguments of its function the first time.  The values given to a
+  // YIELD, or returned by the thread's function, are the results of that
+  // RESUME.  Resuming anything but a suspended thread, or yielding outside
+  // of one, sets A to an error.
+  //
+  // OP     | A     | B     | C/D   | Description
+  //--------+-------+-------+-------+-----------------------------------------
+  TNEW,    // dst   |       | var   | Set A to new thread running function D
+  RESUME,  // base  | lit   | lit   | A, ..., A+B-1 = resume A(A+1, ..., A+C)
+  YIELD,   // base  | lit   | lit   | A, ..., A+B-1 = yield(A+1, ..., A+C)
+
+  // Superinstructions
+  // -----------------
+  // ADDVN fused with the test after it, the pair that ends most counting
+  // loops.  The test keeps its own word, so code jumping straight to it
+  // still works; only the dispatch in between is saved.  The compiler
+  // fuses these, they are never emitted directly.
+  //
+  // OP     | A     | B     | C     | Description
+  //--------+-------+-------+-------+-----------------------------------------
+  ADDLT,   // dst   | var   | num   | ADDVN, then the ISLT that follows
+  ADDGE,   // dst   | var   | num   | ADDVN, then the ISGE that follows
+  ADDLTN,  // dst   | var   | num   | ADDVN, then the ISLTN that follows
+  ADDLEN,  // dst   | var   | num   | ADDVN, then the ISLEN that follows
+
+  JMP,     //       | DELTA | Jump DELTA instructions
+
+} jack_opcode_t;
+
+#define JACK_OPCODES (JMP + 1)
+
+// Primitive operands for KPRI, ISEQP and ISNEP.
+typedef enum {
+  PriNil,
+  PriFalse,
+  PriTrue,
+} jack_primitive_t;
+
+// A single bytecode instruction is 32 bit wide and has an 8 bit opcode field
+// and several operand fields of 8 or 16 bit. Instructions come in one of two
+// formats:
+// ┏━━━┳━━━┳━━━┳━━━━┓
+// ┃ B ┃ C ┃ A ┃ OP ┃
+// ┣━━━┻━━━╋━━━╋━━━━┫
+// ┃   D   ┃ A ┃ OP ┃
+// ┗━━━━━━━┻━━━┻━━━━┛
+
+typedef struct {
+  char b : 8;
+  char c : 8;
+  char a : 8;
+  jack_opcode_t op : 8;
+} jack_opabc_t;
+
+typedef struct {
+  short d : 16;
+  char a : 8;
+  jack_opcode_t op : 8;
+} jack_opd_t;
+
+#define OPABC(OP, A, B, C) ((uint32_t)(OP) | \
+  ((uint32_t)(A) & 0xff) << 8 | \
+  ((uint32_t)(B) & 0xff) << 24 | \
+  ((uint32_t)(C) & 0xff) << 16)
+#define OPAD(OP, A, D) ((uint32_t)(OP) | \
+  ((uint32_t)(A) & 0xff) << 8 | \
+  ((uint32_t)(D) & 0xffff) << 16)
+
+#define OPGETOP(BC) ((BC) & 0xff)
+#define OPGETA(BC) (uint8_t)(((BC) >> 8) & 0xff)
+#define OPGETB(BC) (uint8_t)(((BC) >> 24) & 0xff)
+#define OPGETC(BC) (uint8_t)(((BC) >> 16) & 0xff)
+#define OPGETD(BC) (int16_t)(((BC) >> 16) & 0xffff)
+
+void jack_vm_init(jack_vm_t* vm);
+// Frees the stacks and every object the VM allocated.
+void jack_vm_free(jack_vm_t* vm);
+
+// Free every object the VM allocated that can't be reached any more.  The
+// roots are the stacks of the main thread, of the running thread and of
+// the threads that resumed it.  Allocating collects by itself now and then,
+// see JACK_GC_MIN, so C code holding on to a new object across anything
+// that may allocate, natives included, has to keep it in a stack slot.
+void jack_collect(jack_vm_t* vm);
+
+// Run a prototype on the bottom of the value stack, with its arguments
+// already in the first slots.  Returns the number of values returned, which
+// are left in the first slots of the stack.  The slots past them are
+// cleared, so nothing else the run left behind is kept alive.
+int jack_run(jack_vm_t* vm, const jack_proto_t* proto);
+
+// New suspended thread that runs function, a Closure or Code value, when
+// first resumed.  Returns NULL for anything else.  Its stacks are given
+// back as soon as its function returns, and it is collected like any other
+// object.
+jack_thread_t* jack_new_thread(jack_vm_t* vm, jack_value_t function);
+// Resume a suspended thread with `argc` values and run it until it yields
+// or returns.  Up to `want` of the values it gives back are copied to
+// results, padded with nil, and their number is returned.  The thread's
+// status tells which happened.  Resuming a thread that isn't suspended
+// gives back one error.
+int jack_resume(jack_vm_t* vm, jack_thread_t* thread, const jack_value_t* args,
+                int argc, jack_value_t* results, int want);
+
+jack_map_t* jack_new_map(jack_vm_t* vm, int capacity);
+// Copy a template in one allocation.  The copy shares the template's keys
+// until a key is added to it.
+jack_map_t* jack_dup_map(jack_vm_t* vm, const jack_map_t* template);
+
+// Zeroed inline caches for a prototype's code, or NULL if it has no
+// instructions that use them.  Free with free().
+uint32_t* jack_new_caches(const uint32_t* code, int ncode);
+
+void jack_dump_value(jack_value_t value);
+
+#ifdef JACK_PROFILE_PAIRS
+// Print the `top` most frequent pairs of adjacent opcodes executed so far.
+void jack_dump_pairs(FILE* out, int top);
+#endif
+
+#endif